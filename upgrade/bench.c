@@ -0,0 +1,557 @@
+// bench.c
+// throughput of the hot paths of bw2bmp on synthetic 24-bit BMP images
+//
+//   bw2bmp_bench [-j threads] [-dir path] [-serve requests] <megapixels> ...
+//
+// For each size an image of random pixels is generated, then read_bmp,
+// print_data_hex, encode_message, decode_message, convert_to_grayscale and
+// write_bmp are timed one after the other on it. Every phase prints one JSON
+// line with its MB/s, cycles per byte and peak RSS, so runs can be compared
+// across releases. Sizes below 16 MP take the best of 3 runs.
+//
+// With -serve the phases are replaced by round trips to an in-process --serve
+// server (-j workers): each request type is sent that many times on a memfd
+// copy of the image, and its line has the round-trip and service time
+// percentiles instead.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "bmpstego.h"
+#include "serve.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define BENCH_PATH_LENGTH 512
+#define BENCH_CHUNK (1 << 20) // bytes generated per write
+#define BENCH_SERVE_MESSAGE 1024 // message bytes of the -serve encode requests
+
+typedef enum {
+    PHASE_READ = 0,
+    PHASE_HEX,
+    PHASE_ENCODE,
+    PHASE_DECODE,
+    PHASE_GRAYSCALE,
+    PHASE_WRITE,
+    PHASE_COUNT
+} Phase;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "read_bmp", "print_data_hex", "encode_message", "decode_message", "convert_to_grayscale", "write_bmp"};
+
+typedef enum {
+    CYCLES_NONE = 0,
+    CYCLES_PERF,                // core cycles from a perf event
+    CYCLES_TSC                  // reference cycles at the nominal clock
+} CycleSource;
+
+static const char *cycle_source_names[] = {"none", "perf", "tsc"};
+
+typedef struct {
+    int perf_fd;              // CPU cycle counter, -1 when perf events are not allowed
+    CycleSource cycle_source; // chosen once, so every sample of a run counts the same unit
+    ThreadPool *pool;
+    int threads;
+    int null_fd;              // /dev/null, standard output of the timed phases
+    int stdout_fd;            // the real standard output, for the JSON lines
+    FILE *json;
+} Bench;
+
+typedef struct {
+    double seconds;
+    double cycles;   // < 0 when there is no cycle counter
+    long peak_rss_kb;
+} Sample;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void open_cycle_counter(Bench *b)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.inherit = 1; // threads of the pool count too
+
+    // the event only counts if it can also be read
+    uint64_t count;
+    b->perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (b->perf_fd >= 0 && read(b->perf_fd, &count, sizeof(count)) != sizeof(count))
+    {
+        close(b->perf_fd);
+        b->perf_fd = -1;
+    }
+    b->cycle_source = b->perf_fd >= 0 ? CYCLES_PERF : CYCLES_NONE;
+#ifdef HAVE_TSC
+    if (b->perf_fd < 0)
+    {
+        b->cycle_source = CYCLES_TSC;
+    }
+#endif
+}
+
+// < 0 when there is no cycle counter, or a perf read failed (never a reading of the other source)
+static double read_cycles(const Bench *b)
+{
+    switch (b->cycle_source)
+    {
+    case CYCLES_PERF:
+    {
+        uint64_t count;
+        return read(b->perf_fd, &count, sizeof(count)) == sizeof(count) ? (double)count : -1.0;
+    }
+#ifdef HAVE_TSC
+    case CYCLES_TSC:
+        return (double)__rdtsc();
+#endif
+    default:
+        return -1.0;
+    }
+}
+
+// start a new peak RSS measurement (Linux 4.0+, else the peak of the whole run is reported)
+static void reset_peak_rss(void)
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0)
+    {
+        if (write(fd, "5", 1) != 1)
+        {
+            // keep the peak of the whole run
+        }
+        close(fd);
+    }
+}
+
+static long peak_rss_kb(void)
+{
+    FILE *status = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+    while (status != NULL && fgets(line, sizeof(line), status) != NULL)
+    {
+        if (strncmp(line, "VmHWM:", 6) == 0)
+        {
+            kb = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    if (status != NULL)
+    {
+        fclose(status);
+    }
+    return kb;
+}
+
+// random bytes from xorshift64*, fast enough not to dominate image generation
+static void fill_random(unsigned char *buf, size_t size, uint64_t *state)
+{
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+        uint64_t x = *state * 0x2545F4914F6CDD1DULL;
+        memcpy(buf + i, &x, 8);
+    }
+    for (; i < size; i++)
+    {
+        buf[i] = (unsigned char)(*state >> (8 * (i & 7)));
+    }
+}
+
+static int write_random_file(const char *path, const void *prefix, size_t prefix_size, uint64_t size, uint64_t seed)
+{
+    FILE *file = fopen(path, "wb");
+    unsigned char *chunk = (unsigned char *)malloc(BENCH_CHUNK);
+    int result = file == NULL || chunk == NULL;
+    if (result == 0 && prefix_size > 0)
+    {
+        result = fwrite(prefix, 1, prefix_size, file) != prefix_size;
+    }
+    for (uint64_t done = 0; result == 0 && done < size;)
+    {
+        size_t n = size - done < BENCH_CHUNK ? (size_t)(size - done) : BENCH_CHUNK;
+        fill_random(chunk, n, &seed);
+        result = fwrite(chunk, 1, n, file) != n;
+        done += n;
+    }
+    if (file != NULL && fclose(file) != 0)
+    {
+        result = 1;
+    }
+    free(chunk);
+    if (result != 0)
+    {
+        fprintf(stderr, "Error: writing \'%s\' failed\n", path);
+    }
+    return result;
+}
+
+// 24-bit image of about megapixels million pixels; an odd width so rows are padded
+static int generate_bmp(const char *path, double megapixels, BMPHeader *header)
+{
+    double pixels = megapixels * 1e6;
+    int32_t width = (int32_t)sqrt(pixels * 4.0 / 3.0) | 1;
+    int32_t height = (int32_t)(pixels / width);
+    if (height < 1)
+    {
+        height = 1;
+    }
+    uint64_t stride = ((uint64_t)width * 3 + 3) & ~(uint64_t)3;
+    uint64_t data_size = stride * height;
+    if (data_size + sizeof(BMPHeader) > UINT32_MAX)
+    {
+        fprintf(stderr, "Error: %.0f MP does not fit into a BMP file\n", megapixels);
+        return 2; // Invalid Arguments
+    }
+
+    memset(header, 0, sizeof(*header));
+    header->type = 0x4D42;
+    header->size = (uint32_t)(sizeof(BMPHeader) + data_size);
+    header->offset = sizeof(BMPHeader);
+    header->dib_header_size = 40;
+    header->width_px = width;
+    header->height_px = height;
+    header->num_planes = 1;
+    header->bits_per_pixel = 24;
+    header->image_size_bytes = (uint32_t)data_size;
+    header->x_resolution_ppm = 2835;
+    header->y_resolution_ppm = 2835;
+    return write_random_file(path, header, sizeof(*header), data_size, 0x9E3779B97F4A7C15ULL ^ width);
+}
+
+// one timed run of a phase, with standard output going to /dev/null
+static int run_phase(Bench *b, Phase phase, BMPImage *img, const char *image_path, const char *message_path,
+                     const char *output_path, Sample *sample)
+{
+    int result = 0;
+    fflush(stdout);
+    dup2(b->null_fd, STDOUT_FILENO);
+    reset_peak_rss();
+    double c0 = read_cycles(b);
+    double t0 = now_seconds();
+
+    switch (phase)
+    {
+    case PHASE_READ:
+        free_bmp_image(img);
+        result = read_bmp(image_path, img);
+        break;
+    case PHASE_HEX:
+        print_data_hex(img);
+        break;
+    case PHASE_ENCODE:
+        result = encode_message(img, message_path, 1, 0, NULL, NULL);
+        break;
+    case PHASE_DECODE:
+        result = decode_message(img, "/dev/null", NULL, NULL);
+        break;
+    case PHASE_GRAYSCALE:
+        result = convert_to_grayscale(img, b->pool, GRAY_BT601);
+        break;
+    case PHASE_WRITE:
+        result = write_bmp(output_path, img);
+        break;
+    default:
+        break;
+    }
+
+    double t1 = now_seconds();
+    double c1 = read_cycles(b);
+    fflush(stdout);
+    dup2(b->stdout_fd, STDOUT_FILENO);
+    sample->seconds = t1 - t0;
+    sample->cycles = c0 < 0 || c1 < 0 ? -1.0 : c1 - c0;
+    sample->peak_rss_kb = peak_rss_kb();
+    return result;
+}
+
+static void print_sample(Bench *b, Phase phase, double megapixels, const BMPHeader *header, uint64_t bytes,
+                         const Sample *s)
+{
+    double mb_per_s = s->seconds > 0 ? bytes / s->seconds / 1e6 : 0.0;
+    fprintf(b->json, "{\"phase\":\"%s\",\"megapixels\":%g,\"width\":%d,\"height\":%d,\"threads\":%d,\"bytes\":%llu,"
+                     "\"seconds\":%.6f,\"mb_per_s\":%.1f,",
+            phase_names[phase], megapixels, header->width_px, header->height_px, b->threads,
+            (unsigned long long)bytes, s->seconds, mb_per_s);
+    if (s->cycles >= 0 && bytes > 0)
+    {
+        fprintf(b->json, "\"cycles_per_byte\":%.3f,\"cycle_source\":\"%s\",", s->cycles / bytes,
+                cycle_source_names[b->cycle_source]);
+    }
+    else
+    {
+        fprintf(b->json, "\"cycles_per_byte\":null,\"cycle_source\":null,");
+    }
+    fprintf(b->json, "\"peak_rss_kb\":%ld}\n", s->peak_rss_kb);
+    fflush(b->json);
+}
+
+static int bench_size(Bench *b, const char *dir, double megapixels)
+{
+    char image_path[BENCH_PATH_LENGTH], message_path[BENCH_PATH_LENGTH], output_path[BENCH_PATH_LENGTH];
+    snprintf(image_path, sizeof(image_path), "%s/bench_%gmp.bmp", dir, megapixels);
+    snprintf(message_path, sizeof(message_path), "%s/bench_%gmp.msg", dir, megapixels);
+    snprintf(output_path, sizeof(output_path), "%s/bench_%gmp_out.bmp", dir, megapixels);
+
+    BMPHeader header;
+    int result = generate_bmp(image_path, megapixels, &header);
+    // a message that fills the carrier at 1 bit per byte, so encode and decode cover all of it
+    uint64_t message_size = stego_capacity(bmp_carrier_bytes(&header, 1), 1, 0);
+    if (result == 0)
+    {
+        result = write_random_file(message_path, NULL, 0, message_size, 0xD1B54A32D192ED03ULL);
+    }
+
+    uint64_t data_size = header.size - header.offset;
+    uint64_t bytes[PHASE_COUNT] = {header.size, sizeof(BMPHeader) + data_size, data_size, data_size, data_size, header.size};
+    int runs = megapixels < 16 ? 3 : 1;
+    BMPImage img;
+    memset(&img, 0, sizeof(img));
+
+    for (int phase = 0; result == 0 && phase < PHASE_COUNT; phase++)
+    {
+        Sample best;
+        for (int run = 0; result == 0 && run < runs; run++)
+        {
+            Sample sample;
+            result = run_phase(b, (Phase)phase, &img, image_path, message_path, output_path, &sample);
+            if (run == 0 || sample.seconds < best.seconds)
+            {
+                best = sample;
+            }
+        }
+        if (result == 0)
+        {
+            print_sample(b, (Phase)phase, megapixels, &header, bytes[phase], &best);
+        }
+        else
+        {
+            fprintf(stderr, "Error: %s failed on %g MP (code %d)\n", phase_names[phase], megapixels, result);
+        }
+    }
+
+    free_bmp_image(&img);
+    unlink(image_path);
+    unlink(message_path);
+    unlink(output_path);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// -serve: request latency of the daemon
+// ---------------------------------------------------------------------------
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, int count, double p)
+{
+    int rank = (int)(p * count + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// memfd holding the first size bytes of the file at path
+static int memfd_copy(const char *path, uint64_t size)
+{
+    int in = open(path, O_RDONLY);
+    int fd = memfd_create("bench", MFD_CLOEXEC);
+    off_t offset = 0;
+    while (in >= 0 && fd >= 0 && (uint64_t)offset < size)
+    {
+        if (sendfile(fd, in, &offset, (size_t)(size - offset)) <= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (in >= 0)
+    {
+        close(in);
+    }
+    return in >= 0 ? fd : -1;
+}
+
+static int bench_serve(Bench *b, const char *dir, double megapixels, int requests)
+{
+    static const char *op_names[] = {NULL, "serve_encode", "serve_decode", "serve_grayscale"};
+    char image_path[BENCH_PATH_LENGTH], message_path[BENCH_PATH_LENGTH], socket_path[BENCH_PATH_LENGTH];
+    snprintf(image_path, sizeof(image_path), "%s/bench_%gmp.bmp", dir, megapixels);
+    snprintf(message_path, sizeof(message_path), "%s/bench_%gmp.msg", dir, megapixels);
+    snprintf(socket_path, sizeof(socket_path), "%s/bench_%d.sock", dir, (int)getpid());
+
+    BMPHeader header;
+    int result = generate_bmp(image_path, megapixels, &header);
+    if (result == 0)
+    {
+        result = write_random_file(message_path, NULL, 0, BENCH_SERVE_MESSAGE, 0xD1B54A32D192ED03ULL);
+    }
+    int image_fd = result == 0 ? memfd_copy(image_path, header.size) : -1;
+    int message_fd = result == 0 ? memfd_copy(message_path, BENCH_SERVE_MESSAGE) : -1;
+    int output_fd = memfd_create("bench_out", MFD_CLOEXEC);
+    uint64_t *round_trip = (uint64_t *)malloc(sizeof(uint64_t) * requests);
+    uint64_t *service = (uint64_t *)malloc(sizeof(uint64_t) * requests);
+    StegoServer *server = result == 0 ? serve_start(socket_path, b->threads) : NULL;
+    int conn = server != NULL ? serve_connect(socket_path) : -1;
+    if (result == 0 && (image_fd < 0 || message_fd < 0 || output_fd < 0 || round_trip == NULL || service == NULL || conn < 0))
+    {
+        fprintf(stderr, "Error: cannot set up the -serve benchmark\n");
+        result = 1; // File Not Found
+    }
+
+    for (int op = SERVE_ENCODE; result == 0 && op <= SERVE_GRAYSCALE; op++)
+    {
+        ServeRequest request;
+        serve_request_init(&request, (ServeOp)op, NULL);
+        request.message_length = BENCH_SERVE_MESSAGE;
+        request.gray_mode = GRAY_BT601;
+        int fds[SERVE_MAX_FDS] = {image_fd, op == SERVE_ENCODE ? message_fd : output_fd};
+        for (int i = 0; result == 0 && i < requests; i++)
+        {
+            ServeReply reply;
+            double t0 = now_seconds();
+            if (serve_call(conn, &request, fds, op == SERVE_GRAYSCALE ? 1 : 2, &reply) != 0 || reply.status != BMPSTEGO_OK)
+            {
+                fprintf(stderr, "Error: %s failed on %g MP\n", op_names[op], megapixels);
+                result = 1; // File Not Found
+                break;
+            }
+            round_trip[i] = (uint64_t)((now_seconds() - t0) * 1e9);
+            service[i] = reply.service_ns;
+        }
+        if (result != 0)
+        {
+            break;
+        }
+        qsort(round_trip, requests, sizeof(uint64_t), compare_u64);
+        qsort(service, requests, sizeof(uint64_t), compare_u64);
+        fprintf(b->json, "{\"phase\":\"%s\",\"megapixels\":%g,\"width\":%d,\"height\":%d,\"threads\":%d,\"requests\":%d,"
+                         "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"service_p50_us\":%.1f,\"service_p99_us\":%.1f}\n",
+                op_names[op], megapixels, header.width_px, header.height_px, b->threads, requests,
+                percentile(round_trip, requests, 0.50) / 1e3, percentile(round_trip, requests, 0.99) / 1e3,
+                round_trip[requests - 1] / 1e3, percentile(service, requests, 0.50) / 1e3,
+                percentile(service, requests, 0.99) / 1e3);
+        fflush(b->json);
+    }
+
+    if (conn >= 0)
+    {
+        close(conn);
+    }
+    if (server != NULL)
+    {
+        serve_stop(server, NULL);
+    }
+    int fds[] = {image_fd, message_fd, output_fd};
+    for (int i = 0; i < 3; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            close(fds[i]);
+        }
+    }
+    free(round_trip);
+    free(service);
+    unlink(image_path);
+    unlink(message_path);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    Bench b;
+    const char *dir = ".";
+    int serve_requests = 0;
+    memset(&b, 0, sizeof(b));
+    b.threads = 1;
+
+    int first_size = argc;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            b.threads = atoi(argv[++i]);
+            if (b.threads <= 0)
+            {
+                b.threads = online_cpu_count();
+            }
+        }
+        else if (strcmp(argv[i], "-dir") == 0 && i + 1 < argc)
+        {
+            dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "-serve") == 0 && i + 1 < argc)
+        {
+            serve_requests = atoi(argv[++i]);
+        }
+        else
+        {
+            first_size = i;
+            break;
+        }
+    }
+    if (first_size >= argc)
+    {
+        fprintf(stderr, "usage: %s [-j threads] [-dir path] [-serve requests] <megapixels> ...\n", argv[0]);
+        return 2; // Invalid Arguments
+    }
+
+    b.null_fd = open("/dev/null", O_WRONLY);
+    b.stdout_fd = dup(STDOUT_FILENO);
+    b.json = b.stdout_fd >= 0 ? fdopen(b.stdout_fd, "w") : NULL;
+    if (b.null_fd < 0 || b.json == NULL)
+    {
+        fprintf(stderr, "Error: cannot set up the output streams\n");
+        return 1; // File Not Found
+    }
+    open_cycle_counter(&b);
+    b.pool = thread_pool_create(b.threads);
+
+    fprintf(b.json, "{\"bench\":\"bw2bmp\",\"cpus\":%d,\"threads\":%d,\"cycle_source\":\"%s\"}\n", online_cpu_count(),
+            b.threads, cycle_source_names[b.cycle_source]);
+    int result = 0;
+    for (int i = first_size; i < argc && result == 0; i++)
+    {
+        double megapixels = atof(argv[i]);
+        if (megapixels <= 0)
+        {
+            fprintf(stderr, "Error: size '%s' is not a number of megapixels\n", argv[i]);
+            result = 2; // Invalid Arguments
+            break;
+        }
+        result = serve_requests > 0 ? bench_serve(&b, dir, megapixels, serve_requests) : bench_size(&b, dir, megapixels);
+    }
+
+    thread_pool_destroy(b.pool);
+    if (b.perf_fd >= 0)
+    {
+        close(b.perf_fd);
+    }
+    fclose(b.json);
+    close(b.null_fd);
+    return result;
+}
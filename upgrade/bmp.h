@@ -27,9 +27,75 @@ typedef struct {             // Total: 54 bytes
 } BMPHeader;
 #pragma pack(pop)
 
+#define BMP_BI_RGB            0    // uncompressed, palette for 8 bits per pixel
+#define BMP_BI_BITFIELDS      3    // uncompressed, channel masks after the DIB header
+#define BMP_BI_ALPHABITFIELDS 6    // BI_BITFIELDS with an alpha mask
+
+typedef enum {
+  BMP_FORMAT_BGR24 = 0,       // 3 bytes per pixel: blue, green, red (RGB order in PNG rows)
+  BMP_FORMAT_BGRA32,          // 4 bytes per pixel: 8-bit channels at any byte position (BI_RGB or BI_BITFIELDS)
+  BMP_FORMAT_PAL8             // 1 byte per pixel: index into a BGRX palette
+} BMPFormatId;
+
+// pixel layout of an image, derived from its header, bit masks and palette
+typedef struct {
+  BMPFormatId id;
+  uint8_t   bytes_per_pixel;  // 1, 3 or 4
+  uint8_t   blue;             // byte offset of blue inside a pixel (BGR24, BGRA32)
+  uint8_t   green;            // byte offset of green
+  uint8_t   red;              // byte offset of red
+  uint8_t   alpha;            // byte offset of alpha or the unused byte (BGRA32), else 0xff
+  uint32_t  palette_offset;   // offset of the palette from the end of BMPHeader (PAL8)
+  uint32_t  palette_entries;  // 4-byte BGRX palette entries (PAL8)
+} BMPPixelFormat;
+
+#define STEGO_MAGIC "BSTG"
+#define STEGO_VERSION 2
+#define STEGO_HEADER_V1_BYTES 12   // version 1: magic, version, bits_per_byte, 2 reserved, 32-bit length
+
+#define STEGO_PAYLOAD_TEXT   0     // printable text
+#define STEGO_PAYLOAD_BINARY 1     // arbitrary bytes
+
+#define STEGO_FLAG_SCATTER   0x01  // payload carrier bytes are in keyed pseudo-random order (-key)
+#define STEGO_FLAG_PIXELS    0x02  // the carrier skips row padding (BMP), else it is the whole pixel data array
+#define STEGO_FLAG_DEFLATE   0x04  // the payload is a zlib stream of the message (-z), length is its size
+#define STEGO_FLAG_KEY_CHECK 0x08  // key_check holds a check value of the -key passphrase (with STEGO_FLAG_SCATTER)
+
+#pragma pack(push, 1)
+typedef struct {             // Total: 16 bytes, stored at 1 bit per carrier byte before the payload
+  uint8_t   magic[4];         // STEGO_MAGIC
+  uint8_t   version;          // STEGO_VERSION
+  uint8_t   bits_per_byte;    // payload bits per carrier byte (1-4)
+  uint8_t   payload_type;     // STEGO_PAYLOAD_*
+  uint8_t   flags;            // STEGO_FLAG_*
+  uint32_t  length;           // payload length in bytes, bits 0-31
+  uint16_t  length_high;      // payload length, bits 32-47
+  uint16_t  key_check;        // STEGO_FLAG_KEY_CHECK: hash of the passphrase (the top of a 64-bit length before)
+} StegoHeader;
+#pragma pack(pop)
+
+typedef struct ImageArena ImageArena; // pool of reusable pixel buffers
+
+#define BMP_MAX_DIB_HEADER_SIZE 124   // BITMAPV5HEADER
+#define BMP_INFO_HEADER_SIZE 40       // BITMAPINFOHEADER, the DIB part of BMPHeader
+
+// header-only view of a BMP file (no pixel data)
+typedef struct {
+  BMPHeader header;
+  uint32_t  dib_extension_size;      // DIB header bytes past BITMAPINFOHEADER that were read
+  uint8_t   dib_extension[BMP_MAX_DIB_HEADER_SIZE - BMP_INFO_HEADER_SIZE]; // V2-V5 fields (masks, color space, ...)
+} BMPProbe;
+
 typedef struct { 
   BMPHeader header; 
-  unsigned char* data; 
+  unsigned char* data;        // pixel data (heap buffer, arena buffer, or points into map)
+  unsigned char* map;         // mmap'ed file when opened with map_bmp/map_bmp_output, else NULL
+  size_t         map_size;    // length of map in bytes
+  ImageArena*    arena;       // arena data was borrowed from, else NULL
+  unsigned char* view;        // caller-owned BMP file that header, gap and data come from (bmpstego_image_view), else NULL
+  unsigned char* gap;         // bytes between BMPHeader and the pixel data: DIB extension, masks, palette
+  size_t         gap_size;    // length of gap (header.offset - 54)
+  BMPPixelFormat format;      // pixel layout
 } BMPImage;
 
 #endif // BMP_H
@@ -0,0 +1,4955 @@
+// bmpstego.c
+//
+// libbmpstego: BMP images (reading, writing, mapping, pixel formats), hex
+// dumps, grayscale conversion and LSB steganography in BMP, JPEG and PNG
+// carriers. bw2bmp (main.c) is its command line front end. The functions that
+// take file names report to report_out() like the tool always has; the buffer
+// API at the end of this file (bmpstego.h) works on caller-owned memory and
+// never prints.
+
+#define _GNU_SOURCE // copy_file_range, mkostemp
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <strings.h>
+#include "bmpstego.h"
+#include "jpeg.h"
+#include "png.h"
+#include "zlib.h"
+#include "stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1 // SIMD kernels, selected at runtime with __builtin_cpu_supports
+#endif
+
+#define MESSAGE_CHUNK_BYTES 65532 // message file read size, a multiple of 1, 2, 3 and 4
+
+// stream for per-operation reports (header info, decoded message, progress lines)
+// batch workers point it at a per-job buffer so parallel jobs do not interleave
+__thread FILE *report_stream = NULL;
+
+FILE *report_out(void)
+{
+    return report_stream != NULL ? report_stream : stdout;
+}
+
+// ---------------------------------------------------------------------------
+// image buffer arena
+//
+// Pixel buffers are borrowed from grow-only slabs that stay mapped after the
+// image is freed, so the next image reuses already faulted-in memory instead
+// of going through malloc/free. Slabs are 2 MiB aligned and advised for
+// transparent huge pages. The arena is shared by all threads of a batch.
+// ---------------------------------------------------------------------------
+
+#define ARENA_SLAB_ALIGN ((size_t)2 << 20) // huge page size on x86-64
+
+typedef struct {
+    unsigned char *base; // slab memory (ARENA_SLAB_ALIGN aligned)
+    size_t capacity;     // usable bytes
+    size_t used;         // bytes lent out, 0 while the slab is free
+} ArenaSlab;
+
+struct ImageArena {
+    pthread_mutex_t lock;
+    ArenaSlab *slabs;
+    int slab_count;
+    int slab_capacity;
+    uint64_t hits;         // acquisitions served by an existing slab
+    uint64_t misses;       // acquisitions that mapped or grew a slab
+    size_t in_use_bytes;   // bytes currently lent out
+    size_t peak_in_use;    // maximum of in_use_bytes
+    size_t reserved_bytes; // total slab capacity
+    size_t peak_reserved;  // maximum of reserved_bytes
+};
+
+// map a slab of at least size bytes, aligned to ARENA_SLAB_ALIGN
+static unsigned char *arena_map_slab(size_t size)
+{
+    size_t span = size + ARENA_SLAB_ALIGN;
+    unsigned char *raw = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    // trim the unaligned head and the unused tail
+    uintptr_t aligned = ((uintptr_t)raw + ARENA_SLAB_ALIGN - 1) & ~(uintptr_t)(ARENA_SLAB_ALIGN - 1);
+    size_t head = aligned - (uintptr_t)raw;
+    if (head > 0)
+    {
+        munmap(raw, head);
+    }
+    if (span - head > size)
+    {
+        munmap((unsigned char *)aligned + size, span - head - size);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise((void *)aligned, size, MADV_HUGEPAGE);
+#endif
+    return (unsigned char *)aligned;
+}
+
+ImageArena *image_arena_create(void)
+{
+    ImageArena *arena = (ImageArena *)calloc(1, sizeof(ImageArena));
+    if (arena != NULL)
+    {
+        pthread_mutex_init(&arena->lock, NULL);
+    }
+    return arena;
+}
+
+void image_arena_destroy(ImageArena *arena)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < arena->slab_count; i++)
+    {
+        munmap(arena->slabs[i].base, arena->slabs[i].capacity);
+    }
+    pthread_mutex_destroy(&arena->lock);
+    free(arena->slabs);
+    free(arena);
+}
+
+// borrow a buffer of size bytes, returns NULL when no memory is left
+unsigned char *image_arena_acquire(ImageArena *arena, size_t size)
+{
+    size_t capacity = (size + ARENA_SLAB_ALIGN - 1) & ~(ARENA_SLAB_ALIGN - 1);
+    if (capacity == 0)
+    {
+        capacity = ARENA_SLAB_ALIGN;
+    }
+    if (size == 0)
+    {
+        size = 1;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+
+    // best fit among the free slabs, otherwise the largest free one gets grown
+    ArenaSlab *fit = NULL;
+    ArenaSlab *largest = NULL;
+    for (int i = 0; i < arena->slab_count; i++)
+    {
+        ArenaSlab *slab = &arena->slabs[i];
+        if (slab->used != 0)
+        {
+            continue;
+        }
+        if (slab->capacity >= size && (fit == NULL || slab->capacity < fit->capacity))
+        {
+            fit = slab;
+        }
+        if (largest == NULL || slab->capacity > largest->capacity)
+        {
+            largest = slab;
+        }
+    }
+
+    if (fit != NULL)
+    {
+        arena->hits++;
+    }
+    else
+    {
+        arena->misses++;
+        unsigned char *base = arena_map_slab(capacity);
+        if (base == NULL)
+        {
+            pthread_mutex_unlock(&arena->lock);
+            return NULL;
+        }
+
+        if (largest != NULL)
+        {
+            // grow: the smaller free slab is replaced, never shrunk later
+            munmap(largest->base, largest->capacity);
+            arena->reserved_bytes -= largest->capacity;
+            fit = largest;
+        }
+        else
+        {
+            if (arena->slab_count == arena->slab_capacity)
+            {
+                int slab_capacity = arena->slab_capacity == 0 ? 8 : arena->slab_capacity * 2;
+                ArenaSlab *grown = (ArenaSlab *)realloc(arena->slabs, slab_capacity * sizeof(ArenaSlab));
+                if (grown == NULL)
+                {
+                    munmap(base, capacity);
+                    pthread_mutex_unlock(&arena->lock);
+                    return NULL;
+                }
+                arena->slabs = grown;
+                arena->slab_capacity = slab_capacity;
+            }
+            fit = &arena->slabs[arena->slab_count++];
+        }
+        fit->base = base;
+        fit->capacity = capacity;
+        arena->reserved_bytes += capacity;
+        if (arena->reserved_bytes > arena->peak_reserved)
+        {
+            arena->peak_reserved = arena->reserved_bytes;
+        }
+    }
+
+    fit->used = size;
+    arena->in_use_bytes += size;
+    if (arena->in_use_bytes > arena->peak_in_use)
+    {
+        arena->peak_in_use = arena->in_use_bytes;
+    }
+    unsigned char *buffer = fit->base;
+    pthread_mutex_unlock(&arena->lock);
+    return buffer;
+}
+
+// give a buffer from image_arena_acquire back; its slab stays mapped for the next image
+void image_arena_release(ImageArena *arena, unsigned char *buffer)
+{
+    pthread_mutex_lock(&arena->lock);
+    for (int i = 0; i < arena->slab_count; i++)
+    {
+        if (arena->slabs[i].base == buffer)
+        {
+            arena->in_use_bytes -= arena->slabs[i].used;
+            arena->slabs[i].used = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void image_arena_get_stats(ImageArena *arena, ImageArenaStats *stats)
+{
+    pthread_mutex_lock(&arena->lock);
+    stats->hits = arena->hits;
+    stats->misses = arena->misses;
+    stats->slabs = arena->slab_count;
+    stats->peak_in_use = arena->peak_in_use;
+    stats->peak_reserved = arena->peak_reserved;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// free BMP image data (a view over a caller-owned file has none)
+void free_bmp_image(BMPImage *img)
+{
+    if (img != NULL && img->view == NULL)
+    {
+        if (img->map != NULL)
+        {
+            munmap(img->map, img->map_size);
+            return; // gap and data point into the mapping
+        }
+        if (img->arena != NULL)
+        {
+            image_arena_release(img->arena, img->data);
+        }
+        else if (img->data != NULL)
+        {
+            free(img->data);
+        }
+        free(img->gap);
+    }
+}
+
+
+// read only the file header and the DIB header (no pixel data) with a single pread
+// returns 0, 1 (cannot open/read) or 2 (not a BMP) without printing anything
+int probe_bmp_header_at(int dir_fd, const char *filename, BMPProbe *probe)
+{
+    unsigned char buf[14 + BMP_MAX_DIB_HEADER_SIZE]; // file header + largest DIB header
+
+    int fd = openat(dir_fd, filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 1; // File Not Found
+    }
+    ssize_t got = pread(fd, buf, sizeof(buf), 0);
+    close(fd);
+    if (got < (ssize_t)sizeof(BMPHeader))
+    {
+        return 1; // File Not Found
+    }
+
+    memcpy(&probe->header, buf, sizeof(BMPHeader));
+    if (probe->header.type != 0x4D42)
+    {
+        return 2; // Invalid Arguments
+    }
+
+    // V2-V5 headers continue past the 40-byte BITMAPINFOHEADER
+    size_t dib_size = probe->header.dib_header_size;
+    if (dib_size > BMP_MAX_DIB_HEADER_SIZE)
+    {
+        dib_size = BMP_MAX_DIB_HEADER_SIZE;
+    }
+    size_t extension = dib_size > BMP_INFO_HEADER_SIZE ? dib_size - BMP_INFO_HEADER_SIZE : 0;
+    if ((size_t)got < sizeof(BMPHeader) + extension)
+    {
+        extension = (size_t)got - sizeof(BMPHeader);
+    }
+    probe->dib_extension_size = (uint32_t)extension;
+    memcpy(probe->dib_extension, buf + sizeof(BMPHeader), extension);
+    return 0;
+}
+
+int probe_bmp_header(const char *filename, BMPProbe *probe)
+{
+    return probe_bmp_header_at(AT_FDCWD, filename, probe);
+}
+
+// ---------------------------------------------------------------------------
+// pixel formats
+//
+// 24-bit BGR, 32-bit with 8-bit channels (BI_RGB, or BI_BITFIELDS with
+// byte-aligned masks) and 8-bit palettized images are supported. The masks
+// follow the 40-byte DIB header or are part of a V4/V5 header; either way
+// they start right after BMPHeader.
+// ---------------------------------------------------------------------------
+
+// byte position of an 8-bit channel mask, -1 if the mask is not one whole byte
+static int mask_byte_position(uint32_t mask)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        if (mask == 0xFFu << (8 * i))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 1 if the width is positive, the height has a magnitude and a padded row
+// of bits_per_pixel pixels fits in an int (the row code counts bytes in int)
+int bmp_size_supported(const BMPHeader *header)
+{
+    uint64_t row_bytes = (uint64_t)(header->bits_per_pixel / 8) * (uint32_t)header->width_px;
+    return header->width_px > 0 && header->height_px != INT_MIN && row_bytes + 3 <= INT_MAX;
+}
+
+// describe the pixel layout of an image from its header and the bytes between
+// the header and the pixel data, returns 2 for layouts this program cannot handle
+int bmp_pixel_format(const BMPHeader *header, const unsigned char *gap, size_t gap_size, BMPPixelFormat *format)
+{
+    memset(format, 0, sizeof(*format));
+    format->alpha = 0xFF;
+    if (header->dib_header_size < BMP_INFO_HEADER_SIZE || !bmp_size_supported(header))
+    {
+        return 2; // Invalid Arguments
+    }
+
+    if (header->bits_per_pixel == 24 && header->compression == BMP_BI_RGB)
+    {
+        format->id = BMP_FORMAT_BGR24;
+        format->bytes_per_pixel = 3;
+        format->blue = 0;
+        format->green = 1;
+        format->red = 2;
+        return 0;
+    }
+
+    if (header->bits_per_pixel == 32 && header->compression == BMP_BI_RGB)
+    {
+        format->id = BMP_FORMAT_BGRA32;
+        format->bytes_per_pixel = 4;
+        format->blue = 0;
+        format->green = 1;
+        format->red = 2;
+        format->alpha = 3;
+        return 0;
+    }
+
+    if (header->bits_per_pixel == 32 &&
+        (header->compression == BMP_BI_BITFIELDS || header->compression == BMP_BI_ALPHABITFIELDS))
+    {
+        uint32_t masks[3];
+        if (gap_size < sizeof(masks))
+        {
+            return 2; // Invalid Arguments
+        }
+        memcpy(masks, gap, sizeof(masks));
+        int red = mask_byte_position(masks[0]);
+        int green = mask_byte_position(masks[1]);
+        int blue = mask_byte_position(masks[2]);
+        if (red < 0 || green < 0 || blue < 0 || red == green || red == blue || green == blue)
+        {
+            return 2; // Invalid Arguments
+        }
+        format->id = BMP_FORMAT_BGRA32;
+        format->bytes_per_pixel = 4;
+        format->blue = (uint8_t)blue;
+        format->green = (uint8_t)green;
+        format->red = (uint8_t)red;
+        format->alpha = (uint8_t)(6 - red - green - blue); // the byte no color uses
+        return 0;
+    }
+
+    if (header->bits_per_pixel == 8 && header->compression == BMP_BI_RGB)
+    {
+        // the palette follows the DIB header, 256 entries unless num_colors says otherwise
+        size_t offset = header->dib_header_size - BMP_INFO_HEADER_SIZE;
+        size_t entries = header->num_colors != 0 && header->num_colors < 256 ? header->num_colors : 256;
+        if (offset > gap_size)
+        {
+            return 2; // Invalid Arguments
+        }
+        if (entries > (gap_size - offset) / 4)
+        {
+            entries = (gap_size - offset) / 4;
+        }
+        format->id = BMP_FORMAT_PAL8;
+        format->bytes_per_pixel = 1;
+        format->palette_offset = (uint32_t)offset;
+        format->palette_entries = (uint32_t)entries;
+        return 0;
+    }
+
+    return 2; // Invalid Arguments
+}
+
+// 1 if the bit depth and compression can be one of the supported formats
+// (for code that never looks at the pixels' meaning, such as the hex dump)
+int bmp_depth_supported(const BMPHeader *header)
+{
+    return (header->bits_per_pixel == 24 && header->compression == BMP_BI_RGB) ||
+           (header->bits_per_pixel == 8 && header->compression == BMP_BI_RGB) ||
+           (header->bits_per_pixel == 32 &&
+            (header->compression == BMP_BI_RGB || header->compression == BMP_BI_BITFIELDS ||
+             header->compression == BMP_BI_ALPHABITFIELDS));
+}
+
+void print_format_error(void)
+{
+    fprintf(stderr, "Error: This operation only supports uncompressed 8-bit palettized, 24-bit or 32-bit BMP\n");
+}
+
+// ---------------------------------------------------------------------------
+// hex dump
+//
+// Lines are rendered into a large buffer from lookup tables and the buffer
+// goes to standard output with write(2) when it fills up. The layout is the
+// classic one of this tool:
+//   00000000: 424d b62a 0000 0000 0000 3600 0000 2800   |BM.*......6...(.|
+// i.e. 16 bytes per line, a space after every second byte, a short last
+// line padded to full width, and the ASCII gutter with '.' for unprintables.
+// The dumped stream is the 54-byte header followed by the pixel data.
+// ---------------------------------------------------------------------------
+
+#define HEX_OUTPUT_BUFFER (1 << 20) // bytes of rendered text per write
+#define HEX_READ_CHUNK (64 * 1024)   // bytes read from the file per step (multiple of 16)
+#define HEX_LINE_MAX 96              // longest possible rendered line
+
+typedef struct {
+    char *buf;   // rendered text waiting to be written
+    size_t len;  // bytes used in buf
+    int error;   // a write failed
+} HexWriter;
+
+static char hex_pair_table[256][2]; // "00" .. "ff"
+static char hex_ascii_table[256];   // printable byte or '.'
+static int hex_tables_ready = 0;
+
+static void init_hex_tables(void)
+{
+    const char *digits = "0123456789abcdef";
+    for (int i = 0; i < 256; i++)
+    {
+        hex_pair_table[i][0] = digits[i >> 4];
+        hex_pair_table[i][1] = digits[i & 15];
+        hex_ascii_table[i] = (i >= 32 && i <= 126) ? (char)i : '.';
+    }
+    hex_tables_ready = 1;
+}
+
+static void hex_flush(HexWriter *w)
+{
+    size_t done = 0;
+    while (done < w->len && !w->error)
+    {
+        ssize_t n = write(STDOUT_FILENO, w->buf + done, w->len - done);
+        if (n < 0)
+        {
+            w->error = 1;
+            break;
+        }
+        done += (size_t)n;
+    }
+    stats_add(STATS_BYTES_WRITTEN, done);
+    w->len = 0;
+}
+
+static void hex_append(HexWriter *w, const char *text, size_t length)
+{
+    if (HEX_OUTPUT_BUFFER - w->len < length)
+    {
+        hex_flush(w);
+    }
+    memcpy(w->buf + w->len, text, length);
+    w->len += length;
+}
+
+// render one line of count (1-16) bytes that start at offset in the dumped stream
+static void hex_emit_line(HexWriter *w, uint64_t offset, const unsigned char *bytes, int count)
+{
+    if (HEX_OUTPUT_BUFFER - w->len < HEX_LINE_MAX)
+    {
+        hex_flush(w);
+    }
+    char *p = w->buf + w->len;
+
+    // offset: at least 8 hex digits
+    int digits = 8;
+    while (digits < 16 && (offset >> (4 * digits)) != 0)
+    {
+        digits++;
+    }
+    for (int d = digits - 1; d >= 0; d--)
+    {
+        *p++ = "0123456789abcdef"[(offset >> (4 * d)) & 15];
+    }
+    *p++ = ':';
+    *p++ = ' ';
+
+    // hex columns, blank-padded on a short line
+    for (int i = 0; i < 16; i++)
+    {
+        if (i < count)
+        {
+            memcpy(p, hex_pair_table[bytes[i]], 2);
+        }
+        else
+        {
+            memcpy(p, "  ", 2);
+        }
+        p += 2;
+        if (i & 1)
+        {
+            *p++ = ' ';
+        }
+    }
+
+    memcpy(p, "  |", 3);
+    p += 3;
+    for (int i = 0; i < count; i++)
+    {
+        *p++ = hex_ascii_table[bytes[i]];
+    }
+    *p++ = '|';
+    *p++ = '\n';
+    w->len = p - w->buf;
+}
+
+static int hex_writer_open(HexWriter *w)
+{
+    if (!hex_tables_ready)
+    {
+        init_hex_tables();
+    }
+    w->buf = (char *)malloc(HEX_OUTPUT_BUFFER);
+    w->len = 0;
+    w->error = 0;
+    if (w->buf == NULL)
+    {
+        fprintf(stderr, "Error: hex dump buffer memory allocation failed\n");
+        return 3; // Memory Allocation Failure
+    }
+    fflush(stdout); // keep earlier stdio output ahead of ours
+    const char *title = "\n--- BMP file data (hex dump) ---\n";
+    hex_append(w, title, strlen(title));
+    return 0;
+}
+
+static int hex_writer_close(HexWriter *w)
+{
+    hex_flush(w);
+    free(w->buf);
+    if (w->error)
+    {
+        fprintf(stderr, "Error: writing hex dump failed\n");
+        return 1; // File Not Found
+    }
+    return 0;
+}
+
+// print BMP file data information (header + pixel data of an image in memory)
+void print_data_hex(const BMPImage *img)
+{
+    HexWriter w;
+    if (hex_writer_open(&w) != 0)
+    {
+        return;
+    }
+
+    StatsSpan span = stats_begin(STATS_HEX);
+    size_t header_size = sizeof(BMPHeader);
+    size_t data_size = img->header.size - img->header.offset;
+    size_t total_size = header_size + data_size;
+    const unsigned char *header_bytes = (const unsigned char *)&img->header;
+    unsigned char line[16];
+
+    // lines of the pixel data are rendered straight from the image, only the line
+    // that straddles the header/data boundary is assembled first
+    for (size_t offset = 0; offset < total_size; offset += 16)
+    {
+        int count = total_size - offset < 16 ? (int)(total_size - offset) : 16;
+        const unsigned char *bytes;
+        if (offset >= header_size)
+        {
+            bytes = img->data + (offset - header_size);
+        }
+        else
+        {
+            for (int i = 0; i < count; i++)
+            {
+                size_t at = offset + i;
+                line[i] = at < header_size ? header_bytes[at] : img->data[at - header_size];
+            }
+            bytes = line;
+        }
+        hex_emit_line(&w, offset, bytes, count);
+    }
+    hex_writer_close(&w);
+    stats_end(&span);
+}
+
+// hex dump length bytes from start of the BMP file's dump stream (header + pixel data),
+// reading only that slice of the file
+int dump_bmp_hex(const char *filename, uint64_t start, uint64_t length)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", filename);
+        return 1; // File Not Found
+    }
+
+    BMPHeader header;
+    if (fread(&header, sizeof(BMPHeader), 1, file) != 1)
+    {
+        fprintf(stderr, "Error: reading BMP header\n");
+        fclose(file);
+        return 1; // File Not Found
+    }
+    if (header.type != 0x4D42)
+    {
+        fprintf(stderr, "Error: File is not a valid BMP format (magic number 0x%X)\n", header.type);
+        fclose(file);
+        return 2; // Invalid Arguments
+    }
+    if (!bmp_depth_supported(&header))
+    {
+        print_format_error();
+        fclose(file);
+        return 2; // Invalid Arguments
+    }
+    if (header.offset < sizeof(BMPHeader) || header.offset > header.size)
+    {
+        fprintf(stderr, "Error: reading image data failed\n");
+        fclose(file);
+        return 1; // File Not Found
+    }
+
+    // clamp the slice to the stream
+    uint64_t total_size = sizeof(BMPHeader) + (uint64_t)(header.size - header.offset);
+    if (start > total_size)
+    {
+        start = total_size;
+    }
+    if (length > total_size - start)
+    {
+        length = total_size - start;
+    }
+
+    unsigned char *chunk = (unsigned char *)malloc(HEX_READ_CHUNK);
+    HexWriter w;
+    int result = chunk != NULL ? hex_writer_open(&w) : 3;
+    if (result != 0)
+    {
+        if (chunk == NULL)
+        {
+            fprintf(stderr, "Error: hex dump buffer memory allocation failed\n");
+        }
+        free(chunk);
+        fclose(file);
+        return result;
+    }
+
+    // the pixel part of the slice is read sequentially after one seek
+    uint64_t first_data = start > sizeof(BMPHeader) ? start - sizeof(BMPHeader) : 0;
+    if (start + length > sizeof(BMPHeader) && fseeko(file, (off_t)(header.offset + first_data), SEEK_SET) != 0)
+    {
+        fprintf(stderr, "Error: seeking to image data offset failed\n");
+        result = 1; // File Not Found
+    }
+
+    const unsigned char *header_bytes = (const unsigned char *)&header;
+    uint64_t pos = start;
+    uint64_t end = start + length;
+    while (result == 0 && pos < end)
+    {
+        size_t count = end - pos < HEX_READ_CHUNK ? (size_t)(end - pos) : HEX_READ_CHUNK;
+        size_t filled = 0;
+        while (filled < count && pos + filled < sizeof(BMPHeader))
+        {
+            chunk[filled] = header_bytes[pos + filled];
+            filled++;
+        }
+        if (filled < count && fread(chunk + filled, 1, count - filled, file) != count - filled)
+        {
+            fprintf(stderr, "Error: reading image data failed\n");
+            result = 1; // File Not Found
+            break;
+        }
+        stats_add(STATS_BYTES_READ, count - filled);
+
+        for (size_t i = 0; i < count; i += 16)
+        {
+            hex_emit_line(&w, pos + i, chunk + i, count - i < 16 ? (int)(count - i) : 16);
+        }
+        pos += count;
+    }
+
+    int close_result = hex_writer_close(&w);
+    free(chunk);
+    fclose(file);
+    return result != 0 ? result : close_result;
+}
+
+// calculate padding size for each row
+int calculate_padding(int width_px, int bytes_per_pixel)
+{
+    // rows are stored in multiples of 4 bytes
+    size_t row_size_bytes = (size_t)(uint32_t)width_px * (size_t)bytes_per_pixel;
+
+    return (int)((4 - row_size_bytes % 4) % 4);
+}
+
+// ---------------------------------------------------------------------------
+// thread pool
+//
+// thread_pool_run splits task indices [0, task_count) into one contiguous range
+// per participant (the workers plus the calling thread). Each participant
+// drains its own range first and then steals from the others, claiming one
+// index at a time with an atomic increment, so uneven tasks still balance.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    _Alignas(64) atomic_size_t next; // next unclaimed task of this range
+    size_t end;                      // one past the last task of this range
+} PoolRange;
+
+struct ThreadPool {
+    int participants;   // worker threads + calling thread
+    pthread_t *threads; // participants - 1 worker threads
+    PoolRange *ranges;  // one range per participant
+    pool_task_fn fn;    // task function of the current run
+    void *ctx;          // task context of the current run
+    unsigned generation; // incremented for every run
+    int active;         // workers still busy with the current run
+    int shutdown;       // workers should exit
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finished;
+};
+
+typedef struct {
+    ThreadPool *pool;
+    int self;
+} PoolWorker;
+
+static void pool_participate(ThreadPool *pool, int self)
+{
+    for (int k = 0; k < pool->participants; k++)
+    {
+        PoolRange *range = &pool->ranges[(self + k) % pool->participants];
+        for (;;)
+        {
+            size_t task = atomic_fetch_add_explicit(&range->next, 1, memory_order_relaxed);
+            if (task >= range->end)
+            {
+                break;
+            }
+            pool->fn(pool->ctx, task, self);
+        }
+    }
+}
+
+static void *pool_worker_main(void *arg)
+{
+    PoolWorker *worker = (PoolWorker *)arg;
+    ThreadPool *pool = worker->pool;
+    unsigned seen = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->shutdown)
+        {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_participate(pool, worker->self);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0)
+        {
+            pthread_cond_signal(&pool->finished);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    free(worker);
+    return NULL;
+}
+
+// number of online CPUs (at least 1)
+int online_cpu_count(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+// create a pool with `threads` participants in total (the caller counts as one)
+// returns NULL when threads <= 1, callers then run serially
+ThreadPool *thread_pool_create(int threads)
+{
+    if (threads <= 1)
+    {
+        return NULL;
+    }
+
+    ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->ranges = (PoolRange *)aligned_alloc(64, sizeof(PoolRange) * threads);
+    pool->threads = (pthread_t *)calloc(threads - 1, sizeof(pthread_t));
+    if (pool->ranges == NULL || pool->threads == NULL)
+    {
+        free(pool->ranges);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    // the pool shrinks to the number of workers that could actually be started
+    pool->participants = 1;
+    for (int i = 1; i < threads; i++)
+    {
+        PoolWorker *worker = (PoolWorker *)malloc(sizeof(PoolWorker));
+        if (worker == NULL)
+        {
+            break;
+        }
+        worker->pool = pool;
+        worker->self = i;
+        if (pthread_create(&pool->threads[i - 1], NULL, pool_worker_main, worker) != 0)
+        {
+            free(worker);
+            break;
+        }
+        pool->participants++;
+    }
+    return pool;
+}
+
+// stop and join all workers
+void thread_pool_destroy(ThreadPool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->participants - 1; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->finished);
+    free(pool->ranges);
+    free(pool->threads);
+    free(pool);
+}
+
+// number of threads that run tasks, including the caller (1 for a NULL pool)
+int thread_pool_size(const ThreadPool *pool)
+{
+    return pool != NULL ? pool->participants : 1;
+}
+
+// run fn(ctx, task, worker) for every task in [0, task_count) and wait for all of them
+// worker is the index (0 = caller) of the participant running the task, below thread_pool_size
+// with pool == NULL the tasks simply run in order on the calling thread
+void thread_pool_run(ThreadPool *pool, size_t task_count, pool_task_fn fn, void *ctx)
+{
+    if (pool == NULL || pool->participants == 1 || task_count <= 1)
+    {
+        for (size_t task = 0; task < task_count; task++)
+        {
+            fn(ctx, task, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    for (int i = 0; i < pool->participants; i++)
+    {
+        atomic_store_explicit(&pool->ranges[i].next, task_count * i / pool->participants, memory_order_relaxed);
+        pool->ranges[i].end = task_count * (i + 1) / pool->participants;
+    }
+    pool->active = pool->participants - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_participate(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0)
+    {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// rows of an image; the height is negative for top-down rows, and negated in 64 bits
+// since -INT_MIN does not fit an int
+static uint64_t bmp_row_count(const BMPHeader *header)
+{
+    return header->height_px < 0 ? -(uint64_t)header->height_px : (uint64_t)header->height_px;
+}
+
+// bytes the header says follow the pixel data offset (0 if the offset is past the end)
+static uint64_t bmp_pixel_bytes(const BMPHeader *header)
+{
+    return header->size > header->offset ? (uint64_t)(header->size - header->offset) : 0;
+}
+
+// size in bytes of one stored row (pixels + padding)
+size_t calculate_row_stride(int width_px, int bytes_per_pixel)
+{
+    return (size_t)(uint32_t)width_px * (size_t)bytes_per_pixel + (size_t)calculate_padding(width_px, bytes_per_pixel);
+}
+
+// ---------------------------------------------------------------------------
+// grayscale row kernels
+//
+// All kernels compute Y = (B * wb + G * wg + R * wr + 128) >> 8 with the 8.8
+// fixed-point weights below and write Y to all three channels, so the scalar,
+// SSSE3 and AVX2 versions give identical output. GRAY_GREEN (weights 0/256/0)
+// reproduces the original "copy green into blue and red" conversion.
+//
+// 32-bit pixels are whole 32-bit lanes, so their kernels need no gathering:
+// pmaddwd sums the weighted even and odd bytes of each pixel, with the weights
+// placed at the channels' byte positions and 0 for alpha, which is kept.
+// Palettized images convert their palette instead of their pixels.
+// ---------------------------------------------------------------------------
+
+// {blue, green, red} weights per mode, each row sums to 256
+static const uint16_t gray_weights[3][3] = {
+    {0, 256, 0},
+    {29, 150, 77},
+    {19, 183, 54},
+};
+
+// 24-bit kernels take the weight of each byte position of a pixel (BGR or RGB),
+// green is in the middle either way
+typedef void (*grayscale_row_fn)(unsigned char *row, int width, const uint16_t w[3]);
+
+static void grayscale_row_scalar(unsigned char *row, int width, const uint16_t w[3])
+{
+    for (int j = 0; j < width; j++)
+    {
+        unsigned char *pixel = row + j * 3;
+        unsigned char gray = pixel[1];
+        if (w[1] != 256)
+        {
+            gray = (unsigned char)((pixel[0] * w[0] + pixel[1] * w[1] + pixel[2] * w[2] + 128) >> 8);
+        }
+        pixel[0] = gray;
+        pixel[1] = gray;
+        pixel[2] = gray;
+    }
+}
+
+// per-image constants of the 32-bit kernels
+typedef struct {
+    int16_t weight[4];  // weight of the channel at each byte position of a pixel (alpha 0)
+    int8_t spread[16];  // pshufb mask copying each pixel's gray byte to its B, G and R bytes
+    uint32_t keep;      // bytes of a pixel that are left alone (alpha)
+} Gray32Params;
+
+typedef void (*grayscale_row32_fn)(unsigned char *row, int width, const Gray32Params *params);
+
+static void gray32_params(const BMPPixelFormat *format, GrayscaleMode mode, Gray32Params *params)
+{
+    memset(params, 0, sizeof(*params));
+    params->weight[format->blue] = (int16_t)gray_weights[mode][0];
+    params->weight[format->green] = (int16_t)gray_weights[mode][1];
+    params->weight[format->red] = (int16_t)gray_weights[mode][2];
+    for (int i = 0; i < 16; i++)
+    {
+        params->spread[i] = (i & 3) == format->alpha ? -1 : (int8_t)(i & ~3);
+    }
+    params->keep = format->alpha < 4 ? 0xFFu << (8 * format->alpha) : 0;
+}
+
+static void grayscale_row32_scalar(unsigned char *row, int width, const Gray32Params *params)
+{
+    const int16_t *w = params->weight;
+
+    for (int j = 0; j < width; j++)
+    {
+        unsigned char *pixel = row + j * 4;
+        unsigned char gray = (unsigned char)((pixel[0] * w[0] + pixel[1] * w[1] + pixel[2] * w[2] + pixel[3] * w[3] + 128) >> 8);
+        for (int c = 0; c < 4; c++)
+        {
+            if (params->spread[c] >= 0)
+            {
+                pixel[c] = gray;
+            }
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// pshufb masks for 16 BGR pixels in three 16-byte vectors v0 v1 v2:
+// rows 0-8 gather channel c from vector v (row 3c + v), -1 lanes are zeroed;
+// rows 9-11 spread 16 gray bytes back into three BGR vectors
+static const int8_t gray_shuffle_masks[12][16] = {
+    {0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},  // B from v0
+    {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1}, // B from v1
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13}, // B from v2
+    {1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}, // G from v0
+    {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},  // G from v1
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14}, // G from v2
+    {2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}, // R from v0
+    {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1}, // R from v1
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15},  // R from v2
+    {0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5},              // gray to v0
+    {5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10},            // gray to v1
+    {10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15}, // gray to v2
+};
+
+__attribute__((target("ssse3"))) static inline __m128i gray_gather_ssse3(__m128i v0, __m128i v1, __m128i v2, int channel)
+{
+    const __m128i *masks = (const __m128i *)gray_shuffle_masks[channel * 3];
+    return _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, _mm_loadu_si128(masks + 0)),
+                                     _mm_shuffle_epi8(v1, _mm_loadu_si128(masks + 1))),
+                        _mm_shuffle_epi8(v2, _mm_loadu_si128(masks + 2)));
+}
+
+// weighted sum of 8 zero-extended pixels, result in the low byte of each 16-bit lane
+__attribute__((target("ssse3"))) static inline __m128i gray_luma8_ssse3(__m128i b, __m128i g, __m128i r, const __m128i *w)
+{
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(b, w[0]), _mm_mullo_epi16(g, w[1]));
+    sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_mullo_epi16(r, w[2]), _mm_set1_epi16(128)));
+    return _mm_srli_epi16(sum, 8); // max 255 * 256 + 128, fits in an unsigned 16-bit lane
+}
+
+// 16 pixels per iteration
+__attribute__((target("ssse3"))) static void grayscale_row_ssse3(unsigned char *row, int width, const uint16_t weights[3])
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i *spread = (const __m128i *)gray_shuffle_masks[9];
+    __m128i w[3];
+    for (int c = 0; c < 3; c++)
+    {
+        w[c] = _mm_set1_epi16((short)weights[c]);
+    }
+    int j = 0;
+
+    for (; j + 16 <= width; j += 16)
+    {
+        unsigned char *p = row + j * 3;
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(p + 0));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(p + 32));
+
+        __m128i gray = gray_gather_ssse3(v0, v1, v2, 1);
+        if (weights[1] != 256)
+        {
+            __m128i b = gray_gather_ssse3(v0, v1, v2, 0);
+            __m128i r = gray_gather_ssse3(v0, v1, v2, 2);
+            __m128i lo = gray_luma8_ssse3(_mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(gray, zero), _mm_unpacklo_epi8(r, zero), w);
+            __m128i hi = gray_luma8_ssse3(_mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(gray, zero), _mm_unpackhi_epi8(r, zero), w);
+            gray = _mm_packus_epi16(lo, hi);
+        }
+
+        _mm_storeu_si128((__m128i *)(p + 0), _mm_shuffle_epi8(gray, _mm_loadu_si128(spread + 0)));
+        _mm_storeu_si128((__m128i *)(p + 16), _mm_shuffle_epi8(gray, _mm_loadu_si128(spread + 1)));
+        _mm_storeu_si128((__m128i *)(p + 32), _mm_shuffle_epi8(gray, _mm_loadu_si128(spread + 2)));
+    }
+    grayscale_row_scalar(row + j * 3, width - j, weights);
+}
+
+__attribute__((target("avx2"))) static inline __m256i gray_gather_avx2(__m256i v0, __m256i v1, __m256i v2, int channel)
+{
+    const __m128i *masks = (const __m128i *)gray_shuffle_masks[channel * 3];
+    return _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(v0, _mm256_broadcastsi128_si256(_mm_loadu_si128(masks + 0))),
+                                           _mm256_shuffle_epi8(v1, _mm256_broadcastsi128_si256(_mm_loadu_si128(masks + 1)))),
+                           _mm256_shuffle_epi8(v2, _mm256_broadcastsi128_si256(_mm_loadu_si128(masks + 2))));
+}
+
+__attribute__((target("avx2"))) static inline __m256i gray_luma16_avx2(__m256i b, __m256i g, __m256i r, const __m256i *w)
+{
+    __m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(b, w[0]), _mm256_mullo_epi16(g, w[1]));
+    sum = _mm256_add_epi16(sum, _mm256_add_epi16(_mm256_mullo_epi16(r, w[2]), _mm256_set1_epi16(128)));
+    return _mm256_srli_epi16(sum, 8);
+}
+
+// 32 pixels per iteration: the low 128-bit lanes hold pixels 0-15, the high lanes
+// pixels 16-31, so the in-lane shuffles of the SSSE3 kernel carry over unchanged
+__attribute__((target("avx2"))) static void grayscale_row_avx2(unsigned char *row, int width, const uint16_t weights[3])
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m128i *spread = (const __m128i *)gray_shuffle_masks[9];
+    __m256i w[3];
+    for (int c = 0; c < 3; c++)
+    {
+        w[c] = _mm256_set1_epi16((short)weights[c]);
+    }
+    int j = 0;
+
+    for (; j + 32 <= width; j += 32)
+    {
+        unsigned char *p = row + j * 3;
+        __m256i v[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m128i low = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+            __m128i high = _mm_loadu_si128((const __m128i *)(p + 48 + 16 * k));
+            v[k] = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+        }
+
+        __m256i gray = gray_gather_avx2(v[0], v[1], v[2], 1);
+        if (weights[1] != 256)
+        {
+            __m256i b = gray_gather_avx2(v[0], v[1], v[2], 0);
+            __m256i r = gray_gather_avx2(v[0], v[1], v[2], 2);
+            __m256i lo = gray_luma16_avx2(_mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(gray, zero), _mm256_unpacklo_epi8(r, zero), w);
+            __m256i hi = gray_luma16_avx2(_mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(gray, zero), _mm256_unpackhi_epi8(r, zero), w);
+            gray = _mm256_packus_epi16(lo, hi);
+        }
+
+        for (int k = 0; k < 3; k++)
+        {
+            __m256i out = _mm256_shuffle_epi8(gray, _mm256_broadcastsi128_si256(_mm_loadu_si128(spread + k)));
+            _mm_storeu_si128((__m128i *)(p + 16 * k), _mm256_castsi256_si128(out));
+            _mm_storeu_si128((__m128i *)(p + 48 + 16 * k), _mm256_extracti128_si256(out, 1));
+        }
+    }
+    grayscale_row_ssse3(row + j * 3, width - j, weights);
+}
+
+// 4 pixels per iteration
+__attribute__((target("ssse3"))) static void grayscale_row32_ssse3(unsigned char *row, int width, const Gray32Params *params)
+{
+    const int16_t *w = params->weight;
+    const __m128i even_weights = _mm_setr_epi16(w[0], w[2], w[0], w[2], w[0], w[2], w[0], w[2]);
+    const __m128i odd_weights = _mm_setr_epi16(w[1], w[3], w[1], w[3], w[1], w[3], w[1], w[3]);
+    const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i spread = _mm_loadu_si128((const __m128i *)params->spread);
+    const __m128i keep = _mm_set1_epi32((int)params->keep);
+    int j = 0;
+
+    for (; j + 4 <= width; j += 4)
+    {
+        unsigned char *p = row + j * 4;
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i sum = _mm_add_epi32(_mm_madd_epi16(_mm_and_si128(v, low_bytes), even_weights),
+                                    _mm_madd_epi16(_mm_srli_epi16(v, 8), odd_weights));
+        __m128i gray = _mm_srli_epi32(_mm_add_epi32(sum, round), 8); // one gray byte per pixel
+        _mm_storeu_si128((__m128i *)p, _mm_or_si128(_mm_and_si128(v, keep), _mm_shuffle_epi8(gray, spread)));
+    }
+    grayscale_row32_scalar(row + j * 4, width - j, params);
+}
+
+// 8 pixels per iteration
+__attribute__((target("avx2"))) static void grayscale_row32_avx2(unsigned char *row, int width, const Gray32Params *params)
+{
+    const int16_t *w = params->weight;
+    const __m256i even_weights = _mm256_set1_epi32((int)(((uint32_t)(uint16_t)w[2] << 16) | (uint16_t)w[0]));
+    const __m256i odd_weights = _mm256_set1_epi32((int)(((uint32_t)(uint16_t)w[3] << 16) | (uint16_t)w[1]));
+    const __m256i low_bytes = _mm256_set1_epi16(0x00FF);
+    const __m256i round = _mm256_set1_epi32(128);
+    const __m256i spread = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)params->spread));
+    const __m256i keep = _mm256_set1_epi32((int)params->keep);
+    int j = 0;
+
+    for (; j + 8 <= width; j += 8)
+    {
+        unsigned char *p = row + j * 4;
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(_mm256_and_si256(v, low_bytes), even_weights),
+                                       _mm256_madd_epi16(_mm256_srli_epi16(v, 8), odd_weights));
+        __m256i gray = _mm256_srli_epi32(_mm256_add_epi32(sum, round), 8);
+        _mm256_storeu_si256((__m256i *)p, _mm256_or_si256(_mm256_and_si256(v, keep), _mm256_shuffle_epi8(gray, spread)));
+    }
+    grayscale_row32_ssse3(row + j * 4, width - j, params);
+}
+#endif
+
+static grayscale_row_fn grayscale_row_kernel = NULL;
+static grayscale_row32_fn grayscale_row32_kernel = NULL;
+static const char *grayscale_kernel_name = "scalar";
+
+// pick the fastest row kernel supported by this CPU (BMP_GRAY_KERNEL=scalar|ssse3|avx2 forces one)
+static void select_grayscale_kernel(void)
+{
+    const char *forced = getenv("BMP_GRAY_KERNEL");
+
+    grayscale_row_kernel = grayscale_row_scalar;
+    grayscale_row32_kernel = grayscale_row32_scalar;
+    grayscale_kernel_name = "scalar";
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    int use_avx2 = __builtin_cpu_supports("avx2");
+    int use_ssse3 = __builtin_cpu_supports("ssse3");
+    if (forced != NULL)
+    {
+        use_avx2 = use_avx2 && strcmp(forced, "avx2") == 0;
+        use_ssse3 = use_ssse3 && strcmp(forced, "ssse3") == 0;
+    }
+
+    if (use_avx2)
+    {
+        grayscale_row_kernel = grayscale_row_avx2;
+        grayscale_row32_kernel = grayscale_row32_avx2;
+        grayscale_kernel_name = "avx2";
+    }
+    else if (use_ssse3)
+    {
+        grayscale_row_kernel = grayscale_row_ssse3;
+        grayscale_row32_kernel = grayscale_row32_ssse3;
+        grayscale_kernel_name = "ssse3";
+    }
+#else
+    (void)forced;
+#endif
+}
+
+// convert row_count consecutive rows starting at rows to grayscale
+// (palettized rows are left alone, see grayscale_palette)
+void grayscale_rows(unsigned char *rows, const BMPPixelFormat *format, int width, int row_count, GrayscaleMode mode)
+{
+    size_t stride = calculate_row_stride(width, format->bytes_per_pixel);
+    unsigned char *row = rows; // start of the current row
+
+    bmpstego_init();
+
+    if (format->id == BMP_FORMAT_BGRA32)
+    {
+        Gray32Params params;
+        gray32_params(format, mode, &params);
+        for (int i = 0; i < row_count; i++, row += stride)
+        {
+            grayscale_row32_kernel(row, width, &params);
+        }
+        return;
+    }
+    if (format->id != BMP_FORMAT_BGR24)
+    {
+        return;
+    }
+
+    uint16_t weights[3];
+    weights[format->blue] = gray_weights[mode][0];
+    weights[format->green] = gray_weights[mode][1];
+    weights[format->red] = gray_weights[mode][2];
+    for (int i = 0; i < row_count; i++)
+    {
+        grayscale_row_kernel(row, width, weights);
+
+        // skip padding bytes and move to the start of the next row
+        row += stride;
+    }
+}
+
+// convert the BGRX palette of an 8-bit image, the pixel indices stay as they are
+void grayscale_palette(unsigned char *palette, uint32_t entries, GrayscaleMode mode)
+{
+    // palette entries have the layout of BI_RGB 32-bit pixels
+    static const BMPPixelFormat bgrx = {BMP_FORMAT_BGRA32, 4, 0, 1, 2, 3, 0, 0};
+    Gray32Params params;
+
+    gray32_params(&bgrx, mode, &params);
+    grayscale_row32_scalar(palette, (int)entries, &params);
+}
+
+#define GRAYSCALE_BAND_BYTES (256 * 1024) // target size of one parallel grayscale task
+
+typedef struct {
+    unsigned char *rows; // first row of the region
+    const BMPPixelFormat *format; // pixel layout
+    int width;           // width in pixels
+    int row_count;       // rows in the region
+    int band_rows;       // rows per task
+    GrayscaleMode mode;  // luminance formula
+} GrayscaleBands;
+
+static void grayscale_band_task(void *ctx, size_t task, int worker)
+{
+    (void)worker;
+    GrayscaleBands *bands = (GrayscaleBands *)ctx;
+    int first = (int)task * bands->band_rows;
+    int count = bands->row_count - first < bands->band_rows ? bands->row_count - first : bands->band_rows;
+
+    size_t stride = calculate_row_stride(bands->width, bands->format->bytes_per_pixel);
+    grayscale_rows(bands->rows + (size_t)first * stride, bands->format, bands->width, count, bands->mode);
+}
+
+// convert rows to grayscale, split into bands of whole padded rows across the pool
+void grayscale_rows_parallel(ThreadPool *pool, unsigned char *rows, const BMPPixelFormat *format, int width, int row_count, GrayscaleMode mode)
+{
+    size_t stride = calculate_row_stride(width, format->bytes_per_pixel);
+    if (pool == NULL || row_count <= 0 || stride == 0 || format->id == BMP_FORMAT_PAL8)
+    {
+        grayscale_rows(rows, format, width, row_count, mode);
+        return;
+    }
+
+    // select the kernel before the workers start using it
+    bmpstego_init();
+
+    GrayscaleBands bands;
+    bands.rows = rows;
+    bands.format = format;
+    bands.width = width;
+    bands.row_count = row_count;
+    bands.mode = mode;
+    bands.band_rows = stride < GRAYSCALE_BAND_BYTES ? (int)(GRAYSCALE_BAND_BYTES / stride) : 1;
+
+    size_t band_count = ((size_t)row_count + bands.band_rows - 1) / bands.band_rows;
+    thread_pool_run(pool, band_count, grayscale_band_task, &bands);
+}
+
+// 1 if the pixel data array holds all rows the header describes
+static int pixel_rows_fit(const BMPImage *img)
+{
+    size_t stride = calculate_row_stride(img->header.width_px, img->format.bytes_per_pixel);
+    return bmp_row_count(&img->header) <= bmp_pixel_bytes(&img->header) / stride;
+}
+
+// convert BMP image to grayscale (pool may be NULL for a serial run)
+// palettized images only get a new palette, O(256) instead of O(pixels)
+int convert_to_grayscale(BMPImage *img, ThreadPool *pool, GrayscaleMode mode)
+{
+    if (!pixel_rows_fit(img))
+    {
+        fprintf(stderr, "Error: reading image data failed\n");
+        return 1; // File Not Found
+    }
+
+    fprintf(report_out(), "\n--- Converting to Grayscale ---\n");
+    bmpstego_grayscale(img, pool, mode);
+    fprintf(report_out(), "successfully converted to grayscale\n");
+    return 0; // return 0 for success
+}
+
+// convert the pixels, or the palette, of img to grayscale without printing anything
+int bmpstego_grayscale(BMPImage *img, ThreadPool *pool, GrayscaleMode mode)
+{
+    if (!pixel_rows_fit(img))
+    {
+        return BMPSTEGO_ERR_IO;
+    }
+    if (img->format.id == BMP_FORMAT_PAL8)
+    {
+        grayscale_palette(img->gap + img->format.palette_offset, img->format.palette_entries, mode);
+    }
+    else
+    {
+        grayscale_rows_parallel(pool, img->data, &img->format, img->header.width_px,
+                                (int)bmp_row_count(&img->header), mode);
+    }
+    return BMPSTEGO_OK;
+}
+
+// ---------------------------------------------------------------------------
+// streaming grayscale conversion
+//
+// A reader thread fills one of two fixed-size band buffers with whole rows
+// while the main thread converts and writes the other one, so peak memory is
+// 2 * STREAM_BAND_BYTES no matter how large the image is.
+// ---------------------------------------------------------------------------
+
+#define STREAM_BAND_BYTES (1 << 20) // target size of one band buffer (rounded to whole rows)
+
+typedef struct {
+    unsigned char *buf[2]; // double buffer
+    size_t len[2];         // valid bytes in each buffer
+    int full[2];           // 1 while a buffer waits to be consumed
+    int done;              // reader has finished (end of data, error or stop)
+    int error;             // reader failed
+    int stop;              // consumer asks the reader to quit early
+    size_t band_bytes;     // capacity of each buffer
+    uint64_t remaining;    // pixel data bytes not read yet
+    FILE *in;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} BandQueue;
+
+static void *band_reader(void *arg)
+{
+    BandQueue *q = (BandQueue *)arg;
+    int slot = 0;
+
+    for (;;)
+    {
+        // wait until the consumer has released this buffer
+        pthread_mutex_lock(&q->lock);
+        while (q->full[slot] && !q->stop)
+        {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        if (q->stop || q->remaining == 0)
+        {
+            q->done = 1;
+            pthread_cond_broadcast(&q->cond);
+            pthread_mutex_unlock(&q->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        size_t want = q->remaining < q->band_bytes ? (size_t)q->remaining : q->band_bytes;
+        size_t got = fread(q->buf[slot], 1, want, q->in);
+        stats_add(STATS_BYTES_READ, got);
+
+        pthread_mutex_lock(&q->lock);
+        if (got != want)
+        {
+            q->error = 1;
+            q->done = 1;
+            pthread_cond_broadcast(&q->cond);
+            pthread_mutex_unlock(&q->lock);
+            return NULL;
+        }
+        q->len[slot] = got;
+        q->full[slot] = 1;
+        q->remaining -= got;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+
+        slot ^= 1;
+    }
+}
+
+// convert input BMP to grayscale band by band without loading the whole pixel array
+int convert_to_grayscale_stream(const char *input_file, const char *output_file, ThreadPool *pool, GrayscaleMode mode)
+{
+    // the output is written while the input is still being read
+    if (same_file(input_file, output_file))
+    {
+        fprintf(stderr, "Error: -stream cannot write the grayscale image over its input\n");
+        return 2; // Invalid Arguments
+    }
+
+    FILE *in = fopen(input_file, "rb");
+    if (in == NULL)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", input_file);
+        return 1; // File Not Found
+    }
+
+    BMPHeader header;
+    if (fread(&header, sizeof(BMPHeader), 1, in) != 1)
+    {
+        fprintf(stderr, "Error: reading BMP header\n");
+        fclose(in);
+        return 1; // File Not Found
+    }
+    if (header.type != 0x4D42)
+    {
+        fprintf(stderr, "Error: File is not a valid BMP format (magic number 0x%X)\n", header.type);
+        fclose(in);
+        return 2; // Invalid Arguments
+    }
+    if (header.offset < sizeof(BMPHeader) || header.offset > header.size)
+    {
+        fprintf(stderr, "Error: reading image data failed\n");
+        fclose(in);
+        return 1; // File Not Found
+    }
+
+    // masks and palette sit between the header and the pixel data
+    size_t gap_size = header.offset - sizeof(BMPHeader);
+    unsigned char *gap = (unsigned char *)malloc(gap_size > 0 ? gap_size : 1);
+    if (gap == NULL)
+    {
+        fprintf(stderr, "Error: image data memory allocation failed\n");
+        fclose(in);
+        return 3; // Memory Allocation Failure
+    }
+    if (fread(gap, 1, gap_size, in) != gap_size)
+    {
+        fprintf(stderr, "Error: reading image data failed\n");
+        free(gap);
+        fclose(in);
+        return 1; // File Not Found
+    }
+    BMPPixelFormat format;
+    if (bmp_pixel_format(&header, gap, gap_size, &format) != 0)
+    {
+        print_format_error();
+        free(gap);
+        fclose(in);
+        return 2; // Invalid Arguments
+    }
+
+    int width = header.width_px;
+    int height = (int)bmp_row_count(&header); // bmp_pixel_format rejected INT_MIN
+    size_t stride = calculate_row_stride(width, format.bytes_per_pixel);
+    if ((uint64_t)height > bmp_pixel_bytes(&header) / stride)
+    {
+        fprintf(stderr, "Error: reading image data failed\n");
+        free(gap);
+        fclose(in);
+        return 1; // File Not Found
+    }
+
+    // write a new file next to the output and rename it on success, so a failure leaves
+    // no partial image and no file that happened to be there is overwritten
+    char *temp_name;
+    int out_fd = create_temp_output(output_file, &temp_name);
+    if (out_fd < 0 && errno == ENOMEM)
+    {
+        fprintf(stderr, "Error: image data memory allocation failed\n");
+        free(gap);
+        fclose(in);
+        return 3; // Memory Allocation Failure
+    }
+    FILE *out = out_fd >= 0 ? fdopen(out_fd, "wb") : NULL;
+    if (out == NULL)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", output_file);
+        if (out_fd >= 0)
+        {
+            close(out_fd);
+            remove(temp_name);
+            free(temp_name);
+        }
+        free(gap);
+        fclose(in);
+        return 1; // File Not Found
+    }
+
+    // band = as many whole rows as fit in STREAM_BAND_BYTES (at least one)
+    size_t band_rows = stride > 0 && stride < STREAM_BAND_BYTES ? STREAM_BAND_BYTES / stride : 1;
+    BandQueue q;
+    memset(&q, 0, sizeof(q));
+    q.band_bytes = band_rows * (stride > 0 ? stride : 1);
+    q.buf[0] = (unsigned char *)malloc(q.band_bytes);
+    q.buf[1] = (unsigned char *)malloc(q.band_bytes);
+    if (q.buf[0] == NULL || q.buf[1] == NULL)
+    {
+        fprintf(stderr, "Error: image data memory allocation failed\n");
+        free(q.buf[0]);
+        free(q.buf[1]);
+        free(gap);
+        fclose(in);
+        fclose(out);
+        remove(temp_name);
+        free(temp_name);
+        return 3; // Memory Allocation Failure
+    }
+
+    fprintf(report_out(), "\n--- Converting to Grayscale ---\n");
+
+    // header and anything between the header and the pixel data are copied verbatim,
+    // except for a palette, which is all that changes in a palettized image
+    if (format.id == BMP_FORMAT_PAL8)
+    {
+        grayscale_palette(gap + format.palette_offset, format.palette_entries, mode);
+    }
+    int result = fwrite(&header, sizeof(BMPHeader), 1, out) == 1 && fwrite(gap, 1, gap_size, out) == gap_size ? 0 : 1;
+    free(gap);
+    if (result != 0)
+    {
+        fprintf(stderr, "Error: writing BMP header failed\n");
+        free(q.buf[0]);
+        free(q.buf[1]);
+        fclose(in);
+        fclose(out);
+        remove(temp_name);
+        free(temp_name);
+        return 1; // File Not Found
+    }
+
+    q.in = in;
+    q.remaining = header.size - header.offset;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, band_reader, &q) != 0)
+    {
+        fprintf(stderr, "Error: starting reader thread failed\n");
+        result = 3; // Memory Allocation Failure
+    }
+
+    // consume bands in the order the reader produced them
+    int slot = 0;
+    int rows_done = 0;
+    while (result == 0)
+    {
+        pthread_mutex_lock(&q.lock);
+        while (!q.full[slot] && !q.done && !q.error)
+        {
+            pthread_cond_wait(&q.cond, &q.lock);
+        }
+        int have_band = q.full[slot];
+        int failed = q.error;
+        pthread_mutex_unlock(&q.lock);
+
+        if (!have_band)
+        {
+            if (failed)
+            {
+                fprintf(stderr, "Error: reading image data failed\n");
+                result = 1; // File Not Found
+            }
+            break;
+        }
+
+        // only the first `height` rows are pixels, anything after them is copied as is
+        int rows = stride > 0 ? (int)(q.len[slot] / stride) : 0;
+        if (rows > height - rows_done)
+        {
+            rows = height - rows_done;
+        }
+        grayscale_rows_parallel(pool, q.buf[slot], &format, width, rows, mode);
+        rows_done += rows;
+
+        if (fwrite(q.buf[slot], 1, q.len[slot], out) != q.len[slot])
+        {
+            fprintf(stderr, "Error: writing image data failed\n");
+            result = 1; // File Not Found
+        }
+        stats_add(STATS_BYTES_WRITTEN, q.len[slot]);
+
+        pthread_mutex_lock(&q.lock);
+        q.full[slot] = 0;
+        pthread_cond_broadcast(&q.cond);
+        pthread_mutex_unlock(&q.lock);
+        slot ^= 1;
+    }
+
+    if (result != 3)
+    {
+        // a reader still waiting for a free buffer has to be told to quit before joining
+        pthread_mutex_lock(&q.lock);
+        q.stop = 1;
+        pthread_cond_broadcast(&q.cond);
+        pthread_mutex_unlock(&q.lock);
+        pthread_join(reader, NULL);
+    }
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.cond);
+    free(q.buf[0]);
+    free(q.buf[1]);
+    fclose(in);
+    if (fclose(out) != 0 && result == 0)
+    {
+        fprintf(stderr, "Error: writing image data failed\n");
+        result = 1; // File Not Found
+    }
+    if (result == 0 && rename(temp_name, output_file) != 0)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", output_file);
+        result = 1; // File Not Found
+    }
+    if (result != 0)
+    {
+        remove(temp_name);
+    }
+    free(temp_name);
+
+    if (result == 0)
+    {
+        fprintf(report_out(), "successfully converted to grayscale\n");
+    }
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// LSB embed/extract kernels
+//
+// Message byte i is stored in carrier bytes [8i, 8i + 8): bit j of the message
+// byte goes into the LSB of carrier byte 8i + j. Every kernel below produces
+// exactly this layout, they only differ in how many bytes they handle per step.
+// ---------------------------------------------------------------------------
+
+#define LSB_MASK64 0x0101010101010101ULL // LSB of each of 8 carrier bytes
+
+typedef void (*lsb_embed_fn)(unsigned char *carrier, const unsigned char *bytes, size_t count);
+typedef void (*lsb_extract_fn)(const unsigned char *carrier, unsigned char *bytes, size_t count);
+
+// load/store 8 carrier bytes as a little-endian word (carrier byte k = bits 8k..8k+7)
+static inline uint64_t load_le64(const unsigned char *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static inline void store_le64(unsigned char *p, uint64_t word)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(p, &word, sizeof(word));
+}
+
+// move bit i of byte to bit 8i of the result (bit 0 of byte lane i)
+static inline uint64_t spread_bits(unsigned char byte)
+{
+    uint64_t x = byte;
+    x = (x | (x << 28)) & 0x0000000F0000000FULL;
+    x = (x | (x << 14)) & 0x0003000300030003ULL;
+    x = (x | (x << 7)) & LSB_MASK64;
+    return x;
+}
+
+// collect bit 8i of word into bit i of the result
+static inline unsigned char gather_bits(uint64_t word)
+{
+    // every LSB lands on a distinct bit of the top byte, so no carries occur
+    return (unsigned char)(((word & LSB_MASK64) * 0x0102040810204080ULL) >> 56);
+}
+
+// portable 64-bit SWAR kernels (one message byte per 64-bit word)
+static void embed_lsb_swar(unsigned char *carrier, const unsigned char *bytes, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t word = load_le64(carrier + i * 8);
+        word = (word & ~LSB_MASK64) | spread_bits(bytes[i]);
+        store_le64(carrier + i * 8, word);
+    }
+}
+
+static void extract_lsb_swar(const unsigned char *carrier, unsigned char *bytes, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        bytes[i] = gather_bits(load_le64(carrier + i * 8));
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// BMI2: PDEP/PEXT do the spread/gather in a single instruction
+__attribute__((target("bmi2"))) static void embed_lsb_bmi2(unsigned char *carrier, const unsigned char *bytes, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t word = load_le64(carrier + i * 8);
+        word = (word & ~LSB_MASK64) | _pdep_u64(bytes[i], LSB_MASK64);
+        store_le64(carrier + i * 8, word);
+    }
+}
+
+__attribute__((target("bmi2"))) static void extract_lsb_bmi2(const unsigned char *carrier, unsigned char *bytes, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        bytes[i] = (unsigned char)_pext_u64(load_le64(carrier + i * 8), LSB_MASK64);
+    }
+}
+
+// SSE2: 2 message bytes per 16 carrier bytes
+__attribute__((target("sse2"))) static void embed_lsb_sse2(unsigned char *carrier, const unsigned char *bytes, size_t count)
+{
+    const __m128i bit_select = _mm_set1_epi64x((long long)0x8040201008040201ULL); // byte lane k selects bit k
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2)
+    {
+        // broadcast byte i to lanes 0..7 and byte i+1 to lanes 8..15
+        __m128i msg = _mm_cvtsi32_si128(bytes[i] | (bytes[i + 1] << 8));
+        msg = _mm_unpacklo_epi8(msg, msg);
+        msg = _mm_unpacklo_epi16(msg, msg);
+        msg = _mm_unpacklo_epi32(msg, msg);
+
+        __m128i bits = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(msg, bit_select), bit_select), one);
+        __m128i block = _mm_loadu_si128((const __m128i *)(carrier + i * 8));
+        block = _mm_or_si128(_mm_andnot_si128(one, block), bits);
+        _mm_storeu_si128((__m128i *)(carrier + i * 8), block);
+    }
+    embed_lsb_swar(carrier + i * 8, bytes + i, count - i);
+}
+
+__attribute__((target("sse2"))) static void extract_lsb_sse2(const unsigned char *carrier, unsigned char *bytes, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2)
+    {
+        // shift each LSB into the sign bit of its byte, then collect the sign bits
+        __m128i block = _mm_loadu_si128((const __m128i *)(carrier + i * 8));
+        int mask = _mm_movemask_epi8(_mm_slli_epi64(block, 7));
+        bytes[i] = (unsigned char)mask;
+        bytes[i + 1] = (unsigned char)(mask >> 8);
+    }
+    extract_lsb_swar(carrier + i * 8, bytes + i, count - i);
+}
+
+// AVX2: 4 message bytes per 32 carrier bytes
+__attribute__((target("avx2"))) static void embed_lsb_avx2(unsigned char *carrier, const unsigned char *bytes, size_t count)
+{
+    const __m256i bit_select = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+    const __m256i one = _mm256_set1_epi8(1);
+    // shuffle is per 128-bit lane: the low lane takes bytes 0/1, the high lane bytes 2/3
+    const __m256i broadcast = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                               2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        int32_t quad;
+        memcpy(&quad, bytes + i, sizeof(quad));
+        __m256i msg = _mm256_shuffle_epi8(_mm256_set1_epi32(quad), broadcast);
+
+        __m256i bits = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(msg, bit_select), bit_select), one);
+        __m256i block = _mm256_loadu_si256((const __m256i *)(carrier + i * 8));
+        block = _mm256_or_si256(_mm256_andnot_si256(one, block), bits);
+        _mm256_storeu_si256((__m256i *)(carrier + i * 8), block);
+    }
+    embed_lsb_sse2(carrier + i * 8, bytes + i, count - i);
+}
+
+__attribute__((target("avx2"))) static void extract_lsb_avx2(const unsigned char *carrier, unsigned char *bytes, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(carrier + i * 8));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_slli_epi64(block, 7));
+        memcpy(bytes + i, &mask, sizeof(mask)); // x86 is little-endian
+    }
+    extract_lsb_sse2(carrier + i * 8, bytes + i, count - i);
+}
+#endif
+
+static void select_klsb_kernels(int use_bmi2);
+
+static lsb_embed_fn embed_lsb_kernel = NULL;
+static lsb_extract_fn extract_lsb_kernel = NULL;
+static const char *lsb_kernel_name = "swar";
+
+// pick the fastest kernel pair supported by this CPU (BMP_LSB_KERNEL=swar|sse2|bmi2|avx2 forces one)
+static void select_lsb_kernels(void)
+{
+    const char *forced = getenv("BMP_LSB_KERNEL");
+
+    embed_lsb_kernel = embed_lsb_swar;
+    extract_lsb_kernel = extract_lsb_swar;
+    lsb_kernel_name = "swar";
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    int use_avx2 = __builtin_cpu_supports("avx2");
+    int use_bmi2 = __builtin_cpu_supports("bmi2");
+    int use_sse2 = __builtin_cpu_supports("sse2");
+    if (forced != NULL)
+    {
+        use_avx2 = use_avx2 && strcmp(forced, "avx2") == 0;
+        use_bmi2 = use_bmi2 && strcmp(forced, "bmi2") == 0;
+        use_sse2 = use_sse2 && strcmp(forced, "sse2") == 0;
+    }
+
+    // k > 1 has no wider SIMD variant, PDEP/PEXT are used whenever they exist
+    select_klsb_kernels(use_bmi2 || (forced == NULL && __builtin_cpu_supports("bmi2")));
+
+    if (use_avx2)
+    {
+        embed_lsb_kernel = embed_lsb_avx2;
+        extract_lsb_kernel = extract_lsb_avx2;
+        lsb_kernel_name = "avx2";
+    }
+    else if (use_bmi2)
+    {
+        embed_lsb_kernel = embed_lsb_bmi2;
+        extract_lsb_kernel = extract_lsb_bmi2;
+        lsb_kernel_name = "bmi2";
+    }
+    else if (use_sse2)
+    {
+        embed_lsb_kernel = embed_lsb_sse2;
+        extract_lsb_kernel = extract_lsb_sse2;
+        lsb_kernel_name = "sse2";
+    }
+#else
+    (void)forced;
+#endif
+}
+
+// hide count bytes in the LSBs of carrier[0 .. 8 * count)
+void embed_lsb(unsigned char *carrier, const unsigned char *bytes, size_t count)
+{
+    bmpstego_init();
+    embed_lsb_kernel(carrier, bytes, count);
+}
+
+// recover count bytes from the LSBs of carrier[0 .. 8 * count)
+void extract_lsb(const unsigned char *carrier, unsigned char *bytes, size_t count)
+{
+    bmpstego_init();
+    extract_lsb_kernel(carrier, bytes, count);
+}
+
+// ---------------------------------------------------------------------------
+// k-LSB kernels (1-4 payload bits per carrier byte)
+//
+// The payload is a little-endian bit stream: payload bit b goes to bit (b % k)
+// of carrier byte b / k. With k = 1 this is exactly the layout above. Every
+// 8 carrier bytes hold 8k bits = k payload bytes, so the kernels move one
+// group of k payload bytes per 64-bit carrier word; a leftover partial group
+// at the end is handled bit by bit.
+// ---------------------------------------------------------------------------
+
+typedef void (*klsb_embed_fn)(unsigned char *carrier, const unsigned char *bytes, size_t groups);
+typedef void (*klsb_extract_fn)(const unsigned char *carrier, unsigned char *bytes, size_t groups);
+
+// carrier bytes needed to hold count payload bytes at bits_per_byte bits per carrier byte
+size_t klsb_carrier_bytes(size_t count, int bits_per_byte)
+{
+    return (count * 8 + bits_per_byte - 1) / bits_per_byte;
+}
+
+// low k bits of each of 8 carrier bytes
+static inline uint64_t klsb_mask(int k)
+{
+    return LSB_MASK64 * ((1u << k) - 1);
+}
+
+// k payload bytes as a little-endian value
+static inline uint64_t load_le_bytes(const unsigned char *p, int k)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < k; i++)
+    {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+static inline void store_le_bytes(unsigned char *p, uint64_t value, int k)
+{
+    for (int i = 0; i < k; i++)
+    {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+// move k-bit field i of value to bit 8i (halve the field groups three times)
+static inline uint64_t spread_fields(uint64_t x, int k)
+{
+    switch (k)
+    {
+    case 2:
+        x = (x | (x << 24)) & 0x000000FF000000FFULL;
+        x = (x | (x << 12)) & 0x000F000F000F000FULL;
+        x = (x | (x << 6)) & 0x0303030303030303ULL;
+        break;
+    case 3:
+        x = (x | (x << 20)) & 0x00000FFF00000FFFULL;
+        x = (x | (x << 10)) & 0x003F003F003F003FULL;
+        x = (x | (x << 5)) & 0x0707070707070707ULL;
+        break;
+    default: // 4
+        x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+        x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+        x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        break;
+    }
+    return x;
+}
+
+// inverse of spread_fields
+static inline uint64_t gather_fields(uint64_t x, int k)
+{
+    x &= klsb_mask(k);
+    switch (k)
+    {
+    case 2:
+        x = (x | (x >> 6)) & 0x000F000F000F000FULL;
+        x = (x | (x >> 12)) & 0x000000FF000000FFULL;
+        x = (x | (x >> 24)) & 0xFFFFULL;
+        break;
+    case 3:
+        x = (x | (x >> 5)) & 0x003F003F003F003FULL;
+        x = (x | (x >> 10)) & 0x00000FFF00000FFFULL;
+        x = (x | (x >> 20)) & 0xFFFFFFULL;
+        break;
+    default: // 4
+        x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+        x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+        x = (x | (x >> 16)) & 0xFFFFFFFFULL;
+        break;
+    }
+    return x;
+}
+
+static inline __attribute__((always_inline)) void embed_groups_swar(unsigned char *carrier, const unsigned char *bytes, size_t groups, int k)
+{
+    const uint64_t mask = klsb_mask(k);
+    for (size_t g = 0; g < groups; g++)
+    {
+        uint64_t word = load_le64(carrier + g * 8);
+        word = (word & ~mask) | spread_fields(load_le_bytes(bytes + g * k, k), k);
+        store_le64(carrier + g * 8, word);
+    }
+}
+
+static inline __attribute__((always_inline)) void extract_groups_swar(const unsigned char *carrier, unsigned char *bytes, size_t groups, int k)
+{
+    for (size_t g = 0; g < groups; g++)
+    {
+        store_le_bytes(bytes + g * k, gather_fields(load_le64(carrier + g * 8), k), k);
+    }
+}
+
+// one specialised kernel per k so the field constants are folded in
+static void embed_k2_swar(unsigned char *carrier, const unsigned char *bytes, size_t groups) { embed_groups_swar(carrier, bytes, groups, 2); }
+static void embed_k3_swar(unsigned char *carrier, const unsigned char *bytes, size_t groups) { embed_groups_swar(carrier, bytes, groups, 3); }
+static void embed_k4_swar(unsigned char *carrier, const unsigned char *bytes, size_t groups) { embed_groups_swar(carrier, bytes, groups, 4); }
+static void extract_k2_swar(const unsigned char *carrier, unsigned char *bytes, size_t groups) { extract_groups_swar(carrier, bytes, groups, 2); }
+static void extract_k3_swar(const unsigned char *carrier, unsigned char *bytes, size_t groups) { extract_groups_swar(carrier, bytes, groups, 3); }
+static void extract_k4_swar(const unsigned char *carrier, unsigned char *bytes, size_t groups) { extract_groups_swar(carrier, bytes, groups, 4); }
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("bmi2"))) static inline __attribute__((always_inline)) void embed_groups_bmi2(unsigned char *carrier, const unsigned char *bytes, size_t groups, int k)
+{
+    const uint64_t mask = klsb_mask(k);
+    for (size_t g = 0; g < groups; g++)
+    {
+        uint64_t word = load_le64(carrier + g * 8);
+        word = (word & ~mask) | _pdep_u64(load_le_bytes(bytes + g * k, k), mask);
+        store_le64(carrier + g * 8, word);
+    }
+}
+
+__attribute__((target("bmi2"))) static inline __attribute__((always_inline)) void extract_groups_bmi2(const unsigned char *carrier, unsigned char *bytes, size_t groups, int k)
+{
+    const uint64_t mask = klsb_mask(k);
+    for (size_t g = 0; g < groups; g++)
+    {
+        store_le_bytes(bytes + g * k, _pext_u64(load_le64(carrier + g * 8), mask), k);
+    }
+}
+
+__attribute__((target("bmi2"))) static void embed_k2_bmi2(unsigned char *carrier, const unsigned char *bytes, size_t groups) { embed_groups_bmi2(carrier, bytes, groups, 2); }
+__attribute__((target("bmi2"))) static void embed_k3_bmi2(unsigned char *carrier, const unsigned char *bytes, size_t groups) { embed_groups_bmi2(carrier, bytes, groups, 3); }
+__attribute__((target("bmi2"))) static void embed_k4_bmi2(unsigned char *carrier, const unsigned char *bytes, size_t groups) { embed_groups_bmi2(carrier, bytes, groups, 4); }
+__attribute__((target("bmi2"))) static void extract_k2_bmi2(const unsigned char *carrier, unsigned char *bytes, size_t groups) { extract_groups_bmi2(carrier, bytes, groups, 2); }
+__attribute__((target("bmi2"))) static void extract_k3_bmi2(const unsigned char *carrier, unsigned char *bytes, size_t groups) { extract_groups_bmi2(carrier, bytes, groups, 3); }
+__attribute__((target("bmi2"))) static void extract_k4_bmi2(const unsigned char *carrier, unsigned char *bytes, size_t groups) { extract_groups_bmi2(carrier, bytes, groups, 4); }
+#endif
+
+// indexed by k (entries 0 and 1 unused, k = 1 goes through embed_lsb/extract_lsb)
+static klsb_embed_fn embed_klsb_kernels[MAX_BITS_PER_BYTE + 1] = {NULL, NULL, embed_k2_swar, embed_k3_swar, embed_k4_swar};
+static klsb_extract_fn extract_klsb_kernels[MAX_BITS_PER_BYTE + 1] = {NULL, NULL, extract_k2_swar, extract_k3_swar, extract_k4_swar};
+
+static void select_klsb_kernels(int use_bmi2)
+{
+#ifdef HAVE_X86_KERNELS
+    if (use_bmi2)
+    {
+        embed_klsb_kernels[2] = embed_k2_bmi2;
+        embed_klsb_kernels[3] = embed_k3_bmi2;
+        embed_klsb_kernels[4] = embed_k4_bmi2;
+        extract_klsb_kernels[2] = extract_k2_bmi2;
+        extract_klsb_kernels[3] = extract_k3_bmi2;
+        extract_klsb_kernels[4] = extract_k4_bmi2;
+        return;
+    }
+#endif
+    (void)use_bmi2;
+    embed_klsb_kernels[2] = embed_k2_swar;
+    embed_klsb_kernels[3] = embed_k3_swar;
+    embed_klsb_kernels[4] = embed_k4_swar;
+    extract_klsb_kernels[2] = extract_k2_swar;
+    extract_klsb_kernels[3] = extract_k3_swar;
+    extract_klsb_kernels[4] = extract_k4_swar;
+}
+
+// bit-at-a-time path for a partial group at the end of the payload
+static void embed_klsb_tail(unsigned char *carrier, const unsigned char *bytes, size_t count, int k)
+{
+    size_t total_bits = count * 8;
+    size_t carrier_count = klsb_carrier_bytes(count, k);
+    unsigned char mask = (unsigned char)((1u << k) - 1);
+
+    for (size_t c = 0; c < carrier_count; c++)
+    {
+        unsigned char value = 0;
+        for (int b = 0; b < k && c * k + b < total_bits; b++)
+        {
+            size_t bit = c * k + b;
+            value |= ((bytes[bit / 8] >> (bit % 8)) & 1) << b;
+        }
+        carrier[c] = (unsigned char)((carrier[c] & ~mask) | value);
+    }
+}
+
+static void extract_klsb_tail(const unsigned char *carrier, unsigned char *bytes, size_t count, int k)
+{
+    memset(bytes, 0, count);
+    for (size_t bit = 0; bit < count * 8; bit++)
+    {
+        bytes[bit / 8] |= ((carrier[bit / k] >> (bit % k)) & 1) << (bit % 8);
+    }
+}
+
+// hide count bytes in the low bits_per_byte bits of carrier[0 .. klsb_carrier_bytes(count, bits_per_byte))
+void embed_klsb(unsigned char *carrier, const unsigned char *bytes, size_t count, int bits_per_byte)
+{
+    if (bits_per_byte == 1)
+    {
+        embed_lsb(carrier, bytes, count);
+        return;
+    }
+    bmpstego_init();
+
+    size_t groups = count / bits_per_byte;
+    embed_klsb_kernels[bits_per_byte](carrier, bytes, groups);
+    embed_klsb_tail(carrier + groups * 8, bytes + groups * bits_per_byte, count - groups * bits_per_byte, bits_per_byte);
+}
+
+// recover count bytes stored by embed_klsb
+void extract_klsb(const unsigned char *carrier, unsigned char *bytes, size_t count, int bits_per_byte)
+{
+    if (bits_per_byte == 1)
+    {
+        extract_lsb(carrier, bytes, count);
+        return;
+    }
+    bmpstego_init();
+
+    size_t groups = count / bits_per_byte;
+    extract_klsb_kernels[bits_per_byte](carrier, bytes, groups);
+    extract_klsb_tail(carrier + groups * 8, bytes + groups * bits_per_byte, count - groups * bits_per_byte, bits_per_byte);
+}
+
+// ---------------------------------------------------------------------------
+// keyed scatter
+//
+// With -key the payload does not go into consecutive carrier bytes but is
+// spread over the whole carrier in an order derived from the passphrase. The
+// unit of the order is a group of 8 carrier bytes, the word the k-LSB kernels
+// work on (k payload bytes), so each group costs one permutation step and one
+// cache line. The order is a pseudo-random permutation evaluated per index: a
+// 4-round Feistel network over the smallest number of bits that covers the
+// groups, cycle-walking indices that land past the end. The halves are updated
+// in turn rather than swapped, so they may differ by one bit and the domain
+// stays below twice the number of groups (under 2 steps expected). No shuffle
+// table is kept, so any range of the payload can be placed on its own, and
+// large ranges are split across the thread pool. Targets are computed a batch
+// ahead and prefetched, which hides most of the cache misses of the random
+// accesses.
+// ---------------------------------------------------------------------------
+
+#define SCATTER_ROUNDS 4
+#define SCATTER_BATCH 64                 // group addresses computed ahead of their use
+#define SCATTER_TASK_GROUPS (64 * 1024)  // groups per parallel task
+
+typedef struct {
+    size_t base;         // first carrier byte in keyed order (the header stays in front)
+    uint64_t groups;     // 8-byte carrier groups in keyed order
+    int low_bits;        // bits of the low Feistel half (the high half has the rest)
+    uint64_t domain;     // 1 << bits of the permutation, at most 2 * groups
+    uint32_t round_key[SCATTER_ROUNDS];
+    uint16_t key_check;  // stored in the StegoHeader so -d can tell a wrong passphrase
+    ThreadPool *pool;    // splits large ranges across threads, may be NULL
+} Scatter;
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// keyed order of the whole groups of carrier bytes [base, base + size)
+void scatter_init(Scatter *scatter, const char *passphrase, size_t base, size_t size, ThreadPool *pool)
+{
+    // FNV-1a of the passphrase seeds the round keys
+    uint64_t state = 0xCBF29CE484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)passphrase; *p != '\0'; p++)
+    {
+        state = (state ^ *p) * 0x100000001B3ULL;
+    }
+
+    uint64_t groups = size / 8;
+    int bits = 2;
+    while (bits < 64 && ((uint64_t)1 << bits) < groups)
+    {
+        bits++;
+    }
+    scatter->base = base;
+    scatter->groups = groups;
+    scatter->low_bits = bits / 2;
+    scatter->domain = (uint64_t)1 << bits;
+    scatter->pool = pool;
+    for (int r = 0; r < SCATTER_ROUNDS; r++)
+    {
+        scatter->round_key[r] = (uint32_t)splitmix64(&state);
+    }
+    // the next output, which says nothing about the round keys; 16 bits let 1 wrong
+    // passphrase in 65536 through
+    scatter->key_check = (uint16_t)(splitmix64(&state) >> 48);
+}
+
+static inline uint32_t scatter_round(uint32_t x, uint32_t key)
+{
+    x ^= key;
+    x *= 0x9E3779B1u;
+    x ^= x >> 16;
+    x *= 0x85EBCA6Bu;
+    x ^= x >> 13;
+    return x;
+}
+
+// keyed position of group i (below groups)
+static inline uint64_t scatter_index(const Scatter *scatter, uint64_t i)
+{
+    const int low_bits = scatter->low_bits;
+    const uint32_t low_mask = (uint32_t)(((uint64_t)1 << low_bits) - 1);
+    const uint32_t high_mask = (uint32_t)((scatter->domain >> low_bits) - 1);
+
+    do
+    {
+        uint32_t high = (uint32_t)(i >> low_bits);
+        uint32_t low = (uint32_t)i & low_mask;
+        for (int r = 0; r < SCATTER_ROUNDS; r += 2)
+        {
+            low ^= scatter_round(high, scatter->round_key[r]) & low_mask;
+            high ^= scatter_round(low, scatter->round_key[r + 1]) & high_mask;
+        }
+        i = (uint64_t)high << low_bits | low;
+    } while (i >= scatter->groups);
+    return i;
+}
+
+// ---------------------------------------------------------------------------
+// message carrier
+//
+// The carrier is the sequence of image bytes whose low bits hold the message.
+// For 8-bit and 24-bit images it is the pixel data array as stored. 32-bit
+// images carry only in their B, G and R bytes so the alpha channel is never
+// touched: blocks of pixels are packed into a BGR buffer (one pshufb per 4
+// pixels), the flat kernels run on that, and embedding unpacks it again.
+//
+// Rows of 8-bit and 24-bit images are padded to 4 bytes, and other tools are
+// free to rewrite that padding. New messages therefore skip it (pixel order,
+// STEGO_FLAG_PIXELS): whole rows are copied into a block buffer, the flat
+// kernels run on that, and embedding copies the rows back. Messages written
+// before that still decode from the whole pixel data array.
+// ---------------------------------------------------------------------------
+
+#define CARRIER_BLOCK_PIXELS 4096  // 32-bit pixels packed per step
+#define CARRIER_BLOCK_BYTES 16384  // carrier bytes of padded rows copied per step
+
+typedef struct {
+    unsigned char *data; // pixel data array
+    size_t size;         // carrier bytes
+    int alpha;           // byte of a 32-bit pixel that carries nothing, -1 for a flat carrier
+    size_t row_bytes;    // carrier bytes of a row when row padding is skipped, 0 for a contiguous carrier
+    size_t stride;       // stored bytes of a row (with row_bytes)
+    const Scatter *scatter; // keyed order of the payload bytes, NULL for consecutive bytes
+} Carrier;
+
+// 1 if the rows of a supported BMP image are padded (only with 1 or 3 bytes per pixel)
+static int bmp_rows_padded(const BMPHeader *header)
+{
+    int bytes_per_pixel = header->bits_per_pixel / 8;
+    return bytes_per_pixel != 4 && header->width_px > 0 && calculate_padding(header->width_px, bytes_per_pixel) != 0;
+}
+
+// carrier bytes of a supported BMP image, from its header alone; in pixel order the row
+// padding is left out
+size_t bmp_carrier_bytes(const BMPHeader *header, int pixel_order)
+{
+    size_t data_size = header->size > header->offset ? header->size - header->offset : 0;
+    int bytes_per_pixel = header->bits_per_pixel / 8;
+
+    if (bytes_per_pixel == 4)
+    {
+        return data_size / 4 * 3; // the alpha byte carries nothing
+    }
+    if (!pixel_order || !bmp_rows_padded(header))
+    {
+        return data_size;
+    }
+    size_t stride = calculate_row_stride(header->width_px, bytes_per_pixel);
+    uint64_t rows = bmp_row_count(header);
+    if (rows > data_size / stride)
+    {
+        rows = data_size / stride;
+    }
+    return (size_t)rows * ((size_t)header->width_px * (size_t)bytes_per_pixel); // at most data_size
+}
+
+// carrier of a BMP image; in pixel order the row padding is left out
+static void carrier_init(const BMPImage *img, Carrier *carrier, int pixel_order)
+{
+    carrier->data = img->data;
+    carrier->size = bmp_carrier_bytes(&img->header, pixel_order);
+    carrier->alpha = img->format.id == BMP_FORMAT_BGRA32 ? img->format.alpha : -1;
+    carrier->row_bytes = 0;
+    carrier->stride = 0;
+    carrier->scatter = NULL;
+    if (pixel_order && bmp_rows_padded(&img->header))
+    {
+        carrier->row_bytes = (size_t)img->header.width_px * img->format.bytes_per_pixel;
+        carrier->stride = calculate_row_stride(img->header.width_px, img->format.bytes_per_pixel);
+    }
+}
+
+static void pack_pixels32_scalar(const unsigned char *pixels, unsigned char *packed, size_t count, int alpha)
+{
+    for (size_t i = 0; i < count; i++, pixels += 4)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            if (c != alpha)
+            {
+                *packed++ = pixels[c];
+            }
+        }
+    }
+}
+
+static void unpack_pixels32_scalar(const unsigned char *packed, unsigned char *pixels, size_t count, int alpha)
+{
+    for (size_t i = 0; i < count; i++, pixels += 4)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            if (c != alpha)
+            {
+                pixels[c] = *packed++;
+            }
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// pshufb masks between 4 pixels and their 12 packed bytes
+static void pixels32_shuffle_masks(int alpha, int8_t pack[16], int8_t unpack[16])
+{
+    int packed = 0;
+    memset(pack, -1, 16);
+    for (int i = 0; i < 16; i++)
+    {
+        if ((i & 3) == alpha)
+        {
+            unpack[i] = -1;
+        }
+        else
+        {
+            pack[packed] = (int8_t)i;
+            unpack[i] = (int8_t)packed++;
+        }
+    }
+}
+
+// packed needs 4 bytes of room past count * 3
+__attribute__((target("ssse3"))) static void pack_pixels32_ssse3(const unsigned char *pixels, unsigned char *packed, size_t count, int alpha)
+{
+    int8_t pack[16], unpack[16];
+    pixels32_shuffle_masks(alpha, pack, unpack);
+    const __m128i mask = _mm_loadu_si128((const __m128i *)pack);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(pixels + i * 4));
+        _mm_storeu_si128((__m128i *)(packed + i * 3), _mm_shuffle_epi8(v, mask));
+    }
+    pack_pixels32_scalar(pixels + i * 4, packed + i * 3, count - i, alpha);
+}
+
+// packed needs 4 readable bytes past count * 3
+__attribute__((target("ssse3"))) static void unpack_pixels32_ssse3(const unsigned char *packed, unsigned char *pixels, size_t count, int alpha)
+{
+    int8_t pack[16], unpack[16];
+    pixels32_shuffle_masks(alpha, pack, unpack);
+    const __m128i mask = _mm_loadu_si128((const __m128i *)unpack);
+    const __m128i keep = _mm_set1_epi32((int)(0xFFu << (8 * alpha)));
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(packed + i * 3));
+        __m128i old = _mm_loadu_si128((const __m128i *)(pixels + i * 4));
+        _mm_storeu_si128((__m128i *)(pixels + i * 4), _mm_or_si128(_mm_and_si128(old, keep), _mm_shuffle_epi8(v, mask)));
+    }
+    unpack_pixels32_scalar(packed + i * 3, pixels + i * 4, count - i, alpha);
+}
+#endif
+
+typedef void (*pack_pixels32_fn)(const unsigned char *pixels, unsigned char *packed, size_t count, int alpha);
+typedef void (*unpack_pixels32_fn)(const unsigned char *packed, unsigned char *pixels, size_t count, int alpha);
+
+static pack_pixels32_fn pack_pixels32 = NULL;
+static unpack_pixels32_fn unpack_pixels32 = NULL;
+
+static void select_pixels32_kernels(void)
+{
+    pack_pixels32 = pack_pixels32_scalar;
+    unpack_pixels32 = unpack_pixels32_scalar;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        pack_pixels32 = pack_pixels32_ssse3;
+        unpack_pixels32 = unpack_pixels32_ssse3;
+    }
+#endif
+}
+
+// embed (source != NULL) or extract (into target) count bytes on the packed form of a
+// 32-bit carrier, block by block
+static void carrier_blocks32(const Carrier *carrier, size_t position, const unsigned char *source, unsigned char *target, size_t count, int bits_per_byte)
+{
+    unsigned char packed[(CARRIER_BLOCK_PIXELS + 2) * 3 + 16];
+    // whole bits_per_byte groups per block, so every block starts on a carrier byte boundary
+    size_t block_bytes = (size_t)CARRIER_BLOCK_PIXELS * 3 * bits_per_byte / 8;
+
+    bmpstego_init();
+
+    while (count > 0)
+    {
+        size_t n = count < block_bytes ? count : block_bytes;
+        size_t span = klsb_carrier_bytes(n, bits_per_byte);
+        size_t first = position / 3;               // first pixel touched
+        size_t pixels = (position + span + 2) / 3 - first;
+        unsigned char *block = carrier->data + first * 4;
+
+        pack_pixels32(block, packed, pixels, carrier->alpha);
+        if (source != NULL)
+        {
+            embed_klsb(packed + (position - first * 3), source, n, bits_per_byte);
+            unpack_pixels32(packed, block, pixels, carrier->alpha);
+            source += n;
+        }
+        else
+        {
+            extract_klsb(packed + (position - first * 3), target, n, bits_per_byte);
+            target += n;
+        }
+        position += span;
+        count -= n;
+    }
+}
+
+// copy span carrier bytes from position on between padded rows and a contiguous buffer
+static void carrier_copy_rows(const Carrier *carrier, size_t position, unsigned char *packed, size_t span, int to_rows)
+{
+    size_t row = position / carrier->row_bytes;
+    size_t column = position % carrier->row_bytes;
+
+    while (span > 0)
+    {
+        size_t n = carrier->row_bytes - column < span ? carrier->row_bytes - column : span;
+        unsigned char *pixels = carrier->data + row * carrier->stride + column;
+        if (to_rows)
+        {
+            memcpy(pixels, packed, n);
+        }
+        else
+        {
+            memcpy(packed, pixels, n);
+        }
+        packed += n;
+        span -= n;
+        row++;
+        column = 0;
+    }
+}
+
+// embed (source != NULL) or extract (into target) count bytes on a carrier of padded
+// rows, block by block
+static void carrier_rows(const Carrier *carrier, size_t position, const unsigned char *source, unsigned char *target, size_t count, int bits_per_byte)
+{
+    unsigned char packed[CARRIER_BLOCK_BYTES];
+    // whole bits_per_byte groups per block, so every block starts on a carrier byte boundary
+    size_t block_bytes = (size_t)CARRIER_BLOCK_BYTES * bits_per_byte / 8;
+
+    while (count > 0)
+    {
+        size_t n = count < block_bytes ? count : block_bytes;
+        size_t span = klsb_carrier_bytes(n, bits_per_byte);
+
+        carrier_copy_rows(carrier, position, packed, span, 0);
+        if (source != NULL)
+        {
+            embed_klsb(packed, source, n, bits_per_byte);
+            carrier_copy_rows(carrier, position, packed, span, 1);
+            source += n;
+        }
+        else
+        {
+            extract_klsb(packed, target, n, bits_per_byte);
+            target += n;
+        }
+        position += span;
+        count -= n;
+    }
+}
+
+// address of carrier byte c
+static inline unsigned char *carrier_byte(const Carrier *carrier, uint64_t c)
+{
+    if (carrier->row_bytes != 0)
+    {
+        return carrier->data + c / carrier->row_bytes * carrier->stride + c % carrier->row_bytes;
+    }
+    if (carrier->alpha < 0)
+    {
+        return carrier->data + c;
+    }
+    int channel = (int)(c % 3);
+    return carrier->data + c / 3 * 4 + channel + (channel >= carrier->alpha);
+}
+
+typedef struct {
+    const Carrier *carrier;
+    uint64_t first;               // keyed index of the first group
+    const unsigned char *source;  // embed: payload bytes
+    unsigned char *target;        // extract: payload bytes
+    size_t count;                 // payload bytes
+    size_t groups;                // groups holding them
+    int bits_per_byte;
+} ScatterRun;
+
+// address of group g when its 8 carrier bytes are adjacent in memory, else NULL
+static inline unsigned char *group_address(const Carrier *carrier, uint64_t g)
+{
+    uint64_t c = carrier->scatter->base + g * 8;
+    if (carrier->row_bytes != 0)
+    {
+        return c % carrier->row_bytes + 8 <= carrier->row_bytes ? carrier_byte(carrier, c) : NULL;
+    }
+    return carrier->alpha < 0 ? carrier->data + c : NULL;
+}
+
+// the 8 carrier bytes of group g as a little-endian word
+static inline uint64_t load_group(const Carrier *carrier, uint64_t g)
+{
+    unsigned char *p = group_address(carrier, g);
+    if (p != NULL)
+    {
+        return load_le64(p);
+    }
+    uint64_t word = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        word |= (uint64_t)*carrier_byte(carrier, carrier->scatter->base + g * 8 + i) << (8 * i);
+    }
+    return word;
+}
+
+static inline void store_group(const Carrier *carrier, uint64_t g, uint64_t word)
+{
+    unsigned char *p = group_address(carrier, g);
+    if (p != NULL)
+    {
+        store_le64(p, word);
+        return;
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        *carrier_byte(carrier, carrier->scatter->base + g * 8 + i) = (unsigned char)(word >> (8 * i));
+    }
+}
+
+// groups [begin, end) of a run, each holding its own bits_per_byte payload bytes
+static void scatter_groups(const ScatterRun *run, size_t begin, size_t end)
+{
+    const Carrier *carrier = run->carrier;
+    const Scatter *scatter = carrier->scatter;
+    const int k = run->bits_per_byte;
+    const uint64_t mask = klsb_mask(k);
+    uint64_t where[SCATTER_BATCH];
+
+    for (size_t j = begin; j < end; j += SCATTER_BATCH)
+    {
+        size_t n = end - j < SCATTER_BATCH ? end - j : SCATTER_BATCH;
+        for (size_t i = 0; i < n; i++)
+        {
+            where[i] = scatter_index(scatter, run->first + j + i);
+            const unsigned char *p = carrier_byte(carrier, scatter->base + where[i] * 8);
+            if (run->source != NULL)
+            {
+                __builtin_prefetch(p, 1);
+            }
+            else
+            {
+                __builtin_prefetch(p, 0);
+            }
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            // the last group may hold fewer than k payload bytes; its other fields get 0, as with embed_klsb
+            size_t at = (j + i) * k;
+            int bytes = run->count - at < (size_t)k ? (int)(run->count - at) : k;
+            uint64_t word = load_group(carrier, where[i]);
+            if (run->source != NULL)
+            {
+                uint64_t value = load_le_bytes(run->source + at, bytes);
+                word = (word & ~mask) | (k == 1 ? spread_bits((unsigned char)value) : spread_fields(value, k));
+                store_group(carrier, where[i], word);
+            }
+            else
+            {
+                uint64_t value = k == 1 ? gather_bits(word) : gather_fields(word, k);
+                store_le_bytes(run->target + at, value, bytes);
+            }
+        }
+    }
+}
+
+static void scatter_task(void *ctx, size_t task, int worker)
+{
+    (void)worker;
+    const ScatterRun *run = (const ScatterRun *)ctx;
+    size_t begin = task * SCATTER_TASK_GROUPS;
+    size_t end = run->groups - begin < SCATTER_TASK_GROUPS ? run->groups : begin + SCATTER_TASK_GROUPS;
+    scatter_groups(run, begin, end);
+}
+
+// embed (source != NULL) or extract (into target) count bytes from keyed group first on
+static void carrier_scatter(const Carrier *carrier, uint64_t first, const unsigned char *source, unsigned char *target, size_t count, int bits_per_byte)
+{
+    ScatterRun run;
+    run.carrier = carrier;
+    run.first = first;
+    run.source = source;
+    run.target = target;
+    run.count = count;
+    run.groups = (count + bits_per_byte - 1) / bits_per_byte;
+    run.bits_per_byte = bits_per_byte;
+
+    size_t tasks = (run.groups + SCATTER_TASK_GROUPS - 1) / SCATTER_TASK_GROUPS;
+    thread_pool_run(carrier->scatter->pool, tasks, scatter_task, &run);
+}
+
+// hide count bytes at carrier byte position (the carrier must have room for them)
+static void carrier_embed(const Carrier *carrier, size_t position, const unsigned char *bytes, size_t count, int bits_per_byte)
+{
+    StatsSpan span = stats_begin(STATS_EMBED);
+    stats_add(STATS_BITS_EMBEDDED, (uint64_t)count * 8);
+    if (carrier->scatter != NULL && position >= carrier->scatter->base)
+    {
+        carrier_scatter(carrier, (position - carrier->scatter->base) / 8, bytes, NULL, count, bits_per_byte);
+    }
+    else if (carrier->row_bytes != 0)
+    {
+        carrier_rows(carrier, position, bytes, NULL, count, bits_per_byte);
+    }
+    else if (carrier->alpha < 0)
+    {
+        embed_klsb(carrier->data + position, bytes, count, bits_per_byte);
+    }
+    else
+    {
+        carrier_blocks32(carrier, position, bytes, NULL, count, bits_per_byte);
+    }
+    stats_end(&span);
+}
+
+static void carrier_extract(const Carrier *carrier, size_t position, unsigned char *bytes, size_t count, int bits_per_byte)
+{
+    StatsSpan span = stats_begin(STATS_EXTRACT);
+    stats_add(STATS_BITS_EXTRACTED, (uint64_t)count * 8);
+    if (carrier->scatter != NULL && position >= carrier->scatter->base)
+    {
+        carrier_scatter(carrier, (position - carrier->scatter->base) / 8, NULL, bytes, count, bits_per_byte);
+    }
+    else if (carrier->row_bytes != 0)
+    {
+        carrier_rows(carrier, position, NULL, bytes, count, bits_per_byte);
+    }
+    else if (carrier->alpha < 0)
+    {
+        extract_klsb(carrier->data + position, bytes, count, bits_per_byte);
+    }
+    else
+    {
+        carrier_blocks32(carrier, position, NULL, bytes, count, bits_per_byte);
+    }
+    stats_end(&span);
+}
+
+// 1 if the chunk looks like text (no NUL or control bytes other than whitespace)
+static int is_text_chunk(const unsigned char *bytes, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (bytes[i] < 0x20 && bytes[i] != '\t' && bytes[i] != '\n' && bytes[i] != '\r' && bytes[i] != '\f' &&
+            bytes[i] != '\v')
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// payload bytes that fit after the StegoHeader in carrier_bytes carrier bytes
+uint64_t stego_capacity(size_t carrier_bytes, int bits_per_byte, int keyed)
+{
+    size_t header_carrier = sizeof(StegoHeader) * 8;
+    if (carrier_bytes <= header_carrier)
+    {
+        return 0;
+    }
+    if (keyed)
+    {
+        // keyed order places whole 8-byte groups only
+        return (uint64_t)(carrier_bytes - header_carrier) / 8 * bits_per_byte;
+    }
+    return (uint64_t)(carrier_bytes - header_carrier) * bits_per_byte / 8;
+}
+
+// most bytes a -z message may have, or inflate to, in carrier_bytes carrier bytes: the encoder
+// refuses larger messages and the decoder gives up there, so a few kilobytes of crafted deflate
+// data cannot make it produce gigabytes
+uint64_t stego_inflate_limit(size_t carrier_bytes)
+{
+    uint64_t limit = (uint64_t)carrier_bytes * INFLATE_LIMIT_FACTOR;
+    return limit > INFLATE_MIN_LIMIT ? limit : INFLATE_MIN_LIMIT;
+}
+
+// index of the image with the least room that still holds payload_bytes (unsupported
+// formats are skipped), or -1 when none does; only the headers are needed
+int select_smallest_carrier(const BMPHeader *headers, size_t count, uint64_t payload_bytes, int bits_per_byte, int keyed)
+{
+    int best = -1;
+    uint64_t best_capacity = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!bmp_depth_supported(&headers[i]) || !bmp_size_supported(&headers[i]))
+        {
+            continue;
+        }
+        uint64_t capacity = stego_capacity(bmp_carrier_bytes(&headers[i], 1), bits_per_byte, keyed);
+        if (capacity >= payload_bytes && (best < 0 || capacity < best_capacity))
+        {
+            best = (int)i;
+            best_capacity = capacity;
+        }
+    }
+    return best;
+}
+
+// ---------------------------------------------------------------------------
+// payload compression
+//
+// With -z <level> the message is deflated before it goes into the carrier
+// (zlib.c, the LZ77 + Huffman coder the PNG carrier already uses) and
+// STEGO_FLAG_DEFLATE is set; header.length is then the compressed size. Text
+// shrinks several times, and a smaller payload touches fewer carrier bytes.
+// Payload bytes are staged in MESSAGE_CHUNK_BYTES pieces on their way into
+// the carrier and pulled out in whole bits_per_byte groups on the way back,
+// so neither direction holds the message in memory.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const Carrier *carrier;
+    size_t position;        // carrier byte where the payload starts
+    int bits_per_byte;
+    uint64_t capacity;      // payload bytes that fit
+    uint64_t length;        // payload bytes embedded so far
+    unsigned char *buffer;  // MESSAGE_CHUNK_BYTES of payload waiting to be embedded
+    size_t fill;            // bytes used in buffer
+    int too_long;           // the payload did not fit
+} PayloadSink;
+
+// embed the staged payload bytes; only the last flush may be shorter than
+// MESSAGE_CHUNK_BYTES, so each one starts on a carrier byte boundary
+static int payload_sink_flush(PayloadSink *sink)
+{
+    if (sink->length + sink->fill > sink->capacity)
+    {
+        sink->too_long = 1;
+        return 1;
+    }
+    carrier_embed(sink->carrier, sink->position + klsb_carrier_bytes(sink->length, sink->bits_per_byte), sink->buffer,
+                  sink->fill, sink->bits_per_byte);
+    sink->length += sink->fill;
+    sink->fill = 0;
+    return 0;
+}
+
+// zlib_write_fn that appends to the payload
+static int payload_sink_write(void *ctx, const unsigned char *buf, size_t size)
+{
+    PayloadSink *sink = (PayloadSink *)ctx;
+    while (size > 0)
+    {
+        size_t n = MESSAGE_CHUNK_BYTES - sink->fill < size ? MESSAGE_CHUNK_BYTES - sink->fill : size;
+        memcpy(sink->buffer + sink->fill, buf, n);
+        sink->fill += n;
+        buf += n;
+        size -= n;
+        if (sink->fill == MESSAGE_CHUNK_BYTES && payload_sink_flush(sink) != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    const Carrier *carrier;
+    size_t position;        // carrier byte where the payload starts
+    int bits_per_byte;
+    uint64_t length;        // payload bytes
+    uint64_t done;          // payload bytes extracted so far
+} PayloadSource;
+
+// zlib_read_fn over the payload; every read but the last is a multiple of
+// bits_per_byte bytes, so the next one starts on a carrier byte boundary
+static size_t payload_source_read(void *ctx, unsigned char *buf, size_t size)
+{
+    PayloadSource *source = (PayloadSource *)ctx;
+    uint64_t left = source->length - source->done;
+    size_t n = left < size ? (size_t)left : size;
+    if (n < left)
+    {
+        n -= n % source->bits_per_byte;
+    }
+    carrier_extract(source->carrier, source->position + klsb_carrier_bytes(source->done, source->bits_per_byte), buf,
+                    n, source->bits_per_byte);
+    source->done += n;
+    return n;
+}
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} ByteBuffer;
+
+// room for size more bytes in b
+static int byte_buffer_reserve(ByteBuffer *b, size_t size)
+{
+    if (b->capacity - b->size >= size)
+    {
+        return 0;
+    }
+    size_t capacity = b->capacity * 2 > b->size + size ? b->capacity * 2 : b->size + size;
+    unsigned char *grown = (unsigned char *)realloc(b->data, capacity);
+    if (grown == NULL)
+    {
+        return 1;
+    }
+    b->data = grown;
+    b->capacity = capacity;
+    return 0;
+}
+
+// zlib_write_fn into a growing ByteBuffer (with data == NULL it only counts the bytes)
+static int byte_buffer_write(void *ctx, const unsigned char *buf, size_t size)
+{
+    ByteBuffer *b = (ByteBuffer *)ctx;
+    if (b->data != NULL)
+    {
+        if (byte_buffer_reserve(b, size) != 0)
+        {
+            return 1;
+        }
+        memcpy(b->data + b->size, buf, size);
+    }
+    b->size += size;
+    return 0;
+}
+
+// deflate size bytes into a new buffer
+static int deflate_payload(const unsigned char *data, size_t size, int level, unsigned char **out, size_t *out_size)
+{
+    ByteBuffer b = {NULL, 0, 0};
+    Deflater *z = deflater_create(byte_buffer_write, &b, level);
+    int failed = z == NULL || byte_buffer_reserve(&b, size / 2 + 64) != 0 || deflater_write(z, data, size) != 0 ||
+                 deflater_finish(z) != 0;
+    deflater_destroy(z);
+    if (failed)
+    {
+        free(b.data);
+        return 3; // Memory Allocation Failure
+    }
+    *out = b.data;
+    *out_size = b.size;
+    return 0;
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+} ByteReader;
+
+static size_t byte_reader_read(void *ctx, unsigned char *buf, size_t size)
+{
+    ByteReader *r = (ByteReader *)ctx;
+    size_t n = r->size < size ? r->size : size;
+    memcpy(buf, r->data, n);
+    r->data += n;
+    r->size -= n;
+    return n;
+}
+
+// inflate a whole payload into a new buffer, at most limit bytes of it
+static int inflate_payload(const unsigned char *data, size_t size, uint64_t limit, unsigned char **out, size_t *out_size)
+{
+    ByteReader r = {data, size};
+    ByteBuffer b = {NULL, 0, 0};
+    Inflater *z = inflater_create(byte_reader_read, &r);
+    long got = z != NULL ? MESSAGE_CHUNK_BYTES : -2;
+
+    while (got == MESSAGE_CHUNK_BYTES && b.size <= limit)
+    {
+        got = byte_buffer_reserve(&b, MESSAGE_CHUNK_BYTES) != 0 ? -2 : inflater_read(z, b.data + b.size, MESSAGE_CHUNK_BYTES);
+        b.size += got > 0 ? (size_t)got : 0;
+    }
+    inflater_destroy(z);
+
+    if (b.size > limit)
+    {
+        fprintf(stderr, "Error: The hidden message inflates to more than %llu bytes\n", (unsigned long long)limit);
+        free(b.data);
+        return 2; // Invalid Arguments
+    }
+    if (got == -1)
+    {
+        fprintf(stderr, "Error: The hidden message is not valid compressed data\n");
+        free(b.data);
+        return 2; // Invalid Arguments
+    }
+    if (got < 0)
+    {
+        fprintf(stderr, "Error: message buffer memory allocation failed\n");
+        free(b.data);
+        return 3; // Memory Allocation Failure
+    }
+    *out = b.data;
+    *out_size = b.size;
+    return 0;
+}
+
+// size of a message file once deflated at level, counted without keeping the output
+int deflated_file_size(const char *message_file, int level, uint64_t *size)
+{
+    FILE *file = fopen(message_file, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", message_file);
+        return 1; // File Not Found
+    }
+    ByteBuffer counter = {NULL, 0, 0};
+    unsigned char *chunk = (unsigned char *)malloc(MESSAGE_CHUNK_BYTES);
+    Deflater *z = deflater_create(byte_buffer_write, &counter, level);
+    int result = chunk == NULL || z == NULL ? 3 : 0;
+
+    size_t got;
+    while (result == 0 && (got = fread(chunk, 1, MESSAGE_CHUNK_BYTES, file)) > 0)
+    {
+        deflater_write(z, chunk, got);
+    }
+    if (result == 0)
+    {
+        result = ferror(file) ? 1 : deflater_finish(z) != 0 ? 3 : 0;
+    }
+    free(chunk);
+    deflater_destroy(z);
+    fclose(file);
+
+    if (result == 1)
+    {
+        fprintf(stderr, "Error: reading message from file failed\n");
+    }
+    if (result == 3)
+    {
+        fprintf(stderr, "Error: message buffer memory allocation failed\n");
+    }
+    *size = counter.size;
+    return result;
+}
+
+// payload length of a StegoHeader (48 bits)
+static uint64_t stego_length(const StegoHeader *header)
+{
+    return header->length | (uint64_t)header->length_high << 32;
+}
+
+static void set_stego_length(StegoHeader *header, uint64_t length)
+{
+    header->length = (uint32_t)length;
+    header->length_high = (uint16_t)(length >> 32);
+}
+
+// StegoHeader at the start of the carrier, at 1 bit per byte
+static void embed_stego_header(const Carrier *carrier, int bits_per_byte, int is_text, int deflated, uint64_t length)
+{
+    StegoHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STEGO_MAGIC, sizeof(header.magic));
+    header.version = STEGO_VERSION;
+    header.bits_per_byte = (uint8_t)bits_per_byte;
+    header.payload_type = is_text ? STEGO_PAYLOAD_TEXT : STEGO_PAYLOAD_BINARY;
+    header.flags = (carrier->scatter != NULL ? STEGO_FLAG_SCATTER | STEGO_FLAG_KEY_CHECK : 0) |
+                   (carrier->row_bytes != 0 ? STEGO_FLAG_PIXELS : 0) | (deflated ? STEGO_FLAG_DEFLATE : 0);
+    set_stego_length(&header, length);
+    header.key_check = carrier->scatter != NULL ? carrier->scatter->key_check : 0;
+    carrier_embed(carrier, 0, (const unsigned char *)&header, sizeof(header), 1);
+}
+
+// hide message file in the carrier using LSB steganography
+// layout: StegoHeader at 1 bit per byte, then the file contents at bits_per_byte bits per byte,
+// in keyed order over the rest of the carrier when key is not NULL (pool may be NULL);
+// a carrier that skips row padding is recorded in the header, and so is a payload
+// deflated at compress_level (0 = stored as is)
+static void print_inflate_limit_error(uint64_t limit)
+{
+    fprintf(stderr, "Error: Message is too long to deflate into this image (at most %llu bytes with -z)\n",
+            (unsigned long long)limit);
+}
+
+static int encode_carrier(const Carrier *carrier, const char message_file[], int bits_per_byte, int compress_level,
+                          const char *key, ThreadPool *pool)
+{
+    if (bits_per_byte < 1 || bits_per_byte > MAX_BITS_PER_BYTE)
+    {
+        fprintf(stderr, "Error: bits per byte must be between 1 and %d\n", MAX_BITS_PER_BYTE);
+        return 2; // Invalid Arguments
+    }
+
+    // read message from file (any content, in chunks)
+    FILE *message_file_ptr = fopen(message_file, "rb");
+    if (message_file_ptr == NULL)
+    {
+        fprintf(stderr, "Error: filename '%s' is not incorrect\n", message_file);
+        return 1; // File Not Found
+    }
+
+    // carrier bytes in the image, and how many payload bytes fit after the header
+    size_t data_size = carrier->size;
+    size_t header_carrier = sizeof(StegoHeader) * 8;
+    uint64_t capacity = stego_capacity(data_size, bits_per_byte, key != NULL);
+    uint64_t inflate_limit = stego_inflate_limit(data_size);
+
+    fprintf(report_out(), "\n--- encode message ---\n");
+
+    // regular files are checked up front, pipes (and compressed payloads) when the data arrives
+    struct stat st;
+    int regular = fstat(fileno(message_file_ptr), &st) == 0 && S_ISREG(st.st_mode);
+    if ((data_size < header_carrier) || (compress_level == 0 && regular && (uint64_t)st.st_size > capacity))
+    {
+        fprintf(stderr, "Error: Message is too long\n");
+        fclose(message_file_ptr);
+        return 2; // Invalid Arguments
+    }
+    if (compress_level > 0 && regular && (uint64_t)st.st_size > inflate_limit)
+    {
+        print_inflate_limit_error(inflate_limit);
+        fclose(message_file_ptr);
+        return 2; // Invalid Arguments
+    }
+
+    // the payload (the message, or its deflated form) goes in through the sink
+    PayloadSink sink;
+    memset(&sink, 0, sizeof(sink));
+    sink.position = header_carrier;
+    sink.bits_per_byte = bits_per_byte;
+    sink.capacity = capacity;
+
+    unsigned char *chunk = (unsigned char *)malloc(MESSAGE_CHUNK_BYTES);
+    unsigned char *staged = (unsigned char *)malloc(MESSAGE_CHUNK_BYTES);
+    Deflater *z = compress_level > 0 ? deflater_create(payload_sink_write, &sink, compress_level) : NULL;
+    if (chunk == NULL || staged == NULL || (compress_level > 0 && z == NULL))
+    {
+        fprintf(stderr, "Error: message buffer memory allocation failed\n");
+        free(chunk);
+        free(staged);
+        deflater_destroy(z);
+        fclose(message_file_ptr);
+        return 3; // Memory Allocation Failure
+    }
+
+    Scatter scatter;
+    Carrier keyed;
+    if (key != NULL)
+    {
+        scatter_init(&scatter, key, header_carrier, data_size - header_carrier, pool);
+        keyed = *carrier;
+        keyed.scatter = &scatter;
+        carrier = &keyed;
+    }
+    sink.carrier = carrier;
+    sink.buffer = staged;
+
+    uint64_t message_length = 0;
+    int is_text = 1;
+    int failed = 0;
+    int over_limit = 0;
+    while (!failed)
+    {
+        StatsSpan read_span = stats_begin(STATS_READ);
+        size_t got = fread(chunk, 1, MESSAGE_CHUNK_BYTES, message_file_ptr);
+        stats_end(&read_span);
+        if (got == 0)
+        {
+            break;
+        }
+        stats_add(STATS_BYTES_READ, got);
+        is_text = is_text && is_text_chunk(chunk, got);
+        message_length += got;
+        if (z != NULL && message_length > inflate_limit)
+        {
+            over_limit = 1;
+            break;
+        }
+        failed = z != NULL ? deflater_write(z, chunk, got) : payload_sink_write(&sink, chunk, got);
+    }
+    if (!failed && !over_limit && z != NULL)
+    {
+        failed = deflater_finish(z);
+    }
+    if (!failed && !over_limit && sink.fill > 0)
+    {
+        failed = payload_sink_flush(&sink);
+    }
+    int read_error = ferror(message_file_ptr);
+    free(chunk);
+    free(staged);
+    deflater_destroy(z);
+    fclose(message_file_ptr);
+
+    if (sink.too_long)
+    {
+        fprintf(stderr, "Error: Message is too long\n");
+        return 2; // Invalid Arguments
+    }
+    if (over_limit)
+    {
+        print_inflate_limit_error(inflate_limit);
+        return 2; // Invalid Arguments
+    }
+    if (read_error)
+    {
+        fprintf(stderr, "Error: reading message from file failed\n");
+        return 1; // File Not Found
+    }
+    if (failed)
+    {
+        fprintf(stderr, "Error: message buffer memory allocation failed\n");
+        return 3; // Memory Allocation Failure
+    }
+
+    // header last, now that length and type are known
+    embed_stego_header(carrier, bits_per_byte, is_text, compress_level > 0, sink.length);
+
+    fprintf(report_out(), "message file \'%s\' is successfully encoded into image (%llu bytes", message_file,
+            (unsigned long long)message_length);
+    if (compress_level > 0)
+    {
+        fprintf(report_out(), ", deflated to %llu", (unsigned long long)sink.length);
+    }
+    fprintf(report_out(), ")\n");
+    return 0; // return 0 for success
+}
+
+// 1 if changing the low bits_per_byte bits of a palette index keeps its colour about as
+// close as those bits keep a direct-colour sample: in every aligned run of
+// 2^bits_per_byte entries no channel spans more than 2^bits_per_byte - 1 levels, as in
+// a gray ramp; entries are entry_bytes apart (3 for PNG, 4 for BMP) with 3 colour bytes
+static int palette_hides_bits(const unsigned char *palette, uint32_t entries, size_t entry_bytes, int bits_per_byte)
+{
+    uint32_t run = 1u << bits_per_byte;
+    if (entries == 0 || entries % run != 0)
+    {
+        return 0; // an index could move past the last entry
+    }
+    for (uint32_t first = 0; first < entries; first += run)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            unsigned char low = 255, high = 0;
+            for (uint32_t i = first; i < first + run; i++)
+            {
+                unsigned char v = palette[i * entry_bytes + c];
+                low = v < low ? v : low;
+                high = v > high ? v : high;
+            }
+            if ((uint32_t)(high - low) > run - 1)
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void print_palette_error(int bits_per_byte)
+{
+    fprintf(stderr, "Error: The palette is not ordered so that indices differing in their low %d bit(s) have "
+                    "near-identical colours, the message would show (use a 24-bit or 32-bit image)\n", bits_per_byte);
+}
+
+// hide message file into BMP image using LSB steganography
+int encode_message(BMPImage *img, const char message_file[], int bits_per_byte, int compress_level, const char *key, ThreadPool *pool)
+{
+    // a palettized image carries the message in its pixel indices
+    if (img->format.id == BMP_FORMAT_PAL8 && bits_per_byte >= 1 && bits_per_byte <= MAX_BITS_PER_BYTE &&
+        !palette_hides_bits(img->gap + img->format.palette_offset, img->format.palette_entries, 4, bits_per_byte))
+    {
+        fprintf(report_out(), "\n--- encode message ---\n");
+        print_palette_error(bits_per_byte);
+        return 2; // Invalid Arguments
+    }
+    Carrier carrier;
+    carrier_init(img, &carrier, 1);
+    return encode_carrier(&carrier, message_file, bits_per_byte, compress_level, key, pool);
+}
+
+// read a StegoHeader from the start of the carrier, returns 1 if a valid one is there
+// *header_bytes is set to the header's size in the carrier (version 1 headers are shorter)
+static int read_stego_header(const Carrier *carrier, StegoHeader *header, size_t *header_bytes)
+{
+    if (carrier->size < STEGO_HEADER_V1_BYTES * 8)
+    {
+        return 0;
+    }
+    memset(header, 0, sizeof(*header));
+    size_t available = carrier->size < sizeof(StegoHeader) * 8 ? STEGO_HEADER_V1_BYTES : sizeof(StegoHeader);
+    carrier_extract(carrier, 0, (unsigned char *)header, available, 1);
+
+    if (memcmp(header->magic, STEGO_MAGIC, sizeof(header->magic)) != 0 || header->bits_per_byte < 1 ||
+        header->bits_per_byte > MAX_BITS_PER_BYTE)
+    {
+        return 0;
+    }
+    if (header->version == 1)
+    {
+        // 2 reserved bytes where type and flags are now, and a 32-bit length
+        header->payload_type = STEGO_PAYLOAD_TEXT;
+        header->flags = 0;
+        header->length_high = 0;
+        header->key_check = 0;
+        *header_bytes = STEGO_HEADER_V1_BYTES;
+        return 1;
+    }
+    if (header->version == STEGO_VERSION && available == sizeof(StegoHeader))
+    {
+        *header_bytes = sizeof(StegoHeader);
+        return 1;
+    }
+    return 0;
+}
+
+// display name of an output path that may be "-"
+static const char *to_stdout_name(const char *output_file)
+{
+    return strcmp(output_file, "-") == 0 ? "standard output" : output_file;
+}
+
+// open output_file ("-" for stdout) for a recovered payload
+static FILE *open_payload_output(const char *output_file)
+{
+    FILE *out = strcmp(output_file, "-") == 0 ? stdout : fopen(output_file, "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", output_file);
+    }
+    return out;
+}
+
+// flush or close the payload output, result is nonzero if a write already failed
+static int close_payload_output(FILE *out, const char *output_file, int result)
+{
+    if ((out == stdout ? fflush(out) : fclose(out)) != 0)
+    {
+        result = 1;
+    }
+    if (result != 0)
+    {
+        fprintf(stderr, "Error: writing message to \'%s\' failed\n", output_file);
+        return 1; // File Not Found
+    }
+    return 0;
+}
+
+// extract length payload bytes starting at carrier byte position to output_file ("-" for stdout) one chunk at a time,
+// so memory use does not depend on the payload size; a deflated payload is inflated on the way
+static int write_payload_stream(const Carrier *carrier, size_t position, uint64_t length, int bits_per_byte, int deflated,
+                                const char *output_file)
+{
+    FILE *out = open_payload_output(output_file);
+    if (out == NULL)
+    {
+        return 1; // File Not Found
+    }
+
+    PayloadSource source = {carrier, position, bits_per_byte, length, 0};
+    unsigned char *chunk = (unsigned char *)malloc(MESSAGE_CHUNK_BYTES);
+    Inflater *z = deflated ? inflater_create(payload_source_read, &source) : NULL;
+    if (chunk == NULL || (deflated && z == NULL))
+    {
+        fprintf(stderr, "Error: message buffer memory allocation failed\n");
+        free(chunk);
+        inflater_destroy(z);
+        if (out != stdout)
+        {
+            fclose(out);
+        }
+        return 3; // Memory Allocation Failure
+    }
+
+    // chunks are a multiple of bits_per_byte bytes, so each starts on a carrier byte boundary
+    int result = 0;
+    int corrupt = 0;
+    uint64_t inflated = 0;
+    uint64_t limit = stego_inflate_limit(carrier->size);
+    for (;;)
+    {
+        long count = z != NULL ? inflater_read(z, chunk, MESSAGE_CHUNK_BYTES)
+                               : (long)payload_source_read(&source, chunk, MESSAGE_CHUNK_BYTES);
+        if (count < 0)
+        {
+            corrupt = 1;
+            break;
+        }
+        inflated += (uint64_t)count;
+        if (z != NULL && inflated > limit)
+        {
+            corrupt = 2;
+            break;
+        }
+        StatsSpan write_span = stats_begin(STATS_WRITE);
+        size_t written = fwrite(chunk, 1, (size_t)count, out);
+        stats_end(&write_span);
+        stats_add(STATS_BYTES_WRITTEN, written);
+        if (written != (size_t)count)
+        {
+            result = 1;
+            break;
+        }
+        if (count < MESSAGE_CHUNK_BYTES)
+        {
+            break;
+        }
+    }
+    free(chunk);
+    inflater_destroy(z);
+    if (corrupt == 2)
+    {
+        fprintf(stderr, "Error: The hidden message inflates to more than %llu bytes\n", (unsigned long long)limit);
+    }
+    else if (corrupt)
+    {
+        fprintf(stderr, "Error: The hidden message is not valid compressed data\n");
+    }
+    if (corrupt)
+    {
+        // what was inflated before the damage is not the message
+        int to_stdout = out == stdout;
+        close_payload_output(out, output_file, 0);
+        if (!to_stdout)
+        {
+            remove(output_file);
+        }
+        return 2; // Invalid Arguments
+    }
+    return close_payload_output(out, output_file, result);
+}
+
+// StegoHeader at the start of the carrier, or the original 1-byte length when there is none
+// and legacy is set (BMP images, the only carrier that ever had it); 0 if there is neither
+static int resolve_stego_header(const Carrier *carrier, int legacy, StegoHeader *header, size_t *header_bytes)
+{
+    *header_bytes = 1;
+    if (!read_stego_header(carrier, header, header_bytes))
+    {
+        if (!legacy)
+        {
+            return 0;
+        }
+        unsigned char len_byte;
+        carrier_extract(carrier, 0, &len_byte, 1, 1);
+        memset(header, 0, sizeof(*header));
+        header->bits_per_byte = 1;
+        header->payload_type = STEGO_PAYLOAD_TEXT;
+        set_stego_length(header, len_byte);
+    }
+    return 1;
+}
+
+static void print_no_message_error(void)
+{
+    fprintf(stderr, "Error: No hidden message in this image\n");
+}
+
+// print a recovered payload: text in quotes, binary data as its first bytes
+static void print_payload(const StegoHeader *header, const unsigned char *message, uint64_t msg_len)
+{
+    if (header->payload_type == STEGO_PAYLOAD_TEXT)
+    {
+        // a single trailing newline of the message file is not shown inside the quotes
+        size_t shown = msg_len;
+        if (shown > 0 && message[shown - 1] == '\n')
+        {
+            shown--;
+        }
+        fprintf(report_out(), "Hidden message: \"");
+        fwrite(message, 1, shown, report_out());
+        fprintf(report_out(), "\"\n");
+    }
+    else
+    {
+        fprintf(report_out(), "Hidden payload: binary data, first bytes:");
+        for (size_t i = 0; i < msg_len && i < 16; i++)
+        {
+            fprintf(report_out(), " %02x", message[i]);
+        }
+        fprintf(report_out(), "\n");
+    }
+}
+
+// print a deflated payload once it is inflated (to at most limit bytes)
+static int print_inflated_payload(const StegoHeader *header, const unsigned char *payload, size_t size, uint64_t limit)
+{
+    unsigned char *message;
+    size_t msg_len;
+    int result = inflate_payload(payload, size, limit, &message, &msg_len);
+    if (result != 0)
+    {
+        return result;
+    }
+    fprintf(report_out(), "Inflated message length: %zu bytes\n", msg_len);
+    print_payload(header, message, msg_len);
+    free(message);
+    return 0;
+}
+
+// decode hidden message from the carrier using LSB steganography
+// the message is printed, or written to output_file ("-" = stdout) when that is not NULL
+// key is needed for messages embedded with one (pool may be NULL), legacy as for resolve_stego_header
+static int decode_carrier(const Carrier *carrier, int legacy, const char *output_file, const char *key, ThreadPool *pool)
+{
+    // carrier bytes in the image
+    size_t data_size = carrier->size;
+
+    fprintf(report_out(), "\n--- decode message ---\n");
+    // Decode message length (1 byte) from the first 8 bytes of image data
+    if (data_size < 8)
+    {
+        fprintf(stderr, "Error: Insufficient space while decoding length\n");
+        return 2; // Invalid Arguments
+    }
+
+    // StegoHeader if present, otherwise the original 1-byte length
+    StegoHeader header;
+    size_t header_bytes;
+    if (!resolve_stego_header(carrier, legacy, &header, &header_bytes))
+    {
+        print_no_message_error();
+        return 2; // Invalid Arguments
+    }
+    int bits_per_byte = header.bits_per_byte;
+    uint64_t msg_len = stego_length(&header);
+
+    fprintf(report_out(), "Decoded message length: %llu bytes\n", (unsigned long long)msg_len);
+    if (bits_per_byte != 1)
+    {
+        fprintf(report_out(), "Bits per byte: %d\n", bits_per_byte);
+    }
+
+    // Read the message from the image data
+    if (msg_len > data_size || header_bytes * 8 + klsb_carrier_bytes(msg_len, bits_per_byte) > data_size)
+    {
+        fprintf(stderr, "Error: Insufficient space while decoding message\n");
+        return 2; // Invalid Arguments
+    }
+
+    Scatter scatter;
+    Carrier keyed;
+    if (header.flags & STEGO_FLAG_SCATTER)
+    {
+        if (key == NULL)
+        {
+            fprintf(stderr, "Error: The message was hidden with a key, pass it with -key\n");
+            return 2; // Invalid Arguments
+        }
+        scatter_init(&scatter, key, header_bytes * 8, data_size - header_bytes * 8, pool);
+        if ((header.flags & STEGO_FLAG_KEY_CHECK) && header.key_check != scatter.key_check)
+        {
+            fprintf(stderr, "Error: The key does not match the one the message was hidden with\n");
+            return 2; // Invalid Arguments
+        }
+        if ((msg_len + bits_per_byte - 1) / bits_per_byte > scatter.groups)
+        {
+            fprintf(stderr, "Error: Insufficient space while decoding message\n");
+            return 2; // Invalid Arguments
+        }
+        keyed = *carrier;
+        keyed.scatter = &scatter;
+        carrier = &keyed;
+    }
+
+    int deflated = (header.flags & STEGO_FLAG_DEFLATE) != 0;
+    if (output_file != NULL)
+    {
+        int write_result = write_payload_stream(carrier, header_bytes * 8, msg_len, bits_per_byte, deflated, output_file);
+        if (write_result == 0)
+        {
+            fprintf(report_out(), "hidden message is saved to %s\n", to_stdout_name(output_file));
+        }
+        return write_result;
+    }
+
+    unsigned char *message = (unsigned char *)malloc(msg_len > 0 ? msg_len : 1);
+    if (message == NULL)
+    {
+        fprintf(stderr, "Error: message buffer memory allocation failed\n");
+        return 3; // Memory Allocation Failure
+    }
+    carrier_extract(carrier, header_bytes * 8, message, msg_len, bits_per_byte);
+    int result = deflated ? print_inflated_payload(&header, message, msg_len, stego_inflate_limit(carrier->size)) : 0;
+    if (!deflated)
+    {
+        print_payload(&header, message, msg_len);
+    }
+    free(message);
+    return result;
+}
+
+// carrier of a message hidden in img: a header in pixel order says so itself, anything
+// else was written over the whole pixel data array
+static void stego_carrier_init(const BMPImage *img, Carrier *carrier)
+{
+    carrier_init(img, carrier, 1);
+    StegoHeader header;
+    size_t header_bytes;
+    if (carrier->row_bytes != 0 &&
+        !(read_stego_header(carrier, &header, &header_bytes) && (header.flags & STEGO_FLAG_PIXELS)))
+    {
+        carrier_init(img, carrier, 0);
+    }
+}
+
+// decode hidden message from BMP image using LSB steganography
+int decode_message(const BMPImage *img, const char *output_file, const char *key, ThreadPool *pool)
+{
+    Carrier carrier;
+    stego_carrier_init(img, &carrier);
+    return decode_carrier(&carrier, 1, output_file, key, pool);
+}
+
+// ---------------------------------------------------------------------------
+// JPEG carrier
+//
+// The low bytes of the usable DCT coefficients are gathered into a flat
+// carrier (one byte per coefficient), the message goes in with the same code
+// as for BMP images at 1 bit per coefficient, and the LSBs are put back
+// before the scans are Huffman-coded again (see jpeg.c).
+// ---------------------------------------------------------------------------
+
+// hide message file into JPEG image
+int encode_message_jpeg(const char *input_file, const char message_file[], const char *output_file, int bits_per_byte, int compress_level, const char *key, ThreadPool *pool)
+{
+    if (bits_per_byte != 1)
+    {
+        fprintf(stderr, "Error: JPEG images hide 1 bit per coefficient\n");
+        return 2; // Invalid Arguments
+    }
+
+    JPEGImage jpeg;
+    int read_result = read_jpeg(input_file, &jpeg);
+    if (read_result != 0)
+    {
+        return read_result; // return read_jpeg's error code
+    }
+
+    Carrier carrier;
+    carrier.size = jpeg_carrier_size(&jpeg);
+    carrier.alpha = -1;
+    carrier.row_bytes = 0;
+    carrier.stride = 0;
+    carrier.scatter = NULL;
+    carrier.data = (unsigned char *)malloc(carrier.size > 0 ? carrier.size : 1);
+    if (carrier.data == NULL)
+    {
+        fprintf(stderr, "Error: image data memory allocation failed\n");
+        free_jpeg_image(&jpeg);
+        return 3; // Memory Allocation Failure
+    }
+    jpeg_gather_lsb(&jpeg, carrier.data);
+
+    int result = encode_carrier(&carrier, message_file, bits_per_byte, compress_level, key, pool);
+    if (result == 0)
+    {
+        jpeg_scatter_lsb(&jpeg, carrier.data);
+        result = write_jpeg(output_file, &jpeg);
+    }
+    free(carrier.data);
+    free_jpeg_image(&jpeg);
+    return result;
+}
+
+// decode hidden message from JPEG image
+int decode_message_jpeg(const char *input_file, const char *output_file, const char *key, ThreadPool *pool)
+{
+    JPEGImage jpeg;
+    int read_result = read_jpeg(input_file, &jpeg);
+    if (read_result != 0)
+    {
+        return read_result; // return read_jpeg's error code
+    }
+
+    Carrier carrier;
+    carrier.size = jpeg_carrier_size(&jpeg);
+    carrier.alpha = -1;
+    carrier.row_bytes = 0;
+    carrier.stride = 0;
+    carrier.scatter = NULL;
+    carrier.data = (unsigned char *)malloc(carrier.size > 0 ? carrier.size : 1);
+    if (carrier.data == NULL)
+    {
+        fprintf(stderr, "Error: image data memory allocation failed\n");
+        free_jpeg_image(&jpeg);
+        return 3; // Memory Allocation Failure
+    }
+    jpeg_gather_lsb(&jpeg, carrier.data);
+    free_jpeg_image(&jpeg);
+
+    int result = decode_carrier(&carrier, 0, output_file, key, pool);
+    free(carrier.data);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// PNG carrier
+//
+// The carrier of a PNG image is its samples in row order, without alpha.
+// process_png (see png.c) hands over one unfiltered row at a time and filters
+// and compresses it again afterwards, so nothing bigger than a row is ever
+// decompressed. Each row's share of the carrier is packed (alpha dropped),
+// the stretch of header or payload bits falling on it goes in or comes out,
+// and the row is unpacked again. The header comes first in the carrier, so
+// the message is read into memory before the image is streamed.
+// ---------------------------------------------------------------------------
+
+// carrier bytes [first, first + count) of a run of bits_per_byte-bit fields holding
+// size bytes from carrier byte 0; embed stores bytes into carrier, otherwise the
+// fields are read back into bytes. Whole groups go through the kernels, the edges
+// bit by bit.
+static void klsb_span(unsigned char *carrier, size_t first, size_t count, unsigned char *bytes, size_t size, int bits_per_byte, int embed)
+{
+    size_t group = (size_t)(8 / (bits_per_byte & -bits_per_byte)); // carrier bytes per whole payload bytes
+    unsigned char mask = (unsigned char)((1u << bits_per_byte) - 1);
+    size_t total_bits = size * 8;
+    uint64_t bits = (uint64_t)count * bits_per_byte;
+    stats_add(embed ? STATS_BITS_EMBEDDED : STATS_BITS_EXTRACTED, bits < total_bits ? bits : total_bits);
+
+    for (size_t c = first; c < first + count;)
+    {
+        if (c % group == 0 && first + count - c >= group)
+        {
+            size_t offset = c * bits_per_byte / 8;
+            size_t n = (first + count - c) / group * group * bits_per_byte / 8;
+            n = n < size - offset ? n : size - offset;
+            if (embed)
+            {
+                embed_klsb(carrier + (c - first), bytes + offset, n, bits_per_byte);
+            }
+            else
+            {
+                extract_klsb(carrier + (c - first), bytes + offset, n, bits_per_byte);
+            }
+            c += klsb_carrier_bytes(n, bits_per_byte);
+            continue;
+        }
+
+        unsigned char value = 0;
+        for (int b = 0; b < bits_per_byte && c * bits_per_byte + b < total_bits; b++)
+        {
+            size_t bit = c * bits_per_byte + b;
+            if (embed)
+            {
+                value |= ((bytes[bit / 8] >> (bit % 8)) & 1) << b;
+            }
+            else
+            {
+                bytes[bit / 8] = (unsigned char)((bytes[bit / 8] & ~(1u << (bit % 8))) |
+                                                 ((carrier[c - first] >> b) & 1) << (bit % 8));
+            }
+        }
+        if (embed)
+        {
+            carrier[c - first] = (unsigned char)((carrier[c - first] & ~mask) | value);
+        }
+        c++;
+    }
+}
+
+typedef struct {
+    int channels;            // samples per pixel
+    int alpha;               // sample index of alpha, -1 if none
+    uint32_t width;
+    size_t row_carrier;      // carrier bytes per row
+    size_t carrier_size;     // carrier bytes in the image
+    size_t position;         // carrier bytes before the current row
+    unsigned char *packed;   // carrier bytes of the current row (alpha images only)
+    int bits_per_byte;
+    StegoHeader header;
+    size_t header_bytes;     // size of the header in the carrier, 0 until it is known (decode)
+    unsigned char *message;  // payload
+    uint64_t length;         // payload bytes
+    uint64_t message_length; // encode: message bytes before -z deflated them
+    unsigned char *stage;    // decode: carrier bytes of the header area
+    size_t staged;
+    int result;              // error code of a failed decode step
+} PNGStego;
+
+static int png_stego_begin(PNGStego *s, const PNGInfo *info)
+{
+    s->channels = info->channels;
+    s->alpha = info->color_type == PNG_COLOR_RGBA || info->color_type == PNG_COLOR_GRAY_ALPHA ? info->channels - 1 : -1;
+    s->width = info->width;
+    s->row_carrier = (size_t)info->width * (info->channels - (s->alpha >= 0));
+    s->carrier_size = s->row_carrier * info->height;
+    s->position = 0;
+    if (s->alpha >= 0)
+    {
+        // the SSSE3 pack/unpack kernels touch 4 bytes past the packed pixels
+        s->packed = (unsigned char *)malloc(s->row_carrier + 16);
+        if (s->packed == NULL)
+        {
+            fprintf(stderr, "Error: image data memory allocation failed\n");
+            return 3; // Memory Allocation Failure
+        }
+    }
+    return 0;
+}
+
+// the carrier bytes of a row, packed without alpha when there is one
+static unsigned char *png_stego_pack(PNGStego *s, unsigned char *row)
+{
+    if (s->alpha < 0)
+    {
+        return row;
+    }
+    if (s->channels == 4)
+    {
+        bmpstego_init();
+        pack_pixels32(row, s->packed, s->width, s->alpha);
+        return s->packed;
+    }
+    for (uint32_t j = 0; j < s->width; j++)
+    {
+        s->packed[j] = row[j * 2]; // gray of gray + alpha
+    }
+    return s->packed;
+}
+
+static void png_stego_unpack(PNGStego *s, unsigned char *row)
+{
+    if (s->alpha < 0)
+    {
+        return;
+    }
+    if (s->channels == 4)
+    {
+        unpack_pixels32(s->packed, row, s->width, s->alpha);
+        return;
+    }
+    for (uint32_t j = 0; j < s->width; j++)
+    {
+        row[j * 2] = s->packed[j];
+    }
+}
+
+// store or recover the part of a field run [start, start + span) that falls on the
+// carrier bytes [position, position + count)
+static void png_stego_span(unsigned char *carrier, size_t position, size_t count, size_t start, size_t span, unsigned char *bytes, size_t size, int bits_per_byte, int embed)
+{
+    size_t first = position > start ? position - start : 0;
+    size_t end = position + count < start + span ? position + count - start : span;
+    if (position + count > start && first < end)
+    {
+        klsb_span(carrier + (start + first - position), first, end - first, bytes, size, bits_per_byte, embed);
+    }
+}
+
+static int png_encode_begin(void *ctx, const PNGInfo *info)
+{
+    PNGStego *s = (PNGStego *)ctx;
+    int result = png_stego_begin(s, info);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    size_t header_carrier = sizeof(StegoHeader) * 8;
+    uint64_t capacity = stego_capacity(s->carrier_size, s->bits_per_byte, 0);
+    fprintf(report_out(), "\n--- encode message ---\n");
+    if (s->carrier_size < header_carrier || s->length > capacity)
+    {
+        fprintf(stderr, "Error: Message is too long\n");
+        return 2; // Invalid Arguments
+    }
+    if ((s->header.flags & STEGO_FLAG_DEFLATE) && s->message_length > stego_inflate_limit(s->carrier_size))
+    {
+        print_inflate_limit_error(stego_inflate_limit(s->carrier_size));
+        return 2; // Invalid Arguments
+    }
+    return 0;
+}
+
+// palettized images carry the message in their indices (see palette_hides_bits)
+static int png_encode_palette(void *ctx, unsigned char *rgb, uint32_t entries)
+{
+    PNGStego *s = (PNGStego *)ctx;
+    if (s->channels == 1 && !palette_hides_bits(rgb, entries, 3, s->bits_per_byte))
+    {
+        print_palette_error(s->bits_per_byte);
+        return 2; // Invalid Arguments
+    }
+    return 0;
+}
+
+static int png_encode_row(void *ctx, unsigned char *row, uint32_t y)
+{
+    (void)y;
+    PNGStego *s = (PNGStego *)ctx;
+    size_t header_carrier = s->header_bytes * 8;
+    size_t payload_carrier = klsb_carrier_bytes(s->length, s->bits_per_byte);
+
+    if (s->position < header_carrier + payload_carrier)
+    {
+        unsigned char *carrier = png_stego_pack(s, row);
+        png_stego_span(carrier, s->position, s->row_carrier, 0, header_carrier, (unsigned char *)&s->header,
+                       s->header_bytes, 1, 1);
+        png_stego_span(carrier, s->position, s->row_carrier, header_carrier, payload_carrier, s->message, s->length,
+                       s->bits_per_byte, 1);
+        png_stego_unpack(s, row);
+    }
+    s->position += s->row_carrier;
+    return 0;
+}
+
+// read the whole message file, it has to be in the carrier before the image is streamed
+static int read_message_file(const char message_file[], unsigned char **message, uint64_t *length, int *is_text)
+{
+    FILE *message_file_ptr = fopen(message_file, "rb");
+    if (message_file_ptr == NULL)
+    {
+        fprintf(stderr, "Error: filename '%s' is not incorrect\n", message_file);
+        return 1; // File Not Found
+    }
+
+    size_t capacity = MESSAGE_CHUNK_BYTES;
+    size_t size = 0;
+    unsigned char *buffer = (unsigned char *)malloc(capacity);
+    size_t got = 1;
+    while (buffer != NULL && got > 0)
+    {
+        if (capacity - size < MESSAGE_CHUNK_BYTES)
+        {
+            unsigned char *grown = (unsigned char *)realloc(buffer, capacity * 2);
+            if (grown == NULL)
+            {
+                free(buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        got = fread(buffer + size, 1, MESSAGE_CHUNK_BYTES, message_file_ptr);
+        stats_add(STATS_BYTES_READ, got);
+        size += got;
+    }
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Error: message buffer memory allocation failed\n");
+        fclose(message_file_ptr);
+        return 3; // Memory Allocation Failure
+    }
+    if (ferror(message_file_ptr))
+    {
+        fprintf(stderr, "Error: reading message from file failed\n");
+        free(buffer);
+        fclose(message_file_ptr);
+        return 1; // File Not Found
+    }
+    fclose(message_file_ptr);
+
+    *message = buffer;
+    *length = size;
+    *is_text = is_text_chunk(buffer, size);
+    return 0;
+}
+
+// hide message file into PNG image, row by row
+int encode_message_png(const char *input_file, const char message_file[], const char *output_file, int bits_per_byte, int compress_level)
+{
+    if (bits_per_byte < 1 || bits_per_byte > MAX_BITS_PER_BYTE)
+    {
+        fprintf(stderr, "Error: bits per byte must be between 1 and %d\n", MAX_BITS_PER_BYTE);
+        return 2; // Invalid Arguments
+    }
+
+    PNGStego s;
+    int is_text;
+    memset(&s, 0, sizeof(s));
+    int result = read_message_file(message_file, &s.message, &s.length, &is_text);
+    if (result != 0)
+    {
+        return result;
+    }
+    uint64_t message_length = s.length;
+    s.message_length = s.length;
+    if (compress_level > 0)
+    {
+        unsigned char *deflated;
+        size_t deflated_size;
+        result = deflate_payload(s.message, s.length, compress_level, &deflated, &deflated_size);
+        free(s.message);
+        if (result != 0)
+        {
+            fprintf(stderr, "Error: message buffer memory allocation failed\n");
+            return result;
+        }
+        s.message = deflated;
+        s.length = deflated_size;
+    }
+
+    memcpy(s.header.magic, STEGO_MAGIC, sizeof(s.header.magic));
+    s.header.version = STEGO_VERSION;
+    s.header.bits_per_byte = (uint8_t)bits_per_byte;
+    s.header.payload_type = is_text ? STEGO_PAYLOAD_TEXT : STEGO_PAYLOAD_BINARY;
+    s.header.flags = compress_level > 0 ? STEGO_FLAG_DEFLATE : 0;
+    set_stego_length(&s.header, s.length);
+    s.header_bytes = sizeof(StegoHeader);
+    s.bits_per_byte = bits_per_byte;
+
+    PNGRowHandler handler = {&s, png_encode_begin, png_encode_palette, png_encode_row};
+    result = process_png(input_file, output_file, &handler);
+    if (result == 0)
+    {
+        fprintf(report_out(), "message file \'%s\' is successfully encoded into image (%llu bytes", message_file,
+                (unsigned long long)message_length);
+        if (compress_level > 0)
+        {
+            fprintf(report_out(), ", deflated to %llu", (unsigned long long)s.length);
+        }
+        fprintf(report_out(), ")\n");
+    }
+    free(s.packed);
+    free(s.message);
+    return result;
+}
+
+static int png_decode_begin(void *ctx, const PNGInfo *info)
+{
+    PNGStego *s = (PNGStego *)ctx;
+    int result = png_stego_begin(s, info);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    fprintf(report_out(), "\n--- decode message ---\n");
+    if (s->carrier_size < 8)
+    {
+        fprintf(stderr, "Error: Insufficient space while decoding length\n");
+        return 2; // Invalid Arguments
+    }
+    size_t stage = sizeof(StegoHeader) * 8;
+    s->stage = (unsigned char *)malloc(stage < s->carrier_size ? stage : s->carrier_size);
+    if (s->stage == NULL)
+    {
+        fprintf(stderr, "Error: message buffer memory allocation failed\n");
+        return 3; // Memory Allocation Failure
+    }
+    return 0;
+}
+
+// parse the header from the staged carrier bytes and set up the payload buffer
+static int png_decode_header(PNGStego *s)
+{
+    Carrier carrier = {s->stage, s->staged, -1, 0, 0, NULL};
+    if (!resolve_stego_header(&carrier, 0, &s->header, &s->header_bytes))
+    {
+        print_no_message_error();
+        return 2; // Invalid Arguments
+    }
+    if (s->header.flags & STEGO_FLAG_SCATTER)
+    {
+        fprintf(stderr, "Error: -key needs a BMP or JPEG image\n");
+        return 2; // Invalid Arguments
+    }
+    s->bits_per_byte = s->header.bits_per_byte;
+    s->length = stego_length(&s->header);
+
+    fprintf(report_out(), "Decoded message length: %llu bytes\n", (unsigned long long)s->length);
+    if (s->bits_per_byte != 1)
+    {
+        fprintf(report_out(), "Bits per byte: %d\n", s->bits_per_byte);
+    }
+    if (s->length > s->carrier_size ||
+        s->header_bytes * 8 + klsb_carrier_bytes(s->length, s->bits_per_byte) > s->carrier_size)
+    {
+        fprintf(stderr, "Error: Insufficient space while decoding message\n");
+        return 2; // Invalid Arguments
+    }
+    s->message = (unsigned char *)malloc(s->length > 0 ? s->length : 1);
+    if (s->message == NULL)
+    {
+        fprintf(stderr, "Error: message buffer memory allocation failed\n");
+        return 3; // Memory Allocation Failure
+    }
+
+    // the start of the payload may already be staged
+    png_stego_span(s->stage, 0, s->staged, s->header_bytes * 8, klsb_carrier_bytes(s->length, s->bits_per_byte),
+                   s->message, s->length, s->bits_per_byte, 0);
+    return 0;
+}
+
+static int png_decode_row(void *ctx, unsigned char *row, uint32_t y)
+{
+    (void)y;
+    PNGStego *s = (PNGStego *)ctx;
+    unsigned char *carrier = png_stego_pack(s, row);
+    size_t stage = sizeof(StegoHeader) * 8 < s->carrier_size ? sizeof(StegoHeader) * 8 : s->carrier_size;
+
+    if (s->header_bytes == 0)
+    {
+        size_t n = stage - s->staged < s->row_carrier ? stage - s->staged : s->row_carrier;
+        memcpy(s->stage + s->staged, carrier, n);
+        s->staged += n;
+        if (s->staged < stage)
+        {
+            s->position += s->row_carrier;
+            return 0;
+        }
+        s->result = png_decode_header(s);
+        if (s->result != 0)
+        {
+            return 1;
+        }
+    }
+
+    size_t payload_end = s->header_bytes * 8 + klsb_carrier_bytes(s->length, s->bits_per_byte);
+    png_stego_span(carrier, s->position, s->row_carrier, s->header_bytes * 8, payload_end - s->header_bytes * 8,
+                   s->message, s->length, s->bits_per_byte, 0);
+    s->position += s->row_carrier;
+    return s->position >= payload_end; // the rest of the image is not needed
+}
+
+// decode hidden message from PNG image, reading only the rows that hold it
+int decode_message_png(const char *input_file, const char *output_file)
+{
+    PNGStego s;
+    memset(&s, 0, sizeof(s));
+
+    PNGRowHandler handler = {&s, png_decode_begin, NULL, png_decode_row};
+    int result = process_png(input_file, NULL, &handler);
+    free(s.packed);
+    free(s.stage);
+    if (result == 0)
+    {
+        result = s.result;
+    }
+    if (result != 0)
+    {
+        free(s.message);
+        return result;
+    }
+    if (s.header.flags & STEGO_FLAG_DEFLATE)
+    {
+        unsigned char *message;
+        size_t msg_len;
+        result = inflate_payload(s.message, s.length, stego_inflate_limit(s.carrier_size), &message, &msg_len);
+        free(s.message);
+        if (result != 0)
+        {
+            return result;
+        }
+        fprintf(report_out(), "Inflated message length: %zu bytes\n", msg_len);
+        s.message = message;
+        s.length = msg_len;
+    }
+
+    if (output_file != NULL)
+    {
+        FILE *out = open_payload_output(output_file);
+        if (out == NULL)
+        {
+            free(s.message);
+            return 1; // File Not Found
+        }
+        stats_add(STATS_BYTES_WRITTEN, s.length);
+        result = close_payload_output(out, output_file, fwrite(s.message, 1, s.length, out) != s.length);
+        if (result == 0)
+        {
+            fprintf(report_out(), "hidden message is saved to %s\n", to_stdout_name(output_file));
+        }
+    }
+    else
+    {
+        print_payload(&s.header, s.message, s.length);
+    }
+    free(s.message);
+    return result;
+}
+
+typedef struct {
+    BMPPixelFormat format;   // sample layout of RGB and RGBA rows
+    uint32_t width;
+    int channels;
+    GrayscaleMode mode;
+} PNGGray;
+
+static int png_gray_begin(void *ctx, const PNGInfo *info)
+{
+    // PNG samples are in RGB(A) order
+    static const BMPPixelFormat rgb = {BMP_FORMAT_BGR24, 3, 2, 1, 0, 0xFF, 0, 0};
+    static const BMPPixelFormat rgba = {BMP_FORMAT_BGRA32, 4, 2, 1, 0, 3, 0, 0};
+    PNGGray *g = (PNGGray *)ctx;
+
+    g->format = info->color_type == PNG_COLOR_RGBA ? rgba : rgb;
+    g->width = info->width;
+    g->channels = info->channels;
+    fprintf(report_out(), "\n--- Converting to Grayscale ---\n");
+    return 0;
+}
+
+static int png_gray_palette(void *ctx, unsigned char *rgb, uint32_t entries)
+{
+    PNGGray *g = (PNGGray *)ctx;
+    grayscale_rows(rgb, &g->format, (int)entries, 1, g->mode);
+    return 0;
+}
+
+// gray and gray + alpha rows are gray already, palettized ones change through PLTE
+static int png_gray_row(void *ctx, unsigned char *row, uint32_t y)
+{
+    (void)y;
+    PNGGray *g = (PNGGray *)ctx;
+    if (g->channels >= 3)
+    {
+        grayscale_rows(row, &g->format, (int)g->width, 1, g->mode);
+    }
+    return 0;
+}
+
+// convert PNG image to grayscale, row by row
+int convert_to_grayscale_png(const char *input_file, const char *output_file, GrayscaleMode mode)
+{
+    PNGGray g;
+    g.mode = mode;
+
+    PNGRowHandler handler = {&g, png_gray_begin, png_gray_palette, png_gray_row};
+    int result = process_png(input_file, output_file, &handler);
+    if (result == 0)
+    {
+        fprintf(report_out(), "successfully converted to grayscale\n");
+    }
+    return result;
+}
+
+// read BMP file from disk into BMPImage structure
+// with an arena the pixel data is borrowed from it, otherwise it gets a new heap buffer
+static int read_bmp_file(const char *filename, BMPImage *img, ImageArena *arena)
+{
+    img->data = NULL;
+    img->map = NULL;
+    img->map_size = 0;
+    img->arena = NULL;
+    img->view = NULL;
+    img->gap = NULL;
+    img->gap_size = 0;
+
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", filename);
+        return 1; // File Not Found
+    }
+
+    // read 54-byte BMP header
+    if (fread(&img->header, sizeof(BMPHeader), 1, file) != 1)
+    {
+        fprintf(stderr, "Error: reading BMP header\n");
+        fclose(file);
+        return 1; // File Not Found
+    }
+
+    // check BMP magic number (0x4D42)
+    if (img->header.type != 0x4D42)
+    {
+        fprintf(stderr, "Error: File is not a valid BMP format (magic number 0x%X)\n", img->header.type);
+        fclose(file);
+        return 2; // Invalid Arguments
+    }
+
+    if (img->header.offset < sizeof(BMPHeader) || img->header.offset > img->header.size)
+    {
+        fprintf(stderr, "Error: reading image data failed\n");
+        fclose(file);
+        return 1; // File Not Found
+    }
+
+    // DIB extension, masks and palette between the header and the pixel data
+    img->gap_size = img->header.offset - sizeof(BMPHeader);
+    img->gap = (unsigned char *)malloc(img->gap_size > 0 ? img->gap_size : 1);
+    if (img->gap == NULL)
+    {
+        fprintf(stderr, "Error: image data memory allocation failed\n");
+        fclose(file);
+        return 3; // Memory Allocation Failure
+    }
+    if (fread(img->gap, 1, img->gap_size, file) != img->gap_size)
+    {
+        fprintf(stderr, "Error: reading image data failed\n");
+        free_bmp_image(img);
+        fclose(file);
+        return 1; // File Not Found
+    }
+
+    // 8-bit palettized, 24-bit or 32-bit BMP with no compression
+    if (bmp_pixel_format(&img->header, img->gap, img->gap_size, &img->format) != 0)
+    {
+        print_format_error();
+        free_bmp_image(img);
+        fclose(file);
+        return 2; // Invalid Arguments
+    }
+
+    // calculate the size of the pixel data array (header.size - header.offset)
+    size_t data_size = img->header.size - img->header.offset;
+
+    // allocate memory for the pixel data
+    if (arena != NULL)
+    {
+        img->data = image_arena_acquire(arena, data_size);
+        img->arena = img->data != NULL ? arena : NULL;
+    }
+    else
+    {
+        img->data = (unsigned char *)malloc(data_size > 0 ? data_size : 1);
+    }
+    if (!img->data)
+    {
+        fprintf(stderr, "Error: image data memory allocation failed\n");
+        free_bmp_image(img);
+        fclose(file);
+        return 3; // Memory Allocation Failure
+    }
+
+    // read the pixel data into the buffer
+    if (fread(img->data, 1, data_size, file) != data_size)
+    {
+        fprintf(stderr, "Error: reading image data failed\n");
+        free_bmp_image(img);
+        fclose(file);
+        return 1; // File Not Found
+    }
+
+    fclose(file);
+    return 0; // return 0 for success
+}
+
+// timed read_bmp_file (--stats)
+int read_bmp_arena(const char *filename, BMPImage *img, ImageArena *arena)
+{
+    StatsSpan span = stats_begin(STATS_READ);
+    int result = read_bmp_file(filename, img, arena);
+    stats_end(&span);
+    if (result == 0)
+    {
+        stats_add(STATS_BYTES_READ, img->header.size);
+    }
+    return result;
+}
+
+// read BMP file from disk into BMPImage structure (pixel data in a new heap buffer)
+int read_bmp(const char *filename, BMPImage *img)
+{
+    return read_bmp_arena(filename, img, NULL);
+}
+
+// BMP file already read into memory (the batch I/O queue): the checks and
+// error messages of read_bmp, but img is a view over file and nothing is copied
+int read_bmp_buffer(unsigned char *file, size_t size, BMPImage *img)
+{
+    memset(img, 0, sizeof(*img));
+    img->view = file;
+    if (size < sizeof(BMPHeader))
+    {
+        fprintf(stderr, "Error: reading BMP header\n");
+        return 1; // File Not Found
+    }
+    memcpy(&img->header, file, sizeof(BMPHeader));
+    if (img->header.type != 0x4D42)
+    {
+        fprintf(stderr, "Error: File is not a valid BMP format (magic number 0x%X)\n", img->header.type);
+        return 2; // Invalid Arguments
+    }
+    if (img->header.offset < sizeof(BMPHeader) || img->header.offset > img->header.size || img->header.offset > size)
+    {
+        fprintf(stderr, "Error: reading image data failed\n");
+        return 1; // File Not Found
+    }
+    img->gap = file + sizeof(BMPHeader);
+    img->gap_size = img->header.offset - sizeof(BMPHeader);
+    if (bmp_pixel_format(&img->header, img->gap, img->gap_size, &img->format) != 0)
+    {
+        print_format_error();
+        return 2; // Invalid Arguments
+    }
+    if (img->header.size > size)
+    {
+        fprintf(stderr, "Error: reading image data failed\n");
+        return 1; // File Not Found
+    }
+    img->data = file + img->header.offset;
+    stats_add(STATS_BYTES_READ, img->header.size);
+    return 0; // return 0 for success
+}
+
+// write BMPImage structure to BMP file on disk
+static int write_bmp_file(const char *filename, const BMPImage *img)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", filename);
+        return 1; // File Not Found
+    }
+
+    // write BMP header
+    if (fwrite(&img->header, sizeof(BMPHeader), 1, file) != 1)
+    {
+        fprintf(stderr, "Error: writing BMP header failed\n");
+        fclose(file);
+        return 1; // File Not Found
+    }
+
+    // DIB extension, masks and palette up to the start of the pixel data array
+    if (fwrite(img->gap, 1, img->gap_size, file) != img->gap_size)
+    {
+        fprintf(stderr, "Error: writing BMP header failed\n");
+        fclose(file);
+        return 1; // File Not Found
+    }
+
+    // calculate the size of the pixel data array (header.size - header.offset)
+    size_t data_size = (size_t)bmp_pixel_bytes(&img->header);
+
+    // write the pixel data from the BMPImage structure to the file
+    if (fwrite(img->data, 1, data_size, file) != data_size)
+    {
+        fprintf(stderr, "Error: writing image data failed\n");
+        fclose(file);
+        return 1; // File Not Found
+    }
+
+    fclose(file);
+    return 0; // return 0 for success
+}
+
+// timed write_bmp_file (--stats)
+int write_bmp(const char *filename, const BMPImage *img)
+{
+    StatsSpan span = stats_begin(STATS_WRITE);
+    int result = write_bmp_file(filename, img);
+    stats_end(&span);
+    if (result == 0)
+    {
+        stats_add(STATS_BYTES_WRITTEN, img->header.size);
+    }
+    return result;
+}
+
+// map BMP file into memory, copy-on-write (MAP_PRIVATE) or shared (MAP_SHARED)
+// pixel data is used in place: only the pages that are touched are read from disk,
+// and only in a shared mapping do modified pages reach the file
+static int map_bmp_file(const char *filename, BMPImage *img, int shared)
+{
+    img->data = NULL;
+    img->map = NULL;
+    img->map_size = 0;
+    img->arena = NULL;
+    img->view = NULL;
+    img->gap = NULL;
+    img->gap_size = 0;
+
+    int fd = open(filename, shared ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", filename);
+        return 1; // File Not Found
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BMPHeader))
+    {
+        fprintf(stderr, "Error: reading BMP header\n");
+        close(fd);
+        return 1; // File Not Found
+    }
+
+    unsigned char *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: mapping \'%s\' into memory failed\n", filename);
+        return 3; // Memory Allocation Failure
+    }
+    memcpy(&img->header, map, sizeof(BMPHeader));
+
+    // check BMP magic number (0x4D42)
+    if (img->header.type != 0x4D42)
+    {
+        fprintf(stderr, "Error: File is not a valid BMP format (magic number 0x%X)\n", img->header.type);
+        munmap(map, (size_t)st.st_size);
+        return 2; // Invalid Arguments
+    }
+
+    // the pixel data array (header.offset .. header.size) must lie inside the file
+    if (img->header.offset < sizeof(BMPHeader) || img->header.offset > img->header.size ||
+        img->header.size > (uint64_t)st.st_size)
+    {
+        fprintf(stderr, "Error: reading image data failed\n");
+        munmap(map, (size_t)st.st_size);
+        return 1; // File Not Found
+    }
+
+    // 8-bit palettized, 24-bit or 32-bit BMP with no compression
+    unsigned char *gap = map + sizeof(BMPHeader);
+    size_t gap_size = img->header.offset - sizeof(BMPHeader);
+    if (bmp_pixel_format(&img->header, gap, gap_size, &img->format) != 0)
+    {
+        print_format_error();
+        munmap(map, (size_t)st.st_size);
+        return 2; // Invalid Arguments
+    }
+
+    img->map = map;
+    img->map_size = (size_t)st.st_size;
+    img->gap = gap;
+    img->gap_size = gap_size;
+    img->data = map + img->header.offset;
+    return 0; // return 0 for success
+}
+
+// map BMP file into memory copy-on-write (MAP_PRIVATE); modified pages never reach the file
+int map_bmp(const char *filename, BMPImage *img)
+{
+    StatsSpan span = stats_begin(STATS_MAP);
+    int result = map_bmp_file(filename, img, 0);
+    stats_end(&span);
+    return result;
+}
+
+// map BMP file into memory shared (MAP_SHARED), so that changes to its pixel data are written
+// back to it, and only the pages that were changed
+int map_bmp_shared(const char *filename, BMPImage *img)
+{
+    StatsSpan span = stats_begin(STATS_MAP);
+    int result = map_bmp_file(filename, img, 1);
+    stats_end(&span);
+    return result;
+}
+
+// copy a file without passing its contents through user space: a reflink (FICLONE) where the
+// file system can share extents, else copy_file_range, else plain reads and writes
+static int copy_file_contents(int in, int out, off_t size)
+{
+    if (ioctl(out, FICLONE, in) == 0)
+    {
+        return 0;
+    }
+
+    off_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, (size_t)(size - done), 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        stats_add(STATS_BYTES_WRITTEN, (uint64_t)n);
+        done += n;
+    }
+    if (done == size)
+    {
+        return 0;
+    }
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+    {
+        return 1;
+    }
+
+    // copy_file_range is not available between these files, continue where it stopped
+    unsigned char buf[1 << 16];
+    while (done < size)
+    {
+        ssize_t n = pread(in, buf, sizeof(buf), done);
+        if (n <= 0 || write(out, buf, (size_t)n) != n)
+        {
+            return 1;
+        }
+        stats_add(STATS_BYTES_READ, (uint64_t)n);
+        stats_add(STATS_BYTES_WRITTEN, (uint64_t)n);
+        done += n;
+    }
+    return 0;
+}
+
+// 1 if both paths name the same existing file
+int same_file(const char *a, const char *b)
+{
+    struct stat sa, sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+// the process umask, read from /proc since umask(2) can only be read by changing it
+static mode_t current_umask(void)
+{
+    mode_t mask = 022;
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status == NULL)
+    {
+        return mask;
+    }
+    char line[128];
+    unsigned value;
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        if (sscanf(line, "Umask: %o", &value) == 1)
+        {
+            mask = (mode_t)value;
+            break;
+        }
+    }
+    fclose(status);
+    return mask;
+}
+
+// create "<output_file>.XXXXXX" with mkstemp, in the output's directory so it can be
+// renamed over the output, and give it the permissions the output has or would get;
+// returns the descriptor and sets *temp_name (free it), or -1 with errno set
+int create_temp_output(const char *output_file, char **temp_name)
+{
+    size_t length = strlen(output_file);
+    char *name = (char *)malloc(length + sizeof(".XXXXXX"));
+    if (name == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(name, output_file, length);
+    memcpy(name + length, ".XXXXXX", sizeof(".XXXXXX"));
+    int fd = mkostemp(name, O_CLOEXEC);
+    if (fd < 0)
+    {
+        free(name);
+        return -1;
+    }
+    struct stat st;
+    mode_t mode = stat(output_file, &st) == 0 && S_ISREG(st.st_mode) ? st.st_mode & 07777 : 0666 & ~current_umask();
+    fchmod(fd, mode);
+    *temp_name = name;
+    return fd;
+}
+
+// copy input BMP file to output_file and map the copy shared (see map_bmp_shared), so that
+// hiding a message writes only the pages that change; output_file may be input_file itself
+int patch_bmp_output(const char *input_file, const char *output_file, BMPImage *img)
+{
+    int in = open(input_file, O_RDONLY);
+    if (in < 0)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", input_file);
+        return 1; // File Not Found
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0)
+    {
+        fprintf(stderr, "Error: reading BMP header\n");
+        close(in);
+        return 1; // File Not Found
+    }
+    if (same_file(input_file, output_file))
+    {
+        close(in);
+        return map_bmp_shared(output_file, img);
+    }
+
+    int out = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", output_file);
+        close(in);
+        return 1; // File Not Found
+    }
+    StatsSpan span = stats_begin(STATS_WRITE);
+    int copy_result = copy_file_contents(in, out, st.st_size);
+    stats_end(&span);
+    close(in);
+    if (close(out) != 0 || copy_result != 0)
+    {
+        fprintf(stderr, "Error: writing image data failed\n");
+        unlink(output_file);
+        return 1; // File Not Found
+    }
+
+    int map_result = map_bmp_shared(output_file, img);
+    if (map_result != 0)
+    {
+        unlink(output_file);
+    }
+    return map_result;
+}
+
+// create output BMP file with the contents of src and map it shared (MAP_SHARED)
+// changes made through dst->data go straight to the file, so no write_bmp is needed;
+// filename must not be the file src is mapped from, which the truncation would empty
+int map_bmp_output(const char *filename, const BMPImage *src, BMPImage *dst)
+{
+    dst->data = NULL;
+    dst->map = NULL;
+    dst->map_size = 0;
+    dst->arena = NULL;
+    dst->view = NULL;
+    dst->gap = NULL;
+    dst->gap_size = 0;
+
+    size_t file_size = src->header.size;
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", filename);
+        return 1; // File Not Found
+    }
+
+    if (ftruncate(fd, (off_t)file_size) != 0)
+    {
+        fprintf(stderr, "Error: writing image data failed\n");
+        close(fd);
+        unlink(filename);
+        return 1; // File Not Found
+    }
+
+    unsigned char *map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: mapping \'%s\' into memory failed\n", filename);
+        unlink(filename);
+        return 3; // Memory Allocation Failure
+    }
+
+    // header, gap between header and pixel data, then the pixel data itself
+    size_t data_size = src->header.size - src->header.offset;
+    memcpy(map, &src->header, sizeof(BMPHeader));
+    memcpy(map + sizeof(BMPHeader), src->gap, src->gap_size);
+    memcpy(map + src->header.offset, src->data, data_size);
+
+    dst->header = src->header;
+    dst->format = src->format;
+    dst->map = map;
+    dst->map_size = file_size;
+    dst->gap = map + sizeof(BMPHeader);
+    dst->gap_size = src->gap_size;
+    dst->data = map + src->header.offset;
+    return 0; // return 0 for success
+}
+
+// ---------------------------------------------------------------------------
+// buffer API (bmpstego.h)
+//
+// The same carrier code as the file API, minus the files and the reports: the
+// image is a view over a BMP file the caller already holds in memory, the
+// message goes in from a caller buffer in one carrier_embed call and comes
+// back into a caller buffer, and every failure is a BMPStegoStatus. Only
+// compression allocates (the deflated payload, or the inflater's window).
+// ---------------------------------------------------------------------------
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void)
+{
+    select_lsb_kernels();
+    select_grayscale_kernel();
+    select_pixels32_kernels();
+}
+
+// every kernel user calls this first, so the first call from any thread picks them all exactly once
+void bmpstego_init(void)
+{
+    pthread_once(&kernels_once, select_kernels);
+}
+
+int bmpstego_image_view(BMPImage *img, unsigned char *file, size_t size)
+{
+    memset(img, 0, sizeof(*img));
+    img->view = file; // free_bmp_image has nothing to free, even after a failure
+    if (size < sizeof(BMPHeader))
+    {
+        return BMPSTEGO_ERR_INVALID;
+    }
+    memcpy(&img->header, file, sizeof(BMPHeader));
+    if (img->header.type != 0x4D42 || img->header.offset < sizeof(BMPHeader) ||
+        img->header.offset > img->header.size || img->header.size > size)
+    {
+        return BMPSTEGO_ERR_INVALID;
+    }
+    img->gap = file + sizeof(BMPHeader);
+    img->gap_size = img->header.offset - sizeof(BMPHeader);
+    if (bmp_pixel_format(&img->header, img->gap, img->gap_size, &img->format) != 0)
+    {
+        return BMPSTEGO_ERR_INVALID;
+    }
+    img->data = file + img->header.offset;
+    return BMPSTEGO_OK;
+}
+
+// bits per byte of options, 0 if out of range
+static int options_bits_per_byte(const BMPStegoOptions *options)
+{
+    int k = options != NULL && options->bits_per_byte != 0 ? options->bits_per_byte : 1;
+    return k >= 1 && k <= MAX_BITS_PER_BYTE ? k : 0;
+}
+
+uint64_t bmpstego_capacity(const BMPImage *img, const BMPStegoOptions *options)
+{
+    int k = options_bits_per_byte(options);
+    if (k == 0)
+    {
+        return 0;
+    }
+    Carrier carrier;
+    carrier_init(img, &carrier, 1);
+    return stego_capacity(carrier.size, k, options != NULL && options->key != NULL);
+}
+
+int bmpstego_encode(BMPImage *img, const unsigned char *message, size_t length, const BMPStegoOptions *options)
+{
+    int k = options_bits_per_byte(options);
+    int level = options != NULL ? options->compress_level : 0;
+    const char *key = options != NULL ? options->key : NULL;
+    if (k == 0 || level < 0 || level > MAX_COMPRESS_LEVEL)
+    {
+        return BMPSTEGO_ERR_INVALID;
+    }
+    if (img->format.id == BMP_FORMAT_PAL8 &&
+        !palette_hides_bits(img->gap + img->format.palette_offset, img->format.palette_entries, 4, k))
+    {
+        return BMPSTEGO_ERR_INVALID;
+    }
+
+    Carrier carrier;
+    carrier_init(img, &carrier, 1);
+    size_t header_carrier = sizeof(StegoHeader) * 8;
+    uint64_t capacity = stego_capacity(carrier.size, k, key != NULL);
+    if (level > 0 && length > stego_inflate_limit(carrier.size))
+    {
+        return BMPSTEGO_ERR_TOO_LONG;
+    }
+
+    const unsigned char *payload = message;
+    size_t payload_size = length;
+    unsigned char *deflated = NULL;
+    if (level > 0 && deflate_payload(message, length, level, &deflated, &payload_size) != 0)
+    {
+        return BMPSTEGO_ERR_NOMEM;
+    }
+    if (deflated != NULL)
+    {
+        payload = deflated;
+    }
+    if (carrier.size < header_carrier || payload_size > capacity)
+    {
+        free(deflated);
+        return BMPSTEGO_ERR_TOO_LONG;
+    }
+
+    Scatter scatter;
+    if (key != NULL)
+    {
+        scatter_init(&scatter, key, header_carrier, carrier.size - header_carrier, options->pool);
+        carrier.scatter = &scatter;
+    }
+    carrier_embed(&carrier, header_carrier, payload, payload_size, k);
+    embed_stego_header(&carrier, k, is_text_chunk(message, length), deflated != NULL, payload_size);
+    free(deflated);
+    return BMPSTEGO_OK;
+}
+
+// inflate the payload into out; *length is the inflated size even when it does not fit
+// (a payload that inflates past stego_inflate_limit is corrupt)
+static int inflate_to_buffer(PayloadSource *source, unsigned char *out, size_t capacity, size_t *length)
+{
+    Inflater *z = inflater_create(payload_source_read, source);
+    if (z == NULL)
+    {
+        return BMPSTEGO_ERR_NOMEM;
+    }
+    uint64_t limit = stego_inflate_limit(source->carrier->size);
+    long count = inflater_read(z, out, capacity);
+    int result = count < 0 ? BMPSTEGO_ERR_CORRUPT : BMPSTEGO_OK;
+    *length = count < 0 ? 0 : (size_t)count;
+    if (result == BMPSTEGO_OK && (size_t)count == capacity)
+    {
+        // count the rest to tell the caller how much room it needs
+        unsigned char spill[4096];
+        while (*length <= limit && (count = inflater_read(z, spill, sizeof(spill))) > 0)
+        {
+            *length += (size_t)count;
+            result = BMPSTEGO_ERR_BUFFER;
+        }
+        if (count < 0)
+        {
+            result = BMPSTEGO_ERR_CORRUPT;
+        }
+    }
+    if (*length > limit)
+    {
+        *length = 0;
+        result = BMPSTEGO_ERR_CORRUPT;
+    }
+    inflater_destroy(z);
+    return result;
+}
+
+int bmpstego_decode(const BMPImage *img, unsigned char *out, size_t capacity, size_t *length, const BMPStegoOptions *options)
+{
+    *length = 0;
+    Carrier carrier;
+    stego_carrier_init(img, &carrier);
+    if (carrier.size < 8)
+    {
+        return BMPSTEGO_ERR_INVALID;
+    }
+
+    // StegoHeader if present, otherwise the original 1-byte length
+    StegoHeader header;
+    size_t header_bytes;
+    resolve_stego_header(&carrier, 1, &header, &header_bytes);
+    int k = header.bits_per_byte;
+    uint64_t msg_len = stego_length(&header);
+    if (msg_len > carrier.size || header_bytes * 8 + klsb_carrier_bytes(msg_len, k) > carrier.size)
+    {
+        return BMPSTEGO_ERR_CORRUPT;
+    }
+
+    Scatter scatter;
+    if (header.flags & STEGO_FLAG_SCATTER)
+    {
+        if (options == NULL || options->key == NULL)
+        {
+            return BMPSTEGO_ERR_KEY;
+        }
+        scatter_init(&scatter, options->key, header_bytes * 8, carrier.size - header_bytes * 8, options->pool);
+        if ((header.flags & STEGO_FLAG_KEY_CHECK) && header.key_check != scatter.key_check)
+        {
+            return BMPSTEGO_ERR_KEY;
+        }
+        if ((msg_len + k - 1) / k > scatter.groups)
+        {
+            return BMPSTEGO_ERR_CORRUPT;
+        }
+        carrier.scatter = &scatter;
+    }
+
+    if (header.flags & STEGO_FLAG_DEFLATE)
+    {
+        PayloadSource source = {&carrier, header_bytes * 8, k, msg_len, 0};
+        return inflate_to_buffer(&source, out, capacity, length);
+    }
+    *length = (size_t)msg_len;
+    if (msg_len > capacity)
+    {
+        return BMPSTEGO_ERR_BUFFER;
+    }
+    carrier_extract(&carrier, header_bytes * 8, out, (size_t)msg_len, k);
+    return BMPSTEGO_OK;
+}
+
+const char *bmpstego_strerror(int status)
+{
+    switch (status)
+    {
+    case BMPSTEGO_OK:
+        return "success";
+    case BMPSTEGO_ERR_IO:
+        return "the image could not be read or written, or its pixel data is short";
+    case BMPSTEGO_ERR_INVALID:
+        return "not a supported BMP image, or an option is out of range";
+    case BMPSTEGO_ERR_NOMEM:
+        return "memory allocation failed";
+    case BMPSTEGO_ERR_TOO_LONG:
+        return "the message does not fit into the image";
+    case BMPSTEGO_ERR_BUFFER:
+        return "the output buffer is too small";
+    case BMPSTEGO_ERR_KEY:
+        return "the message was hidden with a key";
+    case BMPSTEGO_ERR_CORRUPT:
+        return "the hidden message is damaged";
+    default:
+        return "unknown error";
+    }
+}
@@ -0,0 +1,159 @@
+// bmpstego.h
+#ifndef BMPSTEGO_H
+#define BMPSTEGO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "bmp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAX_BITS_PER_BYTE 4        // -bits limit: message bits per carrier byte
+#define MAX_COMPRESS_LEVEL 9       // -z limit: deflate level
+#define INFLATE_LIMIT_FACTOR 16    // -z limit: message bytes per carrier byte (see stego_inflate_limit)
+#define INFLATE_MIN_LIMIT (16ull << 20) // -z limit for small carriers
+
+typedef struct ThreadPool ThreadPool; // fixed set of worker threads, see thread_pool_run
+
+// task i of thread_pool_run, worker is the index of the participant running it
+typedef void (*pool_task_fn)(void *ctx, size_t task, int worker);
+
+typedef enum {
+  GRAY_GREEN = 0,             // Blue = Red = Green
+  GRAY_BT601,                 // Y = 0.299 R + 0.587 G + 0.114 B
+  GRAY_BT709                  // Y = 0.2126 R + 0.7152 G + 0.0722 B
+} GrayscaleMode;
+
+typedef struct {
+  uint64_t  hits;             // acquisitions served by an existing slab
+  uint64_t  misses;           // acquisitions that mapped or grew a slab
+  int       slabs;            // slabs mapped
+  size_t    peak_in_use;      // most bytes lent out at once
+  size_t    peak_reserved;    // most slab capacity at once
+} ImageArenaStats;
+
+// ---------------------------------------------------------------------------
+// file API (used by bw2bmp): functions that take file names report progress
+// and results to report_out() and errors to stderr, and return 0, 1 (File Not
+// Found / I/O error), 2 (Invalid Arguments) or 3 (Memory Allocation Failure)
+// ---------------------------------------------------------------------------
+
+// per-thread report stream, NULL = stdout (batch workers capture each job's reports)
+extern __thread FILE *report_stream;
+FILE *report_out(void);
+
+// pick the SIMD kernels for this CPU (once, however many threads call it; the
+// library calls it on first use, so calling it up front only moves the cost)
+void bmpstego_init(void);
+
+// images: read into a heap (or arena) buffer, map copy-on-write or shared, write, free
+int read_bmp(const char *filename, BMPImage *img);
+int read_bmp_arena(const char *filename, BMPImage *img, ImageArena *arena);
+int read_bmp_buffer(unsigned char *file, size_t size, BMPImage *img); // file already in memory, img is a view
+int write_bmp(const char *filename, const BMPImage *img);
+int map_bmp(const char *filename, BMPImage *img);
+int map_bmp_shared(const char *filename, BMPImage *img);
+int map_bmp_output(const char *filename, const BMPImage *src, BMPImage *dst);
+int patch_bmp_output(const char *input_file, const char *output_file, BMPImage *img);
+int same_file(const char *a, const char *b);
+int create_temp_output(const char *output_file, char **temp_name);
+void free_bmp_image(BMPImage *img);
+
+// headers only
+int probe_bmp_header(const char *filename, BMPProbe *probe);
+int probe_bmp_header_at(int dir_fd, const char *filename, BMPProbe *probe);
+int bmp_pixel_format(const BMPHeader *header, const unsigned char *gap, size_t gap_size, BMPPixelFormat *format);
+int bmp_depth_supported(const BMPHeader *header);
+int bmp_size_supported(const BMPHeader *header);
+void print_format_error(void);
+
+// pixel buffers shared by the images of a batch
+ImageArena *image_arena_create(void);
+void image_arena_destroy(ImageArena *arena);
+void image_arena_get_stats(ImageArena *arena, ImageArenaStats *stats);
+unsigned char *image_arena_acquire(ImageArena *arena, size_t size);
+void image_arena_release(ImageArena *arena, unsigned char *buffer);
+
+// threads = 0 means one per CPU; a NULL pool runs everything on the calling thread
+int online_cpu_count(void);
+ThreadPool *thread_pool_create(int threads);
+void thread_pool_destroy(ThreadPool *pool);
+int thread_pool_size(const ThreadPool *pool);
+void thread_pool_run(ThreadPool *pool, size_t task_count, pool_task_fn fn, void *ctx);
+
+// hex dump to standard output
+void print_data_hex(const BMPImage *img);
+int dump_bmp_hex(const char *filename, uint64_t start, uint64_t length);
+
+// grayscale conversion
+int convert_to_grayscale(BMPImage *img, ThreadPool *pool, GrayscaleMode mode);
+int convert_to_grayscale_stream(const char *input_file, const char *output_file, ThreadPool *pool, GrayscaleMode mode);
+int convert_to_grayscale_png(const char *input_file, const char *output_file, GrayscaleMode mode);
+
+// LSB steganography with a message file (key may be NULL, pool may be NULL)
+int encode_message(BMPImage *img, const char message_file[], int bits_per_byte, int compress_level, const char *key, ThreadPool *pool);
+int decode_message(const BMPImage *img, const char *output_file, const char *key, ThreadPool *pool);
+int encode_message_jpeg(const char *input_file, const char message_file[], const char *output_file, int bits_per_byte, int compress_level, const char *key, ThreadPool *pool);
+int decode_message_jpeg(const char *input_file, const char *output_file, const char *key, ThreadPool *pool);
+int encode_message_png(const char *input_file, const char message_file[], const char *output_file, int bits_per_byte, int compress_level);
+int decode_message_png(const char *input_file, const char *output_file);
+
+// capacity planning from headers only
+size_t bmp_carrier_bytes(const BMPHeader *header, int pixel_order);
+uint64_t stego_capacity(size_t carrier_bytes, int bits_per_byte, int keyed);
+uint64_t stego_inflate_limit(size_t carrier_bytes);
+int select_smallest_carrier(const BMPHeader *headers, size_t count, uint64_t payload_bytes, int bits_per_byte, int keyed);
+int deflated_file_size(const char *message_file, int level, uint64_t *size);
+
+// ---------------------------------------------------------------------------
+// buffer API: images over caller-owned memory, messages to and from caller
+// buffers; nothing is printed, and without compression nothing is allocated
+// ---------------------------------------------------------------------------
+
+typedef enum {
+  BMPSTEGO_OK = 0,
+  BMPSTEGO_ERR_IO = 1,        // file not found, I/O error, or pixel data shorter than the header says
+  BMPSTEGO_ERR_INVALID = 2,   // not a supported BMP, or options out of range
+  BMPSTEGO_ERR_NOMEM = 3,     // memory allocation failed (compression only)
+  BMPSTEGO_ERR_TOO_LONG = 4,  // the message does not fit into the image
+  BMPSTEGO_ERR_BUFFER = 5,    // the output buffer is too small, *length is the size needed
+  BMPSTEGO_ERR_KEY = 6,       // the message was hidden with a key and none, or a different one, was given
+  BMPSTEGO_ERR_CORRUPT = 7    // the hidden message is damaged (bad length or compressed data)
+} BMPStegoStatus;
+
+typedef struct {
+  int         bits_per_byte;  // message bits per carrier byte (1-4), 0 = 1
+  int         compress_level; // deflate the message at this level (1-9) first, 0 = store it
+  const char* key;            // passphrase of the keyed order, or NULL
+  ThreadPool* pool;           // workers for the keyed order, or NULL
+} BMPStegoOptions;
+
+// BMP file of size bytes already in memory; img points into it (nothing is copied)
+// and free_bmp_image leaves it alone. Encoding writes into file.
+int bmpstego_image_view(BMPImage *img, unsigned char *file, size_t size);
+
+// message bytes img can hide with options (NULL = 1 bit per byte, no key)
+uint64_t bmpstego_capacity(const BMPImage *img, const BMPStegoOptions *options);
+
+// hide length bytes of message in img (BMPSTEGO_ERR_INVALID for an 8-bit image whose
+// palette would show the changed index bits, see -e)
+int bmpstego_encode(BMPImage *img, const unsigned char *message, size_t length, const BMPStegoOptions *options);
+
+// recover the hidden message into out (capacity bytes), *length is set to its size
+// (also when it does not fit: BMPSTEGO_ERR_BUFFER); options give the key, if any
+int bmpstego_decode(const BMPImage *img, unsigned char *out, size_t capacity, size_t *length, const BMPStegoOptions *options);
+
+// convert img to grayscale in place (pool may be NULL)
+int bmpstego_grayscale(BMPImage *img, ThreadPool *pool, GrayscaleMode mode);
+
+// short description of a BMPStegoStatus
+const char *bmpstego_strerror(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BMPSTEGO_H
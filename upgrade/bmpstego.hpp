@@ -0,0 +1,154 @@
+// bmpstego.hpp
+#ifndef BMPSTEGO_HPP
+#define BMPSTEGO_HPP
+
+// C++20 wrapper of the buffer API in bmpstego.h: owning types for images and
+// thread pools, std::span for pixels and messages, and Error for failures.
+// Header only, link with libbmpstego.a.
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include "bmpstego.h"
+
+namespace bmpstego {
+
+using Options = BMPStegoOptions;
+
+// a BMPStegoStatus (or a file API return code) other than BMPSTEGO_OK
+class Error : public std::runtime_error
+{
+public:
+    explicit Error(int status) : std::runtime_error(bmpstego_strerror(status)), status_(status) {}
+    int status() const noexcept { return status_; }
+
+private:
+    int status_;
+};
+
+inline void check(int status)
+{
+    if (status != BMPSTEGO_OK)
+    {
+        throw Error(status);
+    }
+}
+
+// fixed set of worker threads; threads = 0 means one per CPU, and a pool of
+// one thread holds no pool at all (get() is nullptr, work runs on the caller)
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads = 0)
+        : pool_(thread_pool_create(threads > 0 ? threads : online_cpu_count())) {}
+    ThreadPool(ThreadPool &&other) noexcept : pool_(std::exchange(other.pool_, nullptr)) {}
+    ThreadPool &operator=(ThreadPool &&other) noexcept
+    {
+        std::swap(pool_, other.pool_);
+        return *this;
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    ~ThreadPool() { thread_pool_destroy(pool_); }
+
+    ::ThreadPool *get() const noexcept { return pool_; }
+    int size() const noexcept { return thread_pool_size(pool_); }
+
+private:
+    ::ThreadPool *pool_;
+};
+
+// a BMP image, read from a file, mapped, or viewed in a caller buffer that
+// must outlive it; move-only, the pixels are freed or unmapped with it
+class Image
+{
+public:
+    Image() noexcept : img_{} {}
+    Image(Image &&other) noexcept : img_(std::exchange(other.img_, BMPImage{})) {}
+    Image &operator=(Image &&other) noexcept
+    {
+        std::swap(img_, other.img_);
+        return *this;
+    }
+    Image(const Image &) = delete;
+    Image &operator=(const Image &) = delete;
+    ~Image() { free_bmp_image(&img_); }
+
+    // file API: errors are also printed to stderr
+    static Image read(const char *filename) { return open(read_bmp, filename); }
+    static Image map(const char *filename) { return open(map_bmp, filename); }
+
+    // BMP file already in memory, nothing is copied; encoding writes into file
+    static Image view(std::span<std::uint8_t> file)
+    {
+        Image image;
+        check(bmpstego_image_view(&image.img_, file.data(), file.size()));
+        return image;
+    }
+
+    void write(const char *filename) const { check(write_bmp(filename, &img_)); }
+
+    int width() const noexcept { return img_.header.width_px; }
+    int height() const noexcept { return img_.header.height_px; } // negative for top-down rows
+
+    // pixel data as stored in the file: rows padded to 4 bytes, bottom-up unless height() < 0
+    std::span<std::uint8_t> pixels() noexcept { return {img_.data, pixel_bytes()}; }
+    std::span<const std::uint8_t> pixels() const noexcept { return {img_.data, pixel_bytes()}; }
+
+    BMPImage *get() noexcept { return &img_; }
+    const BMPImage *get() const noexcept { return &img_; }
+
+    std::uint64_t capacity(const Options &options = {}) const noexcept
+    {
+        return bmpstego_capacity(&img_, &options);
+    }
+
+    void encode(std::span<const std::uint8_t> message, const Options &options = {})
+    {
+        check(bmpstego_encode(&img_, message.data(), message.size(), &options));
+    }
+
+    // size of the hidden message; when it is larger than out.size() out does
+    // not hold the message, and the call can be repeated with a larger buffer
+    std::size_t decode(std::span<std::uint8_t> out, const Options &options = {}) const
+    {
+        std::size_t length = 0;
+        int status = bmpstego_decode(&img_, out.data(), out.size(), &length, &options);
+        if (status != BMPSTEGO_ERR_BUFFER)
+        {
+            check(status);
+        }
+        return length;
+    }
+
+    void grayscale(GrayscaleMode mode = GRAY_GREEN, const ThreadPool *pool = nullptr)
+    {
+        check(bmpstego_grayscale(&img_, pool != nullptr ? pool->get() : nullptr, mode));
+    }
+
+private:
+    static Image open(int (*load)(const char *, BMPImage *), const char *filename)
+    {
+        Image image;
+        int status = load(filename, &image.img_);
+        if (status != 0)
+        {
+            image.img_ = BMPImage{}; // the loader already released what it had
+            throw Error(status);
+        }
+        return image;
+    }
+
+    std::size_t pixel_bytes() const noexcept
+    {
+        return img_.data != nullptr ? img_.header.size - img_.header.offset : 0;
+    }
+
+    BMPImage img_;
+};
+
+} // namespace bmpstego
+
+#endif // BMPSTEGO_HPP
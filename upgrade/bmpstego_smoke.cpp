@@ -0,0 +1,93 @@
+// bmpstego_smoke.cpp
+// builds against bmpstego.hpp and runs each wrapper call once on a BMP image:
+// read, view, capacity, encode and decode (plain, -bits/-z and keyed), and grayscale
+// usage: bmpstego_smoke <image.bmp>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string_view>
+#include <vector>
+#include "bmpstego.hpp"
+
+namespace {
+
+int failures = 0;
+
+void expect(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "bmpstego_smoke: %s failed\n", what);
+        failures++;
+    }
+}
+
+// encode message with options, decode it again and compare
+void round_trip(bmpstego::Image &image, std::string_view message, const bmpstego::Options &options, const char *what)
+{
+    std::span<const std::uint8_t> bytes(reinterpret_cast<const std::uint8_t *>(message.data()), message.size());
+    image.encode(bytes, options);
+    std::vector<std::uint8_t> out(message.size());
+    std::size_t length = image.decode(out, options);
+    expect(length == message.size() && std::memcmp(out.data(), message.data(), length) == 0, what);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        std::fprintf(stderr, "usage: %s <image.bmp>\n", argv[0]);
+        return 2;
+    }
+    const std::string_view message = "the quick brown fox jumps over the lazy dog";
+
+    try
+    {
+        bmpstego::Image image = bmpstego::Image::read(argv[1]);
+        expect(image.width() > 0 && !image.pixels().empty(), "read");
+        expect(image.capacity() >= message.size(), "capacity");
+        round_trip(image, message, {}, "encode/decode");
+        round_trip(image, message, {3, 9, nullptr, nullptr}, "encode/decode -bits 3 -z 9");
+
+        bmpstego::ThreadPool pool(2);
+        bmpstego::Options keyed{2, 0, "passphrase", pool.get()};
+        round_trip(image, message, keyed, "encode/decode -key");
+
+        // a different passphrase is told apart by the header's key check
+        bmpstego::Options wrong{2, 0, "other passphrase", nullptr};
+        std::vector<std::uint8_t> out(message.size());
+        try
+        {
+            image.decode(out, wrong);
+            expect(false, "decode with a wrong key");
+        }
+        catch (const bmpstego::Error &e)
+        {
+            expect(e.status() == BMPSTEGO_ERR_KEY, "decode with a wrong key");
+        }
+
+        // a view over the file bytes sees what a file read does
+        std::ifstream file(argv[1], std::ios::binary);
+        std::vector<std::uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        bmpstego::Image view = bmpstego::Image::view(bytes);
+        expect(view.width() == image.width() && view.height() == image.height(), "view");
+        round_trip(view, message, {}, "encode/decode on a view");
+
+        image.grayscale(GRAY_BT709, &pool);
+    }
+    catch (const bmpstego::Error &e)
+    {
+        std::fprintf(stderr, "bmpstego_smoke: %s (status %d)\n", e.what(), e.status());
+        return 1;
+    }
+
+    if (failures == 0)
+    {
+        std::printf("bmpstego.hpp smoke test: ok\n");
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,175 @@
+#!/bin/sh
+# check.sh: round trips and kernel equivalence through the command line (make check)
+#
+# Every SIMD kernel this CPU has is forced in turn (BMP_LSB_KERNEL,
+# BMP_GRAY_KERNEL) and must write byte for byte what the portable kernel
+# writes; every carrier and option combination must decode to the message
+# it was given. Prints one line per failure and a summary, exits 1 on failure.
+# usage: check/check.sh [bw2bmp]
+
+BIN=${1:-./bw2bmp}
+case $BIN in
+/*) ;;
+*) BIN=$(pwd)/$BIN ;;
+esac
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+T=$(mktemp -d) || exit 1
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+
+passed=0
+failed=0
+
+ok()
+{
+    passed=$((passed + 1))
+}
+
+fail()
+{
+    echo "FAIL: $*"
+    failed=$((failed + 1))
+}
+
+# kernels of a family that this CPU can run (the portable one first)
+cpu_has()
+{
+    grep -qw "$1" /proc/cpuinfo 2>/dev/null
+}
+
+lsb_kernels="swar"
+for k in sse2 bmi2 avx2; do
+    cpu_has $k && lsb_kernels="$lsb_kernels $k"
+done
+gray_kernels="scalar"
+for k in ssse3 avx2; do
+    cpu_has $k && gray_kernels="$gray_kernels $k"
+done
+
+# messages: the text file, and 1000 bytes of pixel data as a binary payload
+cp "$SRC/flower.bmp" flower.bmp
+cp "$SRC/message.txt" text.txt
+tail -c +101 flower.bmp | head -c 1000 > binary.bin
+head -c 300 binary.bin > short.bin
+
+# encode with every LSB kernel, compare with swar, and decode with every kernel
+for bits in 1 2 3 4; do
+    for opts in "" "-z 9" "-key pass" "-z 6 -key pass"; do
+        for msg in text.txt binary.bin; do
+            for k in $lsb_kernels; do
+                if ! BMP_LSB_KERNEL=$k "$BIN" -bits $bits $opts -e flower.bmp $msg enc_$k.bmp > /dev/null 2>&1; then
+                    fail "-bits $bits $opts -e $msg with $k kernel"
+                    continue
+                fi
+                if [ $k != swar ] && ! cmp -s enc_$k.bmp enc_swar.bmp; then
+                    fail "-bits $bits $opts -e $msg: $k kernel differs from swar"
+                    continue
+                fi
+                for d in $lsb_kernels; do
+                    rm -f out.bin
+                    if BMP_LSB_KERNEL=$d "$BIN" $opts -d enc_$k.bmp -out out.bin > /dev/null 2>&1 && cmp -s out.bin $msg; then
+                        ok
+                    else
+                        fail "-bits $bits $opts -e $msg ($k) -d ($d): message differs"
+                    fi
+                done
+            done
+        done
+    done
+done
+
+# grayscale: every kernel and luma formula, serial, threaded and streamed, on 24-bit and 32-bit images
+cp "$SRC/check/check32.bmp" check32.bmp
+for img in flower.bmp check32.bmp; do
+    for luma in green 601 709; do
+        if ! BMP_GRAY_KERNEL=scalar "$BIN" -luma $luma -g $img ref.bmp > /dev/null 2>&1; then
+            fail "-luma $luma -g $img with scalar kernel"
+            continue
+        fi
+        for k in $gray_kernels; do
+            for mode in "" "-j 4" "-stream"; do
+                rm -f gray.bmp
+                if BMP_GRAY_KERNEL=$k "$BIN" $mode -luma $luma -g $img gray.bmp > /dev/null 2>&1 && cmp -s gray.bmp ref.bmp; then
+                    ok
+                else
+                    fail "-luma $luma $mode -g $img: $k kernel differs from scalar"
+                fi
+            done
+        done
+    done
+done
+
+# the same message back from a BMP encoded in memory, mapped, patched and in place
+for mode in "" "-mmap" "--patch"; do
+    rm -f out.bin
+    if "$BIN" $mode -e flower.bmp binary.bin enc.bmp > /dev/null 2>&1 && "$BIN" -d enc.bmp -out out.bin > /dev/null 2>&1 &&
+        cmp -s out.bin binary.bin; then
+        ok
+    else
+        fail "$mode -e/-d round trip"
+    fi
+done
+cp flower.bmp inplace.bmp
+rm -f out.bin
+if "$BIN" --in-place -e inplace.bmp binary.bin > /dev/null 2>&1 && "$BIN" -d inplace.bmp -out out.bin > /dev/null 2>&1 &&
+    cmp -s out.bin binary.bin; then
+    ok
+else
+    fail "--in-place -e/-d round trip"
+fi
+
+# JPEG carrier: 1 bit per coefficient, with -z and -key
+cp "$SRC/check/check.jpg" check.jpg
+for opts in "" "-z 9" "-key pass" "-z 9 -key pass"; do
+    for msg in text.txt short.bin; do
+        rm -f out.bin
+        if "$BIN" $opts -e check.jpg $msg enc.jpg > /dev/null 2>&1 && "$BIN" $opts -d enc.jpg -out out.bin > /dev/null 2>&1 &&
+            cmp -s out.bin $msg; then
+            ok
+        else
+            fail "$opts -e/-d $msg in JPEG"
+        fi
+    done
+done
+
+# PNG carrier: RGB and RGBA rows, -bits 1-4, with -z
+cp "$SRC/check/check.png" check.png
+cp "$SRC/check/check_alpha.png" check_alpha.png
+for img in check.png check_alpha.png; do
+    for bits in 1 2 3 4; do
+        for opts in "" "-z 9"; do
+            rm -f out.bin
+            if "$BIN" -bits $bits $opts -e $img binary.bin enc.png > /dev/null 2>&1 &&
+                "$BIN" -d enc.png -out out.bin > /dev/null 2>&1 && cmp -s out.bin binary.bin; then
+                ok
+            else
+                fail "-bits $bits $opts -e/-d $img"
+            fi
+        done
+    done
+    if "$BIN" -g $img gray.png > /dev/null 2>&1; then
+        ok
+    else
+        fail "-g $img"
+    fi
+done
+
+# errors that must not pass for a message
+expect_error()
+{
+    what=$1
+    shift
+    if "$@" > /dev/null 2>&1; then
+        fail "$what succeeded"
+    else
+        ok
+    fi
+}
+"$BIN" -key pass -e flower.bmp text.txt keyed.bmp > /dev/null 2>&1
+expect_error "-d with a wrong key" "$BIN" -key other -d keyed.bmp
+expect_error "-d without the key" "$BIN" -d keyed.bmp
+expect_error "-d on a JPEG without a message" "$BIN" -d check.jpg
+expect_error "-d on a PNG without a message" "$BIN" -d check.png
+
+echo "check: $passed passed, $failed failed (LSB kernels: $lsb_kernels; grayscale kernels: $gray_kernels)"
+[ $failed -eq 0 ]
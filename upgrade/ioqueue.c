@@ -0,0 +1,456 @@
+// ioqueue.c
+//
+// Asynchronous reads and writes for the batch pipeline (ioqueue.h). The
+// io_uring backend talks to the kernel through the raw system calls and the
+// shared rings (no liburing): requests go into the submission ring, one
+// io_uring_enter starts them all, and completions are read off the completion
+// ring. Where io_uring is missing or blocked (old kernels, seccomp, the
+// io_uring_disabled sysctl) the same interface is served by a few threads
+// that take requests off a queue and run pread/pwrite.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "ioqueue.h"
+
+#define IO_MAX_TRANSFER (1u << 30) // longest single request, callers continue short transfers
+#define IO_MAX_THREADS 16          // threads of the fallback backend (at most one per request in flight)
+
+typedef struct {
+    int write;
+    int fd;
+    void *buf;
+    size_t length;
+    uint64_t offset;
+    void *tag;
+} IoRequest;
+
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned unsubmitted; // SQEs filled in since the last io_uring_enter
+} Uring;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;      // requests became ready, or stop
+    pthread_cond_t done;      // a request completed
+    IoRequest *requests;      // ring of depth entries
+    unsigned head;            // next request for a thread
+    unsigned ready;           // submitted requests not taken yet
+    unsigned staged;          // queued requests behind them, not submitted yet
+    IoCompletion *completions; // ring of depth entries
+    unsigned completion_head;
+    unsigned completion_count;
+    int stop;
+    int thread_count;
+    pthread_t threads[IO_MAX_THREADS];
+} IoThreads;
+
+struct IoQueue {
+    unsigned depth;
+    unsigned pending; // queued or in flight, not reaped
+    IoBackend backend;
+    Uring uring;
+    IoThreads threads;
+};
+
+// ---------------------------------------------------------------------------
+// io_uring backend
+// ---------------------------------------------------------------------------
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_setup(Uring *ring, unsigned depth)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+    {
+        size_t size = ring->sq_ring_size > ring->cq_ring_size ? ring->sq_ring_size : ring->cq_ring_size;
+        ring->sq_ring_size = ring->cq_ring_size = size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = single || ring->sq_ring == MAP_FAILED
+                        ? ring->sq_ring
+                        : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                               IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = ring->cq_ring == MAP_FAILED
+                     ? (struct io_uring_sqe *)MAP_FAILED
+                     : (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                                   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if (ring->sq_ring != MAP_FAILED)
+        {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        close(ring->fd);
+        return -1;
+    }
+
+    unsigned char *sq = (unsigned char *)ring->sq_ring;
+    unsigned char *cq = (unsigned char *)ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(Uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// only this thread writes the tail, the kernel reads it after the release store
+static void uring_queue(Uring *ring, const IoRequest *request)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = request->fd;
+    sqe->addr = (uint64_t)(uintptr_t)request->buf;
+    sqe->len = (uint32_t)request->length;
+    sqe->off = request->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)request->tag;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+}
+
+static void uring_submit(Uring *ring)
+{
+    while (ring->unsubmitted > 0)
+    {
+        int submitted = uring_enter(ring->fd, ring->unsubmitted, 0, 0);
+        if (submitted < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return; // the SQEs stay in the ring for the next submit or wait
+        }
+        ring->unsubmitted -= (unsigned)submitted;
+    }
+}
+
+static int uring_reap(Uring *ring, IoCompletion *completions, int max, int wait)
+{
+    for (;;)
+    {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        int count = 0;
+        while (head != tail && count < max)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            completions[count].tag = (void *)(uintptr_t)cqe->user_data;
+            completions[count].result = cqe->res;
+            count++;
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (count > 0 || !wait)
+        {
+            return count;
+        }
+        // submits whatever is still queued and sleeps until something completes
+        int entered = uring_enter(ring->fd, ring->unsubmitted, 1, IORING_ENTER_GETEVENTS);
+        if (entered > 0)
+        {
+            ring->unsubmitted -= (unsigned)entered;
+        }
+        else if (entered < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// fallback: threads doing pread/pwrite
+// ---------------------------------------------------------------------------
+
+static void *io_thread(void *arg)
+{
+    IoQueue *queue = (IoQueue *)arg;
+    IoThreads *t = &queue->threads;
+    pthread_mutex_lock(&t->lock);
+    for (;;)
+    {
+        while (t->ready == 0 && !t->stop)
+        {
+            pthread_cond_wait(&t->work, &t->lock);
+        }
+        if (t->ready == 0)
+        {
+            break; // stop
+        }
+        IoRequest request = t->requests[t->head];
+        t->head = (t->head + 1) % queue->depth;
+        t->ready--;
+        pthread_mutex_unlock(&t->lock);
+
+        ssize_t n;
+        do
+        {
+            n = request.write ? pwrite(request.fd, request.buf, request.length, (off_t)request.offset)
+                              : pread(request.fd, request.buf, request.length, (off_t)request.offset);
+        } while (n < 0 && errno == EINTR);
+        IoCompletion completion = {request.tag, n < 0 ? -(int64_t)errno : (int64_t)n};
+
+        pthread_mutex_lock(&t->lock);
+        t->completions[(t->completion_head + t->completion_count) % queue->depth] = completion;
+        t->completion_count++;
+        pthread_cond_signal(&t->done);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+static int threads_start(IoQueue *queue)
+{
+    IoThreads *t = &queue->threads;
+    memset(t, 0, sizeof(*t));
+    t->requests = (IoRequest *)calloc(queue->depth, sizeof(IoRequest));
+    t->completions = (IoCompletion *)calloc(queue->depth, sizeof(IoCompletion));
+    if (t->requests == NULL || t->completions == NULL)
+    {
+        free(t->requests);
+        free(t->completions);
+        return -1;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->work, NULL);
+    pthread_cond_init(&t->done, NULL);
+    int wanted = queue->depth < IO_MAX_THREADS ? (int)queue->depth : IO_MAX_THREADS;
+    while (t->thread_count < wanted && pthread_create(&t->threads[t->thread_count], NULL, io_thread, queue) == 0)
+    {
+        t->thread_count++;
+    }
+    return t->thread_count > 0 ? 0 : -1;
+}
+
+static void threads_stop(IoQueue *queue)
+{
+    IoThreads *t = &queue->threads;
+    pthread_mutex_lock(&t->lock);
+    t->stop = 1;
+    pthread_cond_broadcast(&t->work);
+    pthread_mutex_unlock(&t->lock);
+    for (int i = 0; i < t->thread_count; i++)
+    {
+        pthread_join(t->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->work);
+    pthread_cond_destroy(&t->done);
+    free(t->requests);
+    free(t->completions);
+}
+
+static int threads_reap(IoQueue *queue, IoCompletion *completions, int max, int wait)
+{
+    IoThreads *t = &queue->threads;
+    pthread_mutex_lock(&t->lock);
+    while (wait && t->completion_count == 0)
+    {
+        pthread_cond_wait(&t->done, &t->lock);
+    }
+    int count = 0;
+    while (t->completion_count > 0 && count < max)
+    {
+        completions[count++] = t->completions[t->completion_head];
+        t->completion_head = (t->completion_head + 1) % queue->depth;
+        t->completion_count--;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return count;
+}
+
+// ---------------------------------------------------------------------------
+// interface
+// ---------------------------------------------------------------------------
+
+IoQueue *io_queue_create(unsigned depth, IoBackend backend)
+{
+    IoQueue *queue = (IoQueue *)calloc(1, sizeof(IoQueue));
+    if (queue == NULL || depth == 0)
+    {
+        fprintf(stderr, "Error: I/O queue setup failed\n");
+        free(queue);
+        return NULL;
+    }
+    queue->depth = depth;
+    queue->backend = IO_BACKEND_URING;
+    if (backend != IO_BACKEND_THREADS && uring_setup(&queue->uring, depth) == 0)
+    {
+        return queue;
+    }
+    if (backend == IO_BACKEND_URING)
+    {
+        fprintf(stderr, "Error: io_uring is not available (%s)\n", strerror(errno));
+        free(queue);
+        return NULL;
+    }
+    queue->backend = IO_BACKEND_THREADS;
+    if (threads_start(queue) != 0)
+    {
+        fprintf(stderr, "Error: I/O queue setup failed\n");
+        free(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+void io_queue_destroy(IoQueue *queue)
+{
+    if (queue == NULL)
+    {
+        return;
+    }
+    io_queue_submit(queue);
+    IoCompletion completions[16];
+    while (queue->pending > 0)
+    {
+        int count = io_queue_reap(queue, completions, 16, 1);
+        if (count < 0)
+        {
+            break;
+        }
+    }
+    if (queue->backend == IO_BACKEND_URING)
+    {
+        uring_teardown(&queue->uring);
+    }
+    else
+    {
+        threads_stop(queue);
+    }
+    free(queue);
+}
+
+const char *io_queue_backend_name(const IoQueue *queue)
+{
+    return queue->backend == IO_BACKEND_URING ? "io_uring" : "pread/pwrite threads";
+}
+
+static int io_queue_add(IoQueue *queue, int write, int fd, void *buf, size_t length, uint64_t offset, void *tag)
+{
+    if (queue->pending >= queue->depth)
+    {
+        return -1;
+    }
+    IoRequest request = {write, fd, buf, length < IO_MAX_TRANSFER ? length : IO_MAX_TRANSFER, offset, tag};
+    if (queue->backend == IO_BACKEND_URING)
+    {
+        uring_queue(&queue->uring, &request);
+    }
+    else
+    {
+        IoThreads *t = &queue->threads;
+        pthread_mutex_lock(&t->lock);
+        t->requests[(t->head + t->ready + t->staged) % queue->depth] = request;
+        t->staged++;
+        pthread_mutex_unlock(&t->lock);
+    }
+    queue->pending++;
+    return 0;
+}
+
+int io_queue_read(IoQueue *queue, int fd, void *buf, size_t length, uint64_t offset, void *tag)
+{
+    return io_queue_add(queue, 0, fd, buf, length, offset, tag);
+}
+
+int io_queue_write(IoQueue *queue, int fd, const void *buf, size_t length, uint64_t offset, void *tag)
+{
+    return io_queue_add(queue, 1, fd, (void *)buf, length, offset, tag);
+}
+
+void io_queue_submit(IoQueue *queue)
+{
+    if (queue->backend == IO_BACKEND_URING)
+    {
+        uring_submit(&queue->uring);
+        return;
+    }
+    IoThreads *t = &queue->threads;
+    pthread_mutex_lock(&t->lock);
+    if (t->staged > 0)
+    {
+        t->ready += t->staged;
+        t->staged = 0;
+        pthread_cond_broadcast(&t->work);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+int io_queue_reap(IoQueue *queue, IoCompletion *completions, int max, int wait)
+{
+    if (queue->pending == 0)
+    {
+        return 0;
+    }
+    if (wait)
+    {
+        io_queue_submit(queue); // nothing would ever complete otherwise
+    }
+    int count = queue->backend == IO_BACKEND_URING ? uring_reap(&queue->uring, completions, max, wait)
+                                                   : threads_reap(queue, completions, max, wait);
+    if (count > 0)
+    {
+        queue->pending -= (unsigned)count;
+    }
+    return count;
+}
+
+unsigned io_queue_pending(const IoQueue *queue)
+{
+    return queue->pending;
+}
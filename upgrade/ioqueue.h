@@ -0,0 +1,57 @@
+// ioqueue.h
+#ifndef IOQUEUE_H
+#define IOQUEUE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ---------------------------------------------------------------------------
+// asynchronous reads and writes at file offsets, up to a fixed number in
+// flight: io_uring where the kernel allows it, otherwise a set of threads
+// doing pread/pwrite. Requests are queued, submitted together, and come back
+// in completion order with the caller's tag.
+// ---------------------------------------------------------------------------
+
+#define IO_MAX_DEPTH 4096          // most requests in flight
+
+typedef enum {
+  IO_BACKEND_AUTO = 0,        // io_uring, or threads if io_uring_setup fails
+  IO_BACKEND_URING,
+  IO_BACKEND_THREADS
+} IoBackend;
+
+typedef struct {
+  void*     tag;              // as passed to io_queue_read / io_queue_write
+  int64_t   result;           // bytes transferred (may be short), or -errno
+} IoCompletion;
+
+typedef struct IoQueue IoQueue;
+
+// queue of depth requests in flight; errors go to stderr, NULL on failure
+IoQueue *io_queue_create(unsigned depth, IoBackend backend);
+void io_queue_destroy(IoQueue *queue); // waits for the requests in flight
+const char *io_queue_backend_name(const IoQueue *queue);
+
+// queue one request (0, or -1 if depth requests are already queued or in flight)
+int io_queue_read(IoQueue *queue, int fd, void *buf, size_t length, uint64_t offset, void *tag);
+int io_queue_write(IoQueue *queue, int fd, const void *buf, size_t length, uint64_t offset, void *tag);
+
+// start the queued requests
+void io_queue_submit(IoQueue *queue);
+
+// up to max completions; wait = 0 only takes those already there, otherwise blocks for at least one
+int io_queue_reap(IoQueue *queue, IoCompletion *completions, int max, int wait);
+
+// requests queued or in flight
+unsigned io_queue_pending(const IoQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IOQUEUE_H
@@ -0,0 +1,1153 @@
+// jpeg.c
+//
+// Baseline JPEG carrier: the scans are entropy-decoded to quantized DCT
+// coefficients, the message goes into coefficient LSBs, and the scans are
+// Huffman-coded again. There is no IDCT or colour conversion, so the cost
+// stays close to entropy-coding speed and the image suffers no generation
+// loss. All other segments (APPn, DQT, SOF, DHT, DRI, COM, ...) are copied
+// byte for byte.
+//
+// A scan is re-encoded with the Huffman tables it was decoded with when they
+// still cover every symbol. Embedding can move a coefficient into another
+// magnitude category (-1 <-> -2) whose symbol an optimized table may lack; such
+// a scan gets optimal tables (ITU T.81 Annex K.2) in a DHT segment written
+// right before its SOS.
+
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "jpeg.h"
+
+#define JPEG_LOOKUP_BITS 9       // Huffman codes up to this length are decoded with one table lookup
+#define JPEG_WRITE_BUFFER (1 << 16)
+
+typedef struct {
+    int defined;
+    uint8_t bits[17];            // number of codes of each length 1..16
+    uint8_t values[256];         // symbols in code order
+    int count;                   // symbols
+    int32_t maxcode[18];         // largest code of each length, -1 if none
+    int32_t valoffset[17];       // index into values minus the first code of each length
+    uint16_t lookup[1 << JPEG_LOOKUP_BITS]; // length << 8 | symbol for short codes, 0 for longer ones
+    uint16_t code[256];          // encoding: code of each symbol
+    uint8_t size[256];           // encoding: code length of each symbol, 0 if it has none
+} JPEGHuffman;
+
+// the Huffman tables (DC = class 0, AC = class 1) and restart interval in force
+typedef struct {
+    JPEGHuffman table[2][4];
+    int restart_interval;
+} JPEGTables;
+
+typedef struct {
+    int count;                   // components in the scan
+    int comp[JPEG_MAX_COMPONENTS];     // index into JPEGImage.component
+    int dc_table[JPEG_MAX_COMPONENTS];
+    int ac_table[JPEG_MAX_COMPONENTS];
+} JPEGScan;
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    uint64_t bits;               // bit buffer, next bit in the top position
+    int count;                   // valid bits in bits
+    int marker;                  // marker the reader stopped at, 0 if none
+} BitReader;
+
+typedef struct {
+    FILE *file;
+    unsigned char buf[JPEG_WRITE_BUFFER + 16];
+    size_t len;
+    uint64_t bits;               // pending bits, right aligned
+    int count;                   // pending bit count
+    int error;
+} BitWriter;
+
+// ---------------------------------------------------------------------------
+// Huffman tables
+// ---------------------------------------------------------------------------
+
+// derive the decoding and encoding tables from bits/values, returns 0 if they are consistent
+static int build_huffman(JPEGHuffman *t)
+{
+    int32_t code = 0;
+    int k = 0;
+
+    memset(t->lookup, 0, sizeof(t->lookup));
+    memset(t->size, 0, sizeof(t->size));
+    for (int len = 1; len <= 16; len++)
+    {
+        t->valoffset[len] = k - code;
+        for (int i = 0; i < t->bits[len]; i++, k++, code++)
+        {
+            uint8_t symbol = t->values[k];
+            t->code[symbol] = (uint16_t)code;
+            t->size[symbol] = (uint8_t)len;
+            if (len <= JPEG_LOOKUP_BITS)
+            {
+                int shift = JPEG_LOOKUP_BITS - len;
+                for (int fill = 0; fill < (1 << shift); fill++)
+                {
+                    t->lookup[(code << shift) | fill] = (uint16_t)(len << 8 | symbol);
+                }
+            }
+        }
+        t->maxcode[len] = t->bits[len] > 0 ? code - 1 : -1;
+        if (code > (1 << len))
+        {
+            return 2; // more codes than fit in len bits
+        }
+        code <<= 1;
+    }
+    t->maxcode[17] = INT32_MAX;
+    t->count = k;
+    t->defined = 1;
+    return 0;
+}
+
+// optimal code lengths for the symbol counts (ITU T.81 Annex K.2)
+static void build_optimal_huffman(const long counts[256], JPEGHuffman *t)
+{
+    long freq[257];
+    int codesize[257];
+    int others[257];
+    int bits[33];
+
+    memcpy(freq, counts, 256 * sizeof(long));
+    freq[256] = 1; // reserved, so that no code is all ones
+    for (int i = 0; i < 257; i++)
+    {
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+
+    for (;;)
+    {
+        // the two least frequent symbols, ties go to the larger value
+        int c1 = -1;
+        int c2 = -1;
+        long v = LONG_MAX;
+        for (int i = 0; i <= 256; i++)
+        {
+            if (freq[i] != 0 && freq[i] <= v)
+            {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+        v = LONG_MAX;
+        for (int i = 0; i <= 256; i++)
+        {
+            if (freq[i] != 0 && freq[i] <= v && i != c1)
+            {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0)
+        {
+            break;
+        }
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codesize[c1]++;
+        while (others[c1] >= 0)
+        {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0)
+        {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    memset(bits, 0, sizeof(bits));
+    for (int i = 0; i <= 256; i++)
+    {
+        if (codesize[i] != 0)
+        {
+            bits[codesize[i]]++;
+        }
+    }
+
+    // limit code lengths to 16 bits
+    for (int i = 32; i > 16; i--)
+    {
+        while (bits[i] > 0)
+        {
+            int j = i - 2;
+            while (bits[j] == 0)
+            {
+                j--;
+            }
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+    // drop the reserved symbol from the longest codes
+    int longest = 16;
+    while (bits[longest] == 0)
+    {
+        longest--;
+    }
+    bits[longest]--;
+
+    memset(t, 0, sizeof(*t));
+    for (int len = 1; len <= 16; len++)
+    {
+        t->bits[len] = (uint8_t)bits[len];
+    }
+    int k = 0;
+    for (int len = 1; len <= 32; len++)
+    {
+        for (int symbol = 0; symbol < 256; symbol++)
+        {
+            if (codesize[symbol] == len)
+            {
+                t->values[k++] = (uint8_t)symbol;
+            }
+        }
+    }
+    build_huffman(t);
+}
+
+// ---------------------------------------------------------------------------
+// segment parsing
+// ---------------------------------------------------------------------------
+
+static unsigned read_u16(const unsigned char *p)
+{
+    return (unsigned)p[0] << 8 | p[1];
+}
+
+// DHT segment body into tables
+static int parse_dht(const unsigned char *p, size_t length, JPEGTables *tables)
+{
+    while (length > 0)
+    {
+        if (length < 17)
+        {
+            return 2; // Invalid Arguments
+        }
+        int table_class = p[0] >> 4;
+        int id = p[0] & 15;
+        if (table_class > 1 || id > 3)
+        {
+            return 2; // Invalid Arguments
+        }
+        JPEGHuffman *t = &tables->table[table_class][id];
+        size_t count = 0;
+        for (int len = 1; len <= 16; len++)
+        {
+            t->bits[len] = p[len];
+            count += p[len];
+        }
+        if (count > 256 || length < 17 + count)
+        {
+            return 2; // Invalid Arguments
+        }
+        memcpy(t->values, p + 17, count);
+        if (build_huffman(t) != 0)
+        {
+            return 2; // Invalid Arguments
+        }
+        p += 17 + count;
+        length -= 17 + count;
+    }
+    return 0;
+}
+
+// SOF0/SOF1 body: frame size, components and the coefficient buffers
+static int parse_sof(const unsigned char *p, size_t length, JPEGImage *img)
+{
+    if (length < 6 || p[0] != 8)
+    {
+        return 2; // Invalid Arguments (only 8-bit samples)
+    }
+    img->height = (int)read_u16(p + 1);
+    img->width = (int)read_u16(p + 3);
+    img->component_count = p[5];
+    if (img->width == 0 || img->height == 0 || img->component_count < 1 ||
+        img->component_count > JPEG_MAX_COMPONENTS || length < 6 + 3 * (size_t)img->component_count)
+    {
+        return 2; // Invalid Arguments
+    }
+
+    img->h_max = 1;
+    img->v_max = 1;
+    for (int c = 0; c < img->component_count; c++)
+    {
+        JPEGComponent *comp = &img->component[c];
+        comp->id = p[6 + 3 * c];
+        comp->h = p[7 + 3 * c] >> 4;
+        comp->v = p[7 + 3 * c] & 15;
+        comp->tq = p[8 + 3 * c];
+        if (comp->h < 1 || comp->h > 4 || comp->v < 1 || comp->v > 4)
+        {
+            return 2; // Invalid Arguments
+        }
+        img->h_max = comp->h > img->h_max ? comp->h : img->h_max;
+        img->v_max = comp->v > img->v_max ? comp->v : img->v_max;
+    }
+    img->mcus_x = (img->width + 8 * img->h_max - 1) / (8 * img->h_max);
+    img->mcus_y = (img->height + 8 * img->v_max - 1) / (8 * img->v_max);
+
+    for (int c = 0; c < img->component_count; c++)
+    {
+        JPEGComponent *comp = &img->component[c];
+        comp->blocks_w = img->mcus_x * comp->h;
+        comp->blocks_h = img->mcus_y * comp->v;
+        comp->coef = (int16_t *)calloc((size_t)comp->blocks_w * comp->blocks_h * 64, sizeof(int16_t));
+        if (comp->coef == NULL)
+        {
+            return 3; // Memory Allocation Failure
+        }
+    }
+    return 0;
+}
+
+// SOS body, checked against the frame and the tables in force
+static int parse_sos(const unsigned char *p, size_t length, const JPEGImage *img, const JPEGTables *tables, JPEGScan *scan)
+{
+    if (length < 1)
+    {
+        return 2; // Invalid Arguments
+    }
+    scan->count = p[0];
+    if (scan->count < 1 || scan->count > img->component_count || length != 4 + 2 * (size_t)scan->count)
+    {
+        return 2; // Invalid Arguments
+    }
+    int blocks_per_mcu = 0;
+    for (int i = 0; i < scan->count; i++)
+    {
+        int c = 0;
+        while (c < img->component_count && img->component[c].id != p[1 + 2 * i])
+        {
+            c++;
+        }
+        if (c == img->component_count)
+        {
+            return 2; // Invalid Arguments
+        }
+        scan->comp[i] = c;
+        scan->dc_table[i] = p[2 + 2 * i] >> 4;
+        scan->ac_table[i] = p[2 + 2 * i] & 15;
+        if (scan->dc_table[i] > 3 || scan->ac_table[i] > 3 || !tables->table[0][scan->dc_table[i]].defined ||
+            !tables->table[1][scan->ac_table[i]].defined)
+        {
+            return 2; // Invalid Arguments
+        }
+        blocks_per_mcu += img->component[c].h * img->component[c].v;
+    }
+    // spectral selection and successive approximation are fixed in sequential mode
+    const unsigned char *tail = p + 1 + 2 * scan->count;
+    if (tail[0] != 0 || tail[1] != 63 || tail[2] != 0 || (scan->count > 1 && blocks_per_mcu > 10))
+    {
+        return 2; // Invalid Arguments
+    }
+    return 0;
+}
+
+// offset of the marker that ends the entropy-coded data starting at pos (RSTn are part of it)
+static size_t find_scan_end(const unsigned char *data, size_t size, size_t pos)
+{
+    for (; pos + 1 < size; pos++)
+    {
+        if (data[pos] == 0xFF && data[pos + 1] != 0x00 && data[pos + 1] != 0xFF &&
+            (data[pos + 1] < 0xD0 || data[pos + 1] > 0xD7))
+        {
+            return pos;
+        }
+    }
+    return size;
+}
+
+// ---------------------------------------------------------------------------
+// entropy decoding
+// ---------------------------------------------------------------------------
+
+static void bit_fill(BitReader *br)
+{
+    while (br->count <= 56)
+    {
+        unsigned byte = 0; // past a marker the data is padded with zeros
+        if (br->marker == 0 && br->pos < br->size)
+        {
+            byte = br->data[br->pos];
+            if (byte == 0xFF)
+            {
+                unsigned next = br->pos + 1 < br->size ? br->data[br->pos + 1] : 0xD9;
+                if (next == 0x00)
+                {
+                    br->pos += 2; // stuffed zero byte
+                }
+                else
+                {
+                    br->marker = (int)next;
+                    byte = 0;
+                }
+            }
+            else
+            {
+                br->pos++;
+            }
+        }
+        br->bits |= (uint64_t)byte << (56 - br->count);
+        br->count += 8;
+    }
+}
+
+static inline void bit_skip(BitReader *br, int n)
+{
+    br->bits <<= n;
+    br->count -= n;
+}
+
+// next Huffman symbol, -1 for a code the table does not have
+static inline int decode_symbol(BitReader *br, const JPEGHuffman *t)
+{
+    if (br->count < 16)
+    {
+        bit_fill(br);
+    }
+    unsigned entry = t->lookup[br->bits >> (64 - JPEG_LOOKUP_BITS)];
+    if (entry != 0)
+    {
+        bit_skip(br, (int)(entry >> 8));
+        return (int)(entry & 0xFF);
+    }
+    for (int len = JPEG_LOOKUP_BITS + 1; len <= 16; len++)
+    {
+        int32_t code = (int32_t)(br->bits >> (64 - len));
+        if (code <= t->maxcode[len])
+        {
+            bit_skip(br, len);
+            return t->values[t->valoffset[len] + code];
+        }
+    }
+    return -1;
+}
+
+// s additional bits as a signed value (ITU T.81 F.2.2.1 EXTEND)
+static inline int receive_extend(BitReader *br, int s)
+{
+    if (s == 0)
+    {
+        return 0;
+    }
+    if (br->count < s)
+    {
+        bit_fill(br);
+    }
+    int value = (int)(br->bits >> (64 - s));
+    bit_skip(br, s);
+    return value < (1 << (s - 1)) ? value - (1 << s) + 1 : value;
+}
+
+static int decode_block(BitReader *br, int16_t *block, const JPEGHuffman *dc, const JPEGHuffman *ac, int *pred)
+{
+    int s = decode_symbol(br, dc);
+    if (s < 0 || s > 11)
+    {
+        return 2; // Invalid Arguments
+    }
+    *pred += receive_extend(br, s);
+    block[0] = (int16_t)*pred;
+
+    for (int k = 1; k < 64;)
+    {
+        int rs = decode_symbol(br, ac);
+        if (rs < 0)
+        {
+            return 2; // Invalid Arguments
+        }
+        int run = rs >> 4;
+        s = rs & 15;
+        if (s == 0)
+        {
+            if (run != 15)
+            {
+                break; // EOB
+            }
+            k += 16; // ZRL
+            continue;
+        }
+        k += run;
+        if (k > 63)
+        {
+            return 2; // Invalid Arguments
+        }
+        block[k++] = (int16_t)receive_extend(br, s);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// entropy encoding
+// ---------------------------------------------------------------------------
+
+static void bit_flush_buffer(BitWriter *bw)
+{
+    if (bw->len > 0 && fwrite(bw->buf, 1, bw->len, bw->file) != bw->len)
+    {
+        bw->error = 1;
+    }
+    bw->len = 0;
+}
+
+static inline void bit_put(BitWriter *bw, uint32_t code, int size)
+{
+    bw->bits = bw->bits << size | (code & ((1u << size) - 1));
+    bw->count += size;
+    while (bw->count >= 8)
+    {
+        unsigned char byte = (unsigned char)(bw->bits >> (bw->count - 8));
+        bw->count -= 8;
+        bw->buf[bw->len++] = byte;
+        if (byte == 0xFF)
+        {
+            bw->buf[bw->len++] = 0x00; // byte stuffing
+        }
+    }
+    if (bw->len >= JPEG_WRITE_BUFFER)
+    {
+        bit_flush_buffer(bw);
+    }
+}
+
+// pad the last byte with ones (ITU T.81 F.1.2.3)
+static void bit_align(BitWriter *bw)
+{
+    if (bw->count > 0)
+    {
+        bit_put(bw, 0x7F, 8 - bw->count);
+    }
+}
+
+static void put_marker(BitWriter *bw, int marker)
+{
+    bw->buf[bw->len++] = 0xFF;
+    bw->buf[bw->len++] = (unsigned char)marker;
+}
+
+// number of bits of |value|
+static inline int magnitude_bits(int value)
+{
+    unsigned magnitude = (unsigned)(value < 0 ? -value : value);
+    return magnitude == 0 ? 0 : 32 - __builtin_clz(magnitude);
+}
+
+// counts (bw == NULL) or writes the symbols of one block
+static void encode_block(BitWriter *bw, const int16_t *block, const JPEGHuffman *dc, const JPEGHuffman *ac, int *pred,
+                         long *dc_counts, long *ac_counts)
+{
+    int diff = block[0] - *pred;
+    *pred = block[0];
+    int s = magnitude_bits(diff);
+    if (bw == NULL)
+    {
+        dc_counts[s]++;
+    }
+    else
+    {
+        bit_put(bw, dc->code[s], dc->size[s]);
+        bit_put(bw, (uint32_t)(diff < 0 ? diff - 1 : diff), s);
+    }
+
+    int run = 0;
+    for (int k = 1; k < 64; k++)
+    {
+        int value = block[k];
+        if (value == 0)
+        {
+            run++;
+            continue;
+        }
+        for (; run > 15; run -= 16)
+        {
+            if (bw == NULL)
+            {
+                ac_counts[0xF0]++;
+            }
+            else
+            {
+                bit_put(bw, ac->code[0xF0], ac->size[0xF0]);
+            }
+        }
+        s = magnitude_bits(value);
+        int rs = run << 4 | s;
+        if (bw == NULL)
+        {
+            ac_counts[rs]++;
+        }
+        else
+        {
+            bit_put(bw, ac->code[rs], ac->size[rs]);
+            bit_put(bw, (uint32_t)(value < 0 ? value - 1 : value), s);
+        }
+        run = 0;
+    }
+    if (run > 0)
+    {
+        if (bw == NULL)
+        {
+            ac_counts[0x00]++;
+        }
+        else
+        {
+            bit_put(bw, ac->code[0x00], ac->size[0x00]);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// scans
+//
+// One loop walks the MCUs of a scan for decoding, counting symbols and
+// encoding, so the three always agree on block order and restart intervals.
+// ---------------------------------------------------------------------------
+
+typedef enum {
+    SCAN_DECODE,
+    SCAN_COUNT,
+    SCAN_ENCODE
+} ScanMode;
+
+typedef struct {
+    ScanMode mode;
+    BitReader *reader;           // SCAN_DECODE
+    BitWriter *writer;           // SCAN_ENCODE
+    long (*counts)[4][256];      // SCAN_COUNT: counts[class][table][symbol]
+} ScanCoder;
+
+// blocks a scan codes: a single component block by block over its own size,
+// several components in whole MCUs
+static void scan_blocks(const JPEGImage *img, const JPEGScan *scan, int *mcus_x, int *mcus_y)
+{
+    const JPEGComponent *first = &img->component[scan->comp[0]];
+
+    *mcus_x = img->mcus_x;
+    *mcus_y = img->mcus_y;
+    if (scan->count == 1)
+    {
+        *mcus_x = ((img->width * first->h + img->h_max - 1) / img->h_max + 7) / 8;
+        *mcus_y = ((img->height * first->v + img->v_max - 1) / img->v_max + 7) / 8;
+    }
+}
+
+// decode (into the coefficients), count or encode the blocks of one scan
+static int code_scan(const JPEGImage *img, const JPEGScan *scan, const JPEGTables *tables, ScanCoder *coder)
+{
+    int pred[JPEG_MAX_COMPONENTS] = {0};
+    int restart_interval = tables->restart_interval;
+    int next_restart = 0;
+    int mcus_x;
+    int mcus_y;
+
+    scan_blocks(img, scan, &mcus_x, &mcus_y);
+
+    long mcu_count = (long)mcus_x * mcus_y;
+    for (long mcu = 0; mcu < mcu_count; mcu++)
+    {
+        if (restart_interval > 0 && mcu > 0 && mcu % restart_interval == 0)
+        {
+            memset(pred, 0, sizeof(pred));
+            if (coder->mode == SCAN_DECODE)
+            {
+                BitReader *br = coder->reader;
+                br->bits = 0;
+                br->count = 0;
+                if (br->marker == 0)
+                {
+                    // the reader has not prefetched up to the marker yet
+                    while (br->pos + 1 < br->size && !(br->data[br->pos] == 0xFF && br->data[br->pos + 1] != 0x00))
+                    {
+                        br->pos++;
+                    }
+                    br->marker = br->pos + 1 < br->size ? br->data[br->pos + 1] : 0;
+                }
+                if (br->marker != 0xD0 + next_restart)
+                {
+                    return 2; // Invalid Arguments
+                }
+                br->pos += 2;
+                br->marker = 0;
+            }
+            else if (coder->mode == SCAN_ENCODE)
+            {
+                bit_align(coder->writer);
+                put_marker(coder->writer, 0xD0 + next_restart);
+            }
+            next_restart = (next_restart + 1) & 7;
+        }
+
+        int mx = (int)(mcu % mcus_x);
+        int my = (int)(mcu / mcus_x);
+        for (int i = 0; i < scan->count; i++)
+        {
+            const JPEGComponent *comp = &img->component[scan->comp[i]];
+            const JPEGHuffman *dc = &tables->table[0][scan->dc_table[i]];
+            const JPEGHuffman *ac = &tables->table[1][scan->ac_table[i]];
+            int h_blocks = scan->count == 1 ? 1 : comp->h;
+            int v_blocks = scan->count == 1 ? 1 : comp->v;
+
+            for (int v = 0; v < v_blocks; v++)
+            {
+                for (int h = 0; h < h_blocks; h++)
+                {
+                    size_t bx = (size_t)mx * h_blocks + h;
+                    size_t by = (size_t)my * v_blocks + v;
+                    int16_t *block = comp->coef + (by * comp->blocks_w + bx) * 64;
+                    if (coder->mode == SCAN_DECODE)
+                    {
+                        if (decode_block(coder->reader, block, dc, ac, &pred[i]) != 0)
+                        {
+                            return 2; // Invalid Arguments
+                        }
+                    }
+                    else if (coder->mode == SCAN_COUNT)
+                    {
+                        encode_block(NULL, block, dc, ac, &pred[i], coder->counts[0][scan->dc_table[i]],
+                                     coder->counts[1][scan->ac_table[i]]);
+                    }
+                    else
+                    {
+                        encode_block(coder->writer, block, dc, ac, &pred[i], NULL, NULL);
+                    }
+                }
+            }
+        }
+    }
+
+    if (coder->mode == SCAN_ENCODE)
+    {
+        bit_align(coder->writer);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// files
+// ---------------------------------------------------------------------------
+
+// 1 if the file starts with a JPEG SOI marker
+int is_jpeg_file(const char *filename)
+{
+    unsigned char magic[3];
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    int is_jpeg = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && magic[0] == 0xFF && magic[1] == 0xD8 &&
+                  magic[2] == 0xFF;
+    fclose(file);
+    return is_jpeg;
+}
+
+void free_jpeg_image(JPEGImage *img)
+{
+    if (img != NULL)
+    {
+        for (int c = 0; c < JPEG_MAX_COMPONENTS; c++)
+        {
+            free(img->component[c].coef);
+            img->component[c].coef = NULL;
+        }
+        free(img->file);
+        img->file = NULL;
+    }
+}
+
+static int jpeg_format_error(JPEGImage *img, int code)
+{
+    if (code == 3)
+    {
+        fprintf(stderr, "Error: image data memory allocation failed\n");
+    }
+    else
+    {
+        fprintf(stderr, "Error: This operation only supports baseline Huffman-coded JPEG\n");
+    }
+    free_jpeg_image(img);
+    return code;
+}
+
+// read JPEG file and entropy-decode its scans into quantized DCT coefficients
+int read_jpeg(const char *filename, JPEGImage *img)
+{
+    memset(img, 0, sizeof(*img));
+
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", filename);
+        return 1; // File Not Found
+    }
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || st.st_size < 4)
+    {
+        fprintf(stderr, "Error: reading JPEG data failed\n");
+        fclose(file);
+        return 1; // File Not Found
+    }
+    img->file_size = (size_t)st.st_size;
+    img->file = (unsigned char *)malloc(img->file_size);
+    if (img->file == NULL)
+    {
+        fprintf(stderr, "Error: image data memory allocation failed\n");
+        fclose(file);
+        return 3; // Memory Allocation Failure
+    }
+    if (fread(img->file, 1, img->file_size, file) != img->file_size)
+    {
+        fprintf(stderr, "Error: reading JPEG data failed\n");
+        fclose(file);
+        free_jpeg_image(img);
+        return 1; // File Not Found
+    }
+    fclose(file);
+
+    const unsigned char *data = img->file;
+    size_t size = img->file_size;
+    if (data[0] != 0xFF || data[1] != 0xD8)
+    {
+        fprintf(stderr, "Error: File is not a valid JPEG format (magic number 0x%02X%02X)\n", data[0], data[1]);
+        free_jpeg_image(img);
+        return 2; // Invalid Arguments
+    }
+
+    JPEGTables tables;
+    memset(&tables, 0, sizeof(tables));
+    int have_frame = 0;
+    int scans = 0;
+    size_t pos = 2;
+    while (pos + 4 <= size)
+    {
+        if (data[pos] != 0xFF)
+        {
+            return jpeg_format_error(img, 2);
+        }
+        int marker = data[pos + 1];
+        if (marker == 0xFF)
+        {
+            pos++; // fill byte
+            continue;
+        }
+        if (marker == 0xD9)
+        {
+            break; // EOI
+        }
+        size_t length = read_u16(data + pos + 2);
+        if (length < 2 || pos + 2 + length > size)
+        {
+            return jpeg_format_error(img, 2);
+        }
+        const unsigned char *body = data + pos + 4;
+        size_t body_length = length - 2;
+        int result = 0;
+
+        if (marker == 0xC0 || marker == 0xC1)
+        {
+            result = have_frame ? 2 : parse_sof(body, body_length, img);
+            have_frame = 1;
+        }
+        else if ((marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC))
+        {
+            result = 2; // progressive, lossless, hierarchical or arithmetic coded
+        }
+        else if (marker == 0xC4)
+        {
+            result = parse_dht(body, body_length, &tables);
+        }
+        else if (marker == 0xDD)
+        {
+            result = body_length == 2 ? 0 : 2;
+            tables.restart_interval = result == 0 ? (int)read_u16(body) : 0;
+        }
+        else if (marker == 0xDA)
+        {
+            JPEGScan scan;
+            result = have_frame ? parse_sos(body, body_length, img, &tables, &scan) : 2;
+            if (result == 0)
+            {
+                size_t start = pos + 2 + length;
+                size_t end = find_scan_end(data, size, start);
+                BitReader br = {data, end, start, 0, 0, 0};
+                ScanCoder coder = {SCAN_DECODE, &br, NULL, NULL};
+                result = code_scan(img, &scan, &tables, &coder);
+                pos = end;
+                // the carrier only uses blocks a scan actually codes
+                int mcus_x;
+                int mcus_y;
+                scan_blocks(img, &scan, &mcus_x, &mcus_y);
+                for (int i = 0; i < scan.count; i++)
+                {
+                    JPEGComponent *comp = &img->component[scan.comp[i]];
+                    comp->coded_w = scan.count == 1 ? mcus_x : comp->blocks_w;
+                    comp->coded_h = scan.count == 1 ? mcus_y : comp->blocks_h;
+                }
+                scans++;
+                if (result != 0)
+                {
+                    return jpeg_format_error(img, result);
+                }
+                continue;
+            }
+        }
+        if (result != 0)
+        {
+            return jpeg_format_error(img, result);
+        }
+        pos += 2 + length;
+    }
+
+    if (!have_frame || scans == 0)
+    {
+        return jpeg_format_error(img, 2);
+    }
+    return 0; // return 0 for success
+}
+
+static void copy_bytes(BitWriter *bw, const unsigned char *bytes, size_t length)
+{
+    bit_flush_buffer(bw);
+    if (length > 0 && fwrite(bytes, 1, length, bw->file) != length)
+    {
+        bw->error = 1;
+    }
+}
+
+// 1 if every symbol the scan needs has a code in the tables in force
+static int tables_cover(long counts[2][4][256], const JPEGTables *tables)
+{
+    for (int table_class = 0; table_class < 2; table_class++)
+    {
+        for (int id = 0; id < 4; id++)
+        {
+            for (int symbol = 0; symbol < 256; symbol++)
+            {
+                if (counts[table_class][id][symbol] != 0 && tables->table[table_class][id].size[symbol] == 0)
+                {
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+// replace the tables the scan uses with optimal ones and write them as a DHT segment
+static void write_optimal_tables(BitWriter *bw, long counts[2][4][256], JPEGTables *tables)
+{
+    unsigned char segment[4 + 4 * 2 * (17 + 256)];
+    size_t length = 4;
+
+    for (int table_class = 0; table_class < 2; table_class++)
+    {
+        for (int id = 0; id < 4; id++)
+        {
+            int used = 0;
+            for (int symbol = 0; symbol < 256; symbol++)
+            {
+                used |= counts[table_class][id][symbol] != 0;
+            }
+            if (!used)
+            {
+                continue;
+            }
+            JPEGHuffman *t = &tables->table[table_class][id];
+            build_optimal_huffman(counts[table_class][id], t);
+            segment[length++] = (unsigned char)(table_class << 4 | id);
+            memcpy(segment + length, t->bits + 1, 16);
+            memcpy(segment + length + 16, t->values, (size_t)t->count);
+            length += 16 + (size_t)t->count;
+        }
+    }
+    segment[0] = 0xFF;
+    segment[1] = 0xC4;
+    segment[2] = (unsigned char)((length - 2) >> 8);
+    segment[3] = (unsigned char)(length - 2);
+    copy_bytes(bw, segment, length);
+}
+
+// write JPEG file: segments are copied from the original, scans are encoded from the coefficients
+int write_jpeg(const char *filename, const JPEGImage *img)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", filename);
+        return 1; // File Not Found
+    }
+    BitWriter *bw = (BitWriter *)calloc(1, sizeof(BitWriter));
+    JPEGTables *tables = (JPEGTables *)calloc(1, sizeof(JPEGTables));
+    long (*counts)[4][256] = (long (*)[4][256])malloc(2 * sizeof(*counts));
+    if (bw == NULL || tables == NULL || counts == NULL)
+    {
+        fprintf(stderr, "Error: image data memory allocation failed\n");
+        free(bw);
+        free(tables);
+        free(counts);
+        fclose(file);
+        return 3; // Memory Allocation Failure
+    }
+    bw->file = file;
+
+    const unsigned char *data = img->file;
+    size_t size = img->file_size;
+    size_t pos = 2;
+    copy_bytes(bw, data, 2); // SOI
+
+    while (pos + 4 <= size && !bw->error)
+    {
+        int marker = data[pos + 1];
+        if (marker == 0xFF)
+        {
+            pos++;
+            continue;
+        }
+        if (marker == 0xD9)
+        {
+            break;
+        }
+        size_t length = read_u16(data + pos + 2);
+        const unsigned char *body = data + pos + 4;
+
+        if (marker == 0xC4)
+        {
+            parse_dht(body, length - 2, tables);
+        }
+        else if (marker == 0xDD)
+        {
+            tables->restart_interval = (int)read_u16(body);
+        }
+        else if (marker == 0xDA)
+        {
+            JPEGScan scan;
+            parse_sos(body, length - 2, img, tables, &scan);
+
+            memset(counts, 0, 2 * sizeof(*counts));
+            ScanCoder coder = {SCAN_COUNT, NULL, NULL, counts};
+            code_scan(img, &scan, tables, &coder);
+            if (!tables_cover(counts, tables))
+            {
+                write_optimal_tables(bw, counts, tables);
+            }
+
+            copy_bytes(bw, data + pos, 2 + length);
+            coder.mode = SCAN_ENCODE;
+            coder.writer = bw;
+            code_scan(img, &scan, tables, &coder);
+            bit_flush_buffer(bw);
+            pos = find_scan_end(data, size, pos + 2 + length);
+            continue;
+        }
+        copy_bytes(bw, data + pos, 2 + length);
+        pos += 2 + length;
+    }
+    // EOI and anything after it
+    copy_bytes(bw, data + pos, size - pos);
+
+    int error = bw->error;
+    free(bw);
+    free(tables);
+    free(counts);
+    if (fclose(file) != 0 || error)
+    {
+        fprintf(stderr, "Error: writing JPEG data failed\n");
+        return 1; // File Not Found
+    }
+    return 0; // return 0 for success
+}
+
+// ---------------------------------------------------------------------------
+// coefficient carrier
+//
+// JSteg order: components in frame order, coded blocks row by row, AC
+// coefficients in zigzag order. Coefficients 0 and 1 are skipped; changing the
+// LSB of any other value never produces 0 or 1, so encoder and decoder always
+// agree on which coefficients carry a bit.
+// ---------------------------------------------------------------------------
+
+static inline int usable_coefficient(int16_t value)
+{
+    return value != 0 && value != 1;
+}
+
+// number of coefficients that can carry a bit
+size_t jpeg_carrier_size(const JPEGImage *img)
+{
+    size_t count = 0;
+    for (int c = 0; c < img->component_count; c++)
+    {
+        const JPEGComponent *comp = &img->component[c];
+        for (int by = 0; by < comp->coded_h; by++)
+        {
+            const int16_t *block = comp->coef + (size_t)by * comp->blocks_w * 64;
+            for (int bx = 0; bx < comp->coded_w; bx++, block += 64)
+            {
+                for (int k = 1; k < 64; k++)
+                {
+                    count += usable_coefficient(block[k]);
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// low byte of every usable coefficient, in carrier order
+void jpeg_gather_lsb(const JPEGImage *img, unsigned char *carrier)
+{
+    for (int c = 0; c < img->component_count; c++)
+    {
+        const JPEGComponent *comp = &img->component[c];
+        for (int by = 0; by < comp->coded_h; by++)
+        {
+            const int16_t *block = comp->coef + (size_t)by * comp->blocks_w * 64;
+            for (int bx = 0; bx < comp->coded_w; bx++, block += 64)
+            {
+                for (int k = 1; k < 64; k++)
+                {
+                    if (usable_coefficient(block[k]))
+                    {
+                        *carrier++ = (unsigned char)block[k];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// put the LSBs of the carrier bytes back into the coefficients they came from
+void jpeg_scatter_lsb(JPEGImage *img, const unsigned char *carrier)
+{
+    for (int c = 0; c < img->component_count; c++)
+    {
+        JPEGComponent *comp = &img->component[c];
+        for (int by = 0; by < comp->coded_h; by++)
+        {
+            int16_t *block = comp->coef + (size_t)by * comp->blocks_w * 64;
+            for (int bx = 0; bx < comp->coded_w; bx++, block += 64)
+            {
+                for (int k = 1; k < 64; k++)
+                {
+                    if (usable_coefficient(block[k]))
+                    {
+                        block[k] = (int16_t)((block[k] & ~1) | (*carrier++ & 1));
+                    }
+                }
+            }
+        }
+    }
+}
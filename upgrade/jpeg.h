@@ -0,0 +1,46 @@
+// jpeg.h
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define JPEG_MAX_COMPONENTS 4
+
+typedef struct {
+  uint8_t   id;               // component identifier from SOF
+  uint8_t   h;                // horizontal sampling factor
+  uint8_t   v;                // vertical sampling factor
+  uint8_t   tq;               // quantization table selector
+  int       blocks_w;         // blocks per row in coef (whole MCUs)
+  int       blocks_h;         // block rows in coef (whole MCUs)
+  int       coded_w;          // blocks per row the scan actually codes
+  int       coded_h;          // block rows the scan actually codes
+  int16_t*  coef;             // blocks_w * blocks_h blocks of 64 quantized coefficients, zigzag order
+} JPEGComponent;
+
+// baseline (sequential, Huffman coded) JPEG as quantized DCT coefficients
+typedef struct {
+  unsigned char* file;        // original file: everything except the scans' entropy data is copied from it
+  size_t         file_size;   // length of file in bytes
+  int            width;       // width in pixels
+  int            height;      // height in pixels
+  int            h_max;       // largest horizontal sampling factor
+  int            v_max;       // largest vertical sampling factor
+  int            mcus_x;      // MCUs per row of an interleaved scan
+  int            mcus_y;      // MCU rows of an interleaved scan
+  int            component_count;
+  JPEGComponent  component[JPEG_MAX_COMPONENTS];
+} JPEGImage;
+
+int is_jpeg_file(const char *filename);
+int read_jpeg(const char *filename, JPEGImage *img);
+int write_jpeg(const char *filename, const JPEGImage *img);
+void free_jpeg_image(JPEGImage *img);
+
+size_t jpeg_carrier_size(const JPEGImage *img);
+void jpeg_gather_lsb(const JPEGImage *img, unsigned char *carrier);
+void jpeg_scatter_lsb(JPEGImage *img, const unsigned char *carrier);
+
+#endif // JPEG_H
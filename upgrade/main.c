@@ -1,551 +1,1860 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include "bmp.h"
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <glob.h>
+#include <strings.h>
+#include "bmpstego.h"
+#include "jpeg.h"
+#include "png.h"
+#include "zlib.h"
+#include "stats.h"
+#include "serve.h"
+#include "ioqueue.h"
 
 #define MAX_FILE_NAME_LENGTH 500   
-#define MAX_MESSAGE_LENGTH 1000
 
 void print_help_message(void)
 {
     printf("--- Available Commands ---\n");
-    printf("  -h <input_bmp>                             : Display BMP header information\n");
+    printf("  -h <input_bmp|dir|'glob'>                  : Display BMP header information (of every .bmp in a directory or glob match)\n");
     printf("  -o <input_bmp>                             : Output BMP file data in hexadecimal format\n");
-    printf("  -g <input_bmp> <output_bmp>                : Convert BMP image to grayscale\n");
-    printf("  -e <input_bmp> <message_file> <output_bmp> : Encode message into BMP image\n");
-    printf("  -d <input_bmp>                             : Decode hidden message from BMP image\n");
+    printf("  -c <input_bmp>                             : Show how many message bytes the BMP image can hide (header only)\n");
+    printf("  -g <input_bmp> <output_bmp>                : Convert BMP or PNG image to grayscale\n");
+    printf("  -e <input_bmp> <message_file> <output_bmp> : Encode message into BMP, JPEG or PNG image\n");
+    printf("                                               (8-bit palettized images only with a ramp-like palette, whose\n");
+    printf("                                               entries differing in the low -bits index bits look alike)\n");
+    printf("  -d <input_bmp>                             : Decode hidden message from BMP, JPEG or PNG image\n");
+    printf("  -batch <manifest>                          : Run every -h/-g/-e/-d line of <manifest> in one process\n");
+    printf("  -qd <depth>                                : Read and write BMP files asynchronously, <depth> requests in flight (with -batch; io_uring, else threads)\n");
+    printf("  --io-threads                               : Use pread/pwrite threads instead of io_uring (with -qd)\n");
+    printf("  --serve <socket>                           : Answer encode/decode/grayscale requests on a Unix socket until SIGINT/SIGTERM\n");
+    printf("  -mmap                                      : Map files into memory instead of copying them (with -h/-o/-g/-e/-d)\n");
+    printf("  -stream                                    : Convert to grayscale band by band with constant memory (with -g)\n");
+    printf("  -j <threads>                               : Use <threads> threads, 0 = all CPUs (with -g, or per file with -batch, or per request with --serve)\n");
+    printf("  -luma <green|601|709>                      : Grayscale formula: copy green (default), BT.601 or BT.709 luma (with -g)\n");
+    printf("  -bits <1-4>                                : Hide 1-4 message bits per image byte (with -e)\n");
+    printf("  -z <1-9>                                   : Deflate the message before hiding it, 9 = smallest (with -e)\n");
+    printf("  -out <file|->                              : Write the decoded message to a file or standard output (with -d)\n");
+    printf("  -key <passphrase>                          : Scatter the message over the image in keyed order (with -e and -d, BMP/JPEG)\n");
+    printf("  --offset <n> --length <n>                  : Dump only <length> bytes starting at <offset> (with -o)\n");
+    printf("  --dry-run                                  : Only check that the message fits, write nothing (with -e, BMP)\n");
+    printf("  --in-place                                 : Hide the message in <input_bmp> itself, without <output_bmp> (with -e, BMP)\n");
+    printf("  --patch                                    : Copy <input_bmp> in the kernel, then write only the changed pages (with -e, BMP)\n");
+    printf("  --stats                                    : Print phase timings, bytes read/written, message bits and page faults to stderr\n");
+    printf("  -json                                      : Print -h headers (or -c capacity, --stats, the --serve summary) as one JSON object per line\n");
     printf("  -help                                      : Display this help message\n");
 }
 
-// free BMP image data
-void free_bmp_image(BMPImage *img)
+
+// print BMP file header information
+void print_header_info(const BMPHeader *header)
+{
+    fprintf(report_out(), "\n--- BMP file header information ---\n");
+    fprintf(report_out(), "type: 0x%04x\n", header->type);
+    fprintf(report_out(), "size: %u bytes\n", header->size);
+    fprintf(report_out(), "reserved1: %u\n", header->reserved1);
+    fprintf(report_out(), "reserved2: %u\n", header->reserved2);
+    fprintf(report_out(), "offset: %u bytes\n", header->offset);
+    fprintf(report_out(), "DIB header size: %u bytes\n", header->dib_header_size);
+    fprintf(report_out(), "width: %d px\n", header->width_px);
+    fprintf(report_out(), "height: %d px\n", header->height_px);
+    fprintf(report_out(), "number of planes: %u\n", header->num_planes);
+    fprintf(report_out(), "bits per pixel: %u\n", header->bits_per_pixel);
+    fprintf(report_out(), "compression: %u\n", header->compression);
+    fprintf(report_out(), "image size: %u bytes\n", header->image_size_bytes);
+    fprintf(report_out(), "X resolution: %d ppm\n", header->x_resolution_ppm);
+    fprintf(report_out(), "Y resolution: %d ppm\n", header->y_resolution_ppm);
+    fprintf(report_out(), "number of colors: %u\n", header->num_colors);
+    fprintf(report_out(), "important colors: %u\n", header->important_colors);
+}
+
+
+// 32-bit little-endian field of the DIB extension, 0 when the header is too short
+static uint32_t dib_extension_u32(const BMPProbe *probe, size_t offset)
+{
+    uint32_t value = 0;
+    if (offset + 4 <= probe->dib_extension_size)
+    {
+        memcpy(&value, probe->dib_extension + offset, 4);
+    }
+    return value;
+}
+
+// print the V2-V5 DIB header fields that BMPHeader does not cover
+void print_dib_extension(const BMPProbe *probe)
+{
+    if (probe->dib_extension_size >= 12)
+    {
+        fprintf(report_out(), "red mask: 0x%08x\n", dib_extension_u32(probe, 0));
+        fprintf(report_out(), "green mask: 0x%08x\n", dib_extension_u32(probe, 4));
+        fprintf(report_out(), "blue mask: 0x%08x\n", dib_extension_u32(probe, 8));
+    }
+    if (probe->dib_extension_size >= 16)
+    {
+        fprintf(report_out(), "alpha mask: 0x%08x\n", dib_extension_u32(probe, 12));
+    }
+    if (probe->dib_extension_size >= 20)
+    {
+        fprintf(report_out(), "color space: 0x%08x\n", dib_extension_u32(probe, 16));
+    }
+}
+
+
+// modifier flags that may appear anywhere on the command line
+typedef struct {
+    int use_mmap; // -mmap : map files instead of reading them into heap buffers
+    int stream;   // -stream : convert -g band by band with constant memory
+    int jobs;     // -j N : threads for -g, or files in parallel for -batch (0 = one per CPU)
+    GrayscaleMode gray_mode; // -luma green|601|709 : grayscale formula for -g
+    int bits_per_byte;       // -bits K : message bits per carrier byte for -e (1-4)
+    const char *decode_output; // -out <file|-> : write the -d message there instead of printing it
+    uint64_t dump_offset;    // --offset N : first byte of the -o dump
+    uint64_t dump_length;    // --length N : bytes to dump with -o (default: everything)
+    int json;                // -json : print -h headers as JSON lines
+    const char *key;         // -key <passphrase> : scatter the -e payload in keyed order (and find it with -d)
+    int dry_run;             // --dry-run : only check that the -e message fits, write nothing
+    int compress_level;      // -z N : deflate the -e message at level N (1-9) first, 0 = off
+    int in_place;            // --in-place : hide the -e message in the input BMP itself
+    int patch;               // --patch : copy the input BMP in the kernel, then patch the copy
+    int stats;               // --stats : print phase timings and I/O counters on stderr at the end
+    unsigned queue_depth;    // -qd N : -batch reads and writes BMP files through an I/O queue N deep, 0 = off
+    int io_threads;          // --io-threads : use pread/pwrite threads for -qd even where io_uring works
+} CommandOptions;
+
+// parse a whole number argument (base 0 also takes 0x hex and 0 octal) of at most max;
+// 0 for a sign, anything after the digits or a value out of range
+static int parse_count(const char *text, int base, uint64_t max, uint64_t *value)
+{
+    if (!isdigit((unsigned char)text[0]))
+    {
+        return 0; // strtoull would skip spaces and take a minus sign
+    }
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &end, base);
+    if (errno != 0 || *end != '\0' || parsed > max)
+    {
+        return 0;
+    }
+    *value = parsed;
+    return 1;
+}
+
+// parse command line arguments and return option character
+char parse_command_line(int argc, char *argv[], char *input_bmp, char *grayscale_output, char *stego_output, char *message_file, CommandOptions *opts)
 {
-    if (img != NULL)
+    if (argc < 2)
     {
-        if (img->data != NULL)
+        fprintf(stderr, "Error: option parsing failed\n");
+        print_help_message();
+        return '\0'; // return null character to indicate error
+    }
+
+    // modifier flags may appear anywhere on the command line
+    memset(opts, 0, sizeof(*opts));
+    opts->jobs = 1;
+    opts->bits_per_byte = 1;
+    opts->dump_length = UINT64_MAX;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-mmap") == 0)
+        {
+            opts->use_mmap = 1;
+        }
+        else if (strcmp(argv[i], "-stream") == 0)
+        {
+            opts->stream = 1;
+        }
+        else if (strcmp(argv[i], "-json") == 0)
+        {
+            opts->json = 1;
+        }
+        else if (strcmp(argv[i], "--dry-run") == 0)
+        {
+            opts->dry_run = 1;
+        }
+        else if (strcmp(argv[i], "--in-place") == 0)
+        {
+            opts->in_place = 1;
+        }
+        else if (strcmp(argv[i], "--patch") == 0)
+        {
+            opts->patch = 1;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            opts->stats = 1;
+        }
+        else if (strcmp(argv[i], "--io-threads") == 0)
+        {
+            opts->io_threads = 1;
+        }
+        else if (strcmp(argv[i], "-qd") == 0 && i + 1 < argc)
+        {
+            uint64_t depth;
+            if (!parse_count(argv[++i], 10, IO_MAX_DEPTH, &depth) || depth < 1)
+            {
+                fprintf(stderr, "Error: queue depth must be between 1 and %d\n", IO_MAX_DEPTH);
+                return '\0'; // return null character to indicate error
+            }
+            opts->queue_depth = (unsigned)depth;
+        }
+        else if (strcmp(argv[i], "-luma") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "601") == 0)
+            {
+                opts->gray_mode = GRAY_BT601;
+            }
+            else if (strcmp(argv[i], "709") == 0)
+            {
+                opts->gray_mode = GRAY_BT709;
+            }
+            else if (strcmp(argv[i], "green") == 0)
+            {
+                opts->gray_mode = GRAY_GREEN;
+            }
+            else
+            {
+                fprintf(stderr, "Error: unknown luma mode '%s'\n", argv[i]);
+                return '\0'; // return null character to indicate error
+            }
+        }
+        else if (strcmp(argv[i], "-bits") == 0 && i + 1 < argc)
+        {
+            uint64_t bits;
+            if (!parse_count(argv[++i], 10, MAX_BITS_PER_BYTE, &bits) || bits < 1)
+            {
+                fprintf(stderr, "Error: bits per byte must be between 1 and %d\n", MAX_BITS_PER_BYTE);
+                return '\0'; // return null character to indicate error
+            }
+            opts->bits_per_byte = (int)bits;
+        }
+        else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc)
+        {
+            uint64_t level;
+            if (!parse_count(argv[++i], 10, MAX_COMPRESS_LEVEL, &level) || level < 1)
+            {
+                fprintf(stderr, "Error: compression level must be between 1 and %d\n", MAX_COMPRESS_LEVEL);
+                return '\0'; // return null character to indicate error
+            }
+            opts->compress_level = (int)level;
+        }
+        else if (strcmp(argv[i], "--offset") == 0 && i + 1 < argc)
+        {
+            if (!parse_count(argv[++i], 0, UINT64_MAX, &opts->dump_offset))
+            {
+                fprintf(stderr, "Error: --offset needs a byte count, not \'%s\'\n", argv[i]);
+                return '\0'; // return null character to indicate error
+            }
+        }
+        else if (strcmp(argv[i], "--length") == 0 && i + 1 < argc)
+        {
+            if (!parse_count(argv[++i], 0, UINT64_MAX, &opts->dump_length))
+            {
+                fprintf(stderr, "Error: --length needs a byte count, not \'%s\'\n", argv[i]);
+                return '\0'; // return null character to indicate error
+            }
+        }
+        else if (strcmp(argv[i], "-out") == 0 && i + 1 < argc)
+        {
+            opts->decode_output = argv[++i];
+        }
+        else if (strcmp(argv[i], "-key") == 0 && i + 1 < argc)
+        {
+            opts->key = argv[++i];
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            uint64_t jobs;
+            if (!parse_count(argv[++i], 10, INT_MAX, &jobs))
+            {
+                fprintf(stderr, "Error: threads must be a number, 0 = all CPUs\n");
+                return '\0'; // return null character to indicate error
+            }
+            opts->jobs = jobs == 0 ? online_cpu_count() : (int)jobs;
+        }
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-g") == 0 && i + 2 < argc)
+        {
+            strcpy(input_bmp, argv[i + 1]);
+            strcpy(grayscale_output, argv[i + 2]);
+            return 'g';
+        }
+        else if (strcmp(argv[i], "-e") == 0 && opts->in_place && i + 2 < argc)
+        {
+            // the input is also the output, an output path would be ignored
+            if (i + 3 < argc && argv[i + 3][0] != '-')
+            {
+                fprintf(stderr, "Error: --in-place writes <input_bmp> itself, leave out <output_bmp> (\'%s\')\n",
+                        argv[i + 3]);
+                return '\0'; // return null character to indicate error
+            }
+            strcpy(input_bmp, argv[i + 1]);
+            strcpy(message_file, argv[i + 2]);
+            strcpy(stego_output, argv[i + 1]);
+            return 'e';
+        }
+        else if (strcmp(argv[i], "-e") == 0 && i + 3 < argc)
+        {
+            strcpy(input_bmp, argv[i + 1]);
+            strcpy(message_file, argv[i + 2]);
+            strcpy(stego_output, argv[i + 3]);
+            return 'e';
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            strcpy(input_bmp, argv[i + 1]);
+            return 'd';
+        }
+        else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc)
+        {
+            strcpy(input_bmp, argv[i + 1]);
+            return 'h';
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            strcpy(input_bmp, argv[i + 1]);
+            return 'o';
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            strcpy(input_bmp, argv[i + 1]);
+            return 'c';
+        }
+
+        else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc)
+        {
+            strcpy(input_bmp, argv[i + 1]); // manifest file
+            return 'b';
+        }
+
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+        {
+            strcpy(input_bmp, argv[i + 1]); // socket path
+            return 'S';
+        }
+
+        else if (strcmp(argv[i], "-help") == 0)
         {
-            free(img->data);
+            return 'H';
         }
     }
+
+    fprintf(stderr, "Error: option parsing failed\n");
+    print_help_message();
+    return '\0'; // return null character to indicate error
 }
 
-// print BMP file header information
-void print_header_info(const BMPHeader *header)
+// ---------------------------------------------------------------------------
+// header scanning (-h on a directory or glob pattern)
+//
+// Paths are collected in batches of PROBE_BATCH, probed on the thread pool
+// (one pread per file), then printed in order, so memory stays bounded for
+// directories with millions of files.
+// ---------------------------------------------------------------------------
+
+#define PROBE_BATCH 4096
+
+typedef struct {
+    char *path;     // path as printed
+    BMPProbe probe;
+    int status;     // probe_bmp_header's return code
+} ProbeJob;
+
+typedef struct {
+    ProbeJob *jobs;
+    size_t count;
+    int dir_fd;       // directory the names are relative to (AT_FDCWD for glob results)
+    size_t name_skip; // length of the directory prefix to skip for openat
+    int json;         // emit JSON lines instead of the text report
+    size_t scanned;   // files probed so far
+    size_t failed;    // files that could not be probed
+} ProbeBatch;
+
+static void probe_task(void *ctx, size_t task, int worker)
 {
-    printf("\n--- BMP file header information ---\n");
-    printf("type: 0x%04x\n", header->type);
-    printf("size: %u bytes\n", header->size);
-    printf("reserved1: %u\n", header->reserved1);
-    printf("reserved2: %u\n", header->reserved2);
-    printf("offset: %u bytes\n", header->offset);
-    printf("DIB header size: %u bytes\n", header->dib_header_size);
-    printf("width: %d px\n", header->width_px);
-    printf("height: %d px\n", header->height_px);
-    printf("number of planes: %u\n", header->num_planes);
-    printf("bits per pixel: %u\n", header->bits_per_pixel);
-    printf("compression: %u\n", header->compression);
-    printf("image size: %u bytes\n", header->image_size_bytes);
-    printf("X resolution: %d ppm\n", header->x_resolution_ppm);
-    printf("Y resolution: %d ppm\n", header->y_resolution_ppm);
-    printf("number of colors: %u\n", header->num_colors);
-    printf("important colors: %u\n", header->important_colors);
-}
-
-// print BMP file data information
-void print_data_hex(const BMPImage *img)
-{
-    // size of header (54bytes)
-    int header_size = sizeof(BMPHeader);
-    // size of image data
-    int data_size = (int)img->header.size - img->header.offset;
-    // size of total BMP (header + image)
-    int total_size = header_size + data_size;
-
-    printf("\n--- BMP file data (hex dump) ---\n");
-
-    unsigned char *header_bytes = (unsigned char *)&img->header;
-    unsigned char *data = img->data;
-    unsigned char byte;
-    int offset = 0; // current offset in bytes
-
-    // print header (54bytes)
-    for (int i = 0; i < header_size; i++)
-    {
-        if (offset % 16 == 0)
-        {
-            if (offset > 0)
-            {
-                // print ASCII expression of before sentence
-                printf("  |");
-                int ascii_start = offset - 16;
-                for (int j = ascii_start; j < offset; j++)
-                {
-                    byte = (j < header_size) ? header_bytes[j] : data[j - header_size];
-                    // if byte is unprintable, then print '.'
-                    printf("%c", (byte >= 32 && byte <= 126) ? byte : '.');
-                }
-                printf("|\n");
-            }
-            printf("%08x: ", offset);
+    ProbeBatch *batch = (ProbeBatch *)ctx;
+    ProbeJob *job = &batch->jobs[task];
+    (void)worker;
+
+    job->status = probe_bmp_header_at(batch->dir_fd, job->path + batch->name_skip, &job->probe);
+}
+
+// write s as a JSON string literal
+static void print_json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s != '\0'; s++)
+    {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+        {
+            fputc('\\', out);
+            fputc(c, out);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(out, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, out);
         }
+    }
+    fputc('"', out);
+}
 
-        // print byte in hexadecimal
-        printf("%02x", header_bytes[i]);
+// one line of JSON per file with every BMPHeader field
+static void print_probe_json(const ProbeJob *job)
+{
+    FILE *out = report_out();
+    const BMPHeader *h = &job->probe.header;
 
-        // add space every 2 bytes (4 hex digits)
-        if (offset % 2 == 1)
+    fputs("{\"file\":", out);
+    print_json_string(out, job->path);
+    if (job->status != 0)
+    {
+        fprintf(out, ",\"error\":%d}\n", job->status);
+        return;
+    }
+    fprintf(out,
+            ",\"type\":%u,\"size\":%u,\"reserved1\":%u,\"reserved2\":%u,\"offset\":%u,\"dib_header_size\":%u,"
+            "\"width\":%d,\"height\":%d,\"planes\":%u,\"bits_per_pixel\":%u,\"compression\":%u,\"image_size\":%u,"
+            "\"x_ppm\":%d,\"y_ppm\":%d,\"colors\":%u,\"important_colors\":%u",
+            h->type, h->size, h->reserved1, h->reserved2, h->offset, h->dib_header_size, h->width_px, h->height_px,
+            h->num_planes, h->bits_per_pixel, h->compression, h->image_size_bytes, h->x_resolution_ppm,
+            h->y_resolution_ppm, h->num_colors, h->important_colors);
+    if (job->probe.dib_extension_size >= 12)
+    {
+        fprintf(out, ",\"red_mask\":%u,\"green_mask\":%u,\"blue_mask\":%u", dib_extension_u32(&job->probe, 0),
+                dib_extension_u32(&job->probe, 4), dib_extension_u32(&job->probe, 8));
+    }
+    if (job->probe.dib_extension_size >= 16)
+    {
+        fprintf(out, ",\"alpha_mask\":%u", dib_extension_u32(&job->probe, 12));
+    }
+    fputs("}\n", out);
+}
+
+// probe and print the collected batch, then empty it
+static void flush_probe_batch(ProbeBatch *batch, ThreadPool *pool)
+{
+    thread_pool_run(pool, batch->count, probe_task, batch);
+
+    for (size_t i = 0; i < batch->count; i++)
+    {
+        ProbeJob *job = &batch->jobs[i];
+        if (batch->json)
         {
-            printf(" ");
+            print_probe_json(job);
         }
+        else if (job->status == 0)
+        {
+            fprintf(report_out(), "\n=== %s ===", job->path);
+            print_header_info(&job->probe.header);
+            print_dib_extension(&job->probe);
+        }
+        else
+        {
+            fprintf(stderr, "Error: '%s' is not a readable BMP file\n", job->path);
+        }
+        batch->failed += job->status != 0;
+        free(job->path);
+    }
+    batch->scanned += batch->count;
+    batch->count = 0;
+}
 
-        offset++;
+static int add_probe_path(ProbeBatch *batch, ThreadPool *pool, const char *prefix, const char *name)
+{
+    size_t prefix_length = strlen(prefix);
+    char *path = (char *)malloc(prefix_length + strlen(name) + 1);
+    if (path == NULL)
+    {
+        return 3; // Memory Allocation Failure
     }
+    memcpy(path, prefix, prefix_length);
+    strcpy(path + prefix_length, name);
 
-    // print data section (image data)
-    for (int i = 0; i < data_size; i++)
+    batch->jobs[batch->count].path = path;
+    if (++batch->count == PROBE_BATCH)
     {
-        if (offset % 16 == 0)
+        flush_probe_batch(batch, pool);
+    }
+    return 0;
+}
+
+// 1 if name ends in .bmp (any case)
+static int has_bmp_extension(const char *name)
+{
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(name + length - 4, ".bmp") == 0;
+}
+
+// print header information of every .bmp file in a directory, or of every match of a glob pattern
+int scan_bmp_headers(const char *path, int json, int jobs)
+{
+    ProbeBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.json = json;
+    batch.dir_fd = AT_FDCWD;
+    batch.jobs = (ProbeJob *)malloc(PROBE_BATCH * sizeof(ProbeJob));
+    if (batch.jobs == NULL)
+    {
+        fprintf(stderr, "Error: header scan memory allocation failed\n");
+        return 3; // Memory Allocation Failure
+    }
+    ThreadPool *pool = thread_pool_create(jobs);
+    int result = 0;
+
+    DIR *dir = opendir(path);
+    if (dir != NULL)
+    {
+        // names are opened relative to the directory, but printed with its path
+        char prefix[MAX_FILE_NAME_LENGTH + 1];
+        snprintf(prefix, sizeof(prefix), "%s%s", path, path[strlen(path) - 1] == '/' ? "" : "/");
+        batch.dir_fd = dirfd(dir);
+        batch.name_skip = strlen(prefix);
+
+        struct dirent *entry;
+        while (result == 0 && (entry = readdir(dir)) != NULL)
         {
-            if (offset > 0)
+            if (entry->d_type != DT_DIR && has_bmp_extension(entry->d_name))
             {
-                // print ASCII representation of previous line
-                printf("  |");
-                int ascii_start = offset - 16;
-                for (int j = ascii_start; j < offset; j++)
-                {
-                    if (j < header_size)
-                    {
-                        byte = header_bytes[j];
-                    }
-                    else
-                    {
-                        byte = data[j - header_size];
-                    }
-                    // if byte is unprintable, then print '.'
-                    printf("%c", (byte >= 32 && byte <= 126) ? byte : '.');
-                }
-                printf("|\n");
+                result = add_probe_path(&batch, pool, prefix, entry->d_name);
             }
-            printf("%08x: ", offset);
         }
+        flush_probe_batch(&batch, pool);
+        closedir(dir);
+    }
+    else
+    {
+        glob_t matches;
+        int glob_result = glob(path, 0, NULL, &matches);
+        if (glob_result != 0)
+        {
+            fprintf(stderr, "Error: filename \'%s\' is incorrect\n", path);
+            result = 1; // File Not Found
+        }
+        for (size_t i = 0; result == 0 && i < matches.gl_pathc; i++)
+        {
+            result = add_probe_path(&batch, pool, "", matches.gl_pathv[i]);
+        }
+        flush_probe_batch(&batch, pool);
+        if (glob_result == 0)
+        {
+            globfree(&matches);
+        }
+    }
+
+    thread_pool_destroy(pool);
+    free(batch.jobs);
+    if (result == 3)
+    {
+        fprintf(stderr, "Error: header scan memory allocation failed\n");
+    }
+    if (!json && result != 1)
+    {
+        fprintf(report_out(), "\n%zu file(s) scanned, %zu failed\n", batch.scanned, batch.failed);
+    }
+    return result != 0 ? result : (batch.failed > 0 ? 1 : 0);
+}
+
+// ---------------------------------------------------------------------------
+// capacity planning (-c, and -e with --dry-run)
+//
+// The room for a payload follows from the BMP header alone, so both read it
+// with one pread and never touch the pixel data.
+// ---------------------------------------------------------------------------
+
+// print why probe_bmp_header failed, with the messages read_bmp gives for the same files
+static void print_probe_error(const char *filename, int result, const BMPProbe *probe)
+{
+    struct stat st;
+    if (result == 2)
+    {
+        fprintf(stderr, "Error: File is not a valid BMP format (magic number 0x%X)\n", probe->header.type);
+    }
+    else if (stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < (off_t)sizeof(BMPHeader))
+    {
+        fprintf(stderr, "Error: reading BMP header\n"); // the file is there, its header is cut short
+    }
+    else
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", filename);
+    }
+}
 
-        // print byte in hexadecimal
-        printf("%02x", data[i]);
+// read the header of a carrier image, printing why it cannot be used
+static int probe_carrier(const char *filename, BMPProbe *probe)
+{
+    if (is_jpeg_file(filename) || is_png_file(filename))
+    {
+        fprintf(stderr, "Error: -c and --dry-run need a BMP image\n");
+        return 2; // Invalid Arguments
+    }
+    int result = probe_bmp_header(filename, probe);
+    if (result != 0)
+    {
+        print_probe_error(filename, result, probe);
+        return result; // File Not Found or Invalid Arguments
+    }
+    if (!bmp_depth_supported(&probe->header) || !bmp_size_supported(&probe->header))
+    {
+        print_format_error();
+        return 2; // Invalid Arguments
+    }
+    return 0;
+}
+
+// payload bytes a BMP image can take for every -bits setting, with and without -key
+int print_stego_capacity(const char *filename, int json)
+{
+    BMPProbe probe;
+    int result = probe_carrier(filename, &probe);
+    if (result != 0)
+    {
+        return result;
+    }
+    size_t carrier_bytes = bmp_carrier_bytes(&probe.header, 1);
+    size_t padded_bytes = bmp_carrier_bytes(&probe.header, 0);
+    FILE *out = report_out();
 
-        // add space every 2 bytes (4 hex digits)
-        if (offset % 2 == 1)
+    if (json)
+    {
+        fputs("{\"file\":", out);
+        print_json_string(out, filename);
+        fprintf(out, ",\"carrier_bytes\":%zu,\"padded_carrier_bytes\":%zu,\"header_bytes\":%zu,\"capacity\":[",
+                carrier_bytes, padded_bytes, sizeof(StegoHeader));
+        for (int k = 1; k <= MAX_BITS_PER_BYTE; k++)
         {
-            printf(" ");
+            fprintf(out, "%s{\"bits\":%d,\"bytes\":%llu,\"keyed_bytes\":%llu}", k > 1 ? "," : "", k,
+                    (unsigned long long)stego_capacity(carrier_bytes, k, 0),
+                    (unsigned long long)stego_capacity(carrier_bytes, k, 1));
         }
+        fputs("]}\n", out);
+        return 0;
+    }
 
-        offset++;
+    fprintf(out, "\n--- message capacity ---\n");
+    fprintf(out, "carrier: %zu bytes", carrier_bytes);
+    if (padded_bytes != carrier_bytes)
+    {
+        fprintf(out, " (row padding of %zu bytes skipped)", padded_bytes - carrier_bytes);
+    }
+    fprintf(out, "\nheader: %zu bytes at 1 bit per byte\n", sizeof(StegoHeader));
+    for (int k = 1; k <= MAX_BITS_PER_BYTE; k++)
+    {
+        fprintf(out, "-bits %d: %llu bytes (%llu with -key)\n", k, (unsigned long long)stego_capacity(carrier_bytes, k, 0),
+                (unsigned long long)stego_capacity(carrier_bytes, k, 1));
     }
+    return 0;
+}
 
-    // if the last line is not complete (less than 16 bytes), fill the rest with spaces
-    int remaining = total_size % 16;
-    if (remaining != 0)
+// check that a message file fits into a BMP image with the -e options, without writing anything
+// size of the message file and of the payload -e hides for it (deflated with -z), without embedding
+// anything; the message must be a regular file, flag names the option that needs one
+static int message_payload_size(const char *message_file, const CommandOptions *opts, const char *flag,
+                                uint64_t *message, uint64_t *payload)
+{
+    struct stat st;
+    if (stat(message_file, &st) != 0)
     {
-        // fill with spaces for hexadecimal output
-        for (int k = 0; k < 16 - remaining; k++)
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", message_file);
+        return 1; // File Not Found
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "Error: %s needs a regular message file\n", flag);
+        return 2; // Invalid Arguments
+    }
+
+    *message = (uint64_t)st.st_size;
+    *payload = *message;
+    if (opts->compress_level > 0)
+    {
+        // the deflated size is only known by deflating, which needs the message but not the image
+        return deflated_file_size(message_file, opts->compress_level, payload);
+    }
+    return 0;
+}
+
+// -z messages larger than the decoder will inflate are refused (2), as -e itself does
+static int check_inflate_limit(const BMPHeader *header, uint64_t message, const CommandOptions *opts)
+{
+    uint64_t limit = stego_inflate_limit(bmp_carrier_bytes(header, 1));
+    if (opts->compress_level > 0 && message > limit)
+    {
+        fprintf(stderr, "Error: Message is too long to deflate into this image (at most %llu bytes with -z)\n",
+                (unsigned long long)limit);
+        return 2; // Invalid Arguments
+    }
+    return 0;
+}
+
+int plan_encode(const char *input_file, const char *message_file, const CommandOptions *opts)
+{
+    BMPProbe probe;
+    int result = probe_carrier(input_file, &probe);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    // the message is not read, so its size has to be known up front
+    uint64_t message;
+    uint64_t payload;
+    result = message_payload_size(message_file, opts, "--dry-run", &message, &payload);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    uint64_t capacity = stego_capacity(bmp_carrier_bytes(&probe.header, 1), opts->bits_per_byte, opts->key != NULL);
+    fprintf(report_out(), "\n--- encode plan ---\n");
+    fprintf(report_out(), "message: %llu bytes\n", (unsigned long long)message);
+    if (opts->compress_level > 0)
+    {
+        fprintf(report_out(), "deflated: %llu bytes at level %d\n", (unsigned long long)payload, opts->compress_level);
+    }
+    fprintf(report_out(), "capacity: %llu bytes at %d bits per byte%s\n", (unsigned long long)capacity,
+            opts->bits_per_byte, opts->key != NULL ? " with -key" : "");
+    if (payload > capacity)
+    {
+        fprintf(stderr, "Error: Message is too long\n");
+        return 2; // Invalid Arguments
+    }
+    result = check_inflate_limit(&probe.header, message, opts);
+    if (result != 0)
+    {
+        return result;
+    }
+    fprintf(report_out(), "message fits, %llu bytes to spare\n", (unsigned long long)(capacity - payload));
+    return 0;
+}
+
+// --in-place (or --patch onto the input): 0 if the payload fits the BMP, checked before anything is written
+static int check_in_place_fit(const char *input_file, const char *message_file, const CommandOptions *opts)
+{
+    BMPProbe probe;
+    int result = probe_carrier(input_file, &probe);
+    if (result != 0)
+    {
+        return result;
+    }
+    uint64_t message;
+    uint64_t payload;
+    result = message_payload_size(message_file, opts, opts->in_place ? "--in-place" : "--patch onto the input", &message, &payload);
+    if (result != 0)
+    {
+        return result;
+    }
+    if (payload > stego_capacity(bmp_carrier_bytes(&probe.header, 1), opts->bits_per_byte, opts->key != NULL))
+    {
+        fprintf(stderr, "Error: Message is too long\n");
+        return 2; // Invalid Arguments
+    }
+    return check_inflate_limit(&probe.header, message, opts);
+}
+
+// load input BMP as the options ask: mapped, borrowed from the arena, or into a new heap buffer
+static int load_input_bmp(const char *filename, BMPImage *img, const CommandOptions *opts, ImageArena *arena)
+{
+    if (opts->use_mmap)
+    {
+        return map_bmp(filename, img);
+    }
+    return read_bmp_arena(filename, img, arena);
+}
+
+// run one -h/-o/-c/-g/-e/-d operation (arena may be NULL)
+int run_command(char option, const char *input_bmp, const char *grayscale_output, const char *stego_output, const char *message_file, const CommandOptions *opts, ImageArena *arena)
+{
+    BMPImage bmp_img;
+    BMPImage out_img;
+    ThreadPool *pool = NULL;
+
+    int read_result;
+    switch (option)
+    {
+    case 'h': // BMP header information, read without the pixel data
+    {
+        // a single file, or a directory / glob pattern to scan
+        struct stat st;
+        if (opts->json || stat(input_bmp, &st) != 0 || S_ISDIR(st.st_mode))
         {
-            printf("  "); // 2글자 공간
-            if ((remaining + k) % 2 == 1)
-                printf(" "); // 2바이트마다 공백
+            return scan_bmp_headers(input_bmp, opts->json, opts->jobs);
         }
+
+        BMPProbe probe;
+        read_result = probe_bmp_header(input_bmp, &probe);
+        if (read_result != 0)
+        {
+            print_probe_error(input_bmp, read_result, &probe);
+            return read_result; // File Not Found or Invalid Arguments
+        }
+        print_header_info(&probe.header);
+        print_dib_extension(&probe);
+        break;
     }
 
-    // print ASCII representation of last line
-    printf("  |");
-    int start_ascii = total_size - remaining;
-    if (remaining == 0 && total_size > 0)
-        start_ascii = total_size - 16;
-    for (int j = start_ascii; j < total_size; j++)
+    case 'o': // BMP data hex dump, read slice by slice
     {
+        StatsSpan span = stats_begin(STATS_HEX);
+        int dump_result = dump_bmp_hex(input_bmp, opts->dump_offset, opts->dump_length);
+        stats_end(&span);
+        return dump_result;
+    }
 
-        if (j < header_size)
+    case 'c': // message capacity, from the header only
+        return print_stego_capacity(input_bmp, opts->json);
+
+    case 'g': // convert to grayscale
+        if (is_png_file(input_bmp))
         {
-            byte = header_bytes[j];
+            StatsSpan span = stats_begin(STATS_GRAYSCALE);
+            int png_result = convert_to_grayscale_png(input_bmp, grayscale_output, opts->gray_mode);
+            stats_end(&span);
+            if (png_result != 0)
+            {
+                return png_result; // return convert_to_grayscale_png's error code
+            }
+            fprintf(report_out(), "grayscale image is saved to %s\n", grayscale_output);
+            break;
+        }
+        if (opts->stream)
+        {
+            pool = thread_pool_create(opts->jobs);
+            StatsSpan span = stats_begin(STATS_GRAYSCALE);
+            int stream_result = convert_to_grayscale_stream(input_bmp, grayscale_output, pool, opts->gray_mode);
+            stats_end(&span);
+            thread_pool_destroy(pool);
+            if (stream_result != 0)
+            {
+                return stream_result; // return convert_to_grayscale_stream's error code
+            }
+            fprintf(report_out(), "grayscale image is saved to %s\n", grayscale_output);
+            break;
+        }
+
+        // -mmap with the input as output reads it instead: creating the output would empty the input's mapping
+        int map_gray_output = opts->use_mmap && !same_file(input_bmp, grayscale_output);
+        read_result = map_gray_output ? map_bmp(input_bmp, &bmp_img) : read_bmp_arena(input_bmp, &bmp_img, arena);
+        if (read_result != 0)
+        {
+            return read_result; // return read_bmp's error code
+        }
+
+        if (map_gray_output)
+        {
+            // work directly on a shared mapping of the output file
+            StatsSpan map_span = stats_begin(STATS_MAP);
+            int map_result = map_bmp_output(grayscale_output, &bmp_img, &out_img);
+            stats_end(&map_span);
+            free_bmp_image(&bmp_img);
+            if (map_result != 0)
+            {
+                return map_result; // return map_bmp_output's error code
+            }
+            bmp_img = out_img;
+        }
+
+        pool = thread_pool_create(opts->jobs);
+        StatsSpan gray_span = stats_begin(STATS_GRAYSCALE);
+        int convert_result = convert_to_grayscale(&bmp_img, pool, opts->gray_mode);
+        stats_end(&gray_span);
+        thread_pool_destroy(pool);
+        if (convert_result != 0)
+        {
+            free_bmp_image(&bmp_img);
+            if (map_gray_output)
+            {
+                unlink(grayscale_output); // not converted
+            }
+            return convert_result; // return convert_to_grayscale's error code
+        }
+
+        int write_result = map_gray_output ? 0 : write_bmp(grayscale_output, &bmp_img);
+        if (write_result != 0)
+        {
+            free_bmp_image(&bmp_img);
+            return write_result; // return write_bmp's error code
+        }
+        fprintf(report_out(), "grayscale image is saved to %s\n", grayscale_output);
+        free_bmp_image(&bmp_img);
+        break;
+
+    case 'e': // hide message using LSB steganography
+        if (opts->dry_run)
+        {
+            return plan_encode(input_bmp, message_file, opts);
+        }
+        if (opts->in_place && strcmp(input_bmp, stego_output) != 0 && !same_file(input_bmp, stego_output))
+        {
+            // a -batch line names an output, which --in-place would ignore
+            fprintf(stderr, "Error: --in-place writes \'%s\' itself, leave out the output \'%s\'\n", input_bmp,
+                    stego_output);
+            return 2; // Invalid Arguments
+        }
+        if (is_jpeg_file(input_bmp))
+        {
+            pool = opts->key != NULL ? thread_pool_create(opts->jobs) : NULL;
+            int jpeg_result = encode_message_jpeg(input_bmp, message_file, stego_output, opts->bits_per_byte, opts->compress_level, opts->key, pool);
+            thread_pool_destroy(pool);
+            return jpeg_result;
+        }
+        if (is_png_file(input_bmp))
+        {
+            if (opts->key != NULL)
+            {
+                // rows are streamed, the keyed order needs the whole carrier at once
+                fprintf(stderr, "Error: -key needs a BMP or JPEG image\n");
+                return 2; // Invalid Arguments
+            }
+            return encode_message_png(input_bmp, message_file, stego_output, opts->bits_per_byte, opts->compress_level);
+        }
+        int patched = opts->in_place || opts->patch;
+        int copied = opts->patch && !opts->in_place && !same_file(input_bmp, stego_output);
+        int map_stego_output = opts->use_mmap && !patched && !same_file(input_bmp, stego_output);
+        if (patched && !copied)
+        {
+            // the input itself is about to be mapped shared, where a message found too long halfway
+            // would already have overwritten part of the old one: check that it fits first
+            int fit_result = check_in_place_fit(input_bmp, message_file, opts);
+            if (fit_result != 0)
+            {
+                return fit_result;
+            }
+        }
+        if (patched)
+        {
+            // a shared mapping of the output file: only the pages the message lands on are written
+            read_result = opts->in_place ? map_bmp_shared(input_bmp, &bmp_img)
+                                         : patch_bmp_output(input_bmp, stego_output, &bmp_img);
+            if (read_result != 0)
+            {
+                return read_result; // return map_bmp_shared's error code
+            }
         }
         else
         {
-            byte = data[j - header_size];
+            // as for -g, -mmap onto the input itself reads it instead
+            read_result = map_stego_output ? map_bmp(input_bmp, &bmp_img) : read_bmp_arena(input_bmp, &bmp_img, arena);
+            if (read_result != 0)
+            {
+                return read_result; // return read_bmp's error code
+            }
         }
-        printf("%c", (byte >= 32 && byte <= 126) ? byte : '.');
+
+        pool = opts->key != NULL ? thread_pool_create(opts->jobs) : NULL;
+        int encode_result = encode_message(&bmp_img, message_file, opts->bits_per_byte, opts->compress_level, opts->key, pool);
+        thread_pool_destroy(pool);
+        if (encode_result != 0)
+        {
+            free_bmp_image(&bmp_img);
+            if (copied)
+            {
+                unlink(stego_output); // no message went into the copy
+            }
+            return encode_result; // return encode_message's error code
+        }
+
+        if (map_stego_output)
+        {
+            // the message went into the copy-on-write input mapping; only now create the output
+            StatsSpan map_span = stats_begin(STATS_MAP);
+            int map_result = map_bmp_output(stego_output, &bmp_img, &out_img);
+            stats_end(&map_span);
+            free_bmp_image(&bmp_img);
+            if (map_result != 0)
+            {
+                return map_result; // return map_bmp_output's error code
+            }
+            bmp_img = out_img;
+        }
+
+        write_result = map_stego_output || patched ? 0 : write_bmp(stego_output, &bmp_img);
+        if (write_result != 0)
+        {
+            free_bmp_image(&bmp_img);
+            return write_result; // return write_bmp's error code
+        }
+        free_bmp_image(&bmp_img);
+        break;
+
+    case 'd': // decode hidden message
+    {
+        int is_jpeg = is_jpeg_file(input_bmp);
+        int is_png = !is_jpeg && is_png_file(input_bmp);
+        if (!is_jpeg && !is_png)
+        {
+            read_result = load_input_bmp(input_bmp, &bmp_img, opts, arena);
+            if (read_result != 0)
+            {
+                return read_result; // return read_bmp's error code
+            }
+        }
+        // the message owns standard output with -out -, so reports move to stderr
+        FILE *saved_report = report_stream;
+        if (opts->decode_output != NULL && strcmp(opts->decode_output, "-") == 0 && report_stream == NULL)
+        {
+            report_stream = stderr;
+        }
+        pool = opts->key != NULL && !is_png ? thread_pool_create(opts->jobs) : NULL;
+        int decode_result = is_jpeg  ? decode_message_jpeg(input_bmp, opts->decode_output, opts->key, pool)
+                            : is_png ? decode_message_png(input_bmp, opts->decode_output)
+                                     : decode_message(&bmp_img, opts->decode_output, opts->key, pool);
+        thread_pool_destroy(pool);
+        report_stream = saved_report;
+        if (is_jpeg || is_png)
+        {
+            return decode_result;
+        }
+        if (decode_result != 0)
+        {
+            free_bmp_image(&bmp_img);
+            return decode_result; // return decode_message's error code
+        }
+        free_bmp_image(&bmp_img);
+        break;
+    }
+
+    default:
+        fprintf(stderr, "Error: unknown option\n");
+        return 2; // Invalid Arguments
     }
-    printf("|\n");
+    return 0; // return 0 for success
 }
 
-// calculate padding size for each row
-int calculate_padding(int width_px)
+// ---------------------------------------------------------------------------
+// batch mode
+//
+// Every manifest line is one operation in command line syntax, e.g.
+//   -g photo.bmp photo_gray.bmp
+//   -e photo.bmp secret.txt photo_stego.bmp
+//   -d photo_stego.bmp secret_out.txt   (message file output is optional)
+// Blank lines and lines starting with '#' are skipped. The jobs run on a
+// thread pool (-j N), borrowing their pixel buffers from one shared ImageArena,
+// and their reports are printed in manifest order followed by a summary.
+// With -j N jobs run in any order, except that a line which reads or writes a
+// file an earlier line writes (or writes a file an earlier line reads) waits
+// for that line: the jobs run in waves, see batch_schedule.
+// ---------------------------------------------------------------------------
+
+#define BATCH_LINE_LENGTH (4 * MAX_FILE_NAME_LENGTH)
+
+typedef struct {
+    int line;                                // manifest line number
+    char option;                             // h, g, e or d ('\0' for an invalid line)
+    char input_bmp[MAX_FILE_NAME_LENGTH];
+    char message_file[MAX_FILE_NAME_LENGTH]; // -e only
+    char output_bmp[MAX_FILE_NAME_LENGTH];   // -g and -e, optional message output for -d
+    int status;                              // run_command's return code
+    uint64_t bytes;                          // size of the input file
+    double seconds;                          // time spent on the job
+    char *report;                            // captured report output
+    size_t report_length;
+} BatchJob;
+
+typedef struct {
+    BatchJob *jobs;
+    CommandOptions opts;   // options for a single job
+    ImageArena *arena;     // pixel buffers shared by all workers
+    const size_t *order;   // indices into jobs of the wave being run
+} BatchRun;
+
+static double monotonic_seconds(void)
 {
-    // 3bytes per pixel (24-bit BMP)
-    int row_size_bytes = width_px * 3;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    return (4 - (row_size_bytes % 4)) % 4;
+// copy a manifest path, rejecting names that do not fit
+static int copy_batch_path(char *dst, const char *src)
+{
+    if (src == NULL || strlen(src) >= MAX_FILE_NAME_LENGTH)
+    {
+        return 0;
+    }
+    strcpy(dst, src);
+    return 1;
 }
 
-// convert 24-bit BMP image to grayscale
-int convert_to_grayscale(BMPImage *img)
+// parse one manifest line into job, returns 0 for a blank/comment line, 1 otherwise
+static int parse_batch_line(char *line, BatchJob *job)
 {
-    if (img->header.bits_per_pixel != 24)
+    char *save = NULL;
+    char *op = strtok_r(line, " \t\r\n", &save);
+
+    if (op == NULL || op[0] == '#')
     {
-        fprintf(stderr, "Error: This operation only supports uncompressed 24-bit BMP\n");
-        return 2; // Invalid Arguments
+        return 0;
     }
 
-    int width = img->header.width_px;        // width in pixels
-    int height = abs(img->header.height_px); // height in pixels
-    int padding = calculate_padding(width);  // row padding in bytes
-    unsigned char *data = img->data;
-    int row_start_offset = 0; // start offset of the current row in data array
+    // arguments: input, then the message file (-e) and the output (-g/-e)
+    char *args[4];
+    int count = 0;
+    char *token;
+    while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+    {
+        if (count == 4)
+        {
+            count++;
+            break;
+        }
+        args[count++] = token;
+    }
 
-    printf("\n--- Converting to Grayscale ---\n");
-    for (int i = 0; i < height; i++)
+    job->option = '\0';
+    if ((strcmp(op, "-h") == 0 || strcmp(op, "-d") == 0) && count == 1)
+    {
+        if (copy_batch_path(job->input_bmp, args[0]))
+        {
+            job->option = op[1];
+        }
+    }
+    else if (strcmp(op, "-d") == 0 && count == 2)
+    {
+        // -d <input> <message output>
+        if (copy_batch_path(job->input_bmp, args[0]) && copy_batch_path(job->output_bmp, args[1]))
+        {
+            job->option = 'd';
+        }
+    }
+    else if (strcmp(op, "-g") == 0 && count == 2)
+    {
+        if (copy_batch_path(job->input_bmp, args[0]) && copy_batch_path(job->output_bmp, args[1]))
+        {
+            job->option = 'g';
+        }
+    }
+    else if (strcmp(op, "-e") == 0 && count == 3)
     {
-        for (int j = 0; j < width; j++)
+        if (copy_batch_path(job->input_bmp, args[0]) && copy_batch_path(job->message_file, args[1]) &&
+            copy_batch_path(job->output_bmp, args[2]))
         {
-            // each pixel's BGR data offset
-            int pixel_offset = row_start_offset + (j * 3);
-            unsigned char blue = data[pixel_offset + 0];
-            unsigned char green = data[pixel_offset + 1];
-            unsigned char red = data[pixel_offset + 2];
+            job->option = 'e';
+        }
+    }
+    return 1;
+}
+
+static void batch_job_task(void *ctx, size_t task, int worker)
+{
+    (void)worker;
+    BatchRun *run = (BatchRun *)ctx;
+    BatchJob *job = &run->jobs[task];
+
+    if (job->option == '\0')
+    {
+        job->status = 2; // Invalid Arguments
+        return;
+    }
+
+    // capture this job's report so parallel jobs do not interleave on stdout
+    report_stream = open_memstream(&job->report, &job->report_length);
+
+    CommandOptions opts = run->opts;
+    if (job->option == 'd' && job->output_bmp[0] != '\0')
+    {
+        opts.decode_output = job->output_bmp;
+    }
+
+    double start = monotonic_seconds();
+    job->status = run_command(job->option, job->input_bmp, job->output_bmp, job->output_bmp, job->message_file, &opts,
+                              run->arena);
+    job->seconds = monotonic_seconds() - start;
+
+    if (report_stream != NULL)
+    {
+        fclose(report_stream);
+        report_stream = NULL;
+    }
+
+    struct stat st;
+    if (stat(job->input_bmp, &st) == 0)
+    {
+        job->bytes = (uint64_t)st.st_size;
+    }
+}
+
+static void batch_wave_task(void *ctx, size_t task, int worker)
+{
+    BatchRun *run = (BatchRun *)ctx;
+    batch_job_task(ctx, run->order[task], worker);
+}
+
+// a manifest path in a form that compares equal for the same file: the real path of an
+// existing file, otherwise the real path of its directory and its name, so that
+// ./out.bmp and out.bmp match before out.bmp is written (NULL if out of memory)
+static char *batch_path_key(const char *path)
+{
+    char *resolved = realpath(path, NULL);
+    if (resolved != NULL)
+    {
+        return resolved;
+    }
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : (size_t)(slash - path));
+    char *dir_resolved = dir != NULL ? realpath(dir, NULL) : NULL;
+    free(dir);
+    if (dir_resolved == NULL)
+    {
+        return strdup(path);
+    }
+    const char *name = slash == NULL ? path : slash + 1;
+    size_t length = strlen(dir_resolved) + 1 + strlen(name) + 1;
+    char *key = (char *)malloc(length);
+    if (key != NULL)
+    {
+        snprintf(key, length, "%s/%s", dir_resolved, name);
+    }
+    free(dir_resolved);
+    return key;
+}
+
+static int batch_key_equal(const char *a, const char *b)
+{
+    return a != NULL && b != NULL && strcmp(a, b) == 0;
+}
 
-            // calculate grayscale value using green channel
-            data[pixel_offset + 0] = green; // Blue = Green
-            data[pixel_offset + 2] = green; // Red = Green
+// put the jobs in waves: a job goes in the wave after every earlier job whose output it
+// reads or writes, or whose input or message file it overwrites, so running one wave
+// after the other keeps the manifest order wherever it matters; fills order with the
+// job indices wave by wave (manifest order within a wave) and wave_end with the end of
+// each wave in order, returns the number of waves, or -1 if out of memory
+static int batch_schedule(const BatchJob *jobs, size_t job_count, size_t *order, size_t *wave_end)
+{
+    // keys[3 * i]: input, [3 * i + 1]: message file, [3 * i + 2]: output
+    char **keys = (char **)calloc(job_count * 3 + 1, sizeof(char *));
+    int *wave = (int *)calloc(job_count + 1, sizeof(int));
+    if (keys == NULL || wave == NULL)
+    {
+        free(keys);
+        free(wave);
+        return -1;
+    }
+    int result = 0;
+    for (size_t i = 0; i < job_count && result == 0; i++)
+    {
+        const BatchJob *job = &jobs[i];
+        if (job->option == '\0')
+        {
+            continue;
+        }
+        keys[3 * i] = batch_path_key(job->input_bmp);
+        keys[3 * i + 1] = job->option == 'e' ? batch_path_key(job->message_file) : NULL;
+        keys[3 * i + 2] = job->output_bmp[0] != '\0' ? batch_path_key(job->output_bmp) : NULL;
+        if (keys[3 * i] == NULL || (job->option == 'e' && keys[3 * i + 1] == NULL) ||
+            (job->output_bmp[0] != '\0' && keys[3 * i + 2] == NULL))
+        {
+            result = -1;
         }
+    }
 
-        // skip padding bytes and move offset to the start of the next row
-        row_start_offset += (width * 3) + padding;
+    int waves = 0;
+    for (size_t j = 0; j < job_count && result == 0; j++)
+    {
+        char **mine = &keys[3 * j];
+        for (size_t i = 0; i < j; i++)
+        {
+            char **theirs = &keys[3 * i];
+            int reads_output = batch_key_equal(mine[0], theirs[2]) || batch_key_equal(mine[1], theirs[2]);
+            int overwrites = batch_key_equal(mine[2], theirs[0]) || batch_key_equal(mine[2], theirs[1]) ||
+                             batch_key_equal(mine[2], theirs[2]);
+            if ((reads_output || overwrites) && wave[j] <= wave[i])
+            {
+                wave[j] = wave[i] + 1;
+            }
+        }
+        if (wave[j] + 1 > waves)
+        {
+            waves = wave[j] + 1;
+        }
     }
 
-    printf("successfully converted to grayscale\n");
-    return 0; // return 0 for success
+    if (result == 0)
+    {
+        // counting sort by wave, stable so each wave keeps the manifest order
+        size_t next = 0;
+        for (int w = 0; w < waves; w++)
+        {
+            for (size_t i = 0; i < job_count; i++)
+            {
+                if (wave[i] == w)
+                {
+                    order[next++] = i;
+                }
+            }
+            wave_end[w] = next;
+        }
+        result = waves;
+    }
+    for (size_t i = 0; i < job_count * 3; i++)
+    {
+        free(keys[i]);
+    }
+    free(keys);
+    free(wave);
+    return result;
 }
 
-// hide message into BMP image using LSB steganography
-int encode_message(BMPImage *img, char message_file[])
+// ---------------------------------------------------------------------------
+// batch I/O pipeline (-batch with -qd N)
+//
+// The -g/-e/-d jobs on BMP files read and write their images through an I/O
+// queue (ioqueue.h, io_uring or pread/pwrite threads) instead of read_bmp and
+// write_bmp. Up to N whole-file reads and writes are in flight while the
+// thread pool converts, embeds or extracts on the images whose reads have
+// completed, so disk time overlaps CPU time even with a single thread. A job
+// holds one arena buffer from its read to the end of its write, changed in
+// place from the input into the output image, so at most N images are in
+// memory. -h lines, JPEG and PNG inputs, files that cannot be opened or read
+// whole, and the options the pipeline does not cover (-mmap, -stream,
+// --dry-run, --in-place, --patch) run through run_command in the same pass.
+// Reads run ahead of writes, so the pipeline runs one batch_schedule wave at a
+// time. Outputs are written to a temporary file and renamed over the output
+// once the write has completed, so a failed write leaves no truncated image.
+// ---------------------------------------------------------------------------
+
+typedef enum {
+    PIPE_READING = 0, // input read in flight
+    PIPE_READY,       // read complete (or a run_command job), waiting for the CPU stage
+    PIPE_WRITING      // output write in flight
+} PipeStage;
+
+typedef struct {
+    BatchJob *job;
+    PipeStage stage;
+    int direct;          // run through run_command instead
+    int fd;              // input while reading, output while writing
+    unsigned char *file; // whole input file, then the output image (arena buffer)
+    uint64_t size;       // bytes to read or write
+    uint64_t done;       // bytes read or written so far
+    int write_output;    // the CPU stage left an -g/-e output image in file
+    char *temp_name;     // file the output is written to, renamed to the output when complete
+    FILE *report;        // job report, open until the output is written
+    double start;
+} PipeSlot;
+
+typedef struct {
+    BatchRun *run;
+    IoQueue *queue;
+    PipeSlot *slots;
+    PipeSlot **free_slots;
+    int free_count;
+    PipeSlot **ready; // slots for the next CPU stage
+    size_t ready_count;
+    size_t finished;  // jobs done
+} Pipeline;
+
+static int pipe_supported(const BatchJob *job, const CommandOptions *opts)
 {
-    if (img->header.bits_per_pixel != 24 || img->header.compression != 0)
+    if (opts->use_mmap)
     {
-        fprintf(stderr, "Error: This operation only supports uncompressed 24-bit BMP\n");
-        return 2; // Invalid Arguments
+        return 0;
     }
+    return (job->option == 'g' && !opts->stream) ||
+           (job->option == 'e' && !opts->dry_run && !opts->in_place && !opts->patch) || job->option == 'd';
+}
 
-    // read message from file
-    FILE *message_file_ptr = fopen(message_file, "r");
-    if (message_file_ptr == NULL)
+static void pipe_ready(Pipeline *p, PipeSlot *slot, int direct)
+{
+    if (direct && slot->file != NULL)
     {
-        fprintf(stderr, "Error: filename '%s' is not incorrect\n", message_file);
-        return 1; // File Not Found
+        image_arena_release(p->run->arena, slot->file);
+        slot->file = NULL;
     }
-    char message[MAX_MESSAGE_LENGTH + 1];
-    if (fgets(message, sizeof(message), message_file_ptr) == NULL)
+    if (direct && slot->fd >= 0)
     {
-        fprintf(stderr, "Error: reading message from file failed\n");
-        fclose(message_file_ptr);
-        return 1; // File Not Found
+        close(slot->fd);
+        slot->fd = -1;
     }
+    slot->direct = direct;
+    slot->stage = PIPE_READY;
+    p->ready[p->ready_count++] = slot;
+}
 
-    // remove newline character if present
-    int len = strlen(message);
-    if (len > 0 && message[len - 1] == '\n')
+static void pipe_finish(Pipeline *p, PipeSlot *slot)
+{
+    BatchJob *job = slot->job;
+    if (slot->fd >= 0 && close(slot->fd) != 0 && slot->temp_name != NULL && job->status == 0)
     {
-        message[len - 1] = '\0';
+        fprintf(stderr, "Error: writing image data failed\n");
+        job->status = 1; // File Not Found
     }
-
-    // total size of image data in bytes
-    int data_size = (int)img->header.size - img->header.offset;
-    int msg_len = strlen(message);
-
-    // total bits required to encode message (1 byte for length + 8 bits per character)
-    int required_bits = 8 + (msg_len * 8);
-    int max_bits = data_size * 1; // 1 bit per byte of image data
-
-    printf("\n--- encode message ---\n");
-    if (required_bits > max_bits)
+    if (slot->temp_name != NULL)
     {
-        fprintf(stderr, "Error: Message is too long\n");
-        fclose(message_file_ptr);
-        return 2; // Invalid Arguments
-    }
-
-    unsigned char *data = img->data;
-    int data_index = 0; // current index in BMP data array
-
-    // encode message length (1 byte)
-    int len_byte = msg_len;
-    for (int i = 0; i < 8; i++)
-    { // use 8 bytes of image data for 8 bits of length
-        if (data_index >= data_size)
+        if (job->status == 0 && rename(slot->temp_name, job->output_bmp) != 0)
         {
-            fprintf(stderr, "Error: Insufficient space while encoding length\n");
-            fclose(message_file_ptr);
-            return 2; // Invalid Arguments
+            fprintf(stderr, "Error: filename \'%s\' is incorrect\n", job->output_bmp);
+            job->status = 1; // File Not Found
         }
-
-        // extract i-th bit of len_byte
-        int msg_bit = (len_byte >> i) & 1;
-
-        // delete LSB of data byte and set it to msg_bit
-        data[data_index] &= 0xFE;    // delete LSB
-        data[data_index] |= msg_bit; // set LSB
-
-        data_index++;
+        if (job->status != 0)
+        {
+            unlink(slot->temp_name);
+        }
+        free(slot->temp_name);
     }
-
-    // encode message characters
-    for (int i = 0; i < msg_len; i++)
+    if (slot->report != NULL)
     {
-        unsigned char current_char = message[i];
-
-        for (int j = 0; j < 8; j++)
+        if (job->status == 0 && job->option == 'g')
         {
-            if (data_index >= data_size)
-            {
-                fprintf(stderr, "Error: Insufficient space while encoding message\n");
-                fclose(message_file_ptr);
-                return 2; // Invalid Arguments
-            }
-
-            // extract j-th bit of current_char
-            int msg_bit = (current_char >> j) & 1;
-
-            // delete LSB of data byte and set it to msg_bit
-            data[data_index] &= 0xFE;
-            data[data_index] |= msg_bit;
-
-            data_index++;
+            fprintf(slot->report, "grayscale image is saved to %s\n", job->output_bmp);
         }
+        fclose(slot->report);
     }
-    printf("message file \'%s\' is successfully encoded into image\n", message_file);
-    fclose(message_file_ptr);
-    return 0; // return 0 for success
+    if (slot->file != NULL)
+    {
+        image_arena_release(p->run->arena, slot->file);
+    }
+    if (!slot->direct)
+    {
+        job->seconds = monotonic_seconds() - slot->start;
+    }
+    p->free_slots[p->free_count++] = slot;
+    p->finished++;
 }
 
-// decode hidden message from BMP image using LSB steganography
-int decode_message(const BMPImage *img)
+// take a slot for job and queue the read of its whole input file
+static void pipe_start(Pipeline *p, BatchJob *job)
 {
-    if (img->header.bits_per_pixel != 24 || img->header.compression != 0)
+    PipeSlot *slot = p->free_slots[--p->free_count];
+    memset(slot, 0, sizeof(*slot));
+    slot->job = job;
+    slot->fd = -1;
+    slot->start = monotonic_seconds();
+    if (job->option == '\0' || !pipe_supported(job, &p->run->opts))
     {
-        fprintf(stderr, "Error: This operation only supports uncompressed 24-bit BMP\n");
-        return 2; // Invalid Arguments
+        pipe_ready(p, slot, 1);
+        return;
     }
-    // total size of image data in bytes
-    int data_size = (int)img->header.size - img->header.offset;
-    unsigned char *data = img->data;
-    int data_index = 0; // current index in BMP data array
-
-    char message[MAX_MESSAGE_LENGTH + 1]; // buffer for decoded message
-
-    printf("\n--- decode message ---\n");
-    // Decode message length (1 byte) ---
-    int msg_len = 0;
-    for (int i = 0; i < 8; i++)
-    { // use 8 bytes of image data for 8 bits of length
-        if (data_index >= data_size)
-        {
-            fprintf(stderr, "Error: Insufficient space while decoding length\n");
-            return 2; // Invalid Arguments
-        }
-
-        // extract LSB from data byte
-        int bit = data[data_index] & 1;
 
-        // set the i-th bit of msg_len
-        msg_len |= (bit << i);
-
-        data_index++;
+    struct stat st;
+    slot->fd = open(job->input_bmp, O_RDONLY | O_CLOEXEC);
+    if (slot->fd < 0 || fstat(slot->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(BMPHeader) ||
+        (uint64_t)st.st_size > UINT32_MAX)
+    {
+        pipe_ready(p, slot, 1); // run_command reports the error
+        return;
     }
+    slot->size = (uint64_t)st.st_size;
+    job->bytes = slot->size;
+    slot->file = image_arena_acquire(p->run->arena, (size_t)slot->size);
+    if (slot->file == NULL || io_queue_read(p->queue, slot->fd, slot->file, (size_t)slot->size, 0, slot) != 0)
+    {
+        pipe_ready(p, slot, 1);
+        return;
+    }
+    slot->stage = PIPE_READING;
+}
 
-    printf("Decoded message length: %d bytes\n", msg_len);
-
-    // Read the message from the image data
-    for (int i = 0; i < msg_len; i++)
+static void pipe_complete(Pipeline *p, PipeSlot *slot, int64_t result)
+{
+    BatchJob *job = slot->job;
+    if (result > 0)
+    {
+        slot->done += (uint64_t)result;
+    }
+    if (result > 0 && slot->done < slot->size)
     {
-        if (data_index >= data_size)
+        // short transfer: queue the rest (the slot's previous request is done, so there is room)
+        if (slot->stage == PIPE_READING)
         {
-            fprintf(stderr, "Error: Insufficient space while decoding message\n");
-            return 2; // Invalid Arguments
+            io_queue_read(p->queue, slot->fd, slot->file + slot->done, (size_t)(slot->size - slot->done), slot->done, slot);
         }
+        else
+        {
+            io_queue_write(p->queue, slot->fd, slot->file + slot->done, (size_t)(slot->size - slot->done), slot->done,
+                           slot);
+        }
+        return;
+    }
 
-        unsigned char current_char = 0;
-        for (int j = 0; j < 8; j++)
+    if (slot->stage == PIPE_READING)
+    {
+        // only BMP files that read in whole stay in the pipeline
+        int bmp = result > 0 && slot->file[0] == 'B' && slot->file[1] == 'M';
+        if (bmp)
         {
-            // Extract LSB from data byte
-            int bit = data[data_index] & 1;
-            current_char |= (bit << j);
-            data_index++;
+            close(slot->fd);
+            slot->fd = -1;
         }
-        message[i] = current_char;
+        pipe_ready(p, slot, !bmp);
+        return;
     }
 
-    message[msg_len] = '\0'; // Null-terminate the string
-    printf("Hidden message: \"%s\"\n", message);
-    return 0; // return 0 for success
+    if (result <= 0)
+    {
+        fprintf(stderr, "Error: writing image data failed\n");
+        job->status = 1; // File Not Found
+    }
+    else
+    {
+        stats_add(STATS_BYTES_WRITTEN, slot->size);
+    }
+    pipe_finish(p, slot);
 }
 
-// read BMP file from disk into BMPImage structure
-int read_bmp(const char *filename, BMPImage *img)
+// CPU stage of one ready slot, on a pool thread
+static void pipe_cpu_task(void *ctx, size_t task, int worker)
 {
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL)
+    Pipeline *p = (Pipeline *)ctx;
+    PipeSlot *slot = p->ready[task];
+    BatchJob *job = slot->job;
+    if (slot->direct)
     {
-        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", filename);
-        return 1; // File Not Found
+        batch_job_task(p->run, (size_t)(job - p->run->jobs), worker);
+        return;
     }
 
-    // read 54-byte BMP header
-    if (fread(&img->header, sizeof(BMPHeader), 1, file) != 1)
+    slot->report = open_memstream(&job->report, &job->report_length);
+    report_stream = slot->report;
+    const CommandOptions *opts = &p->run->opts;
+    BMPImage img;
+    int status = read_bmp_buffer(slot->file, (size_t)slot->size, &img);
+    if (status == 0 && job->option == 'g')
     {
-        fprintf(stderr, "Error: reading BMP header\n");
-        fclose(file);
-        return 1; // File Not Found
+        StatsSpan span = stats_begin(STATS_GRAYSCALE);
+        status = convert_to_grayscale(&img, NULL, opts->gray_mode);
+        stats_end(&span);
+        slot->write_output = status == 0;
     }
-
-    // check BMP magic number (0x4D42)
-    if (img->header.type != 0x4D42)
+    else if (status == 0 && job->option == 'e')
     {
-        fprintf(stderr, "Error: File is not a valid BMP format (magic number 0x%X)\n", img->header.type);
-        fclose(file);
-        return 2; // Invalid Arguments
+        status = encode_message(&img, job->message_file, opts->bits_per_byte, opts->compress_level, opts->key, NULL);
+        slot->write_output = status == 0;
     }
-
-    // Check for 24-bit uncompressed BMP
-    // Only support 24-bit BMP with no compression
-    if (img->header.bits_per_pixel != 24 || img->header.compression != 0)
+    else if (status == 0)
     {
-        fprintf(stderr, "Error: This operation only supports uncompressed 24-bit BMP\n");
-        fclose(file);
-        return 2; // Invalid Arguments
+        const char *output = job->output_bmp[0] != '\0' ? job->output_bmp : opts->decode_output;
+        status = decode_message(&img, output, opts->key, NULL);
     }
-
-    // calculate the size of the pixel data array (header.size - header.offset)
-    int data_size = (int)img->header.size - img->header.offset;
-
-    // allocate memory for the pixel data
-    img->data = (unsigned char *)malloc(data_size);
-    if (!img->data)
+    job->status = status;
+    if (slot->write_output)
     {
-        fprintf(stderr, "Error: image data memory allocation failed\n");
-        fclose(file);
-        return 3; // Memory Allocation Failure
+        slot->size = img.header.size; // what write_bmp would write: header, gap and pixel data
     }
+    report_stream = NULL;
+}
 
-    // move to the start of the pixel data array
-    if (fseek(file, img->header.offset, SEEK_SET) != 0)
+// after the CPU stage: queue the output write, or finish the job
+static void pipe_after_cpu(Pipeline *p, PipeSlot *slot)
+{
+    BatchJob *job = slot->job;
+    if (slot->direct || !slot->write_output)
     {
-        fprintf(stderr, "Error: seeking to image data offset failed\n");
-        free(img->data);
-        fclose(file);
-        return 1; // File Not Found
+        pipe_finish(p, slot);
+        return;
     }
-
-    // read the pixel data into the allocated memory
-    if (fread(img->data, 1, data_size, file) != data_size)
+    slot->fd = create_temp_output(job->output_bmp, &slot->temp_name);
+    if (slot->fd < 0)
     {
-        fprintf(stderr, "Error: reading image data failed\n");
-        free(img->data);
-        fclose(file);
-        return 1; // File Not Found
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", job->output_bmp);
+        job->status = 1; // File Not Found
+        pipe_finish(p, slot);
+        return;
     }
-
-    fclose(file);
-    return 0; // return 0 for success
+    slot->stage = PIPE_WRITING;
+    slot->done = 0;
+    io_queue_write(p->queue, slot->fd, slot->file, (size_t)slot->size, 0, slot);
 }
 
-// write BMPImage structure to BMP file on disk
-int write_bmp(const char *filename, const BMPImage *img)
+// run the jobs run->order[0..job_count) through the pipeline
+static int run_batch_pipeline(BatchRun *run, size_t job_count, ThreadPool *pool, IoQueue *queue, unsigned depth)
 {
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL)
+    Pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.run = run;
+    p.queue = queue;
+    p.slots = (PipeSlot *)calloc(depth, sizeof(PipeSlot));
+    p.free_slots = (PipeSlot **)malloc(depth * sizeof(PipeSlot *));
+    p.ready = (PipeSlot **)malloc(depth * sizeof(PipeSlot *));
+    IoCompletion *completions = (IoCompletion *)malloc(depth * sizeof(IoCompletion));
+    if (p.slots == NULL || p.free_slots == NULL || p.ready == NULL || completions == NULL)
     {
-        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", filename);
-        return 1; // File Not Found
+        fprintf(stderr, "Error: batch job memory allocation failed\n");
+        free(p.slots);
+        free(p.free_slots);
+        free(p.ready);
+        free(completions);
+        return 3; // Memory Allocation Failure
+    }
+    for (unsigned i = 0; i < depth; i++)
+    {
+        p.free_slots[p.free_count++] = &p.slots[depth - 1 - i];
     }
 
-    // write BMP header
-    if (fwrite(&img->header, sizeof(BMPHeader), 1, file) != 1)
+    int result = 0;
+    size_t next = 0;
+    while (p.finished < job_count)
     {
-        fprintf(stderr, "Error: writing BMP header failed\n");
-        fclose(file);
-        return 1; // File Not Found
+        while (next < job_count && p.free_count > 0)
+        {
+            pipe_start(&p, &run->jobs[run->order[next++]]);
+        }
+        io_queue_submit(queue);
+
+        // take what has completed, and sleep on the queue only when the CPU has nothing to do
+        int wait = p.ready_count == 0;
+        if (wait && io_queue_pending(queue) == 0)
+        {
+            break; // nothing in flight and nothing ready: cannot happen while jobs are left
+        }
+        int count = io_queue_reap(queue, completions, (int)depth, wait);
+        if (count < 0)
+        {
+            fprintf(stderr, "Error: waiting for I/O failed\n");
+            result = 1; // File Not Found
+            break;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            pipe_complete(&p, (PipeSlot *)completions[i].tag, completions[i].result);
+        }
+
+        // the reads and writes queued so far keep going while the pool works
+        if (p.ready_count > 0)
+        {
+            io_queue_submit(queue);
+            thread_pool_run(pool, p.ready_count, pipe_cpu_task, &p);
+            size_t ready_count = p.ready_count;
+            p.ready_count = 0;
+            for (size_t i = 0; i < ready_count; i++)
+            {
+                pipe_after_cpu(&p, p.ready[i]);
+            }
+        }
     }
 
-    // move to the start of the pixel data array
-    if (fseek(file, img->header.offset, SEEK_SET) != 0)
+    free(p.slots);
+    free(p.free_slots);
+    free(p.ready);
+    free(completions);
+    return result;
+}
+
+// run every operation listed in the manifest and print a summary
+int run_batch(const char *manifest_file, const CommandOptions *opts)
+{
+    FILE *manifest = fopen(manifest_file, "r");
+    if (manifest == NULL)
     {
-        fprintf(stderr, "Error: seeking to image data offset failed\n");
-        fclose(file);
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", manifest_file);
         return 1; // File Not Found
     }
 
-    // calculate the size of the pixel data array (header.size - header.offset)
-    int data_size = (int)img->header.size - img->header.offset;
+    BatchJob *jobs = NULL;
+    size_t job_count = 0;
+    size_t job_capacity = 0;
+    char line[BATCH_LINE_LENGTH];
+    int line_number = 0;
 
-    // write the pixel data from the BMPImage structure to the file
-    if (fwrite(img->data, 1, data_size, file) != data_size)
+    while (fgets(line, sizeof(line), manifest) != NULL)
     {
-        fprintf(stderr, "Error: writing image data failed\n");
-        fclose(file);
-        return 1; // File Not Found
+        line_number++;
+        if (job_count == job_capacity)
+        {
+            size_t capacity = job_capacity == 0 ? 64 : job_capacity * 2;
+            BatchJob *grown = (BatchJob *)realloc(jobs, capacity * sizeof(BatchJob));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Error: batch job memory allocation failed\n");
+                free(jobs);
+                fclose(manifest);
+                return 3; // Memory Allocation Failure
+            }
+            jobs = grown;
+            job_capacity = capacity;
+        }
+
+        BatchJob *job = &jobs[job_count];
+        memset(job, 0, sizeof(*job));
+        job->line = line_number;
+
+        // a line that did not fit is an invalid job; its remainder is not a line of its own
+        if (strchr(line, '\n') == NULL && !feof(manifest))
+        {
+            fprintf(stderr, "Error: manifest line %d too long (at most %d bytes)\n", line_number,
+                    BATCH_LINE_LENGTH - 2);
+            int c = fgetc(manifest);
+            while (c != '\n' && c != EOF)
+            {
+                c = fgetc(manifest);
+            }
+            job_count++;
+            continue;
+        }
+
+        if (parse_batch_line(line, job))
+        {
+            job_count++;
+        }
     }
+    fclose(manifest);
 
-    fclose(file);
-    return 0; // return 0 for success
-}
+    // lines that depend on each other's files go in later waves
+    size_t *order = (size_t *)malloc((job_count + 1) * sizeof(size_t));
+    size_t *wave_end = (size_t *)malloc((job_count + 1) * sizeof(size_t));
+    int waves = order != NULL && wave_end != NULL ? batch_schedule(jobs, job_count, order, wave_end) : -1;
+    if (waves < 0)
+    {
+        fprintf(stderr, "Error: batch job memory allocation failed\n");
+        free(order);
+        free(wave_end);
+        free(jobs);
+        return 3; // Memory Allocation Failure
+    }
 
-// parse command line arguments and return option character
-char parse_command_line(int argc, char *argv[], char *input_bmp, char *grayscale_output, char *stego_output, char *message_file)
-{
-    if (argc < 2)
+    // jobs run the single-file code paths; -j parallelises across files instead
+    BatchRun run;
+    run.jobs = jobs;
+    run.opts = *opts;
+    run.opts.jobs = 1;
+    run.order = order;
+
+    ThreadPool *pool = thread_pool_create(opts->jobs);
+    int participants = thread_pool_size(pool);
+    run.arena = image_arena_create();
+    if (run.arena == NULL)
     {
-        fprintf(stderr, "Error: option parsing failed\n");
-        print_help_message();
-        return '\0'; // return null character to indicate error
+        fprintf(stderr, "Error: batch job memory allocation failed\n");
+        thread_pool_destroy(pool);
+        free(order);
+        free(wave_end);
+        free(jobs);
+        return 3; // Memory Allocation Failure
     }
 
-    for (int i = 1; i < argc; i++)
+    // pick the SIMD kernels once, before the workers use them
+    bmpstego_init();
+
+    double start = monotonic_seconds();
+    const char *io_backend = NULL;
+    int pipeline_result = 0;
+    if (opts->queue_depth > 0)
     {
-        if (strcmp(argv[i], "-g") == 0 && i + 2 < argc)
+        IoQueue *queue = io_queue_create(opts->queue_depth, opts->io_threads ? IO_BACKEND_THREADS : IO_BACKEND_AUTO);
+        if (queue == NULL)
         {
-            strcpy(input_bmp, argv[i + 1]);
-            strcpy(grayscale_output, argv[i + 2]);
-            return 'g';
+            thread_pool_destroy(pool);
+            image_arena_destroy(run.arena);
+            free(order);
+            free(wave_end);
+            free(jobs);
+            return 3; // Memory Allocation Failure
         }
-        else if (strcmp(argv[i], "-e") == 0 && i + 3 < argc)
+        io_backend = io_queue_backend_name(queue);
+        for (int w = 0; w < waves; w++)
         {
-            strcpy(input_bmp, argv[i + 1]);
-            strcpy(message_file, argv[i + 2]);
-            strcpy(stego_output, argv[i + 3]);
-            return 'e';
+            size_t begin = w == 0 ? 0 : wave_end[w - 1];
+            run.order = order + begin;
+            int wave_result = run_batch_pipeline(&run, wave_end[w] - begin, pool, queue, opts->queue_depth);
+            if (pipeline_result == 0)
+            {
+                pipeline_result = wave_result;
+            }
         }
-        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        io_queue_destroy(queue);
+    }
+    else
+    {
+        for (int w = 0; w < waves; w++)
         {
-            strcpy(input_bmp, argv[i + 1]);
-            return 'd';
+            size_t begin = w == 0 ? 0 : wave_end[w - 1];
+            run.order = order + begin;
+            thread_pool_run(pool, wave_end[w] - begin, batch_wave_task, &run);
         }
-        else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc)
+    }
+    free(order);
+    free(wave_end);
+    double elapsed = monotonic_seconds() - start;
+    thread_pool_destroy(pool);
+
+    ImageArenaStats arena_stats;
+    image_arena_get_stats(run.arena, &arena_stats);
+    image_arena_destroy(run.arena);
+
+    // reports in manifest order, then the per-file status and totals
+    int result = pipeline_result;
+    size_t failed = 0;
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < job_count; i++)
+    {
+        if (jobs[i].report != NULL)
         {
-            strcpy(input_bmp, argv[i + 1]);
-            return 'h';
+            fwrite(jobs[i].report, 1, jobs[i].report_length, stdout);
         }
-        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+    }
+
+    printf("\n--- batch summary ---\n");
+    for (size_t i = 0; i < job_count; i++)
+    {
+        BatchJob *job = &jobs[i];
+        if (job->option == '\0')
         {
-            strcpy(input_bmp, argv[i + 1]);
-            return 'o';
+            printf("line %d: error 2  invalid manifest line\n", job->line);
+        }
+        else
+        {
+            printf("line %d: %-8s -%c %s", job->line, job->status == 0 ? "ok" : "error", job->option, job->input_bmp);
+            if (job->status != 0)
+            {
+                printf(" (code %d)", job->status);
+            }
+            if (job->option == 'g' || job->option == 'e' || (job->option == 'd' && job->output_bmp[0] != '\0'))
+            {
+                printf(" -> %s", job->output_bmp);
+            }
+            printf(" [%llu bytes, %.3f ms]\n", (unsigned long long)job->bytes, job->seconds * 1e3);
         }
 
-        else if (strcmp(argv[i], "-help") == 0)
+        total_bytes += job->bytes;
+        if (job->status != 0)
         {
-            return 'H';
+            failed++;
+            if (result == 0)
+            {
+                result = job->status;
+            }
         }
+        free(job->report);
     }
 
-    fprintf(stderr, "Error: option parsing failed\n");
-    print_help_message();
-    return '\0'; // return null character to indicate error
+    double seconds = elapsed > 0 ? elapsed : 1e-9;
+    printf("%zu jobs: %zu ok, %zu failed, %d thread(s)\n", job_count, job_count - failed, failed, participants);
+    if (waves > 1)
+    {
+        printf("%d waves: lines that use files written by earlier lines ran after them\n", waves);
+    }
+    printf("%.2f MB in %.3f s (%.2f MB/s, %.1f files/s)\n", total_bytes / 1e6, elapsed, total_bytes / 1e6 / seconds,
+           job_count / seconds);
+    printf("buffer arena: %llu hits, %llu misses, %d slab(s), peak %.2f MB in use / %.2f MB reserved\n",
+           (unsigned long long)arena_stats.hits, (unsigned long long)arena_stats.misses, arena_stats.slabs,
+           arena_stats.peak_in_use / 1e6, arena_stats.peak_reserved / 1e6);
+    if (io_backend != NULL)
+    {
+        printf("I/O queue: %s, depth %u\n", io_backend, opts->queue_depth);
+    }
+
+    free(jobs);
+    return result;
 }
 
 int main(int argc, char *argv[])
@@ -555,11 +1864,10 @@ int main(int argc, char *argv[])
     char stego_output[MAX_FILE_NAME_LENGTH];
     char message_file[MAX_FILE_NAME_LENGTH];
     char option;
-
-    BMPImage bmp_img;
+    CommandOptions opts;
 
     // command line parsing
-    option = parse_command_line(argc, argv, input_bmp, grayscale_output, stego_output, message_file);
+    option = parse_command_line(argc, argv, input_bmp, grayscale_output, stego_output, message_file, &opts);
 
     // quit if option parsing failed
     if (option == '\0')
@@ -567,98 +1875,35 @@ int main(int argc, char *argv[])
         return 2; // Invalid Arguments
     }
 
-    int read_result;
-    switch (option)
+    if (option == 'H') // help message
     {
-    case 'h': // BMP header information
-        read_result = read_bmp(input_bmp, &bmp_img);
-        if (read_result != 0)
-        {
-            return read_result; // return read_bmp's error code
-        }
-        print_header_info(&bmp_img.header);
-        free_bmp_image(&bmp_img);
-        break;
-
-    case 'o': // BMP data hex dump
-        read_result = read_bmp(input_bmp, &bmp_img);
-        if (read_result != 0)
-        {
-            return read_result; // return read_bmp's error code
-        }
-        print_data_hex(&bmp_img);
-        free_bmp_image(&bmp_img);
-        break;
-
-    case 'g': // convert to grayscale
-        read_result = read_bmp(input_bmp, &bmp_img);
-        if (read_result != 0)
-        {
-            return read_result; // return read_bmp's error code
-        }
-
-        int convert_result = convert_to_grayscale(&bmp_img);
-        if (convert_result != 0)
-        {
-            free_bmp_image(&bmp_img);
-            return convert_result; // return convert_to_grayscale's error code
-        }
-
-        int write_result = write_bmp(grayscale_output, &bmp_img);
-        if (write_result != 0)
-        {
-            free_bmp_image(&bmp_img);
-            return write_result; // return write_bmp's error code
-        }
-        printf("grayscale image is saved to %s\n", grayscale_output);
-        free_bmp_image(&bmp_img);
-        break;
-
-    case 'e': // hide message using LSB steganography
-        read_result = read_bmp(input_bmp, &bmp_img);
-        if (read_result != 0)
-        {
-            return read_result; // return read_bmp's error code
-        }
-
-        int encode_result = encode_message(&bmp_img, message_file);
-        if (encode_result != 0)
-        {
-            free_bmp_image(&bmp_img);
-            return encode_result; // return encode_message's error code
-        }
+        print_help_message();
+        return 0;
+    }
 
-        write_result = write_bmp(stego_output, &bmp_img);
-        if (write_result != 0)
-        {
-            free_bmp_image(&bmp_img);
-            return write_result; // return write_bmp's error code
-        }
-        free_bmp_image(&bmp_img);
+    stats_enabled = opts.stats;
+    StatsSpan span = stats_begin(STATS_TOTAL);
+    int result;
+    switch (option)
+    {
+    case 'b': // batch manifest (input_bmp holds the manifest path)
+        result = run_batch(input_bmp, &opts);
         break;
 
-    case 'd': // decode hidden message
-        read_result = read_bmp(input_bmp, &bmp_img);
-        if (read_result != 0)
-        {
-            return read_result; // return read_bmp's error code
-        }
-        int decode_result = decode_message(&bmp_img);
-        if (decode_result != 0)
-        {
-            free_bmp_image(&bmp_img);
-            return decode_result; // return decode_message's error code
-        }
-        free_bmp_image(&bmp_img);
+    case 'S': // daemon (input_bmp holds the socket path)
+        result = serve_run(input_bmp, opts.jobs, opts.json);
         break;
 
-    case 'H': // help message
-        print_help_message();
+    default:
+        result = run_command(option, input_bmp, grayscale_output, stego_output, message_file, &opts, NULL);
         break;
+    }
+    stats_end(&span);
 
-    default:
-        fprintf(stderr, "Error: unknown option\n");
-        return 2; // Invalid Arguments
+    if (opts.stats)
+    {
+        fflush(stdout); // the report follows the command's own output
+        print_stats(opts.json);
     }
-    return 0; // return 0 for success
+    return result;
 }
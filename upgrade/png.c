@@ -0,0 +1,542 @@
+// png.c
+//
+// PNG carrier: the image data is streamed one row at a time. IDAT contents
+// are pulled through the Inflater, each row is unfiltered, handed to the
+// caller (which may rewrite it), filtered again with its original filter type
+// and pushed through the Deflater into new IDAT chunks. Only two rows of the
+// image are in memory at any time, whatever its size. PLTE goes through the
+// caller too; all other chunks are copied byte for byte.
+//
+// The output is written to "<output>.tmp" and renamed when complete, so the
+// input and output may be the same file.
+
+#include <string.h>
+#include "png.h"
+#include "zlib.h"
+
+#define PNG_IO_BUFFER (64 * 1024)
+#define PNG_DEFLATE_LEVEL 6
+#define PNG_MAX_CHUNK 0x7FFFFFFFu
+
+static const unsigned char png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+// Inflater input: the data of consecutive IDAT chunks as one stream
+typedef struct {
+    FILE *in;
+    uint32_t left;              // data bytes left in the current IDAT chunk
+    int in_idat;                // still inside the run of IDAT chunks
+    int error;                  // the file ended inside the run
+    int have_next;              // next_length/next_type hold the chunk after the run
+    uint32_t next_length;
+    unsigned char next_type[4];
+} IdatReader;
+
+static uint32_t load_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store_be32(unsigned char *p, uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static size_t idat_read(void *ctx, unsigned char *buf, size_t size)
+{
+    IdatReader *r = (IdatReader *)ctx;
+    size_t got = 0;
+
+    while (got < size && r->in_idat)
+    {
+        if (r->left == 0)
+        {
+            // CRC of the finished chunk, then the next chunk's length and type
+            unsigned char head[12];
+            if (fread(head, 1, sizeof(head), r->in) != sizeof(head))
+            {
+                r->in_idat = 0;
+                r->error = 1;
+                break;
+            }
+            uint32_t length = load_be32(head + 4);
+            if (memcmp(head + 8, "IDAT", 4) != 0)
+            {
+                r->in_idat = 0;
+                r->have_next = 1;
+                r->next_length = length;
+                memcpy(r->next_type, head + 8, 4);
+                break;
+            }
+            r->left = length;
+            continue;
+        }
+        size_t want = size - got < r->left ? size - got : r->left;
+        size_t n = fread(buf + got, 1, want, r->in);
+        got += n;
+        r->left -= (uint32_t)n;
+        if (n < want)
+        {
+            r->in_idat = 0;
+            r->error = 1;
+        }
+    }
+    return got;
+}
+
+static int write_chunk(FILE *out, const char *type, const unsigned char *data, size_t length)
+{
+    unsigned char head[8];
+    unsigned char tail[4];
+
+    store_be32(head, (uint32_t)length);
+    memcpy(head + 4, type, 4);
+    store_be32(tail, crc32_update(crc32_update(0, head + 4, 4), data, length));
+    return fwrite(head, 1, sizeof(head), out) != sizeof(head) || fwrite(data, 1, length, out) != length ||
+           fwrite(tail, 1, sizeof(tail), out) != sizeof(tail);
+}
+
+static int write_idat(void *ctx, const unsigned char *buf, size_t size)
+{
+    return write_chunk((FILE *)ctx, "IDAT", buf, size);
+}
+
+// copy (out != NULL) or skip count bytes of the input
+static int copy_bytes(FILE *in, FILE *out, uint64_t count)
+{
+    unsigned char buf[PNG_IO_BUFFER];
+
+    if (out == NULL)
+    {
+        return fseeko(in, (off_t)count, SEEK_CUR) != 0;
+    }
+    while (count > 0)
+    {
+        size_t n = count < sizeof(buf) ? (size_t)count : sizeof(buf);
+        if (fread(buf, 1, n, in) != n || fwrite(buf, 1, n, out) != n)
+        {
+            return 1;
+        }
+        count -= n;
+    }
+    return 0;
+}
+
+static inline unsigned char paeth(unsigned char a, unsigned char b, unsigned char c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// undo the filter of a row in place, prior is the previous unfiltered row (zeros for the first)
+static int unfilter_row(unsigned char type, unsigned char *row, const unsigned char *prior, size_t length, int bpp)
+{
+    size_t i;
+
+    switch (type)
+    {
+    case 0:
+        break;
+    case 1: // Sub
+        for (i = (size_t)bpp; i < length; i++)
+        {
+            row[i] = (unsigned char)(row[i] + row[i - bpp]);
+        }
+        break;
+    case 2: // Up
+        for (i = 0; i < length; i++)
+        {
+            row[i] = (unsigned char)(row[i] + prior[i]);
+        }
+        break;
+    case 3: // Average
+        for (i = 0; i < (size_t)bpp && i < length; i++)
+        {
+            row[i] = (unsigned char)(row[i] + (prior[i] >> 1));
+        }
+        for (; i < length; i++)
+        {
+            row[i] = (unsigned char)(row[i] + ((row[i - bpp] + prior[i]) >> 1));
+        }
+        break;
+    case 4: // Paeth
+        for (i = 0; i < (size_t)bpp && i < length; i++)
+        {
+            row[i] = (unsigned char)(row[i] + prior[i]);
+        }
+        for (; i < length; i++)
+        {
+            row[i] = (unsigned char)(row[i] + paeth(row[i - bpp], prior[i], prior[i - bpp]));
+        }
+        break;
+    default:
+        return 1;
+    }
+    return 0;
+}
+
+// filter a row with the given type into out
+static void filter_row(unsigned char type, const unsigned char *row, const unsigned char *prior, unsigned char *out, size_t length, int bpp)
+{
+    size_t i;
+
+    switch (type)
+    {
+    case 1:
+        memcpy(out, row, length < (size_t)bpp ? length : (size_t)bpp);
+        for (i = (size_t)bpp; i < length; i++)
+        {
+            out[i] = (unsigned char)(row[i] - row[i - bpp]);
+        }
+        break;
+    case 2:
+        for (i = 0; i < length; i++)
+        {
+            out[i] = (unsigned char)(row[i] - prior[i]);
+        }
+        break;
+    case 3:
+        for (i = 0; i < (size_t)bpp && i < length; i++)
+        {
+            out[i] = (unsigned char)(row[i] - (prior[i] >> 1));
+        }
+        for (; i < length; i++)
+        {
+            out[i] = (unsigned char)(row[i] - ((row[i - bpp] + prior[i]) >> 1));
+        }
+        break;
+    case 4:
+        for (i = 0; i < (size_t)bpp && i < length; i++)
+        {
+            out[i] = (unsigned char)(row[i] - prior[i]);
+        }
+        for (; i < length; i++)
+        {
+            out[i] = (unsigned char)(row[i] - paeth(row[i - bpp], prior[i], prior[i - bpp]));
+        }
+        break;
+    default:
+        memcpy(out, row, length);
+        break;
+    }
+}
+
+int is_png_file(const char *filename)
+{
+    unsigned char magic[8];
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    int is_png = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, png_signature, 8) == 0;
+    fclose(file);
+    return is_png;
+}
+
+// parse and check IHDR, returns 0 or an error code
+static int parse_ihdr(const unsigned char *data, PNGInfo *info)
+{
+    static const int channels[7] = {1, 0, 3, 1, 2, 0, 4};
+
+    info->width = load_be32(data);
+    info->height = load_be32(data + 4);
+    info->color_type = data[9];
+    if (info->width == 0 || info->height == 0 || info->width > PNG_MAX_CHUNK || info->height > PNG_MAX_CHUNK ||
+        data[10] != 0 || data[11] != 0)
+    {
+        fprintf(stderr, "Error: File is not a valid PNG format\n");
+        return 2; // Invalid Arguments
+    }
+    if (data[8] != 8 || data[12] != 0 || info->color_type > 6 || channels[info->color_type] == 0)
+    {
+        fprintf(stderr, "Error: This operation only supports 8-bit non-interlaced PNG\n");
+        return 2; // Invalid Arguments
+    }
+    info->channels = channels[info->color_type];
+    info->row_bytes = (size_t)info->width * info->channels;
+    return 0;
+}
+
+// the IDAT run: inflate, unfilter, hand to the handler, refilter and deflate row by row
+// *stopped is set when the handler ended a run without output early
+static int process_rows(IdatReader *reader, FILE *out, const PNGInfo *info, const PNGRowHandler *handler, int *stopped)
+{
+    size_t line = info->row_bytes + 1; // filter type byte and the row
+    int bpp = info->channels;
+    int result = 0;
+
+    // original rows (current, previous) and rewritten rows (current, previous), plus filter output
+    unsigned char *buffers = (unsigned char *)calloc(5, line);
+    Inflater *inflater = inflater_create(idat_read, reader);
+    Deflater *deflater = out != NULL ? deflater_create(write_idat, out, PNG_DEFLATE_LEVEL) : NULL;
+    if (buffers == NULL || inflater == NULL || (out != NULL && deflater == NULL))
+    {
+        fprintf(stderr, "Error: image data memory allocation failed\n");
+        free(buffers);
+        inflater_destroy(inflater);
+        deflater_destroy(deflater);
+        return 3; // Memory Allocation Failure
+    }
+    unsigned char *raw = buffers;
+    unsigned char *raw_prior = buffers + line;
+    unsigned char *mod = buffers + 2 * line;
+    unsigned char *mod_prior = buffers + 3 * line;
+    unsigned char *filtered = buffers + 4 * line;
+
+    for (uint32_t y = 0; y < info->height; y++)
+    {
+        if (inflater_read(inflater, raw, line) != (long)line ||
+            unfilter_row(raw[0], raw + 1, raw_prior + 1, info->row_bytes, bpp) != 0)
+        {
+            fprintf(stderr, "Error: reading PNG data failed\n");
+            result = 1; // File Not Found
+            break;
+        }
+        memcpy(mod, raw, line);
+        if (handler->row(handler->ctx, mod + 1, y) != 0 && out == NULL)
+        {
+            *stopped = 1;
+            break;
+        }
+        if (out != NULL)
+        {
+            filtered[0] = raw[0];
+            filter_row(raw[0], mod + 1, mod_prior + 1, filtered + 1, info->row_bytes, bpp);
+            if (deflater_write(deflater, filtered, line) != 0)
+            {
+                fprintf(stderr, "Error: writing PNG data failed\n");
+                result = 1;
+                break;
+            }
+        }
+
+        unsigned char *swap = raw_prior;
+        raw_prior = raw;
+        raw = swap;
+        swap = mod_prior;
+        mod_prior = mod;
+        mod = swap;
+    }
+
+    if (result == 0 && !*stopped)
+    {
+        // the end of the zlib stream (checks adler32), then any IDAT data after it
+        unsigned char rest[64];
+        long n;
+        while ((n = inflater_read(inflater, rest, sizeof(rest))) > 0)
+        {
+        }
+        while (idat_read(reader, rest, sizeof(rest)) > 0)
+        {
+        }
+        if (n < 0 || reader->error)
+        {
+            fprintf(stderr, "Error: reading PNG data failed\n");
+            result = 1; // File Not Found
+        }
+        else if (out != NULL && deflater_finish(deflater) != 0)
+        {
+            fprintf(stderr, "Error: writing PNG data failed\n");
+            result = 1;
+        }
+    }
+
+    free(buffers);
+    inflater_destroy(inflater);
+    deflater_destroy(deflater);
+    return result;
+}
+
+static int process_chunks(FILE *in, FILE *out, const PNGRowHandler *handler)
+{
+    unsigned char head[8];
+    unsigned char data[13 + 4];
+    PNGInfo info;
+    IdatReader reader;
+    int seen_ihdr = 0;
+    int seen_idat = 0;
+
+    memset(&reader, 0, sizeof(reader));
+    reader.in = in;
+
+    for (;;)
+    {
+        if (reader.have_next)
+        {
+            store_be32(head, reader.next_length);
+            memcpy(head + 4, reader.next_type, 4);
+            reader.have_next = 0;
+        }
+        else if (fread(head, 1, sizeof(head), in) != sizeof(head))
+        {
+            fprintf(stderr, "Error: reading PNG data failed\n");
+            return 1; // File Not Found
+        }
+        uint32_t length = load_be32(head);
+        const unsigned char *type = head + 4;
+        if (length > PNG_MAX_CHUNK || seen_ihdr != (memcmp(type, "IHDR", 4) != 0))
+        {
+            fprintf(stderr, "Error: File is not a valid PNG format\n");
+            return 2; // Invalid Arguments
+        }
+
+        if (memcmp(type, "IHDR", 4) == 0)
+        {
+            if (length != 13 || fread(data, 1, 17, in) != 17 ||
+                load_be32(data + 13) != crc32_update(crc32_update(0, type, 4), data, 13))
+            {
+                fprintf(stderr, "Error: File is not a valid PNG format\n");
+                return 2; // Invalid Arguments
+            }
+            int result = parse_ihdr(data, &info);
+            if (result == 0)
+            {
+                result = handler->begin(handler->ctx, &info);
+            }
+            if (result != 0)
+            {
+                return result;
+            }
+            if (out != NULL && (fwrite(head, 1, 8, out) != 8 || fwrite(data, 1, 17, out) != 17))
+            {
+                fprintf(stderr, "Error: writing PNG data failed\n");
+                return 1;
+            }
+            seen_ihdr = 1;
+        }
+        else if (memcmp(type, "PLTE", 4) == 0)
+        {
+            unsigned char palette[256 * 3 + 4];
+            if (length % 3 != 0 || length > 256 * 3 || fread(palette, 1, length + 4, in) != length + 4 ||
+                load_be32(palette + length) != crc32_update(crc32_update(0, type, 4), palette, length))
+            {
+                fprintf(stderr, "Error: File is not a valid PNG format\n");
+                return 2; // Invalid Arguments
+            }
+            if (handler->palette != NULL)
+            {
+                int result = handler->palette(handler->ctx, palette, length / 3);
+                if (result != 0)
+                {
+                    return result;
+                }
+            }
+            if (out != NULL && write_chunk(out, "PLTE", palette, length) != 0)
+            {
+                fprintf(stderr, "Error: writing PNG data failed\n");
+                return 1;
+            }
+        }
+        else if (memcmp(type, "IDAT", 4) == 0)
+        {
+            if (seen_idat)
+            {
+                fprintf(stderr, "Error: File is not a valid PNG format\n");
+                return 2; // Invalid Arguments
+            }
+            seen_idat = 1;
+            reader.left = length;
+            reader.in_idat = 1;
+            int stopped = 0;
+            int result = process_rows(&reader, out, &info, handler, &stopped);
+            if (result != 0 || stopped)
+            {
+                return result;
+            }
+        }
+        else
+        {
+            if ((out != NULL && fwrite(head, 1, 8, out) != 8) || copy_bytes(in, out, (uint64_t)length + 4) != 0)
+            {
+                fprintf(stderr, "Error: reading PNG data failed\n");
+                return 1; // File Not Found
+            }
+            if (memcmp(type, "IEND", 4) == 0)
+            {
+                break;
+            }
+        }
+    }
+
+    if (!seen_idat)
+    {
+        fprintf(stderr, "Error: File is not a valid PNG format\n");
+        return 2; // Invalid Arguments
+    }
+    return 0;
+}
+
+int process_png(const char *input_file, const char *output_file, const PNGRowHandler *handler)
+{
+    unsigned char magic[8];
+    FILE *in = fopen(input_file, "rb");
+    if (in == NULL)
+    {
+        fprintf(stderr, "Error: filename \'%s\' is incorrect\n", input_file);
+        return 1; // File Not Found
+    }
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, png_signature, 8) != 0)
+    {
+        fprintf(stderr, "Error: File is not a valid PNG format\n");
+        fclose(in);
+        return 2; // Invalid Arguments
+    }
+
+    FILE *out = NULL;
+    char *temp_name = NULL;
+    if (output_file != NULL)
+    {
+        size_t name_length = strlen(output_file);
+        temp_name = (char *)malloc(name_length + 5);
+        if (temp_name == NULL)
+        {
+            fprintf(stderr, "Error: image data memory allocation failed\n");
+            fclose(in);
+            return 3; // Memory Allocation Failure
+        }
+        memcpy(temp_name, output_file, name_length);
+        memcpy(temp_name + name_length, ".tmp", 5);
+        out = fopen(temp_name, "wb");
+        if (out == NULL || fwrite(png_signature, 1, 8, out) != 8)
+        {
+            fprintf(stderr, "Error: filename \'%s\' is incorrect\n", output_file);
+            if (out != NULL)
+            {
+                fclose(out);
+                remove(temp_name);
+            }
+            free(temp_name);
+            fclose(in);
+            return 1; // File Not Found
+        }
+    }
+
+    int result = process_chunks(in, out, handler);
+    fclose(in);
+
+    if (out != NULL)
+    {
+        if (fclose(out) != 0 && result == 0)
+        {
+            fprintf(stderr, "Error: writing PNG data failed\n");
+            result = 1;
+        }
+        if (result == 0 && rename(temp_name, output_file) != 0)
+        {
+            fprintf(stderr, "Error: filename \'%s\' is incorrect\n", output_file);
+            result = 1;
+        }
+        if (result != 0)
+        {
+            remove(temp_name);
+        }
+        free(temp_name);
+    }
+    return result;
+}
@@ -0,0 +1,42 @@
+// png.h
+#ifndef PNG_H
+#define PNG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define PNG_COLOR_GRAY 0
+#define PNG_COLOR_RGB 2
+#define PNG_COLOR_PALETTE 3
+#define PNG_COLOR_GRAY_ALPHA 4
+#define PNG_COLOR_RGBA 6
+
+// image parameters from IHDR (8-bit, non-interlaced images only)
+typedef struct {
+  uint32_t  width;            // width in pixels
+  uint32_t  height;           // height in pixels
+  uint8_t   color_type;       // PNG_COLOR_*
+  int       channels;         // samples (bytes) per pixel
+  size_t    row_bytes;        // bytes of an unfiltered row
+} PNGInfo;
+
+// callbacks of process_png, called in file order
+typedef struct {
+  void  *ctx;
+  // after IHDR; a nonzero return stops processing and becomes the result
+  int  (*begin)(void *ctx, const PNGInfo *info);
+  // PLTE contents as RGB triples, may be rewritten in place (may be NULL);
+  // a nonzero return stops processing and becomes the result
+  int  (*palette)(void *ctx, unsigned char *rgb, uint32_t entries);
+  // one unfiltered row, may be rewritten in place; a nonzero return ends a
+  // run without output early (with output every row is processed)
+  int  (*row)(void *ctx, unsigned char *row, uint32_t y);
+} PNGRowHandler;
+
+int is_png_file(const char *filename);
+// stream the rows of input_file through handler; with an output_file the
+// (possibly rewritten) image is filtered and compressed again into it
+int process_png(const char *input_file, const char *output_file, const PNGRowHandler *handler);
+
+#endif // PNG_H
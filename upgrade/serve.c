@@ -0,0 +1,653 @@
+// serve.c
+//
+// --serve: a long-running bw2bmp that answers encode, decode and grayscale
+// requests on a Unix socket (protocol in serve.h), so small images do not pay
+// for process startup, file opens and first-touch page faults on every call.
+// A fixed set of workers accept connections and run their requests on the
+// buffer API: the image descriptor is mapped shared and changed in place, and
+// messages go through per-worker buffers that are touched once at startup and
+// only ever grow. Each worker keeps a histogram of its service times.
+
+#define _GNU_SOURCE // accept4, MSG_CMSG_CLOEXEC
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "serve.h"
+
+#define SERVE_WARM_BYTES (1 << 20)      // initial message and output buffer of each worker
+#define SERVE_HISTOGRAM_BUCKETS 10000   // 1 us buckets, the last one also counts everything slower
+#define SERVE_BACKLOG 128
+
+typedef struct {
+    StegoServer *server;
+    pthread_t thread;
+    _Atomic int conn;          // connection being served, -1 between connections
+    unsigned char *message;    // encode input
+    size_t message_capacity;
+    unsigned char *out;        // decode output
+    size_t out_capacity;
+    uint64_t requests;
+    uint64_t failed;
+    uint64_t max_ns;
+    uint32_t histogram[SERVE_HISTOGRAM_BUCKETS];
+} ServeWorker;
+
+struct StegoServer {
+    int listen_fd;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    atomic_int stopping;
+    int worker_count;
+    ServeWorker *workers;
+};
+
+static uint64_t serve_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// grow *buf to at least size bytes (never shrinks, so later requests find it warm)
+static int reserve_buffer(unsigned char **buf, size_t *capacity, size_t size)
+{
+    if (size <= *capacity)
+    {
+        return BMPSTEGO_OK;
+    }
+    unsigned char *grown = (unsigned char *)realloc(*buf, size);
+    if (grown == NULL)
+    {
+        return BMPSTEGO_ERR_NOMEM;
+    }
+    *buf = grown;
+    *capacity = size;
+    return BMPSTEGO_OK;
+}
+
+static int read_message(ServeWorker *w, int fd, uint64_t length)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < length)
+    {
+        return BMPSTEGO_ERR_IO;
+    }
+    if (reserve_buffer(&w->message, &w->message_capacity, (size_t)length) != BMPSTEGO_OK)
+    {
+        return BMPSTEGO_ERR_NOMEM;
+    }
+    for (uint64_t done = 0; done < length;)
+    {
+        ssize_t n = pread(fd, w->message + done, (size_t)(length - done), (off_t)done);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return BMPSTEGO_ERR_IO;
+        }
+        done += (uint64_t)n;
+    }
+    return BMPSTEGO_OK;
+}
+
+// the message replaces the contents of fd
+static int write_message(int fd, const unsigned char *message, size_t length)
+{
+    for (size_t done = 0; done < length;)
+    {
+        ssize_t n = pwrite(fd, message + done, length - done, (off_t)done);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return BMPSTEGO_ERR_IO;
+        }
+        done += (size_t)n;
+    }
+    return ftruncate(fd, (off_t)length) == 0 ? BMPSTEGO_OK : BMPSTEGO_ERR_IO;
+}
+
+static int serve_decode(ServeWorker *w, const BMPImage *img, int out_fd, const BMPStegoOptions *options, uint64_t *length)
+{
+    size_t size;
+    int status = bmpstego_decode(img, w->out, w->out_capacity, &size, options);
+    if (status == BMPSTEGO_ERR_BUFFER && reserve_buffer(&w->out, &w->out_capacity, size) == BMPSTEGO_OK)
+    {
+        status = bmpstego_decode(img, w->out, w->out_capacity, &size, options);
+    }
+    *length = size;
+    if (status == BMPSTEGO_OK)
+    {
+        status = write_message(out_fd, w->out, size);
+    }
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// a client that shrinks the image descriptor while a worker has it mapped makes
+// the pages past the new end raise SIGBUS. The handler puts anonymous zero pages
+// over the rest of the mapping and notes the fault, so the request runs to its
+// end (freeing whatever the library allocated) and is answered BMPSTEGO_ERR_IO.
+// A SIGBUS anywhere else gets the action that was installed before.
+// ---------------------------------------------------------------------------
+
+static __thread unsigned char *fault_map; // image mapping of the request being served, or NULL
+static __thread size_t fault_map_size;
+static __thread volatile sig_atomic_t fault_hit;
+static struct sigaction previous_sigbus;
+static uintptr_t page_size;
+
+static void serve_sigbus(int sig, siginfo_t *info, void *context)
+{
+    (void)context;
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    uintptr_t start = (uintptr_t)fault_map;
+    if (fault_map != NULL && addr >= start && addr < start + fault_map_size)
+    {
+        uintptr_t page = addr & ~(page_size - 1);
+        if (mmap((void *)page, start + fault_map_size - page, PROT_READ | PROT_WRITE,
+                 MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) != MAP_FAILED)
+        {
+            fault_hit = 1;
+            return; // the access is retried on the zero page
+        }
+    }
+    // not ours: put the old action back, the retried access raises the signal again
+    sigaction(sig, &previous_sigbus, NULL);
+}
+
+static void install_sigbus_handler(void)
+{
+    page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = serve_sigbus;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, &previous_sigbus);
+}
+
+static int serve_request(ServeWorker *w, const ServeRequest *request, const int *fds, int fd_count, uint64_t *length)
+{
+    int needed = request->op == SERVE_GRAYSCALE ? 1 : 2;
+    if (request->op < SERVE_ENCODE || request->op > SERVE_GRAYSCALE || fd_count != needed ||
+        request->key_length >= SERVE_MAX_KEY || request->gray_mode < GRAY_GREEN || request->gray_mode > GRAY_BT709)
+    {
+        return BMPSTEGO_ERR_INVALID;
+    }
+    char key[SERVE_MAX_KEY];
+    memcpy(key, request->key, request->key_length);
+    key[request->key_length] = '\0';
+    BMPStegoOptions options = {request->bits_per_byte, request->compress_level, request->key_length > 0 ? key : NULL,
+                               NULL};
+
+    struct stat st;
+    if (fstat(fds[0], &st) != 0 || st.st_size <= 0)
+    {
+        return BMPSTEGO_ERR_IO;
+    }
+    // grayscale touches every page, so map them all at once; encode and decode only fault in the carrier they use
+    size_t size = (size_t)st.st_size;
+    int prot = request->op == SERVE_DECODE ? PROT_READ : PROT_READ | PROT_WRITE;
+    int flags = MAP_SHARED | (request->op == SERVE_GRAYSCALE ? MAP_POPULATE : 0);
+    unsigned char *file = (unsigned char *)mmap(NULL, size, prot, flags, fds[0], 0);
+    if (file == MAP_FAILED)
+    {
+        return BMPSTEGO_ERR_IO;
+    }
+
+    fault_hit = 0;
+    fault_map_size = size;
+    fault_map = file;
+    atomic_signal_fence(memory_order_seq_cst);
+
+    BMPImage img;
+    int status = bmpstego_image_view(&img, file, size);
+    if (status == BMPSTEGO_OK)
+    {
+        switch (request->op)
+        {
+        case SERVE_ENCODE:
+            status = read_message(w, fds[1], request->message_length);
+            if (status == BMPSTEGO_OK)
+            {
+                status = bmpstego_encode(&img, w->message, (size_t)request->message_length, &options);
+                *length = request->message_length;
+            }
+            break;
+        case SERVE_DECODE:
+            status = serve_decode(w, &img, fds[1], &options, length);
+            break;
+        default:
+            status = bmpstego_grayscale(&img, NULL, (GrayscaleMode)request->gray_mode);
+            break;
+        }
+    }
+    atomic_signal_fence(memory_order_seq_cst);
+    fault_map = NULL;
+    munmap(file, size);
+    return fault_hit ? BMPSTEGO_ERR_IO : status;
+}
+
+// one request packet and its descriptors; 0 when the client hung up
+static ssize_t receive_request(int conn, ServeRequest *request, int *fds, int *fd_count)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SERVE_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {request, sizeof(*request)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do
+    {
+        n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    *fd_count = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); n >= 0 && c != NULL; c = CMSG_NXTHDR(&msg, c))
+    {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+        {
+            int count = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < count && *fd_count < SERVE_MAX_FDS; i++)
+            {
+                memcpy(&fds[(*fd_count)++], CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            }
+        }
+    }
+    if (n > 0 && (size_t)n != sizeof(*request))
+    {
+        request->magic = 0; // truncated or short packet: answered as invalid
+    }
+    if (n >= 0 && (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+    {
+        request->magic = 0; // a longer packet, or more descriptors than any request takes
+    }
+    return n;
+}
+
+static void record_latency(ServeWorker *w, uint64_t ns, int status)
+{
+    uint64_t us = ns / 1000;
+    w->histogram[us < SERVE_HISTOGRAM_BUCKETS ? us : SERVE_HISTOGRAM_BUCKETS - 1]++;
+    w->requests++;
+    w->failed += status != BMPSTEGO_OK;
+    if (ns > w->max_ns)
+    {
+        w->max_ns = ns;
+    }
+}
+
+static void serve_connection(ServeWorker *w, int conn)
+{
+    for (;;)
+    {
+        ServeRequest request;
+        int fds[SERVE_MAX_FDS];
+        int fd_count;
+        if (receive_request(conn, &request, fds, &fd_count) <= 0)
+        {
+            for (int i = 0; i < fd_count; i++)
+            {
+                close(fds[i]);
+            }
+            return;
+        }
+
+        uint64_t start = serve_now_ns();
+        ServeReply reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.status = request.magic == SERVE_MAGIC ? serve_request(w, &request, fds, fd_count, &reply.length)
+                                                    : BMPSTEGO_ERR_INVALID;
+        for (int i = 0; i < fd_count; i++)
+        {
+            close(fds[i]);
+        }
+        reply.service_ns = serve_now_ns() - start;
+        record_latency(w, reply.service_ns, reply.status);
+
+        if (send(conn, &reply, sizeof(reply), MSG_NOSIGNAL) != (ssize_t)sizeof(reply))
+        {
+            return;
+        }
+    }
+}
+
+static void *serve_worker(void *arg)
+{
+    ServeWorker *w = (ServeWorker *)arg;
+    StegoServer *server = w->server;
+    while (!atomic_load(&server->stopping))
+    {
+        int conn = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            break; // the socket was shut down (or is broken)
+        }
+        atomic_store(&w->conn, conn);
+        if (!atomic_load(&server->stopping)) // serve_stop may have looked before the store
+        {
+            serve_connection(w, conn);
+        }
+        atomic_store(&w->conn, -1);
+        close(conn);
+    }
+    return NULL;
+}
+
+// bind socket_path, replacing a stale socket file but not a live server
+static int serve_listen(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: socket path '%s' is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int probe = serve_connect(socket_path);
+    if (probe >= 0)
+    {
+        close(probe);
+        fprintf(stderr, "Error: another server is listening on '%s'\n", socket_path);
+        return -1;
+    }
+    if (errno == ECONNREFUSED)
+    {
+        unlink(socket_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SERVE_BACKLOG) != 0)
+    {
+        fprintf(stderr, "Error: cannot listen on '%s': %s\n", socket_path, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+StegoServer *serve_start(const char *socket_path, int workers)
+{
+    static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+    bmpstego_init();
+    pthread_once(&sigbus_once, install_sigbus_handler);
+    StegoServer *server = (StegoServer *)calloc(1, sizeof(StegoServer));
+    ServeWorker *slots = (ServeWorker *)calloc(workers > 0 ? workers : 1, sizeof(ServeWorker));
+    if (server == NULL || slots == NULL)
+    {
+        fprintf(stderr, "Error: memory allocation failed\n");
+        free(server);
+        free(slots);
+        return NULL;
+    }
+    server->workers = slots;
+    server->listen_fd = serve_listen(socket_path);
+    if (server->listen_fd < 0)
+    {
+        free(slots);
+        free(server);
+        return NULL;
+    }
+    strcpy(server->path, socket_path);
+
+    // workers never take SIGPIPE from a client that went away mid-reply
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block, &saved);
+    for (int i = 0; i < (workers > 0 ? workers : 1); i++)
+    {
+        ServeWorker *w = &slots[i];
+        w->server = server;
+        atomic_init(&w->conn, -1);
+        w->message = (unsigned char *)malloc(SERVE_WARM_BYTES);
+        w->out = (unsigned char *)malloc(SERVE_WARM_BYTES);
+        if (w->message != NULL && w->out != NULL)
+        {
+            // fault the buffers in now rather than on the first requests
+            memset(w->message, 0, SERVE_WARM_BYTES);
+            memset(w->out, 0, SERVE_WARM_BYTES);
+            w->message_capacity = SERVE_WARM_BYTES;
+            w->out_capacity = SERVE_WARM_BYTES;
+        }
+        if (w->message == NULL || w->out == NULL || pthread_create(&w->thread, NULL, serve_worker, w) != 0)
+        {
+            free(w->message);
+            free(w->out);
+            fprintf(stderr, "Error: cannot start server worker %d\n", i + 1);
+            break;
+        }
+        server->worker_count++;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (server->worker_count == 0)
+    {
+        serve_stop(server, NULL);
+        return NULL;
+    }
+    return server;
+}
+
+static uint64_t histogram_percentile(const uint32_t *histogram, uint64_t count, uint64_t max_ns, double p)
+{
+    uint64_t rank = (uint64_t)(p * count + 0.999999);
+    uint64_t seen = 0;
+    for (int us = 0; us < SERVE_HISTOGRAM_BUCKETS - 1; us++)
+    {
+        seen += histogram[us];
+        if (seen >= rank && seen > 0)
+        {
+            uint64_t upper = (uint64_t)(us + 1) * 1000; // bucket upper bound
+            return upper < max_ns ? upper : max_ns;
+        }
+    }
+    return max_ns;
+}
+
+void serve_stop(StegoServer *server, ServeSummary *summary)
+{
+    atomic_store(&server->stopping, 1);
+    shutdown(server->listen_fd, SHUT_RDWR); // wakes the workers blocked in accept
+    for (int i = 0; i < server->worker_count; i++)
+    {
+        int conn = atomic_load(&server->workers[i].conn);
+        if (conn >= 0)
+        {
+            shutdown(conn, SHUT_RDWR); // ends the connection after the request in progress
+        }
+    }
+
+    // the histograms add up in the first worker's
+    uint32_t *histogram = server->workers[0].histogram;
+    ServeSummary total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < server->worker_count; i++)
+    {
+        ServeWorker *w = &server->workers[i];
+        pthread_join(w->thread, NULL);
+        for (int us = 0; i > 0 && us < SERVE_HISTOGRAM_BUCKETS; us++)
+        {
+            histogram[us] += w->histogram[us];
+        }
+        total.requests += w->requests;
+        total.failed += w->failed;
+        total.max_ns = w->max_ns > total.max_ns ? w->max_ns : total.max_ns;
+        free(w->message);
+        free(w->out);
+    }
+    total.p50_ns = histogram_percentile(histogram, total.requests, total.max_ns, 0.50);
+    total.p99_ns = histogram_percentile(histogram, total.requests, total.max_ns, 0.99);
+    if (summary != NULL)
+    {
+        *summary = total;
+    }
+
+    close(server->listen_fd);
+    unlink(server->path);
+    free(server->workers);
+    free(server);
+}
+
+int serve_run(const char *socket_path, int workers, int json)
+{
+    // SIGINT and SIGTERM are taken with sigwait below, never by a worker
+    sigset_t stop, saved;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, &saved);
+
+    StegoServer *server = serve_start(socket_path, workers);
+    if (server == NULL)
+    {
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        return 1; // File Not Found (the socket could not be set up)
+    }
+    fprintf(report_out(), "serving on '%s' with %d worker(s), stop with SIGINT or SIGTERM\n", socket_path,
+            server->worker_count);
+    fflush(report_out());
+
+    int sig;
+    sigwait(&stop, &sig);
+    ServeSummary summary;
+    serve_stop(server, &summary);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    FILE *out = report_out();
+    if (json)
+    {
+        fprintf(out, "{\"serve\":\"summary\",\"requests\":%llu,\"failed\":%llu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+                (unsigned long long)summary.requests, (unsigned long long)summary.failed,
+                summary.p50_ns / 1e3, summary.p99_ns / 1e3, summary.max_ns / 1e3);
+    }
+    else
+    {
+        fprintf(out, "served %llu request(s), %llu failed; service time p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                (unsigned long long)summary.requests, (unsigned long long)summary.failed, summary.p50_ns / 1e3,
+                summary.p99_ns / 1e3, summary.max_ns / 1e3);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// client side
+// ---------------------------------------------------------------------------
+
+int serve_connect(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        fd = -1;
+    }
+    return fd;
+}
+
+int serve_request_init(ServeRequest *request, ServeOp op, const char *key)
+{
+    memset(request, 0, sizeof(*request));
+    request->magic = SERVE_MAGIC;
+    request->op = op;
+    request->bits_per_byte = 1;
+    if (key != NULL)
+    {
+        size_t length = strlen(key);
+        if (length >= SERVE_MAX_KEY)
+        {
+            return 2; // Invalid Arguments
+        }
+        memcpy(request->key, key, length);
+        request->key_length = (uint32_t)length;
+    }
+    return 0;
+}
+
+int serve_call(int conn, const ServeRequest *request, const int *fds, int fd_count, ServeReply *reply)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SERVE_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {(void *)request, sizeof(*request)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd_count > 0)
+    {
+        if (fd_count > SERVE_MAX_FDS)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * fd_count);
+    }
+
+    ssize_t n;
+    do
+    {
+        n = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t)sizeof(*request))
+    {
+        return -1;
+    }
+    do
+    {
+        n = recv(conn, reply, sizeof(*reply), 0);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)sizeof(*reply) ? 0 : -1;
+}
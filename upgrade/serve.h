@@ -0,0 +1,86 @@
+// serve.h
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "bmpstego.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ---------------------------------------------------------------------------
+// --serve protocol: a client connects to the SOCK_SEQPACKET Unix socket and
+// sends one ServeRequest per packet with its descriptors attached
+// (SCM_RIGHTS); the server answers each with one ServeReply.
+//
+//   SERVE_ENCODE     fds: image (read-write), message   hides message_length bytes
+//   SERVE_DECODE     fds: image, output (seekable)      writes the message at offset 0
+//   SERVE_GRAYSCALE  fds: image (read-write)            converts in place
+//
+// The image descriptor is a BMP file or shared memory (memfd, shm_open)
+// holding one from offset 0; it is mapped shared and changed in place, so
+// the client passes a copy if it wants to keep the original. Shrinking it
+// while the request runs fails the request with BMPSTEGO_ERR_IO.
+// ---------------------------------------------------------------------------
+
+#define SERVE_MAGIC 0x31534D42     // "BMS1"
+#define SERVE_MAX_KEY 256          // key bytes, including the terminating 0
+#define SERVE_MAX_FDS 2
+
+typedef enum {
+  SERVE_ENCODE = 1,
+  SERVE_DECODE,
+  SERVE_GRAYSCALE
+} ServeOp;
+
+typedef struct {
+  uint32_t  magic;            // SERVE_MAGIC
+  uint32_t  op;               // ServeOp
+  int32_t   bits_per_byte;    // encode: message bits per carrier byte (1-4)
+  int32_t   compress_level;   // encode: deflate level (1-9), 0 = store
+  int32_t   gray_mode;        // grayscale: GrayscaleMode
+  uint32_t  key_length;       // bytes of key, 0 = no key
+  uint64_t  message_length;   // encode: bytes of the message descriptor to hide
+  char      key[SERVE_MAX_KEY]; // passphrase of the keyed order (encode, decode)
+} ServeRequest;
+
+typedef struct {
+  int32_t   status;           // BMPStegoStatus
+  uint32_t  reserved;
+  uint64_t  length;           // message bytes hidden (encode) or written (decode); needed size on failure
+  uint64_t  service_ns;       // time the worker spent on the request
+} ServeReply;
+
+typedef struct {
+  uint64_t  requests;         // requests answered
+  uint64_t  failed;           // of which did not return BMPSTEGO_OK
+  uint64_t  p50_ns;           // service time percentiles (1 us resolution below 10 ms)
+  uint64_t  p99_ns;
+  uint64_t  max_ns;
+} ServeSummary;
+
+typedef struct StegoServer StegoServer;
+
+// listen on socket_path with workers threads; errors go to stderr, NULL on failure
+StegoServer *serve_start(const char *socket_path, int workers);
+
+// close the socket and the open connections, join the workers, fill summary (may be NULL)
+void serve_stop(StegoServer *server, ServeSummary *summary);
+
+// --serve: serve until SIGINT or SIGTERM, then report the summary; 0, or 1 if the socket could not be set up
+int serve_run(const char *socket_path, int workers, int json);
+
+// client side: connect (-1 on failure, errno set), fill a request (2 if the
+// key is too long), and make one round trip (0, or -1 if the connection failed)
+int serve_connect(const char *socket_path);
+int serve_request_init(ServeRequest *request, ServeOp op, const char *key);
+int serve_call(int conn, const ServeRequest *request, const int *fds, int fd_count, ServeReply *reply);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SERVE_H
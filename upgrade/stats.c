@@ -0,0 +1,129 @@
+// stats.c
+//
+// Run statistics for --stats. Spans time the phases of a command (file reads,
+// mapping, embedding, writes, ...) on the monotonic clock together with the
+// page faults of the calling thread, and counters add up the bytes read and
+// written and the message bits hidden or recovered. Both are process-wide
+// atomics, so batch workers share them, and print_stats reports them on
+// stderr at the end of the run. The hooks in stats.h only call in here while
+// stats_enabled is set.
+
+#define _GNU_SOURCE // RUSAGE_THREAD
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+static const char *stats_phase_names[STATS_PHASE_COUNT] = {"total", "read", "map", "embed", "extract", "grayscale", "hex", "write"};
+static const char *stats_counter_names[STATS_COUNTER_COUNT] = {"bytes_read", "bytes_written", "bits_embedded", "bits_extracted"};
+
+typedef struct {
+    _Atomic uint64_t calls;
+    _Atomic uint64_t ns;
+    _Atomic uint64_t minor_faults;
+    _Atomic uint64_t major_faults;
+} StatsPhaseTotals;
+
+int stats_enabled = 0;
+static StatsPhaseTotals stats_phases[STATS_PHASE_COUNT];
+static _Atomic uint64_t stats_counters[STATS_COUNTER_COUNT];
+
+static uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void stats_thread_faults(long *minor, long *major)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) != 0)
+    {
+        memset(&usage, 0, sizeof(usage));
+    }
+    *minor = usage.ru_minflt;
+    *major = usage.ru_majflt;
+}
+
+StatsSpan stats_span_start(StatsPhase phase)
+{
+    StatsSpan span;
+    span.phase = (int)phase;
+    stats_thread_faults(&span.minor_faults, &span.major_faults);
+    span.start_ns = stats_now_ns();
+    return span;
+}
+
+void stats_span_finish(const StatsSpan *span)
+{
+    uint64_t ns = stats_now_ns() - span->start_ns;
+    long minor, major;
+    stats_thread_faults(&minor, &major);
+    StatsPhaseTotals *totals = &stats_phases[span->phase];
+    atomic_fetch_add_explicit(&totals->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals->ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals->minor_faults, (uint64_t)(minor - span->minor_faults), memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals->major_faults, (uint64_t)(major - span->major_faults), memory_order_relaxed);
+}
+
+void stats_count(StatsCounter counter, uint64_t value)
+{
+    atomic_fetch_add_explicit(&stats_counters[counter], value, memory_order_relaxed);
+}
+
+// phases that ran (faults of pool workers only show in the process totals), then the counters
+void print_stats(int json)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        memset(&usage, 0, sizeof(usage));
+    }
+
+    if (!json)
+    {
+        fprintf(stderr, "\n--- stats ---\n");
+        fprintf(stderr, "%-10s %8s %12s %12s %12s\n", "phase", "calls", "ms", "minor faults", "major faults");
+    }
+    for (int i = 0; i < STATS_PHASE_COUNT; i++)
+    {
+        StatsPhaseTotals *totals = &stats_phases[i];
+        unsigned long long calls = atomic_load(&totals->calls);
+        if (calls == 0)
+        {
+            continue;
+        }
+        double seconds = atomic_load(&totals->ns) / 1e9;
+        unsigned long long minor = atomic_load(&totals->minor_faults);
+        unsigned long long major = atomic_load(&totals->major_faults);
+        if (json)
+        {
+            fprintf(stderr, "{\"stats\":\"phase\",\"phase\":\"%s\",\"calls\":%llu,\"seconds\":%.6f,\"minor_faults\":%llu,\"major_faults\":%llu}\n",
+                    stats_phase_names[i], calls, seconds, minor, major);
+        }
+        else
+        {
+            fprintf(stderr, "%-10s %8llu %12.3f %12llu %12llu\n", stats_phase_names[i], calls, seconds * 1e3, minor, major);
+        }
+    }
+
+    if (json)
+    {
+        fprintf(stderr, "{\"stats\":\"counters\"");
+        for (int i = 0; i < STATS_COUNTER_COUNT; i++)
+        {
+            fprintf(stderr, ",\"%s\":%llu", stats_counter_names[i], (unsigned long long)atomic_load(&stats_counters[i]));
+        }
+        fprintf(stderr, ",\"minor_faults\":%ld,\"major_faults\":%ld,\"max_rss_kb\":%ld}\n", usage.ru_minflt,
+                usage.ru_majflt, usage.ru_maxrss);
+        return;
+    }
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++)
+    {
+        fprintf(stderr, "%s: %llu\n", stats_counter_names[i], (unsigned long long)atomic_load(&stats_counters[i]));
+    }
+    fprintf(stderr, "page faults: %ld minor, %ld major (process)\n", usage.ru_minflt, usage.ru_majflt);
+    fprintf(stderr, "max RSS: %ld KiB\n", usage.ru_maxrss);
+}
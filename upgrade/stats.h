@@ -0,0 +1,74 @@
+// stats.h
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// timed phases of a command
+typedef enum {
+  STATS_TOTAL = 0,            // the whole command
+  STATS_READ,                 // reading image and message files
+  STATS_MAP,                  // mapping image files into memory
+  STATS_EMBED,                // hiding message bytes in the carrier
+  STATS_EXTRACT,              // recovering message bytes from the carrier
+  STATS_GRAYSCALE,            // grayscale conversion
+  STATS_HEX,                  // hex dump
+  STATS_WRITE,                // writing and copying image and message files
+  STATS_PHASE_COUNT
+} StatsPhase;
+
+typedef enum {
+  STATS_BYTES_READ = 0,
+  STATS_BYTES_WRITTEN,
+  STATS_BITS_EMBEDDED,
+  STATS_BITS_EXTRACTED,
+  STATS_COUNTER_COUNT
+} StatsCounter;
+
+typedef struct {
+  int       phase;            // StatsPhase, -1 while stats are off
+  uint64_t  start_ns;         // monotonic clock at the start
+  long      minor_faults;     // page faults of the calling thread at the start
+  long      major_faults;
+} StatsSpan;
+
+// --stats: set once before any work starts, every hook below is a single branch while it is 0
+extern int stats_enabled;
+
+StatsSpan stats_span_start(StatsPhase phase);
+void stats_span_finish(const StatsSpan *span);
+void stats_count(StatsCounter counter, uint64_t value);
+
+// start timing a phase (spans of the same phase add up, and may run on several threads)
+static inline StatsSpan stats_begin(StatsPhase phase)
+{
+    if (__builtin_expect(stats_enabled, 0))
+    {
+        return stats_span_start(phase);
+    }
+    StatsSpan off = {-1, 0, 0, 0};
+    return off;
+}
+
+static inline void stats_end(const StatsSpan *span)
+{
+    if (__builtin_expect(span->phase >= 0, 0))
+    {
+        stats_span_finish(span);
+    }
+}
+
+static inline void stats_add(StatsCounter counter, uint64_t value)
+{
+    if (__builtin_expect(stats_enabled, 0))
+    {
+        stats_count(counter, value);
+    }
+}
+
+// phase table and counters on stderr, as text or JSON lines
+void print_stats(int json);
+
+#endif // STATS_H
@@ -0,0 +1,1081 @@
+// zlib.c
+//
+// Streaming zlib (RFC 1950) / deflate (RFC 1951) codec for the PNG carrier.
+//
+// The Inflater pulls compressed bytes through a callback and hands out
+// decompressed bytes on request, keeping only the 32 KiB history window, so a
+// caller can walk an image row by row without ever holding all of it. The
+// Deflater collects input into 64 KiB blocks behind a 32 KiB history, finds
+// matches with hash chains (the level sets the chain length) and writes each
+// block with its own dynamic Huffman codes.
+
+#include <string.h>
+#include "zlib.h"
+
+#define INFLATE_WINDOW 32768         // deflate history size (power of two)
+#define INFLATE_INPUT (64 * 1024)    // compressed bytes pulled per read callback
+#define INFLATE_FAST_BITS 10         // codes up to this length are decoded with one table lookup
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_BLOCK (64 * 1024)    // new bytes compressed per block
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_OUTPUT (64 * 1024)   // compressed bytes collected before the write callback
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+// base values and extra bits of the length (257..285) and distance (0..29) codes
+static const uint16_t length_base[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                         31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                         2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,    65,    97,    129,
+                                       193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                       6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// order in which the code length code lengths are sent
+static const uint8_t code_length_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static uint32_t crc_table[256];
+static int crc_table_ready = 0;
+
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t size)
+{
+    if (!crc_table_ready)
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+            {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            crc_table[n] = c;
+        }
+        crc_table_ready = 1;
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// adler32 checksum as two running sums
+static void adler32_update(uint32_t *a, uint32_t *b, const unsigned char *data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t n = size < 5552 ? size : 5552; // largest run that cannot overflow b
+        for (size_t i = 0; i < n; i++)
+        {
+            *a += data[i];
+            *b += *a;
+        }
+        *a %= 65521;
+        *b %= 65521;
+        data += n;
+        size -= n;
+    }
+}
+
+static unsigned reverse_bits(unsigned code, int length)
+{
+    unsigned reversed = 0;
+    for (int i = 0; i < length; i++)
+    {
+        reversed = reversed << 1 | (code & 1);
+        code >>= 1;
+    }
+    return reversed;
+}
+
+// ---------------------------------------------------------------------------
+// inflate
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    uint16_t fast[1 << INFLATE_FAST_BITS]; // symbol << 4 | length for short codes, 0 for longer ones
+    uint16_t count[16];                    // codes of each length
+    uint16_t symbol[288];                  // symbols in canonical code order
+} InflateTable;
+
+typedef enum {
+    INFLATE_HEADER,  // zlib header next
+    INFLATE_BLOCK,   // block header (or the adler32 trailer after the last block) next
+    INFLATE_STORED,  // inside a stored block
+    INFLATE_CODES,   // inside a Huffman coded block
+    INFLATE_DONE,
+    INFLATE_ERROR
+} InflateState;
+
+struct Inflater {
+    zlib_read_fn read;
+    void *ctx;
+    unsigned char input[INFLATE_INPUT];
+    size_t in_pos;
+    size_t in_len;
+    int in_end;             // read returned 0
+    int overrun;            // zero bytes fed past the end of the input
+    uint64_t bits;          // bit buffer, next bit in the lowest position
+    int count;              // valid bits in bits
+    unsigned char window[INFLATE_WINDOW];
+    uint64_t total;         // bytes produced so far
+    InflateState state;
+    int last;               // the current block is the final one
+    uint32_t stored_left;   // bytes left in a stored block
+    int copy_len;           // bytes left of a match being copied
+    int copy_dist;
+    uint32_t adler_a;
+    uint32_t adler_b;
+    InflateTable lencode;
+    InflateTable distcode;
+};
+
+// canonical Huffman decoding table from code lengths, -1 for an oversubscribed set
+static int build_inflate_table(InflateTable *t, const uint8_t *lengths, int n)
+{
+    uint16_t offsets[16];
+
+    memset(t->count, 0, sizeof(t->count));
+    for (int s = 0; s < n; s++)
+    {
+        t->count[lengths[s]]++;
+    }
+    t->count[0] = 0;
+
+    int left = 1;
+    for (int len = 1; len < 16; len++)
+    {
+        left = (left << 1) - t->count[len];
+        if (left < 0)
+        {
+            return -1;
+        }
+    }
+
+    offsets[1] = 0;
+    for (int len = 1; len < 15; len++)
+    {
+        offsets[len + 1] = offsets[len] + t->count[len];
+    }
+    for (int s = 0; s < n; s++)
+    {
+        if (lengths[s] != 0)
+        {
+            t->symbol[offsets[lengths[s]]++] = (uint16_t)s;
+        }
+    }
+
+    memset(t->fast, 0, sizeof(t->fast));
+    unsigned code = 0;
+    int k = 0;
+    for (int len = 1; len < 16; len++)
+    {
+        for (int i = 0; i < t->count[len]; i++, k++, code++)
+        {
+            if (len <= INFLATE_FAST_BITS)
+            {
+                for (unsigned j = reverse_bits(code, len); j < (1u << INFLATE_FAST_BITS); j += 1u << len)
+                {
+                    t->fast[j] = (uint16_t)(t->symbol[k] << 4 | len);
+                }
+            }
+        }
+        code <<= 1;
+    }
+    return 0;
+}
+
+static void inflate_fill(Inflater *z, int need)
+{
+    while (z->count < need)
+    {
+        if (z->in_pos == z->in_len && !z->in_end)
+        {
+            z->in_len = z->read(z->ctx, z->input, sizeof(z->input));
+            z->in_pos = 0;
+            z->in_end = z->in_len == 0;
+        }
+        unsigned byte = 0;
+        if (z->in_pos < z->in_len)
+        {
+            byte = z->input[z->in_pos++];
+        }
+        else
+        {
+            z->overrun++; // past the end: zeros, caught after the current step
+        }
+        z->bits |= (uint64_t)byte << z->count;
+        z->count += 8;
+    }
+}
+
+static inline unsigned inflate_bits(Inflater *z, int n)
+{
+    if (z->count < n)
+    {
+        inflate_fill(z, n);
+    }
+    unsigned value = (unsigned)(z->bits & ((1u << n) - 1));
+    z->bits >>= n;
+    z->count -= n;
+    return value;
+}
+
+static inline int inflate_symbol(Inflater *z, const InflateTable *t)
+{
+    if (z->count < 15)
+    {
+        inflate_fill(z, 15);
+    }
+    unsigned entry = t->fast[z->bits & ((1u << INFLATE_FAST_BITS) - 1)];
+    if (entry != 0)
+    {
+        z->bits >>= entry & 15;
+        z->count -= entry & 15;
+        return (int)(entry >> 4);
+    }
+
+    // longer codes one bit at a time
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (int len = 1; len < 16; len++)
+    {
+        code |= (int)((z->bits >> (len - 1)) & 1);
+        int count = t->count[len];
+        if (code - first < count)
+        {
+            z->bits >>= len;
+            z->count -= len;
+            return t->symbol[index + code - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static void build_fixed_tables(Inflater *z)
+{
+    uint8_t lengths[288];
+
+    for (int s = 0; s < 288; s++)
+    {
+        lengths[s] = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+    }
+    build_inflate_table(&z->lencode, lengths, 288);
+    for (int s = 0; s < 30; s++)
+    {
+        lengths[s] = 5;
+    }
+    build_inflate_table(&z->distcode, lengths, 30);
+}
+
+static int read_dynamic_tables(Inflater *z)
+{
+    uint8_t lengths[320];
+    int nlen = (int)inflate_bits(z, 5) + 257;
+    int ndist = (int)inflate_bits(z, 5) + 1;
+    int ncode = (int)inflate_bits(z, 4) + 4;
+    if (nlen > 286 || ndist > 30)
+    {
+        return -1;
+    }
+
+    memset(lengths, 0, 19);
+    for (int i = 0; i < ncode; i++)
+    {
+        lengths[code_length_order[i]] = (uint8_t)inflate_bits(z, 3);
+    }
+    if (build_inflate_table(&z->lencode, lengths, 19) != 0)
+    {
+        return -1;
+    }
+
+    // literal/length and distance code lengths, run-length coded
+    for (int i = 0; i < nlen + ndist;)
+    {
+        int symbol = inflate_symbol(z, &z->lencode);
+        if (symbol < 0)
+        {
+            return -1;
+        }
+        if (symbol < 16)
+        {
+            lengths[i++] = (uint8_t)symbol;
+            continue;
+        }
+        int value = 0;
+        int repeat;
+        if (symbol == 16)
+        {
+            if (i == 0)
+            {
+                return -1;
+            }
+            value = lengths[i - 1];
+            repeat = 3 + (int)inflate_bits(z, 2);
+        }
+        else if (symbol == 17)
+        {
+            repeat = 3 + (int)inflate_bits(z, 3);
+        }
+        else
+        {
+            repeat = 11 + (int)inflate_bits(z, 7);
+        }
+        if (i + repeat > nlen + ndist)
+        {
+            return -1;
+        }
+        while (repeat-- > 0)
+        {
+            lengths[i++] = (uint8_t)value;
+        }
+    }
+    if (lengths[256] == 0)
+    {
+        return -1; // no end-of-block code
+    }
+    if (build_inflate_table(&z->lencode, lengths, nlen) != 0 ||
+        build_inflate_table(&z->distcode, lengths + nlen, ndist) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+Inflater *inflater_create(zlib_read_fn read, void *ctx)
+{
+    Inflater *z = (Inflater *)calloc(1, sizeof(Inflater));
+    if (z == NULL)
+    {
+        return NULL;
+    }
+    z->read = read;
+    z->ctx = ctx;
+    z->state = INFLATE_HEADER;
+    z->adler_a = 1;
+    return z;
+}
+
+void inflater_destroy(Inflater *z)
+{
+    free(z);
+}
+
+static inline void inflate_put(Inflater *z, unsigned char *out, size_t *produced, unsigned char byte)
+{
+    z->window[z->total++ & (INFLATE_WINDOW - 1)] = byte;
+    out[(*produced)++] = byte;
+}
+
+long inflater_read(Inflater *z, unsigned char *out, size_t size)
+{
+    size_t produced = 0;
+
+    while (produced < size)
+    {
+        // finish a match first, it may span several calls
+        if (z->copy_len > 0)
+        {
+            while (z->copy_len > 0 && produced < size)
+            {
+                inflate_put(z, out, &produced, z->window[(z->total - z->copy_dist) & (INFLATE_WINDOW - 1)]);
+                z->copy_len--;
+            }
+            continue;
+        }
+
+        switch (z->state)
+        {
+        case INFLATE_HEADER:
+        {
+            unsigned cmf = inflate_bits(z, 8);
+            unsigned flg = inflate_bits(z, 8);
+            // deflate, window up to 32 KiB, no preset dictionary
+            z->state = (cmf & 15) == 8 && (cmf >> 4) <= 7 && (cmf << 8 | flg) % 31 == 0 && !(flg & 0x20)
+                           ? INFLATE_BLOCK
+                           : INFLATE_ERROR;
+            break;
+        }
+
+        case INFLATE_BLOCK:
+            if (z->last)
+            {
+                // adler32 of the data, big-endian, after the final block
+                inflate_bits(z, z->count & 7);
+                uint32_t adler = 0;
+                for (int i = 0; i < 4; i++)
+                {
+                    adler = adler << 8 | inflate_bits(z, 8);
+                }
+                adler32_update(&z->adler_a, &z->adler_b, out, produced);
+                z->state = adler == (z->adler_b << 16 | z->adler_a) && z->overrun == 0 ? INFLATE_DONE : INFLATE_ERROR;
+                return z->state == INFLATE_DONE ? (long)produced : -1;
+            }
+            z->last = (int)inflate_bits(z, 1);
+            switch (inflate_bits(z, 2))
+            {
+            case 0:
+            {
+                inflate_bits(z, z->count & 7);
+                unsigned length = inflate_bits(z, 16);
+                unsigned check = inflate_bits(z, 16);
+                z->stored_left = length;
+                z->state = (length ^ 0xFFFF) == check ? INFLATE_STORED : INFLATE_ERROR;
+                break;
+            }
+            case 1:
+                build_fixed_tables(z);
+                z->state = INFLATE_CODES;
+                break;
+            case 2:
+                z->state = read_dynamic_tables(z) == 0 ? INFLATE_CODES : INFLATE_ERROR;
+                break;
+            default:
+                z->state = INFLATE_ERROR;
+                break;
+            }
+            break;
+
+        case INFLATE_STORED:
+            if (z->stored_left == 0)
+            {
+                z->state = INFLATE_BLOCK;
+                break;
+            }
+            inflate_put(z, out, &produced, (unsigned char)inflate_bits(z, 8));
+            z->stored_left--;
+            break;
+
+        case INFLATE_CODES:
+        {
+            int symbol = inflate_symbol(z, &z->lencode);
+            if (symbol < 256)
+            {
+                if (symbol < 0)
+                {
+                    z->state = INFLATE_ERROR;
+                    break;
+                }
+                inflate_put(z, out, &produced, (unsigned char)symbol);
+                break;
+            }
+            if (symbol == 256)
+            {
+                z->state = INFLATE_BLOCK;
+                break;
+            }
+            symbol -= 257;
+            if (symbol >= 29)
+            {
+                z->state = INFLATE_ERROR;
+                break;
+            }
+            int length = length_base[symbol] + (int)inflate_bits(z, length_extra[symbol]);
+            int dist_symbol = inflate_symbol(z, &z->distcode);
+            if (dist_symbol < 0 || dist_symbol >= 30)
+            {
+                z->state = INFLATE_ERROR;
+                break;
+            }
+            int dist = dist_base[dist_symbol] + (int)inflate_bits(z, dist_extra[dist_symbol]);
+            if ((uint64_t)dist > z->total)
+            {
+                z->state = INFLATE_ERROR;
+                break;
+            }
+            z->copy_len = length;
+            z->copy_dist = dist;
+            break;
+        }
+
+        case INFLATE_DONE:
+            adler32_update(&z->adler_a, &z->adler_b, out, produced);
+            return (long)produced;
+
+        case INFLATE_ERROR:
+            return -1;
+        }
+
+        if (z->overrun > 8)
+        {
+            z->state = INFLATE_ERROR; // ran out of input in the middle of the stream
+        }
+    }
+
+    adler32_update(&z->adler_a, &z->adler_b, out, produced);
+    return (long)produced;
+}
+
+// ---------------------------------------------------------------------------
+// deflate
+// ---------------------------------------------------------------------------
+
+struct Deflater {
+    zlib_write_fn write;
+    void *ctx;
+    int level;
+    int max_chain;          // hash chain entries looked at per position
+    int nice_length;        // a match this long ends the search
+    int error;
+    int header_done;
+    unsigned char buf[DEFLATE_WINDOW + DEFLATE_BLOCK]; // history, then the bytes of the next block
+    size_t start;           // first byte of buf not compressed yet
+    size_t fill;            // bytes in buf
+    int32_t head[1 << DEFLATE_HASH_BITS];              // last position of each hash, -1 if none
+    int32_t prev[DEFLATE_WINDOW + DEFLATE_BLOCK];      // previous position with the same hash
+    uint16_t sym_length[DEFLATE_WINDOW + DEFLATE_BLOCK]; // literal byte, or match length
+    uint16_t sym_dist[DEFLATE_WINDOW + DEFLATE_BLOCK];   // 0 for a literal, else match distance
+    size_t sym_count;
+    unsigned char out[DEFLATE_OUTPUT + 64];
+    size_t out_len;
+    uint64_t bits;          // pending output bits, first bit in the lowest position
+    int count;
+    uint32_t adler_a;
+    uint32_t adler_b;
+};
+
+static void deflate_flush_output(Deflater *z)
+{
+    if (z->out_len > 0 && !z->error && z->write(z->ctx, z->out, z->out_len) != 0)
+    {
+        z->error = 1;
+    }
+    z->out_len = 0;
+}
+
+static inline void deflate_put_bits(Deflater *z, uint32_t value, int n)
+{
+    z->bits |= (uint64_t)value << z->count;
+    z->count += n;
+    while (z->count >= 8)
+    {
+        z->out[z->out_len++] = (unsigned char)z->bits;
+        z->bits >>= 8;
+        z->count -= 8;
+    }
+    if (z->out_len >= DEFLATE_OUTPUT)
+    {
+        deflate_flush_output(z);
+    }
+}
+
+static void deflate_align(Deflater *z)
+{
+    if (z->count > 0)
+    {
+        deflate_put_bits(z, 0, 8 - z->count);
+    }
+}
+
+// length-limited Huffman code lengths for the frequencies (ITU T.81 Annex K.2
+// merging, then lengths above max_len are folded back)
+static void huffman_lengths(const uint32_t *freq_in, int n, int max_len, uint8_t *lengths)
+{
+    uint32_t freq[288];
+    int codesize[288];
+    int others[288];
+    int bits[290];
+    int used = 0;
+
+    memset(lengths, 0, (size_t)n);
+    for (int i = 0; i < n; i++)
+    {
+        freq[i] = freq_in[i];
+        codesize[i] = 0;
+        others[i] = -1;
+        used += freq[i] != 0;
+    }
+    if (used <= 1)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            lengths[i] = freq[i] != 0;
+        }
+        return;
+    }
+
+    for (;;)
+    {
+        int c1 = -1;
+        int c2 = -1;
+        uint32_t v = UINT32_MAX;
+        for (int i = 0; i < n; i++)
+        {
+            if (freq[i] != 0 && freq[i] <= v)
+            {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+        v = UINT32_MAX;
+        for (int i = 0; i < n; i++)
+        {
+            if (freq[i] != 0 && freq[i] <= v && i != c1)
+            {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0)
+        {
+            break;
+        }
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codesize[c1]++;
+        while (others[c1] >= 0)
+        {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0)
+        {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    memset(bits, 0, sizeof(bits));
+    for (int i = 0; i < n; i++)
+    {
+        bits[codesize[i]]++;
+    }
+    bits[0] = 0;
+    for (int i = n; i > max_len; i--)
+    {
+        while (bits[i] > 0)
+        {
+            int j = i - 2;
+            while (bits[j] == 0)
+            {
+                j--;
+            }
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    // most frequent symbols (shortest original codes) get the shortest lengths
+    int len = 1;
+    for (int size = 1; size <= n; size++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (codesize[i] == size)
+            {
+                while (bits[len] == 0)
+                {
+                    len++;
+                }
+                lengths[i] = (uint8_t)len;
+                bits[len]--;
+            }
+        }
+    }
+}
+
+// canonical codes, bit-reversed for LSB-first output
+static void huffman_codes(const uint8_t *lengths, int n, uint16_t *codes)
+{
+    int count[16] = {0};
+    unsigned next[16];
+
+    for (int i = 0; i < n; i++)
+    {
+        count[lengths[i]]++;
+    }
+    count[0] = 0;
+    unsigned code = 0;
+    for (int len = 1; len < 16; len++)
+    {
+        code = (code + count[len - 1]) << 1;
+        next[len] = code;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (lengths[i] != 0)
+        {
+            codes[i] = (uint16_t)reverse_bits(next[lengths[i]]++, lengths[i]);
+        }
+    }
+}
+
+static int length_code(int length)
+{
+    int code = 0;
+    while (code < 28 && length_base[code + 1] <= length)
+    {
+        code++;
+    }
+    return code;
+}
+
+static int dist_code(int dist)
+{
+    int code = 0;
+    while (code < 29 && dist_base[code + 1] <= dist)
+    {
+        code++;
+    }
+    return code;
+}
+
+static void write_stored_block(Deflater *z, const unsigned char *data, size_t size, int final)
+{
+    do
+    {
+        size_t n = size < 65535 ? size : 65535;
+        int last = final && n == size;
+        deflate_put_bits(z, (uint32_t)last, 1);
+        deflate_put_bits(z, 0, 2);
+        deflate_align(z);
+        deflate_put_bits(z, (uint32_t)n, 16);
+        deflate_put_bits(z, (uint32_t)n ^ 0xFFFF, 16);
+        for (size_t i = 0; i < n; i++)
+        {
+            deflate_put_bits(z, data[i], 8);
+        }
+        data += n;
+        size -= n;
+    } while (size > 0);
+}
+
+// write the collected symbols as one block with dynamic Huffman codes
+static void write_dynamic_block(Deflater *z, int final)
+{
+    uint32_t lit_freq[288] = {0};
+    uint32_t dist_freq[30] = {0};
+    uint8_t lengths[286 + 30];
+    uint16_t lit_codes[286];
+    uint16_t dist_codes[30];
+
+    for (size_t i = 0; i < z->sym_count; i++)
+    {
+        if (z->sym_dist[i] == 0)
+        {
+            lit_freq[z->sym_length[i]]++;
+        }
+        else
+        {
+            lit_freq[257 + length_code(z->sym_length[i])]++;
+            dist_freq[dist_code(z->sym_dist[i])]++;
+        }
+    }
+    lit_freq[256] = 1;
+    huffman_lengths(lit_freq, 286, 15, lengths);
+    huffman_lengths(dist_freq, 30, 15, lengths + 286);
+    int nlen = 286;
+    while (nlen > 257 && lengths[nlen - 1] == 0)
+    {
+        nlen--;
+    }
+    int ndist = 30;
+    while (ndist > 1 && lengths[286 + ndist - 1] == 0)
+    {
+        ndist--;
+    }
+    if (lengths[286] == 0 && ndist == 1)
+    {
+        lengths[286] = 1; // one distance code even when no match was found
+    }
+    huffman_codes(lengths, 286, lit_codes);
+    huffman_codes(lengths + 286, 30, dist_codes);
+
+    // run-length code the lengths of both codes as one sequence
+    uint8_t all[286 + 30];
+    uint8_t rle_symbol[286 + 30];
+    uint8_t rle_extra[286 + 30];
+    int rle_count = 0;
+    int total = nlen + ndist;
+    memcpy(all, lengths, (size_t)nlen);
+    memcpy(all + nlen, lengths + 286, (size_t)ndist);
+    for (int i = 0; i < total;)
+    {
+        int run = 1;
+        while (i + run < total && all[i + run] == all[i])
+        {
+            run++;
+        }
+        if (all[i] == 0 && run >= 3)
+        {
+            run = run > 138 ? 138 : run;
+            rle_symbol[rle_count] = run >= 11 ? 18 : 17;
+            rle_extra[rle_count++] = (uint8_t)(run >= 11 ? run - 11 : run - 3);
+            i += run;
+        }
+        else if (run >= 4)
+        {
+            rle_symbol[rle_count] = all[i];
+            rle_extra[rle_count++] = 0;
+            run = run - 1 > 6 ? 6 : run - 1;
+            rle_symbol[rle_count] = 16;
+            rle_extra[rle_count++] = (uint8_t)(run - 3);
+            i += run + 1;
+        }
+        else
+        {
+            rle_symbol[rle_count] = all[i];
+            rle_extra[rle_count++] = 0;
+            i++;
+        }
+    }
+
+    uint32_t cl_freq[19] = {0};
+    uint8_t cl_lengths[19];
+    uint16_t cl_codes[19];
+    for (int i = 0; i < rle_count; i++)
+    {
+        cl_freq[rle_symbol[i]]++;
+    }
+    huffman_lengths(cl_freq, 19, 7, cl_lengths);
+    huffman_codes(cl_lengths, 19, cl_codes);
+    int ncode = 19;
+    while (ncode > 4 && cl_lengths[code_length_order[ncode - 1]] == 0)
+    {
+        ncode--;
+    }
+
+    deflate_put_bits(z, (uint32_t)final, 1);
+    deflate_put_bits(z, 2, 2);
+    deflate_put_bits(z, (uint32_t)(nlen - 257), 5);
+    deflate_put_bits(z, (uint32_t)(ndist - 1), 5);
+    deflate_put_bits(z, (uint32_t)(ncode - 4), 4);
+    for (int i = 0; i < ncode; i++)
+    {
+        deflate_put_bits(z, cl_lengths[code_length_order[i]], 3);
+    }
+    static const uint8_t rle_extra_bits[19] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7};
+    for (int i = 0; i < rle_count; i++)
+    {
+        deflate_put_bits(z, cl_codes[rle_symbol[i]], cl_lengths[rle_symbol[i]]);
+        deflate_put_bits(z, rle_extra[i], rle_extra_bits[rle_symbol[i]]);
+    }
+
+    for (size_t i = 0; i < z->sym_count; i++)
+    {
+        if (z->sym_dist[i] == 0)
+        {
+            deflate_put_bits(z, lit_codes[z->sym_length[i]], lengths[z->sym_length[i]]);
+            continue;
+        }
+        int length = z->sym_length[i];
+        int dist = z->sym_dist[i];
+        int lc = length_code(length);
+        int dc = dist_code(dist);
+        deflate_put_bits(z, lit_codes[257 + lc], lengths[257 + lc]);
+        deflate_put_bits(z, (uint32_t)(length - length_base[lc]), length_extra[lc]);
+        deflate_put_bits(z, dist_codes[dc], lengths[286 + dc]);
+        deflate_put_bits(z, (uint32_t)(dist - dist_base[dc]), dist_extra[dc]);
+    }
+    deflate_put_bits(z, lit_codes[256], lengths[256]);
+}
+
+static inline uint32_t deflate_hash(const unsigned char *p)
+{
+    uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static inline int match_length(const unsigned char *a, const unsigned char *b, int max)
+{
+    int len = 0;
+    while (len + 8 <= max)
+    {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + len, 8);
+        memcpy(&y, b + len, 8);
+        if (x != y)
+        {
+            return len + (__builtin_ctzll(x ^ y) >> 3);
+        }
+        len += 8;
+    }
+    while (len < max && a[len] == b[len])
+    {
+        len++;
+    }
+    return len;
+}
+
+static inline void deflate_insert(Deflater *z, size_t pos)
+{
+    uint32_t h = deflate_hash(z->buf + pos);
+    z->prev[pos] = z->head[h];
+    z->head[h] = (int32_t)pos;
+}
+
+// compress buf[start, fill) as one block, then keep the last 32 KiB as history
+static void deflate_block(Deflater *z, int final)
+{
+    if (!z->header_done)
+    {
+        // 32 KiB window, compression level hint in FLEVEL
+        unsigned flevel = z->level < 2 ? 0 : z->level < 6 ? 1 : z->level == 6 ? 2 : 3;
+        unsigned header = 0x7800 | flevel << 6;
+        header += 31 - header % 31;
+        deflate_put_bits(z, header >> 8, 8);
+        deflate_put_bits(z, header & 0xFF, 8);
+        z->header_done = 1;
+    }
+
+    size_t end = z->fill;
+    if (z->level == 0)
+    {
+        write_stored_block(z, z->buf + z->start, end - z->start, final);
+    }
+    else
+    {
+        z->sym_count = 0;
+        for (size_t pos = z->start; pos < end;)
+        {
+            int best_len = 0;
+            int best_dist = 0;
+            if (end - pos >= DEFLATE_MIN_MATCH)
+            {
+                int max_len = end - pos < DEFLATE_MAX_MATCH ? (int)(end - pos) : DEFLATE_MAX_MATCH;
+                int32_t candidate = z->head[deflate_hash(z->buf + pos)];
+                for (int chain = z->max_chain; candidate >= 0 && pos - (size_t)candidate <= DEFLATE_WINDOW && chain > 0;
+                     chain--)
+                {
+                    const unsigned char *match = z->buf + candidate;
+                    if (match[best_len] == z->buf[pos + best_len])
+                    {
+                        int len = match_length(match, z->buf + pos, max_len);
+                        if (len > best_len)
+                        {
+                            best_len = len;
+                            best_dist = (int)(pos - (size_t)candidate);
+                            if (len >= max_len || len >= z->nice_length)
+                            {
+                                break;
+                            }
+                        }
+                    }
+                    candidate = z->prev[candidate];
+                }
+                deflate_insert(z, pos);
+            }
+
+            if (best_len >= DEFLATE_MIN_MATCH)
+            {
+                z->sym_length[z->sym_count] = (uint16_t)best_len;
+                z->sym_dist[z->sym_count++] = (uint16_t)best_dist;
+                // the fast levels do not index the inside of long matches
+                if (z->level >= 4 || best_len <= z->nice_length)
+                {
+                    for (size_t i = pos + 1; i < pos + (size_t)best_len && i + DEFLATE_MIN_MATCH <= end; i++)
+                    {
+                        deflate_insert(z, i);
+                    }
+                }
+                pos += (size_t)best_len;
+            }
+            else
+            {
+                z->sym_length[z->sym_count] = z->buf[pos];
+                z->sym_dist[z->sym_count++] = 0;
+                pos++;
+            }
+        }
+        write_dynamic_block(z, final);
+    }
+    z->start = end;
+
+    // slide: the last DEFLATE_WINDOW bytes become the history of the next block
+    if (end > DEFLATE_WINDOW)
+    {
+        size_t delta = end - DEFLATE_WINDOW;
+        memmove(z->buf, z->buf + delta, DEFLATE_WINDOW);
+        memmove(z->prev, z->prev + delta, DEFLATE_WINDOW * sizeof(int32_t));
+        for (size_t i = 0; i < (1u << DEFLATE_HASH_BITS); i++)
+        {
+            z->head[i] = z->head[i] >= (int32_t)delta ? z->head[i] - (int32_t)delta : -1;
+        }
+        for (size_t i = 0; i < DEFLATE_WINDOW; i++)
+        {
+            z->prev[i] = z->prev[i] >= (int32_t)delta ? z->prev[i] - (int32_t)delta : -1;
+        }
+        z->start = DEFLATE_WINDOW;
+        z->fill = DEFLATE_WINDOW;
+    }
+}
+
+Deflater *deflater_create(zlib_write_fn write, void *ctx, int level)
+{
+    static const int chains[10] = {0, 4, 5, 6, 8, 16, 32, 64, 256, 1024};
+    static const int nice[10] = {0, 8, 16, 32, 32, 64, 128, 128, 258, 258};
+
+    Deflater *z = (Deflater *)malloc(sizeof(Deflater));
+    if (z == NULL)
+    {
+        return NULL;
+    }
+    level = level < 0 ? 6 : level > 9 ? 9 : level;
+    z->write = write;
+    z->ctx = ctx;
+    z->level = level;
+    z->max_chain = chains[level];
+    z->nice_length = nice[level];
+    z->error = 0;
+    z->header_done = 0;
+    z->start = 0;
+    z->fill = 0;
+    z->sym_count = 0;
+    z->out_len = 0;
+    z->bits = 0;
+    z->count = 0;
+    z->adler_a = 1;
+    z->adler_b = 0;
+    memset(z->head, 0xFF, sizeof(z->head));
+    return z;
+}
+
+void deflater_destroy(Deflater *z)
+{
+    free(z);
+}
+
+int deflater_write(Deflater *z, const unsigned char *data, size_t size)
+{
+    adler32_update(&z->adler_a, &z->adler_b, data, size);
+    while (size > 0 && !z->error)
+    {
+        size_t room = sizeof(z->buf) - z->fill;
+        size_t n = size < room ? size : room;
+        memcpy(z->buf + z->fill, data, n);
+        z->fill += n;
+        data += n;
+        size -= n;
+        if (z->fill == sizeof(z->buf))
+        {
+            deflate_block(z, 0);
+        }
+    }
+    return z->error;
+}
+
+// compress what is left as the final block and write the adler32 trailer
+int deflater_finish(Deflater *z)
+{
+    deflate_block(z, 1);
+    deflate_align(z);
+    uint32_t adler = z->adler_b << 16 | z->adler_a;
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        deflate_put_bits(z, (adler >> shift) & 0xFF, 8);
+    }
+    deflate_flush_output(z);
+    return z->error;
+}
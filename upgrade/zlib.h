@@ -0,0 +1,33 @@
+// zlib.h
+#ifndef ZLIB_H
+#define ZLIB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// input callback of an Inflater: up to size bytes into buf, 0 at the end of the input
+typedef size_t (*zlib_read_fn)(void *ctx, unsigned char *buf, size_t size);
+// output callback of a Deflater: returns 0 when all size bytes were written
+typedef int (*zlib_write_fn)(void *ctx, const unsigned char *buf, size_t size);
+
+typedef struct Inflater Inflater;
+typedef struct Deflater Deflater;
+
+// streaming zlib (RFC 1950) decompression, pulling compressed input through read
+Inflater *inflater_create(zlib_read_fn read, void *ctx);
+// up to size decompressed bytes into out; returns the count (less than size only at
+// the end of the stream) or -1 for corrupt data
+long inflater_read(Inflater *z, unsigned char *out, size_t size);
+void inflater_destroy(Inflater *z);
+
+// streaming zlib compression, pushing compressed output through write
+// level 0 stores, 1 (fastest) .. 9 (smallest) search for matches harder
+Deflater *deflater_create(zlib_write_fn write, void *ctx, int level);
+int deflater_write(Deflater *z, const unsigned char *data, size_t size);
+int deflater_finish(Deflater *z);
+void deflater_destroy(Deflater *z);
+
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t size);
+
+#endif // ZLIB_H